@@ -0,0 +1,26 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+
+#pragma once
+
+#include <stddef.h>
+
+struct arena_chunk;
+
+/* Bump allocator for data which lives as long as one request. Nothing
+   allocated from an arena can be freed on its own, arena_free() frees
+   everything at once.
+   Strings added with arena_intern() are stored only once per arena,
+   which is used for values like the architecture or the OS version,
+   which are the same for nearly all images. */
+struct arena {
+  struct arena_chunk *chunks;
+  const char **strings;     /* interned strings, open addressing */
+  size_t n_strings;
+  size_t n_slots;
+};
+
+extern void *arena_alloc(struct arena *a, size_t size);
+extern char *arena_strdup(struct arena *a, const char *s);
+extern char *arena_strndup(struct arena *a, const char *s, size_t n);
+extern const char *arena_intern(struct arena *a, const char *s);
+extern void arena_free(struct arena *a);
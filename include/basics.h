@@ -7,6 +7,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #define _unused_ __attribute__((unused))
 #define _pure_ __attribute__((__pure__))
@@ -47,6 +48,11 @@ static inline void fclosep(FILE **f) {
         fclose(*f);
 }
 
+#define USEC_INFINITY ((uint64_t) UINT64_MAX)
+#define USEC_PER_SEC  ((uint64_t) 1000000ULL)
+#define USEC_PER_MSEC ((uint64_t) 1000ULL)
+#define NSEC_PER_USEC ((uint64_t) 1000ULL)
+
 #define _cleanup_(x) __attribute__((__cleanup__(x)))
 #define _cleanup_close_ _cleanup_(closep)
 #define _cleanup_fclose_ _cleanup_(fclosep)
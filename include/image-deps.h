@@ -2,8 +2,11 @@
 
 #pragma once
 
+#include <stdint.h>
 #include <systemd/sd-json.h>
 
+#include "arena.h"
+
 struct image_deps {
   char *image_name_json;    /* full image name from json file, e.g. "gcc-30.3.x86-64.raw" */
   char *sysext_version_id;
@@ -15,20 +18,39 @@ struct image_deps {
   sd_json_variant *sysext;
 };
 
+/* Sort key of a version string, comparing two keys with
+   version_key_cmp() gives the same result as strverscmp() */
+struct version_key {
+  uint8_t len;              /* 0 if the version has no key */
+  uint8_t data[31];
+};
+
 struct image_entry {
   char *name;              /* name of the image, e.g. "gcc" */
   char *image_name;        /* full image name, e.g. "gcc-30.3.x86-64.raw" */
+  char *digest;            /* SHA256 from SHA256SUMS, remote images only */
   struct image_deps *deps;
   bool remote;
   bool local;
   bool installed;
   bool compatible;
   int  refcount;
+  struct version_key version;          /* of the version in image_name */
+  struct version_key sysext_version;   /* of deps->sysext_version_id */
+};
+
+/* List of images, the entries and everything they reference are
+   allocated from the arena. */
+struct image_list {
+  struct arena arena;
+  struct image_entry **images;   /* NULL terminated */
+  size_t n;
 };
 
 extern void free_image_deps(struct image_deps *e);
 extern void free_image_depsp(struct image_deps **e);
 extern void free_image_deps_list(struct image_deps ***images);
+extern int dup_image_deps(const struct image_deps *src, struct image_deps **ret);
 extern void dump_image_deps(struct image_deps *e);
 extern void free_image_entry(struct image_entry *list);
 extern void free_image_entryp(struct image_entry **list);
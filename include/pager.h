@@ -1,3 +1,6 @@
+#include <stdio.h>
 #include <libsmartcols/libsmartcols.h>
 
 void pager(struct libscols_table *tb, const char *fooder);
+FILE *pager_open(void);
+void pager_close(FILE *out, const char *fooder);
@@ -28,6 +28,11 @@ static inline bool strv_isempty(char * const *l) {
         return !l || !*l;
 }
 
+/* comparison function for qsort()/bsearch() on a char* array */
+static inline int strptr_cmp(const void *a, const void *b) {
+        return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
 #define XCONCATENATE(x, y) x ## y
 #define CONCATENATE(x, y) XCONCATENATE(x, y)
 #define UNIQ_T(x, uniq) CONCATENATE(__unique_prefix_, CONCATENATE(x, uniq))
@@ -2,6 +2,9 @@
 
 #pragma once
 
+#include <stdint.h>
+#include <stdbool.h>
+
 #define _VARLINK_SYSEXTMGR_SOCKET_DIR "/run/sysextmgr"
 #define _VARLINK_SYSEXTMGR_SOCKET _VARLINK_SYSEXTMGR_SOCKET_DIR"/socket"
 
@@ -9,9 +12,20 @@
 struct config {
   bool verbose;
   bool verify_signature;
+  bool warm_cache;          /* keep remote listing, meta data and refcounts between requests */
+  uint64_t idle_timeout;    /* usec, USEC_INFINITY means never exit */
   char *url;
   char *sysext_store_dir;
   char *extensions_dir;
+  char *snapshots_dir;            /* directory with one directory per snapshot */
+  char *snapshot_extensions_dir;  /* extensions directory inside a snapshot */
+  unsigned keep_unused_versions;  /* newest unused versions per image kept by Cleanup */
+  uint64_t store_max_size;        /* bytes, 0 means no limit */
+  uint64_t store_min_free;        /* bytes, 0 means no limit */
+  uint64_t verify_max_rate;       /* bytes per second read by Verify, 0 means no limit */
+  bool fsverity;                  /* enable fs-verity for downloaded images */
+  char *metrics_file;             /* textfile for node_exporter, NULL if none */
+  bool trace;                     /* send the phases of every request to the journal */
 };
 
 extern struct config config;
@@ -29,7 +43,24 @@ extern int parse_image_deps(sd_json_variant *json, struct image_deps **e);
 extern int load_image_json(int fd, const char *path, struct image_deps ***images);
 extern int load_manifest(int fd, const char *path, struct image_deps ***images);
 
-extern int get_latest_version(struct image_entry *curr, struct image_entry **new, const char *url, bool verify_signature, const struct osrelease *osrelease);
+/* newversion.c */
+struct image_index;
+struct host_match;
+
+/* remote images and images in the store, indexed by name */
+struct available_images {
+  struct image_list remote;
+  struct image_list local;
+  struct image_index *remote_index;
+  struct image_index *local_index;
+};
+
+extern void free_available_images(struct available_images *a);
+extern void free_available_imagesp(struct available_images **a);
+extern int load_available_images(const char *url, char **filter, bool verify_signature, const struct host_match *host, struct available_images **ret);
+extern int find_latest_version(struct image_entry *curr, const struct available_images *a, struct image_entry **new);
+extern int get_latest_version(struct image_entry *curr, struct image_entry **new, const char *url, bool verify_signature, const struct host_match *host);
+
 /* main.c */
 extern void usage(int retval);
 
@@ -42,6 +73,12 @@ extern int main_check(int argc, char **argv);
 /* main-cleanup.c */
 extern int main_cleanup(int argc, char **argv);
 
+/* main-dedup.c */
+extern int main_dedup(int argc, char **argv);
+
+/* main-verify.c */
+extern int main_verify(int argc, char **argv);
+
 /* main-update.c */
 extern int main_update(int argc, char **argv);
 
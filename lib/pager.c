@@ -55,3 +55,23 @@ void pager(struct libscols_table *table, const char *fooder)
       pclose(out);
     }
 }
+
+/* For output which gets printed while it arrives: print to the
+   returned stream and call pager_close() at the end. */
+FILE *pager_open(void)
+{
+  return setup_pager();
+}
+
+void pager_close(FILE *out, const char *fooder)
+{
+  if (out == stdout)
+    {
+      fflush(stdout);
+      return;
+    }
+
+  if (fooder)
+    fprintf(out, "%s", fooder);
+  pclose(out);
+}
@@ -0,0 +1,196 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdalign.h>
+#include <stdint.h>
+
+#include "basics.h"
+#include "arena.h"
+#include "image-index.h"
+
+/* Large enough for the meta data of a few hundred images */
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+struct arena_chunk {
+  struct arena_chunk *next;
+  size_t size;
+  size_t used;
+  max_align_t data[];
+};
+
+static struct arena_chunk *
+arena_chunk_new(size_t size)
+{
+  struct arena_chunk *c;
+
+  c = malloc(sizeof(struct arena_chunk) + size);
+  if (c == NULL)
+    return NULL;
+
+  c->next = NULL;
+  c->size = size;
+  c->used = 0;
+
+  return c;
+}
+
+/* Returns zeroed memory, aligned like malloc() */
+void *
+arena_alloc(struct arena *a, size_t size)
+{
+  struct arena_chunk *c;
+  void *p;
+
+  assert(a);
+
+  size = (size + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+  if (size == 0)
+    size = alignof(max_align_t);
+
+  c = a->chunks;
+  if (c == NULL || c->size - c->used < size)
+    {
+      if (size > ARENA_CHUNK_SIZE / 4)
+	{
+	  /* big objects get their own chunk, behind the current
+	     one, so that the free space of it is not lost */
+	  c = arena_chunk_new(size);
+	  if (c == NULL)
+	    return NULL;
+	  if (a->chunks)
+	    {
+	      c->next = a->chunks->next;
+	      a->chunks->next = c;
+	    }
+	  else
+	    a->chunks = c;
+	}
+      else
+	{
+	  c = arena_chunk_new(ARENA_CHUNK_SIZE);
+	  if (c == NULL)
+	    return NULL;
+	  c->next = a->chunks;
+	  a->chunks = c;
+	}
+    }
+
+  p = (uint8_t *)c->data + c->used;
+  c->used += size;
+
+  return memset(p, 0, size);
+}
+
+char *
+arena_strdup(struct arena *a, const char *s)
+{
+  size_t len;
+  char *p;
+
+  if (s == NULL)
+    return NULL;
+
+  len = strlen(s);
+  p = arena_alloc(a, len + 1);
+  if (p == NULL)
+    return NULL;
+
+  return memcpy(p, s, len + 1);
+}
+
+/* s does not need to be NUL terminated */
+char *
+arena_strndup(struct arena *a, const char *s, size_t n)
+{
+  char *p;
+
+  p = arena_alloc(a, n + 1);
+  if (p == NULL)
+    return NULL;
+
+  /* arena_alloc() returns zeroed memory */
+  return memcpy(p, s, n);
+}
+
+static int
+arena_strings_resize(struct arena *a, size_t n_slots)
+{
+  const char **slots;
+
+  slots = calloc(n_slots, sizeof(char *));
+  if (slots == NULL)
+    return -ENOMEM;
+
+  for (size_t i = 0; i < a->n_slots; i++)
+    {
+      size_t j;
+
+      if (a->strings[i] == NULL)
+	continue;
+
+      for (j = string_hash(a->strings[i]) & (n_slots - 1);
+	   slots[j] != NULL;
+	   j = (j + 1) & (n_slots - 1))
+	;
+      slots[j] = a->strings[i];
+    }
+
+  free(a->strings);
+  a->strings = slots;
+  a->n_slots = n_slots;
+
+  return 0;
+}
+
+/* Returns the copy of s in the arena, the same pointer for the
+   same string. */
+const char *
+arena_intern(struct arena *a, const char *s)
+{
+  size_t i;
+  char *p;
+
+  assert(a);
+
+  if (s == NULL)
+    return NULL;
+
+  /* keep the load factor below 1/2 */
+  if ((a->n_strings + 1) * 2 > a->n_slots &&
+      arena_strings_resize(a, a->n_slots ? a->n_slots * 2 : 16) < 0)
+    return NULL;
+
+  for (i = string_hash(s) & (a->n_slots - 1);
+       a->strings[i] != NULL;
+       i = (i + 1) & (a->n_slots - 1))
+    if (streq(a->strings[i], s))
+      return a->strings[i];
+
+  p = arena_strdup(a, s);
+  if (p == NULL)
+    return NULL;
+
+  a->strings[i] = p;
+  a->n_strings++;
+
+  return p;
+}
+
+void
+arena_free(struct arena *a)
+{
+  if (!a)
+    return;
+
+  while (a->chunks)
+    {
+      struct arena_chunk *c = a->chunks;
+
+      a->chunks = c->next;
+      free(c);
+    }
+
+  a->strings = mfree(a->strings);
+  a->n_strings = a->n_slots = 0;
+}
@@ -0,0 +1,1402 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/* Warm state of sysextmgrd: everything which is expensive to
+   compute and stays valid between two requests. The entries are
+   validated by the caller (SHA256SUMS digest of the remote image,
+   mtime of the extensions directory of a snapshot, inode and mtime
+   of an image in the store), so nothing here expires by time. */
+
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <systemd/sd-json.h>
+
+#include "basics.h"
+#include "strv.h"
+#include "sysextmgr.h"
+#include "tmpfile-util.h"
+#include "log_msg.h"
+#include "mkdir_p.h"
+#include "download.h"
+#include "image-index.h"
+#include "host-match.h"
+#include "cache.h"
+
+/* Increase if the format of the state file changes incompatible */
+#define CACHE_STATE_VERSION 2
+
+struct remote_entry {
+  char *url;
+  char *image_name;
+  char *digest;             /* digest of the image in SHA256SUMS */
+  struct image_deps *deps;
+  bool keep;                /* used by cache_remote_prune() */
+};
+
+struct metadata_entry {
+  char *image_name;
+  uint64_t mtime;           /* mtime of the image in the store in usec */
+  struct image_deps *deps;
+};
+
+/* Open addressing hash over the entries of a cache like the tables
+   of image-index.c: a slot contains the position of the entry + 1,
+   0 marks an empty slot. */
+struct cache_index {
+  size_t *slots;
+  size_t n_slots;
+};
+
+/* keyed by url and image name */
+static struct remote_entry *remote_cache = NULL;
+static size_t n_remote_cache = 0;
+static struct cache_index remote_index = {};
+
+/* keyed by image name */
+static struct metadata_entry *metadata_cache = NULL;
+static size_t n_metadata_cache = 0;
+static struct cache_index metadata_index = {};
+
+struct snapshot_entry {
+  char *id;                 /* name of the snapshot directory */
+  uint64_t mtime;           /* mtime of the extensions directory */
+  struct refcount_table *refs;
+};
+
+/* sorted by id */
+static struct snapshot_entry *snapshot_cache = NULL;
+static size_t n_snapshot_cache = 0;
+
+/* sum of all snapshots, NULL if a snapshot changed since */
+static struct refcount_table *refcount_cache = NULL;
+
+struct digest_entry {
+  char *image_name;
+  uint64_t inode;           /* inode, size and mtime of the image when */
+  uint64_t size;            /* the digest got calculated */
+  uint64_t mtime;
+  char *digest;             /* SHA256 of the image in the store */
+  char *verity;             /* fs-verity digest if enabled, else NULL */
+  bool keep;                /* used by cache_digest_prune() */
+};
+
+/* keyed by image name */
+static struct digest_entry *digest_cache = NULL;
+static size_t n_digest_cache = 0;
+static struct cache_index digest_index = {};
+
+void
+free_refcount_table(struct refcount_table *t)
+{
+  if (!t)
+    return;
+
+  for (size_t i = 0; i < t->n; i++)
+    free(t->names[i]);
+  t->names = mfree(t->names);
+  t->counts = mfree(t->counts);
+  t->slots = mfree(t->slots);
+  t->n = 0;
+  t->max = 0;
+  t->n_slots = 0;
+}
+
+void
+free_refcount_tablep(struct refcount_table **t)
+{
+  if (!t || !*t)
+    return;
+
+  free_refcount_table(*t);
+  *t = mfree(*t);
+}
+
+/* slot of name, either the one containing it or the empty one
+   where it would be inserted */
+static size_t
+refcount_table_slot(const struct refcount_table *t, const char *name)
+{
+  size_t mask = t->n_slots - 1;
+  size_t slot = string_hash(name) & mask;
+
+  while (t->slots[slot] != 0 && !streq(t->names[t->slots[slot] - 1], name))
+    slot = (slot + 1) & mask;
+
+  return slot;
+}
+
+static int
+refcount_table_rehash(struct refcount_table *t, size_t n_slots)
+{
+  size_t *slots = calloc(n_slots, sizeof(size_t));
+  if (slots == NULL)
+    return -ENOMEM;
+
+  free(t->slots);
+  t->slots = slots;
+  t->n_slots = n_slots;
+
+  for (size_t i = 0; i < t->n; i++)
+    t->slots[refcount_table_slot(t, t->names[i])] = i + 1;
+
+  return 0;
+}
+
+int
+refcount_table_add_count(struct refcount_table *t, const char *name, int count)
+{
+  size_t slot;
+  int r;
+
+  assert(t);
+  assert(name);
+
+  /* keep the load factor below 1/2 */
+  if ((t->n + 1) * 2 > t->n_slots)
+    {
+      r = refcount_table_rehash(t, t->n_slots ? t->n_slots * 2 : 64);
+      if (r < 0)
+	return r;
+    }
+
+  slot = refcount_table_slot(t, name);
+  if (t->slots[slot] != 0)
+    {
+      t->counts[t->slots[slot] - 1] += count;
+      return 0;
+    }
+
+  if (t->n == t->max)
+    {
+      size_t max = t->max ? t->max * 2 : 16;
+      char **names;
+      int *counts;
+
+      names = realloc(t->names, max * sizeof(char *));
+      if (names == NULL)
+	return -ENOMEM;
+      t->names = names;
+
+      counts = realloc(t->counts, max * sizeof(int));
+      if (counts == NULL)
+	return -ENOMEM;
+      t->counts = counts;
+
+      t->max = max;
+    }
+
+  t->names[t->n] = strdup(name);
+  if (t->names[t->n] == NULL)
+    return -ENOMEM;
+  t->counts[t->n] = count;
+  t->n++;
+  t->slots[slot] = t->n;
+
+  return 0;
+}
+
+int
+refcount_table_add(struct refcount_table *t, const char *name)
+{
+  return refcount_table_add_count(t, name, 1);
+}
+
+int
+refcount_table_lookup(const struct refcount_table *t, const char *name)
+{
+  size_t slot;
+
+  assert(t);
+  assert(name);
+
+  if (t->n == 0)
+    return 0;
+
+  slot = refcount_table_slot(t, name);
+  if (t->slots[slot] == 0)
+    return 0;
+
+  return t->counts[t->slots[slot] - 1];
+}
+
+static void
+free_cache_index(struct cache_index *idx)
+{
+  idx->slots = mfree(idx->slots);
+  idx->n_slots = 0;
+}
+
+/* Make room for one more entry in an index of n entries, keeping
+   the load factor below 1/2. Returns 1 if the slots got replaced
+   and the caller has to reindex all entries. */
+static int
+cache_index_reserve(struct cache_index *idx, size_t n)
+{
+  size_t n_slots;
+  size_t *slots;
+
+  if ((n + 1) * 2 <= idx->n_slots)
+    return 0;
+
+  n_slots = idx->n_slots ? idx->n_slots * 2 : 64;
+  slots = calloc(n_slots, sizeof(size_t));
+  if (slots == NULL)
+    return -ENOMEM;
+
+  free(idx->slots);
+  idx->slots = slots;
+  idx->n_slots = n_slots;
+
+  return 1;
+}
+
+static void
+cache_index_clear(struct cache_index *idx)
+{
+  if (idx->slots)
+    memset(idx->slots, 0, idx->n_slots * sizeof(size_t));
+}
+
+static void
+free_remote_entry(struct remote_entry *e)
+{
+  e->url = mfree(e->url);
+  e->image_name = mfree(e->image_name);
+  e->digest = mfree(e->digest);
+  free_image_depsp(&e->deps);
+}
+
+static uint64_t
+remote_hash(const char *url, const char *image_name)
+{
+  return (string_hash(url) * UINT64_C(0x100000001b3)) ^ string_hash(image_name);
+}
+
+/* slot of url and image_name, either the one containing it or the
+   empty one where it would be inserted */
+static size_t
+remote_slot(const char *url, const char *image_name)
+{
+  size_t mask = remote_index.n_slots - 1;
+  size_t slot = remote_hash(url, image_name) & mask;
+
+  while (remote_index.slots[slot] != 0)
+    {
+      const struct remote_entry *e = &remote_cache[remote_index.slots[slot] - 1];
+
+      if (streq(e->url, url) && streq(e->image_name, image_name))
+	break;
+      slot = (slot + 1) & mask;
+    }
+
+  return slot;
+}
+
+static struct remote_entry *
+remote_find(const char *url, const char *image_name)
+{
+  size_t slot;
+
+  if (n_remote_cache == 0)
+    return NULL;
+
+  slot = remote_slot(url, image_name);
+  if (remote_index.slots[slot] == 0)
+    return NULL;
+
+  return &remote_cache[remote_index.slots[slot] - 1];
+}
+
+static void
+remote_reindex(void)
+{
+  cache_index_clear(&remote_index);
+  for (size_t i = 0; i < n_remote_cache; i++)
+    remote_index.slots[remote_slot(remote_cache[i].url, remote_cache[i].image_name)] = i + 1;
+}
+
+/* Returns the cached meta data or NULL if the image is not cached.
+   The result is owned by the cache and valid until the next change
+   of the cache. */
+const struct image_deps *
+cache_remote_get(const char *url, const char *image_name, const char *digest)
+{
+  struct remote_entry *e;
+
+  assert(url);
+  assert(image_name);
+
+  e = remote_find(url, image_name);
+  if (e == NULL)
+    return NULL;
+
+  /* image got replaced in the repository */
+  if (!streq(e->digest, strempty(digest)))
+    return NULL;
+
+  return e->deps;
+}
+
+int
+cache_remote_put(const char *url, const char *image_name,
+		 const char *digest, const struct image_deps *deps)
+{
+  _cleanup_(free_image_depsp) struct image_deps *copy = NULL;
+  _cleanup_free_ char *url_copy = NULL;
+  _cleanup_free_ char *name = NULL;
+  _cleanup_free_ char *digest_copy = NULL;
+  struct remote_entry *e;
+  size_t slot;
+  int r;
+
+  assert(url);
+  assert(image_name);
+  assert(deps);
+
+  url_copy = strdup(url);
+  name = strdup(image_name);
+  digest_copy = strdup(strempty(digest));
+  if (url_copy == NULL || name == NULL || digest_copy == NULL)
+    return -ENOMEM;
+
+  r = dup_image_deps(deps, &copy);
+  if (r < 0)
+    return r;
+
+  r = cache_index_reserve(&remote_index, n_remote_cache);
+  if (r < 0)
+    return r;
+  if (r > 0)
+    remote_reindex();
+
+  slot = remote_slot(url, image_name);
+  if (remote_index.slots[slot] != 0)
+    {
+      e = &remote_cache[remote_index.slots[slot] - 1];
+      free_remote_entry(e);
+    }
+  else
+    {
+      struct remote_entry *tmp;
+
+      tmp = realloc(remote_cache, (n_remote_cache + 1) * sizeof(struct remote_entry));
+      if (tmp == NULL)
+	return -ENOMEM;
+      remote_cache = tmp;
+      e = &remote_cache[n_remote_cache++];
+      remote_index.slots[slot] = n_remote_cache;
+    }
+
+  *e = (struct remote_entry) {
+    .url = TAKE_PTR(url_copy),
+    .image_name = TAKE_PTR(name),
+    .digest = TAKE_PTR(digest_copy),
+    .deps = TAKE_PTR(copy),
+  };
+
+  return 0;
+}
+
+/* Remove all entries of url, which are no longer listed in SHA256SUMS
+   or which have a different digest now. */
+void
+cache_remote_prune(const char *url, char **names, char **digests)
+{
+  size_t j = 0;
+
+  assert(url);
+
+  for (size_t i = 0; i < n_remote_cache; i++)
+    remote_cache[i].keep = false;
+
+  for (size_t i = 0; names && names[i] != NULL; i++)
+    {
+      struct remote_entry *e = remote_find(url, names[i]);
+
+      if (e && streq(strempty(digests ? digests[i] : NULL), e->digest))
+	e->keep = true;
+    }
+
+  for (size_t i = 0; i < n_remote_cache; i++)
+    {
+      if (remote_cache[i].keep || !streq(remote_cache[i].url, url))
+	remote_cache[j++] = remote_cache[i];
+      else
+	free_remote_entry(&remote_cache[i]);
+    }
+
+  if (j < n_remote_cache)
+    {
+      n_remote_cache = j;
+      remote_reindex();
+    }
+}
+
+/* slot of image_name, either the one containing it or the empty one
+   where it would be inserted */
+static size_t
+metadata_slot(const char *image_name)
+{
+  size_t mask = metadata_index.n_slots - 1;
+  size_t slot = string_hash(image_name) & mask;
+
+  while (metadata_index.slots[slot] != 0 &&
+	 !streq(metadata_cache[metadata_index.slots[slot] - 1].image_name, image_name))
+    slot = (slot + 1) & mask;
+
+  return slot;
+}
+
+static void
+metadata_reindex(void)
+{
+  cache_index_clear(&metadata_index);
+  for (size_t i = 0; i < n_metadata_cache; i++)
+    metadata_index.slots[metadata_slot(metadata_cache[i].image_name)] = i + 1;
+}
+
+/* Meta data of images in the local store. The image name contains
+   version and architecture, so the content never changes as long as
+   the image exists. */
+const struct image_deps *
+cache_metadata_get(const char *image_name)
+{
+  size_t slot;
+
+  assert(image_name);
+
+  if (n_metadata_cache == 0)
+    return NULL;
+
+  slot = metadata_slot(image_name);
+  if (metadata_index.slots[slot] == 0)
+    return NULL;
+
+  return metadata_cache[metadata_index.slots[slot] - 1].deps;
+}
+
+static uint64_t
+timespec_load(const struct timespec *ts)
+{
+  return (uint64_t)ts->tv_sec * USEC_PER_SEC + (uint64_t)ts->tv_nsec / NSEC_PER_USEC;
+}
+
+/* mtime of the image in the store, 0 if it does not exist */
+static uint64_t
+image_mtime(const char *image_name)
+{
+  _cleanup_free_ char *fn = NULL;
+  struct stat st;
+
+  if (join_path(config.sysext_store_dir, image_name, &fn) < 0)
+    return 0;
+
+  if (stat(fn, &st) < 0)
+    return 0;
+
+  return timespec_load(&st.st_mtim);
+}
+
+static int
+metadata_insert(const char *image_name, uint64_t mtime,
+		const struct image_deps *deps)
+{
+  _cleanup_(free_image_depsp) struct image_deps *copy = NULL;
+  _cleanup_free_ char *name = NULL;
+  struct metadata_entry *e;
+  size_t slot;
+  int r;
+
+  name = strdup(image_name);
+  if (name == NULL)
+    return -ENOMEM;
+
+  r = dup_image_deps(deps, &copy);
+  if (r < 0)
+    return r;
+
+  r = cache_index_reserve(&metadata_index, n_metadata_cache);
+  if (r < 0)
+    return r;
+  if (r > 0)
+    metadata_reindex();
+
+  slot = metadata_slot(image_name);
+  if (metadata_index.slots[slot] != 0)
+    {
+      e = &metadata_cache[metadata_index.slots[slot] - 1];
+      free(e->image_name);
+      free_image_depsp(&e->deps);
+    }
+  else
+    {
+      struct metadata_entry *tmp;
+
+      tmp = realloc(metadata_cache, (n_metadata_cache + 1) * sizeof(struct metadata_entry));
+      if (tmp == NULL)
+	return -ENOMEM;
+      metadata_cache = tmp;
+      e = &metadata_cache[n_metadata_cache++];
+      metadata_index.slots[slot] = n_metadata_cache;
+    }
+
+  e->image_name = TAKE_PTR(name);
+  e->mtime = mtime;
+  e->deps = TAKE_PTR(copy);
+
+  return 0;
+}
+
+int
+cache_metadata_put(const char *image_name, const struct image_deps *deps)
+{
+  assert(image_name);
+  assert(deps);
+
+  return metadata_insert(image_name, image_mtime(image_name), deps);
+}
+
+void
+cache_metadata_drop(const char *image_name)
+{
+  size_t slot, mask, i;
+
+  assert(image_name);
+
+  if (n_metadata_cache == 0)
+    return;
+
+  slot = metadata_slot(image_name);
+  if (metadata_index.slots[slot] == 0)
+    return;
+
+  i = metadata_index.slots[slot] - 1;
+  free(metadata_cache[i].image_name);
+  free_image_depsp(&metadata_cache[i].deps);
+
+  /* entries behind the removed one in the same cluster could have
+     been placed there because of it, insert them again */
+  mask = metadata_index.n_slots - 1;
+  metadata_index.slots[slot] = 0;
+  for (size_t s = (slot + 1) & mask; metadata_index.slots[s] != 0; s = (s + 1) & mask)
+    {
+      size_t v = metadata_index.slots[s];
+
+      metadata_index.slots[s] = 0;
+      metadata_index.slots[metadata_slot(metadata_cache[v - 1].image_name)] = v;
+    }
+
+  /* move the last entry into the gap */
+  n_metadata_cache--;
+  if (i < n_metadata_cache)
+    {
+      metadata_index.slots[metadata_slot(metadata_cache[n_metadata_cache].image_name)] = i + 1;
+      metadata_cache[i] = metadata_cache[n_metadata_cache];
+    }
+}
+
+static int
+snapshot_cmp(const void *key, const void *e)
+{
+  return strcmp(key, ((const struct snapshot_entry *)e)->id);
+}
+
+static struct snapshot_entry *
+snapshot_find(const char *id)
+{
+  if (n_snapshot_cache == 0)
+    return NULL;
+
+  return bsearch(id, snapshot_cache, n_snapshot_cache,
+		 sizeof(struct snapshot_entry), snapshot_cmp);
+}
+
+static void
+free_snapshot_entry(struct snapshot_entry *e)
+{
+  e->id = mfree(e->id);
+  free_refcount_tablep(&e->refs);
+}
+
+/* References of snapshot id, if the extensions directory did not
+   change since they got cached. */
+const struct refcount_table *
+cache_snapshot_get(const char *id, uint64_t mtime)
+{
+  struct snapshot_entry *e;
+
+  assert(id);
+
+  e = snapshot_find(id);
+  if (e == NULL || e->mtime != mtime)
+    return NULL;
+
+  return e->refs;
+}
+
+/* takes ownership of refs */
+int
+cache_snapshot_put(const char *id, uint64_t mtime, struct refcount_table *refs)
+{
+  _cleanup_(free_refcount_tablep) struct refcount_table *t = refs;
+  struct snapshot_entry *e, *tmp;
+  size_t pos;
+
+  assert(id);
+  assert(refs);
+
+  free_refcount_tablep(&refcount_cache);
+
+  e = snapshot_find(id);
+  if (e)
+    {
+      free_refcount_tablep(&e->refs);
+      e->mtime = mtime;
+      e->refs = TAKE_PTR(t);
+      return 0;
+    }
+
+  tmp = realloc(snapshot_cache, (n_snapshot_cache + 1) * sizeof(struct snapshot_entry));
+  if (tmp == NULL)
+    return -ENOMEM;
+  snapshot_cache = tmp;
+
+  for (pos = 0; pos < n_snapshot_cache; pos++)
+    if (strcmp(snapshot_cache[pos].id, id) > 0)
+      break;
+
+  e = &snapshot_cache[pos];
+  memmove(e + 1, e, (n_snapshot_cache - pos) * sizeof(struct snapshot_entry));
+  n_snapshot_cache++;
+
+  *e = (struct snapshot_entry) {
+    .id = strdup(id),
+    .mtime = mtime,
+    .refs = TAKE_PTR(t),
+  };
+  if (e->id == NULL)
+    {
+      free_snapshot_entry(e);
+      n_snapshot_cache--;
+      memmove(e, e + 1, (n_snapshot_cache - pos) * sizeof(struct snapshot_entry));
+      return -ENOMEM;
+    }
+
+  return 0;
+}
+
+/* Forget all snapshots which are not in ids (sorted) anymore */
+void
+cache_snapshot_prune(char **ids, size_t n_ids)
+{
+  size_t i = 0, j = 0;
+
+  for (i = 0; i < n_snapshot_cache; i++)
+    {
+      if (bsearch(&snapshot_cache[i].id, ids, n_ids, sizeof(char *),
+		  strptr_cmp) == NULL)
+	{
+	  free_snapshot_entry(&snapshot_cache[i]);
+	  free_refcount_tablep(&refcount_cache);
+	  continue;
+	}
+      snapshot_cache[j++] = snapshot_cache[i];
+    }
+  n_snapshot_cache = j;
+}
+
+/* Sum of the references of all cached snapshots */
+int
+cache_refcount_get(const struct refcount_table **ret)
+{
+  _cleanup_(free_refcount_tablep) struct refcount_table *t = NULL;
+  int r;
+
+  assert(ret);
+
+  if (refcount_cache == NULL)
+    {
+      t = calloc(1, sizeof(struct refcount_table));
+      if (t == NULL)
+	return -ENOMEM;
+
+      for (size_t i = 0; i < n_snapshot_cache; i++)
+	for (size_t j = 0; j < snapshot_cache[i].refs->n; j++)
+	  {
+	    r = refcount_table_add_count(t, snapshot_cache[i].refs->names[j],
+					 snapshot_cache[i].refs->counts[j]);
+	    if (r < 0)
+	      return r;
+	  }
+
+      refcount_cache = TAKE_PTR(t);
+    }
+
+  *ret = refcount_cache;
+
+  return 0;
+}
+
+static void
+free_digest_entry(struct digest_entry *e)
+{
+  e->image_name = mfree(e->image_name);
+  e->digest = mfree(e->digest);
+  e->verity = mfree(e->verity);
+}
+
+/* slot of image_name, either the one containing it or the empty one
+   where it would be inserted */
+static size_t
+digest_slot(const char *image_name)
+{
+  size_t mask = digest_index.n_slots - 1;
+  size_t slot = string_hash(image_name) & mask;
+
+  while (digest_index.slots[slot] != 0 &&
+	 !streq(digest_cache[digest_index.slots[slot] - 1].image_name, image_name))
+    slot = (slot + 1) & mask;
+
+  return slot;
+}
+
+static struct digest_entry *
+digest_find(const char *image_name)
+{
+  size_t slot;
+
+  if (n_digest_cache == 0)
+    return NULL;
+
+  slot = digest_slot(image_name);
+  if (digest_index.slots[slot] == 0)
+    return NULL;
+
+  return &digest_cache[digest_index.slots[slot] - 1];
+}
+
+static void
+digest_reindex(void)
+{
+  cache_index_clear(&digest_index);
+  for (size_t i = 0; i < n_digest_cache; i++)
+    digest_index.slots[digest_slot(digest_cache[i].image_name)] = i + 1;
+}
+
+/* SHA256 digests of the images in the store calculated by Verify. A
+   digest is only valid as long as inode, size and mtime of the image
+   don't change. For images with fs-verity, the verity digest measured
+   at the same time is returned in ret_verity. */
+const char *
+cache_digest_get(const char *image_name, uint64_t inode, uint64_t size, uint64_t mtime,
+		 const char **ret_verity)
+{
+  struct digest_entry *e;
+
+  assert(image_name);
+  assert(ret_verity);
+
+  e = digest_find(image_name);
+  if (e == NULL)
+    return NULL;
+
+  if (e->inode != inode || e->size != size || e->mtime != mtime)
+    return NULL;
+
+  *ret_verity = e->verity;
+  return e->digest;
+}
+
+int
+cache_digest_put(const char *image_name, uint64_t inode, uint64_t size,
+		 uint64_t mtime, const char *digest, const char *verity)
+{
+  _cleanup_free_ char *name = NULL;
+  _cleanup_free_ char *copy = NULL;
+  _cleanup_free_ char *verity_copy = NULL;
+  struct digest_entry *e;
+  size_t slot;
+  int r;
+
+  assert(image_name);
+  assert(digest);
+
+  name = strdup(image_name);
+  copy = strdup(digest);
+  if (name == NULL || copy == NULL)
+    return -ENOMEM;
+  if (verity)
+    {
+      verity_copy = strdup(verity);
+      if (verity_copy == NULL)
+	return -ENOMEM;
+    }
+
+  r = cache_index_reserve(&digest_index, n_digest_cache);
+  if (r < 0)
+    return r;
+  if (r > 0)
+    digest_reindex();
+
+  slot = digest_slot(image_name);
+  if (digest_index.slots[slot] != 0)
+    {
+      e = &digest_cache[digest_index.slots[slot] - 1];
+      free_digest_entry(e);
+    }
+  else
+    {
+      struct digest_entry *tmp;
+
+      tmp = realloc(digest_cache, (n_digest_cache + 1) * sizeof(struct digest_entry));
+      if (tmp == NULL)
+	return -ENOMEM;
+      digest_cache = tmp;
+      e = &digest_cache[n_digest_cache++];
+      digest_index.slots[slot] = n_digest_cache;
+    }
+
+  *e = (struct digest_entry) {
+    .image_name = TAKE_PTR(name),
+    .inode = inode,
+    .size = size,
+    .mtime = mtime,
+    .digest = TAKE_PTR(copy),
+    .verity = TAKE_PTR(verity_copy),
+  };
+
+  return 0;
+}
+
+/* Remove the digests of all images not in names */
+void
+cache_digest_prune(char **names)
+{
+  size_t j = 0;
+
+  for (size_t i = 0; i < n_digest_cache; i++)
+    digest_cache[i].keep = false;
+
+  STRV_FOREACH(name, names)
+    {
+      struct digest_entry *e = digest_find(*name);
+
+      if (e)
+	e->keep = true;
+    }
+
+  for (size_t i = 0; i < n_digest_cache; i++)
+    {
+      if (digest_cache[i].keep)
+	digest_cache[j++] = digest_cache[i];
+      else
+	free_digest_entry(&digest_cache[i]);
+    }
+
+  if (j < n_digest_cache)
+    {
+      n_digest_cache = j;
+      digest_reindex();
+    }
+}
+
+void
+cache_flush(void)
+{
+  for (size_t i = 0; i < n_remote_cache; i++)
+    free_remote_entry(&remote_cache[i]);
+  remote_cache = mfree(remote_cache);
+  n_remote_cache = 0;
+  free_cache_index(&remote_index);
+
+  for (size_t i = 0; i < n_metadata_cache; i++)
+    {
+      free(metadata_cache[i].image_name);
+      free_image_depsp(&metadata_cache[i].deps);
+    }
+  metadata_cache = mfree(metadata_cache);
+  n_metadata_cache = 0;
+  free_cache_index(&metadata_index);
+
+  for (size_t i = 0; i < n_snapshot_cache; i++)
+    free_snapshot_entry(&snapshot_cache[i]);
+  snapshot_cache = mfree(snapshot_cache);
+  n_snapshot_cache = 0;
+
+  free_refcount_tablep(&refcount_cache);
+
+  for (size_t i = 0; i < n_digest_cache; i++)
+    free_digest_entry(&digest_cache[i]);
+  digest_cache = mfree(digest_cache);
+  n_digest_cache = 0;
+  free_cache_index(&digest_index);
+}
+
+static int
+deps_to_json(const struct image_deps *deps, sd_json_variant **ret)
+{
+  return sd_json_buildo(ret,
+			SD_JSON_BUILD_PAIR_CONDITION(!!deps->image_name_json, "image_name", SD_JSON_BUILD_STRING(deps->image_name_json)),
+			SD_JSON_BUILD_PAIR_CONDITION(!!deps->sysext_version_id, "SYSEXT_VERSION_ID", SD_JSON_BUILD_STRING(deps->sysext_version_id)),
+			SD_JSON_BUILD_PAIR_CONDITION(!!deps->sysext_scope, "SYSEXT_SCOPE", SD_JSON_BUILD_STRING(deps->sysext_scope)),
+			SD_JSON_BUILD_PAIR_CONDITION(!!deps->id, "ID", SD_JSON_BUILD_STRING(deps->id)),
+			SD_JSON_BUILD_PAIR_CONDITION(!!deps->sysext_level, "SYSEXT_LEVEL", SD_JSON_BUILD_STRING(deps->sysext_level)),
+			SD_JSON_BUILD_PAIR_CONDITION(!!deps->version_id, "VERSION_ID", SD_JSON_BUILD_STRING(deps->version_id)),
+			SD_JSON_BUILD_PAIR_CONDITION(!!deps->architecture, "ARCHITECTURE", SD_JSON_BUILD_STRING(deps->architecture)));
+}
+
+static int
+cache_to_json(sd_json_variant **ret)
+{
+  _cleanup_(sd_json_variant_unrefp) sd_json_variant *remote = NULL;
+  _cleanup_(sd_json_variant_unrefp) sd_json_variant *metadata = NULL;
+  _cleanup_(sd_json_variant_unrefp) sd_json_variant *snapshots = NULL;
+  _cleanup_(sd_json_variant_unrefp) sd_json_variant *digests = NULL;
+  _cleanup_(sd_json_variant_unrefp) sd_json_variant *verdicts = NULL;
+  int r;
+
+  r = sd_json_variant_new_array(&remote, NULL, 0);
+  if (r < 0)
+    return r;
+
+  for (size_t i = 0; i < n_remote_cache; i++)
+    {
+      _cleanup_(sd_json_variant_unrefp) sd_json_variant *deps = NULL;
+
+      r = deps_to_json(remote_cache[i].deps, &deps);
+      if (r < 0)
+	return r;
+
+      r = sd_json_variant_append_arraybo(&remote,
+					 SD_JSON_BUILD_PAIR_STRING("Url", remote_cache[i].url),
+					 SD_JSON_BUILD_PAIR_STRING("ImageName", remote_cache[i].image_name),
+					 SD_JSON_BUILD_PAIR_STRING("Digest", remote_cache[i].digest),
+					 SD_JSON_BUILD_PAIR_VARIANT("Deps", deps));
+      if (r < 0)
+	return r;
+    }
+
+  r = sd_json_variant_new_array(&metadata, NULL, 0);
+  if (r < 0)
+    return r;
+
+  for (size_t i = 0; i < n_metadata_cache; i++)
+    {
+      _cleanup_(sd_json_variant_unrefp) sd_json_variant *deps = NULL;
+
+      r = deps_to_json(metadata_cache[i].deps, &deps);
+      if (r < 0)
+	return r;
+
+      r = sd_json_variant_append_arraybo(&metadata,
+					 SD_JSON_BUILD_PAIR_STRING("ImageName", metadata_cache[i].image_name),
+					 SD_JSON_BUILD_PAIR_UNSIGNED("MTime", metadata_cache[i].mtime),
+					 SD_JSON_BUILD_PAIR_VARIANT("Deps", deps));
+      if (r < 0)
+	return r;
+    }
+
+  r = sd_json_variant_new_array(&snapshots, NULL, 0);
+  if (r < 0)
+    return r;
+
+  for (size_t i = 0; i < n_snapshot_cache; i++)
+    {
+      _cleanup_(sd_json_variant_unrefp) sd_json_variant *refs = NULL;
+      const struct refcount_table *t = snapshot_cache[i].refs;
+
+      r = sd_json_variant_new_array(&refs, NULL, 0);
+      if (r < 0)
+	return r;
+
+      for (size_t j = 0; j < t->n; j++)
+	{
+	  r = sd_json_variant_append_arraybo(&refs,
+					     SD_JSON_BUILD_PAIR_STRING("ImageName", t->names[j]),
+					     SD_JSON_BUILD_PAIR_INTEGER("Count", t->counts[j]));
+	  if (r < 0)
+	    return r;
+	}
+
+      r = sd_json_variant_append_arraybo(&snapshots,
+					 SD_JSON_BUILD_PAIR_STRING("Id", snapshot_cache[i].id),
+					 SD_JSON_BUILD_PAIR_UNSIGNED("MTime", snapshot_cache[i].mtime),
+					 SD_JSON_BUILD_PAIR_VARIANT("Images", refs));
+      if (r < 0)
+	return r;
+    }
+
+  r = sd_json_variant_new_array(&digests, NULL, 0);
+  if (r < 0)
+    return r;
+
+  for (size_t i = 0; i < n_digest_cache; i++)
+    {
+      r = sd_json_variant_append_arraybo(&digests,
+					 SD_JSON_BUILD_PAIR_STRING("ImageName", digest_cache[i].image_name),
+					 SD_JSON_BUILD_PAIR_UNSIGNED("Inode", digest_cache[i].inode),
+					 SD_JSON_BUILD_PAIR_UNSIGNED("Size", digest_cache[i].size),
+					 SD_JSON_BUILD_PAIR_UNSIGNED("MTime", digest_cache[i].mtime),
+					 SD_JSON_BUILD_PAIR_STRING("Digest", digest_cache[i].digest),
+					 SD_JSON_BUILD_PAIR_CONDITION(!!digest_cache[i].verity, "Verity",
+								      SD_JSON_BUILD_STRING(digest_cache[i].verity)));
+      if (r < 0)
+	return r;
+    }
+
+  r = host_match_to_json(&verdicts);
+  if (r < 0)
+    return r;
+
+  return sd_json_buildo(ret,
+			SD_JSON_BUILD_PAIR_UNSIGNED("Version", CACHE_STATE_VERSION),
+			SD_JSON_BUILD_PAIR_VARIANT("Remote", remote),
+			SD_JSON_BUILD_PAIR_VARIANT("Metadata", metadata),
+			SD_JSON_BUILD_PAIR_VARIANT("Snapshots", snapshots),
+			SD_JSON_BUILD_PAIR_VARIANT("Digests", digests),
+			SD_JSON_BUILD_PAIR_VARIANT("Verdicts", verdicts));
+}
+
+/* Write the cache atomically to path, so that a restarted daemon
+   can answer the first request with warm caches. */
+int
+cache_save(const char *path)
+{
+  _cleanup_(sd_json_variant_unrefp) sd_json_variant *json = NULL;
+  _cleanup_free_ char *tmpfn = NULL;
+  _cleanup_free_ char *dir = NULL;
+  _cleanup_fclose_ FILE *fp = NULL;
+  char *p;
+  int fd, r;
+
+  assert(path);
+
+  r = cache_to_json(&json);
+  if (r < 0)
+    return r;
+
+  dir = strdup(path);
+  if (dir == NULL)
+    return -ENOMEM;
+  p = strrchr(dir, '/');
+  if (p && p != dir)
+    {
+      *p = '\0';
+      r = mkdir_p(dir, 0755);
+      if (r < 0)
+	return r;
+    }
+
+  if (asprintf(&tmpfn, "%s.XXXXXX", path) < 0)
+    return -ENOMEM;
+
+  fd = mkostemp_safe(tmpfn);
+  if (fd < 0)
+    return fd;
+
+  fp = fdopen(fd, "w");
+  if (fp == NULL)
+    {
+      r = -errno;
+      close(fd);
+      unlink(tmpfn);
+      return r;
+    }
+
+  /* compact, no pretty printing */
+  r = sd_json_variant_dump(json, 0, fp, NULL);
+  if (r >= 0 && (fflush(fp) != 0 || fsync(fileno(fp)) < 0))
+    r = -errno;
+  if (r >= 0 && rename(tmpfn, path) < 0)
+    r = -errno;
+  if (r < 0)
+    {
+      unlink(tmpfn);
+      return r;
+    }
+
+  return 0;
+}
+
+struct state_entry {
+  char *url;
+  char *image_name;
+  char *digest;
+  char *verity;
+  uint64_t mtime;
+  uint64_t inode;
+  uint64_t size;
+  int count;
+  sd_json_variant *deps;
+};
+
+static void
+state_entry_free(struct state_entry *e)
+{
+  e->url = mfree(e->url);
+  e->image_name = mfree(e->image_name);
+  e->digest = mfree(e->digest);
+  e->verity = mfree(e->verity);
+  e->deps = sd_json_variant_unref(e->deps);
+}
+
+static int
+load_remote(sd_json_variant *array)
+{
+  static const sd_json_dispatch_field dispatch_table[] = {
+    { "Url",       SD_JSON_VARIANT_STRING, sd_json_dispatch_string,  offsetof(struct state_entry, url),        SD_JSON_MANDATORY },
+    { "ImageName", SD_JSON_VARIANT_STRING, sd_json_dispatch_string,  offsetof(struct state_entry, image_name), SD_JSON_MANDATORY },
+    { "Digest",    SD_JSON_VARIANT_STRING, sd_json_dispatch_string,  offsetof(struct state_entry, digest),     SD_JSON_MANDATORY },
+    { "Deps",      SD_JSON_VARIANT_OBJECT, sd_json_dispatch_variant, offsetof(struct state_entry, deps),       SD_JSON_MANDATORY },
+    {}
+  };
+  int r;
+
+  for (size_t i = 0; i < sd_json_variant_elements(array); i++)
+    {
+      _cleanup_(state_entry_free) struct state_entry e = {};
+      _cleanup_(free_image_depsp) struct image_deps *deps = NULL;
+
+      r = sd_json_dispatch(sd_json_variant_by_index(array, i), dispatch_table,
+			   SD_JSON_ALLOW_EXTENSIONS, &e);
+      if (r < 0)
+	return r;
+
+      r = parse_image_deps(e.deps, &deps);
+      if (r < 0)
+	return r;
+
+      /* The digest gets compared with SHA256SUMS on first use */
+      r = cache_remote_put(e.url, e.image_name, e.digest, deps);
+      if (r < 0)
+	return r;
+    }
+
+  return 0;
+}
+
+static int
+load_metadata(sd_json_variant *array)
+{
+  static const sd_json_dispatch_field dispatch_table[] = {
+    { "ImageName", SD_JSON_VARIANT_STRING,   sd_json_dispatch_string,  offsetof(struct state_entry, image_name), SD_JSON_MANDATORY },
+    { "MTime",     SD_JSON_VARIANT_UNSIGNED, sd_json_dispatch_uint64,  offsetof(struct state_entry, mtime),      SD_JSON_MANDATORY },
+    { "Deps",      SD_JSON_VARIANT_OBJECT,   sd_json_dispatch_variant, offsetof(struct state_entry, deps),       SD_JSON_MANDATORY },
+    {}
+  };
+  int r;
+
+  for (size_t i = 0; i < sd_json_variant_elements(array); i++)
+    {
+      _cleanup_(state_entry_free) struct state_entry e = {};
+      _cleanup_(free_image_depsp) struct image_deps *deps = NULL;
+
+      r = sd_json_dispatch(sd_json_variant_by_index(array, i), dispatch_table,
+			   SD_JSON_ALLOW_EXTENSIONS, &e);
+      if (r < 0)
+	return r;
+
+      /* image got removed or replaced while we were not running */
+      if (e.mtime == 0 || image_mtime(e.image_name) != e.mtime)
+	continue;
+
+      r = parse_image_deps(e.deps, &deps);
+      if (r < 0)
+	return r;
+
+      r = metadata_insert(e.image_name, e.mtime, deps);
+      if (r < 0)
+	return r;
+    }
+
+  return 0;
+}
+
+static int
+load_refs(sd_json_variant *array, struct refcount_table **ret)
+{
+  static const sd_json_dispatch_field dispatch_table[] = {
+    { "ImageName", SD_JSON_VARIANT_STRING,  sd_json_dispatch_string, offsetof(struct state_entry, image_name), SD_JSON_MANDATORY },
+    { "Count",     SD_JSON_VARIANT_INTEGER, sd_json_dispatch_int,    offsetof(struct state_entry, count),      SD_JSON_MANDATORY },
+    {}
+  };
+  _cleanup_(free_refcount_tablep) struct refcount_table *t = NULL;
+  int r;
+
+  t = calloc(1, sizeof(struct refcount_table));
+  if (t == NULL)
+    return -ENOMEM;
+
+  for (size_t i = 0; i < sd_json_variant_elements(array); i++)
+    {
+      _cleanup_(state_entry_free) struct state_entry e = {};
+
+      r = sd_json_dispatch(sd_json_variant_by_index(array, i), dispatch_table,
+			   SD_JSON_ALLOW_EXTENSIONS, &e);
+      if (r < 0)
+	return r;
+
+      r = refcount_table_add_count(t, e.image_name, e.count);
+      if (r < 0)
+	return r;
+    }
+
+  *ret = TAKE_PTR(t);
+
+  return 0;
+}
+
+static int
+load_snapshots(sd_json_variant *array)
+{
+  static const sd_json_dispatch_field dispatch_table[] = {
+    { "Id",     SD_JSON_VARIANT_STRING,   sd_json_dispatch_string,  offsetof(struct state_entry, image_name), SD_JSON_MANDATORY },
+    { "MTime",  SD_JSON_VARIANT_UNSIGNED, sd_json_dispatch_uint64,  offsetof(struct state_entry, mtime),      SD_JSON_MANDATORY },
+    { "Images", SD_JSON_VARIANT_ARRAY,    sd_json_dispatch_variant, offsetof(struct state_entry, deps),       SD_JSON_MANDATORY },
+    {}
+  };
+  int r;
+
+  /* No need to verify the snapshots here, calc_refcount() compares
+     the mtimes of the extensions directories before using them. */
+  for (size_t i = 0; i < sd_json_variant_elements(array); i++)
+    {
+      _cleanup_(state_entry_free) struct state_entry e = {};
+      struct refcount_table *refs = NULL;
+
+      r = sd_json_dispatch(sd_json_variant_by_index(array, i), dispatch_table,
+			   SD_JSON_ALLOW_EXTENSIONS, &e);
+      if (r < 0)
+	return r;
+
+      r = load_refs(e.deps, &refs);
+      if (r < 0)
+	return r;
+
+      r = cache_snapshot_put(e.image_name, e.mtime, refs);
+      if (r < 0)
+	return r;
+    }
+
+  return 0;
+}
+
+/* The digests are compared with inode, size and mtime of the image
+   on every use, so they can be loaded without further checks. */
+static int
+load_digests(sd_json_variant *array)
+{
+  static const sd_json_dispatch_field dispatch_table[] = {
+    { "ImageName", SD_JSON_VARIANT_STRING,   sd_json_dispatch_string, offsetof(struct state_entry, image_name), SD_JSON_MANDATORY },
+    { "Inode",     SD_JSON_VARIANT_UNSIGNED, sd_json_dispatch_uint64, offsetof(struct state_entry, inode),      SD_JSON_MANDATORY },
+    { "Size",      SD_JSON_VARIANT_UNSIGNED, sd_json_dispatch_uint64, offsetof(struct state_entry, size),       SD_JSON_MANDATORY },
+    { "MTime",     SD_JSON_VARIANT_UNSIGNED, sd_json_dispatch_uint64, offsetof(struct state_entry, mtime),      SD_JSON_MANDATORY },
+    { "Digest",    SD_JSON_VARIANT_STRING,   sd_json_dispatch_string, offsetof(struct state_entry, digest),     SD_JSON_MANDATORY },
+    { "Verity",    SD_JSON_VARIANT_STRING,   sd_json_dispatch_string, offsetof(struct state_entry, verity),     0 },
+    {}
+  };
+  int r;
+
+  for (size_t i = 0; i < sd_json_variant_elements(array); i++)
+    {
+      _cleanup_(state_entry_free) struct state_entry e = {};
+
+      r = sd_json_dispatch(sd_json_variant_by_index(array, i), dispatch_table,
+			   SD_JSON_ALLOW_EXTENSIONS, &e);
+      if (r < 0)
+	return r;
+
+      r = cache_digest_put(e.image_name, e.inode, e.size, e.mtime, e.digest, e.verity);
+      if (r < 0)
+	return r;
+    }
+
+  return 0;
+}
+
+struct state {
+  uint64_t version;
+  sd_json_variant *remote;
+  sd_json_variant *metadata;
+  sd_json_variant *snapshots;
+  sd_json_variant *digests;
+  sd_json_variant *verdicts;
+};
+
+static void
+state_free(struct state *s)
+{
+  s->remote = sd_json_variant_unref(s->remote);
+  s->metadata = sd_json_variant_unref(s->metadata);
+  s->snapshots = sd_json_variant_unref(s->snapshots);
+  s->digests = sd_json_variant_unref(s->digests);
+  s->verdicts = sd_json_variant_unref(s->verdicts);
+}
+
+/* Load the state written by cache_save(). Entries which are no longer
+   valid are ignored, a missing or outdated file is not an error. */
+int
+cache_load(const char *path)
+{
+  static const sd_json_dispatch_field dispatch_table[] = {
+    { "Version",     SD_JSON_VARIANT_UNSIGNED, sd_json_dispatch_uint64,  offsetof(struct state, version),     SD_JSON_MANDATORY },
+    { "Remote",      SD_JSON_VARIANT_ARRAY,    sd_json_dispatch_variant, offsetof(struct state, remote),      0 },
+    { "Metadata",    SD_JSON_VARIANT_ARRAY,    sd_json_dispatch_variant, offsetof(struct state, metadata),    0 },
+    { "Snapshots",   SD_JSON_VARIANT_ARRAY,    sd_json_dispatch_variant, offsetof(struct state, snapshots),   0 },
+    { "Digests",     SD_JSON_VARIANT_ARRAY,    sd_json_dispatch_variant, offsetof(struct state, digests),     0 },
+    { "Verdicts",    SD_JSON_VARIANT_ARRAY,    sd_json_dispatch_variant, offsetof(struct state, verdicts),    0 },
+    {}
+  };
+  _cleanup_(sd_json_variant_unrefp) sd_json_variant *json = NULL;
+  _cleanup_(state_free) struct state s = {};
+  unsigned line = 0, column = 0;
+  int r;
+
+  assert(path);
+
+  r = sd_json_parse_file(NULL, path, 0, &json, &line, &column);
+  if (r < 0)
+    {
+      if (r == -ENOENT)
+	return 0;
+      log_msg(LOG_WARNING, "Ignoring state file %s (line %u, column %u): %s",
+	      path, line, column, strerror(-r));
+      return 0;
+    }
+
+  r = sd_json_dispatch(json, dispatch_table, SD_JSON_ALLOW_EXTENSIONS, &s);
+  if (r < 0)
+    return r;
+
+  if (s.version != CACHE_STATE_VERSION)
+    {
+      log_msg(LOG_INFO, "Ignoring state file %s with version %llu",
+	      path, (unsigned long long)s.version);
+      return 0;
+    }
+
+  r = load_remote(s.remote);
+  if (r >= 0)
+    r = load_metadata(s.metadata);
+  if (r >= 0)
+    r = load_snapshots(s.snapshots);
+  if (r >= 0)
+    r = load_digests(s.digests);
+  if (r >= 0)
+    r = host_match_from_json(s.verdicts);
+  if (r < 0)
+    {
+      cache_flush();
+      host_match_flush();
+      return r;
+    }
+
+  log_msg(LOG_DEBUG, "Loaded state: %zu remote, %zu local images, %zu snapshots, %zu digests",
+	  n_remote_cache, n_metadata_cache, n_snapshot_cache, n_digest_cache);
+
+  return 0;
+}
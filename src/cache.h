@@ -0,0 +1,48 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+
+#pragma once
+
+#include "image-deps.h"
+
+/* Number of references to an image from one or all snapshots */
+struct refcount_table {
+  char **names;
+  int *counts;
+  size_t n;
+  size_t max;
+  size_t *slots;            /* hash of name -> index + 1, 0 means empty */
+  size_t n_slots;
+};
+
+extern void free_refcount_table(struct refcount_table *t);
+extern void free_refcount_tablep(struct refcount_table **t);
+extern int refcount_table_add(struct refcount_table *t, const char *name);
+extern int refcount_table_add_count(struct refcount_table *t, const char *name, int count);
+extern int refcount_table_lookup(const struct refcount_table *t, const char *name);
+
+extern const struct image_deps *cache_remote_get(const char *url,
+		const char *image_name, const char *digest);
+extern int cache_remote_put(const char *url, const char *image_name,
+		const char *digest, const struct image_deps *deps);
+extern void cache_remote_prune(const char *url, char **names, char **digests);
+
+extern const struct image_deps *cache_metadata_get(const char *image_name);
+extern int cache_metadata_put(const char *image_name, const struct image_deps *deps);
+extern void cache_metadata_drop(const char *image_name);
+
+extern const struct refcount_table *cache_snapshot_get(const char *id, uint64_t mtime);
+extern int cache_snapshot_put(const char *id, uint64_t mtime, struct refcount_table *refs);
+extern void cache_snapshot_prune(char **ids, size_t n_ids);
+extern int cache_refcount_get(const struct refcount_table **ret);
+
+extern const char *cache_digest_get(const char *image_name, uint64_t inode,
+		uint64_t size, uint64_t mtime, const char **ret_verity);
+extern int cache_digest_put(const char *image_name, uint64_t inode,
+		uint64_t size, uint64_t mtime, const char *digest,
+		const char *verity);
+extern void cache_digest_prune(char **names);
+
+extern void cache_flush(void);
+
+extern int cache_save(const char *path);
+extern int cache_load(const char *path);
@@ -2,6 +2,7 @@
 
 #include "config.h"
 
+#include <errno.h>
 #include <string.h>
 #include <syslog.h>
 #include <libeconf.h>
@@ -13,9 +14,20 @@
 struct config config = {
   .verbose = false,
   .verify_signature = true,
+  .warm_cache = true,
+  .idle_timeout = 30 * USEC_PER_SEC,
   .url = NULL,
   .sysext_store_dir = SYSEXT_STORE_DIR,
-  .extensions_dir = EXTENSIONS_DIR
+  .extensions_dir = EXTENSIONS_DIR,
+  .snapshots_dir = "/.snapshots",
+  .snapshot_extensions_dir = "snapshot/etc/extensions",
+  .keep_unused_versions = 0,
+  .store_max_size = 0,
+  .store_min_free = 0,
+  .verify_max_rate = 0,
+  .fsverity = false,
+  .metrics_file = NULL,
+  .trace = false
 };
 
 static econf_err
@@ -52,6 +64,30 @@ getBoolValueDef(econf_file *key_file, const char *group, const char *key, bool *
   return 0;
 }
 
+static int
+getUIntValueDef(econf_file *key_file, const char *group, const char *key, unsigned *val, unsigned def)
+{
+  econf_err error;
+
+  /* first try, special (client, daemon) group */
+  error = econf_getUIntValue(key_file, group, key, val);
+  if (!error)
+    return 0;
+
+  /* second try, use "default" group */
+  if (error && error == ECONF_NOKEY)
+    error = econf_getUIntValueDef(key_file, "default", key, val, def);
+
+  if (error && error != ECONF_NOKEY)
+    {
+      log_msg(LOG_ERR, "ERROR (econf): cannot get key '%s': %s",
+	      key, econf_errString(error));
+      return -1;
+    }
+
+  return 0;
+}
+
 static int
 getStringValueDef(econf_file *key_file, const char *group, const char *key, char **val, char *def)
 {
@@ -76,6 +112,118 @@ getStringValueDef(econf_file *key_file, const char *group, const char *key, char
   return 0;
 }
 
+/* Accepts the timeout in seconds or "infinity"/"never" */
+static int
+parse_timeout(const char *s, uint64_t *ret)
+{
+  char *ep;
+  unsigned long long sec;
+
+  if (isempty(s))
+    return -EINVAL;
+
+  if (streq(s, "infinity") || streq(s, "never"))
+    {
+      *ret = USEC_INFINITY;
+      return 0;
+    }
+
+  errno = 0;
+  sec = strtoull(s, &ep, 10);
+  if (errno != 0 || *ep != '\0' || s[0] == '-')
+    return -EINVAL;
+
+  if (sec >= USEC_INFINITY / USEC_PER_SEC)
+    *ret = USEC_INFINITY;
+  else
+    *ret = sec * USEC_PER_SEC;
+
+  return 0;
+}
+
+static int
+getTimeoutValueDef(econf_file *key_file, const char *group, const char *key, uint64_t *val)
+{
+  _cleanup_free_ char *str = NULL;
+  int r;
+
+  r = getStringValueDef(key_file, group, key, &str, NULL);
+  if (r < 0)
+    return r;
+
+  /* keep default */
+  if (str == NULL)
+    return 0;
+
+  r = parse_timeout(str, val);
+  if (r < 0)
+    {
+      log_msg(LOG_ERR, "ERROR: invalid value for key '%s': %s", key, str);
+      return r;
+    }
+
+  return 0;
+}
+
+/* Accepts the size in bytes with an optional K, M, G or T suffix
+   (base 1024) */
+static int
+parse_size(const char *s, uint64_t *ret)
+{
+  char *ep;
+  static const char suffixes[] = "KMGT";
+  unsigned long long size;
+  unsigned shift = 0;
+
+  if (isempty(s))
+    return -EINVAL;
+
+  errno = 0;
+  size = strtoull(s, &ep, 10);
+  if (errno != 0 || ep == s || s[0] == '-')
+    return -EINVAL;
+
+  if (*ep != '\0')
+    {
+      const char *suffix = strchr(suffixes, *ep);
+
+      if (suffix == NULL || ep[1] != '\0')
+	return -EINVAL;
+      shift = 10 * (suffix - suffixes + 1);
+    }
+
+  if (size > (UINT64_MAX >> shift))
+    return -ERANGE;
+
+  *ret = (uint64_t)size << shift;
+
+  return 0;
+}
+
+static int
+getSizeValueDef(econf_file *key_file, const char *group, const char *key, uint64_t *val)
+{
+  _cleanup_free_ char *str = NULL;
+  int r;
+
+  r = getStringValueDef(key_file, group, key, &str, NULL);
+  if (r < 0)
+    return r;
+
+  /* keep default */
+  if (str == NULL)
+    return 0;
+
+  r = parse_size(str, val);
+  if (r < 0)
+    {
+      log_msg(LOG_ERR, "ERROR: invalid value for key '%s': %s", key, str);
+      return r;
+    }
+
+  return 0;
+}
+
 int
 load_config(const char *defgroup)
 {
@@ -104,6 +252,12 @@ load_config(const char *defgroup)
       if (r < 0)
 	return r;
       r = getBoolValueDef(key_file, defgroup, "verify_signature", &config.verify_signature, config.verify_signature);
+      if (r < 0)
+	return r;
+      r = getBoolValueDef(key_file, defgroup, "warm_cache", &config.warm_cache, config.warm_cache);
+      if (r < 0)
+	return r;
+      r = getTimeoutValueDef(key_file, defgroup, "idle_timeout", &config.idle_timeout);
       if (r < 0)
 	return r;
       r = getStringValueDef(key_file, defgroup, "url", &config.url, config.url);
@@ -115,6 +269,33 @@ load_config(const char *defgroup)
       r = getStringValueDef(key_file, defgroup, "extensions_dir", &config.extensions_dir, config.extensions_dir);
       if (r < 0)
 	return r;
+      r = getStringValueDef(key_file, defgroup, "snapshots_dir", &config.snapshots_dir, config.snapshots_dir);
+      if (r < 0)
+	return r;
+      r = getStringValueDef(key_file, defgroup, "snapshot_extensions_dir", &config.snapshot_extensions_dir, config.snapshot_extensions_dir);
+      if (r < 0)
+	return r;
+      r = getUIntValueDef(key_file, defgroup, "keep_unused_versions", &config.keep_unused_versions, config.keep_unused_versions);
+      if (r < 0)
+	return r;
+      r = getSizeValueDef(key_file, defgroup, "store_max_size", &config.store_max_size);
+      if (r < 0)
+	return r;
+      r = getSizeValueDef(key_file, defgroup, "store_min_free", &config.store_min_free);
+      if (r < 0)
+	return r;
+      r = getSizeValueDef(key_file, defgroup, "verify_max_rate", &config.verify_max_rate);
+      if (r < 0)
+	return r;
+      r = getBoolValueDef(key_file, defgroup, "fsverity", &config.fsverity, config.fsverity);
+      if (r < 0)
+	return r;
+      r = getStringValueDef(key_file, defgroup, "metrics_file", &config.metrics_file, config.metrics_file);
+      if (r < 0)
+	return r;
+      r = getBoolValueDef(key_file, defgroup, "trace", &config.trace, config.trace);
+      if (r < 0)
+	return r;
     }
 
   return 0;
@@ -0,0 +1,544 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+#include "basics.h"
+#include "dedup.h"
+#include "images-list.h"
+#include "image-index.h"
+#include "image-name.h"
+#include "log_msg.h"
+#include "state-lock.h"
+#include "strv.h"
+
+/* The kernel limits a single dedupe request, btrfs to 16 MiB */
+#define DEDUP_MAX_RANGE (16 * 1024 * 1024)
+/* Don't fragment the files with very small shared extents */
+#define DEDUP_MIN_RANGE (64 * 1024)
+#define DEDUP_READ_SIZE (1024 * 1024)
+
+/* Hashes of all blocks of the source file and an index from the hash
+   to the first block with this content */
+struct block_index {
+  size_t block_size;
+  size_t n_blocks;
+  uint64_t *hashes;
+  size_t *slots;            /* block + 1, 0 means empty */
+  size_t n_slots;
+};
+
+static void
+free_block_index(struct block_index *b)
+{
+  b->hashes = mfree(b->hashes);
+  b->slots = mfree(b->slots);
+  b->n_blocks = b->n_slots = 0;
+}
+
+/* FNV-1a over a whole block */
+static uint64_t
+block_hash(const uint8_t *p, size_t size)
+{
+  uint64_t h = UINT64_C(0xcbf29ce484222325);
+
+  for (size_t i = 0; i < size; i++)
+    {
+      h ^= p[i];
+      h *= UINT64_C(0x100000001b3);
+    }
+
+  return h;
+}
+
+/* Calls cb for every full block of fd */
+static int
+read_blocks(int fd, size_t block_size,
+	    int (*cb)(size_t block, uint64_t hash, void *userdata),
+	    void *userdata)
+{
+  _cleanup_free_ uint8_t *buf = NULL;
+  size_t block = 0;
+  off_t offset = 0;
+  int r;
+
+  buf = malloc(DEDUP_READ_SIZE);
+  if (buf == NULL)
+    return -ENOMEM;
+
+  for (;;)
+    {
+      ssize_t n = pread(fd, buf, DEDUP_READ_SIZE, offset);
+      if (n < 0)
+	return -errno;
+      if (n == 0)
+	break;
+
+      for (size_t pos = 0; pos + block_size <= (size_t)n; pos += block_size)
+	{
+	  r = cb(block++, block_hash(buf + pos, block_size), userdata);
+	  if (r < 0)
+	    return r;
+	}
+
+      /* DEDUP_READ_SIZE is a multiple of the block size, so only the
+	 end of the file can contain a partial block */
+      if ((size_t)n < DEDUP_READ_SIZE)
+	break;
+      offset += n;
+    }
+
+  return 0;
+}
+
+static int
+index_block(size_t block, uint64_t hash, void *userdata)
+{
+  struct block_index *b = userdata;
+  size_t i;
+
+  b->hashes[block] = hash;
+
+  for (i = hash & (b->n_slots - 1); b->slots[i] != 0; i = (i + 1) & (b->n_slots - 1))
+    if (b->hashes[b->slots[i] - 1] == hash)
+      return 0;   /* keep the first block with this content */
+
+  b->slots[i] = block + 1;
+
+  return 0;
+}
+
+static int
+block_index_build(int fd, size_t block_size, uint64_t size, struct block_index *b)
+{
+  size_t n_slots = 16;
+
+  b->block_size = block_size;
+  b->n_blocks = size / block_size;
+
+  while (n_slots < b->n_blocks * 2)
+    n_slots *= 2;
+
+  b->hashes = calloc(b->n_blocks ? b->n_blocks : 1, sizeof(uint64_t));
+  b->slots = calloc(n_slots, sizeof(size_t));
+  if (b->hashes == NULL || b->slots == NULL)
+    return -ENOMEM;
+  b->n_slots = n_slots;
+
+  return read_blocks(fd, block_size, index_block, b);
+}
+
+/* first block of the source file with this content, -1 if none */
+static ssize_t
+block_index_lookup(const struct block_index *b, uint64_t hash)
+{
+  for (size_t i = hash & (b->n_slots - 1); b->slots[i] != 0; i = (i + 1) & (b->n_slots - 1))
+    if (b->hashes[b->slots[i] - 1] == hash)
+      return (ssize_t)b->slots[i] - 1;
+
+  return -1;
+}
+
+/* Ranges of a file which already share their extents with another
+   file, those don't need to be deduplicated again */
+struct shared_ranges {
+  uint64_t *start;
+  uint64_t *end;
+  size_t n;
+};
+
+static void
+free_shared_ranges(struct shared_ranges *s)
+{
+  s->start = mfree(s->start);
+  s->end = mfree(s->end);
+  s->n = 0;
+}
+
+#define FIEMAP_BATCH 64
+
+static int
+load_shared_ranges(int fd, struct shared_ranges *s)
+{
+  _cleanup_free_ struct fiemap *fm = NULL;
+  uint64_t offset = 0;
+  size_t max = 0;
+
+  fm = malloc(sizeof(struct fiemap) + FIEMAP_BATCH * sizeof(struct fiemap_extent));
+  if (fm == NULL)
+    return -ENOMEM;
+
+  for (;;)
+    {
+      bool last = false;
+
+      memset(fm, 0, sizeof(struct fiemap));
+      fm->fm_start = offset;
+      fm->fm_length = FIEMAP_MAX_OFFSET - offset;
+      fm->fm_flags = FIEMAP_FLAG_SYNC;
+      fm->fm_extent_count = FIEMAP_BATCH;
+
+      if (ioctl(fd, FS_IOC_FIEMAP, fm) < 0)
+	{
+	  /* without FIEMAP everything gets deduplicated again */
+	  if (errno == EOPNOTSUPP || errno == ENOTTY)
+	    return 0;
+	  return -errno;
+	}
+
+      if (fm->fm_mapped_extents == 0)
+	break;
+
+      for (size_t i = 0; i < fm->fm_mapped_extents; i++)
+	{
+	  const struct fiemap_extent *fe = &fm->fm_extents[i];
+
+	  if (fe->fe_flags & FIEMAP_EXTENT_SHARED)
+	    {
+	      if (s->n == max)
+		{
+		  size_t m = max ? max * 2 : 16;
+		  uint64_t *start, *end;
+
+		  start = realloc(s->start, m * sizeof(uint64_t));
+		  if (start == NULL)
+		    return -ENOMEM;
+		  s->start = start;
+		  end = realloc(s->end, m * sizeof(uint64_t));
+		  if (end == NULL)
+		    return -ENOMEM;
+		  s->end = end;
+		  max = m;
+		}
+	      s->start[s->n] = fe->fe_logical;
+	      s->end[s->n] = fe->fe_logical + fe->fe_length;
+	      s->n++;
+	    }
+
+	  offset = fe->fe_logical + fe->fe_length;
+	  if (fe->fe_flags & FIEMAP_EXTENT_LAST)
+	    last = true;
+	}
+
+      if (last)
+	break;
+    }
+
+  return 0;
+}
+
+/* the ranges are sorted, pos is the index to start searching at */
+static bool
+is_shared(const struct shared_ranges *s, uint64_t offset, size_t *pos)
+{
+  while (*pos < s->n && s->end[*pos] <= offset)
+    (*pos)++;
+
+  return *pos < s->n && s->start[*pos] <= offset;
+}
+
+static int
+dedupe_range(int src_fd, uint64_t src_offset, int dst_fd, uint64_t dst_offset,
+	     uint64_t length, uint64_t *bytes)
+{
+  struct {
+    struct file_dedupe_range range;
+    struct file_dedupe_range_info info;
+  } req;
+
+  while (length > 0)
+    {
+      uint64_t len = length > DEDUP_MAX_RANGE ? DEDUP_MAX_RANGE : length;
+
+      memset(&req, 0, sizeof(req));
+      req.range.src_offset = src_offset;
+      req.range.src_length = len;
+      req.range.dest_count = 1;
+      req.info.dest_fd = dst_fd;
+      req.info.dest_offset = dst_offset;
+
+      if (ioctl(src_fd, FIDEDUPERANGE, &req) < 0)
+	return -errno;
+      if (req.info.status < 0)
+	return req.info.status;
+
+      /* FILE_DEDUPE_RANGE_DIFFERS: hash collision, nothing to do */
+      if (req.info.status == FILE_DEDUPE_RANGE_SAME)
+	*bytes += req.info.bytes_deduped;
+
+      src_offset += len;
+      dst_offset += len;
+      length -= len;
+    }
+
+  return 0;
+}
+
+/* a sequence of blocks of the destination, which has the same content
+   in the source at the same distance */
+struct dedup_run {
+  int src_fd;
+  int dst_fd;
+  const struct block_index *index;
+  const struct shared_ranges *shared;
+  size_t shared_pos;
+  ssize_t src_block;        /* -1 if there is no current run */
+  size_t dst_block;
+  size_t n_blocks;
+  uint64_t bytes;
+};
+
+static int
+dedup_run_flush(struct dedup_run *d)
+{
+  uint64_t bs = d->index->block_size;
+  int r = 0;
+
+  if (d->src_block >= 0 && d->n_blocks * bs >= DEDUP_MIN_RANGE)
+    r = dedupe_range(d->src_fd, (uint64_t)d->src_block * bs,
+		     d->dst_fd, (uint64_t)d->dst_block * bs,
+		     (uint64_t)d->n_blocks * bs, &d->bytes);
+
+  d->src_block = -1;
+  d->n_blocks = 0;
+
+  return r;
+}
+
+static int
+dedup_block(size_t block, uint64_t hash, void *userdata)
+{
+  struct dedup_run *d = userdata;
+  const struct block_index *b = d->index;
+  ssize_t src;
+  int r;
+
+  if (is_shared(d->shared, (uint64_t)block * b->block_size, &d->shared_pos))
+    return dedup_run_flush(d);
+
+  /* continue the current run if possible */
+  if (d->src_block >= 0)
+    {
+      size_t next = (size_t)d->src_block + d->n_blocks;
+
+      if (next < b->n_blocks && b->hashes[next] == hash)
+	{
+	  d->n_blocks++;
+	  return 0;
+	}
+    }
+
+  r = dedup_run_flush(d);
+  if (r < 0)
+    return r;
+
+  src = block_index_lookup(b, hash);
+  if (src >= 0)
+    {
+      d->src_block = src;
+      d->dst_block = block;
+      d->n_blocks = 1;
+    }
+
+  return 0;
+}
+
+/* The content of files with fs-verity is immutable, the filesystems
+   don't allow to change their extents */
+static bool
+has_verity(int fd)
+{
+  int flags = 0;
+
+  if (ioctl(fd, FS_IOC_GETFLAGS, &flags) < 0)
+    return false;
+
+  return (flags & FS_VERITY_FL) != 0;
+}
+
+/* Share all blocks of dst which exist in src, too. */
+static int
+dedup_file(int dir_fd, const char *src, const char *dst, uint64_t *bytes)
+{
+  _cleanup_(free_block_index) struct block_index index = {};
+  _cleanup_(free_shared_ranges) struct shared_ranges shared = {};
+  _cleanup_close_ int src_fd = -EBADF;
+  _cleanup_close_ int dst_fd = -EBADF;
+  struct stat st_src, st_dst;
+  size_t block_size;
+  int r;
+
+  src_fd = openat(dir_fd, src, O_RDONLY|O_CLOEXEC|O_NOFOLLOW);
+  if (src_fd < 0)
+    return -errno;
+  dst_fd = openat(dir_fd, dst, O_RDONLY|O_CLOEXEC|O_NOFOLLOW);
+  if (dst_fd < 0)
+    return -errno;
+
+  if (fstat(src_fd, &st_src) < 0 || fstat(dst_fd, &st_dst) < 0)
+    return -errno;
+  if (!S_ISREG(st_src.st_mode) || !S_ISREG(st_dst.st_mode))
+    return 0;
+  if (has_verity(src_fd) || has_verity(dst_fd))
+    return 0;
+
+  block_size = st_src.st_blksize >= 4096 ? (size_t)st_src.st_blksize : 4096;
+  if (DEDUP_READ_SIZE % block_size != 0)
+    block_size = 4096;
+
+  if ((uint64_t)st_src.st_size < DEDUP_MIN_RANGE ||
+      (uint64_t)st_dst.st_size < DEDUP_MIN_RANGE)
+    return 0;
+
+  r = block_index_build(src_fd, block_size, st_src.st_size, &index);
+  if (r < 0)
+    return r;
+
+  r = load_shared_ranges(dst_fd, &shared);
+  if (r < 0)
+    return r;
+
+  struct dedup_run d = {
+    .src_fd = src_fd,
+    .dst_fd = dst_fd,
+    .index = &index,
+    .shared = &shared,
+    .src_block = -1,
+  };
+
+  r = read_blocks(dst_fd, block_size, dedup_block, &d);
+  if (r >= 0)
+    r = dedup_run_flush(&d);
+  if (r < 0)
+    return r;
+
+  *bytes = d.bytes;
+
+  return 0;
+}
+
+static int
+dedup_cmp(const void *a, const void *b)
+{
+  const struct image_entry *const *i_a = a;
+  const struct image_entry *const *i_b = b;
+  int r;
+
+  r = strcmp((*i_a)->name, (*i_b)->name);
+  if (r != 0)
+    return r;
+
+  return image_version_cmp(*i_a, *i_b);
+}
+
+/* Deduplicate all versions of an image in the store against the newest
+   one, which will most likely stay the longest in the store. */
+int
+dedup_store(const char *store, char ***ret_images, uint64_t *ret_bytes)
+{
+  _cleanup_(free_image_list) struct image_list images = {};
+  _cleanup_free_ struct image_entry **sorted = NULL;
+  _cleanup_strv_free_ char **deduped = NULL;
+  _cleanup_close_ int dir_fd = -EBADF;
+  uint64_t total = 0;
+  size_t n_deduped = 0;
+  int r;
+
+  assert(store);
+  assert(ret_images);
+  assert(ret_bytes);
+
+  r = image_local_metadata(store, &images, NULL, NULL, false);
+  if (r < 0)
+    return r;
+
+  *ret_images = NULL;
+  *ret_bytes = 0;
+
+  if (images.n < 2)
+    return 0;
+
+  dir_fd = open(store, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+  if (dir_fd < 0)
+    return -errno;
+
+  sorted = malloc(images.n * sizeof(struct image_entry *));
+  deduped = calloc(images.n + 1, sizeof(char *));
+  if (sorted == NULL || deduped == NULL)
+    return -ENOMEM;
+  memcpy(sorted, images.images, images.n * sizeof(struct image_entry *));
+  qsort(sorted, images.n, sizeof(struct image_entry *), dedup_cmp);
+
+  for (size_t first = 0, last; first < images.n; first = last + 1)
+    {
+      /* all versions of this image are first..last, last is the newest */
+      for (last = first; last + 1 < images.n &&
+	     streq(sorted[last + 1]->name, sorted[first]->name); last++)
+	;
+
+      for (size_t i = first; i < last; i++)
+	{
+	  uint64_t bytes = 0;
+	  bool suspended;
+
+	  /* pinned by a running Install or Update, which might enable
+	     fs-verity on it */
+	  if (store_pinned(sorted[i]->image_name))
+	    continue;
+
+	  /* only reads and remaps the files, other requests can run,
+	     but Cleanup must not remove them meanwhile */
+	  r = store_pin(sorted[last]->image_name);
+	  if (r < 0)
+	    return r;
+	  r = store_pin(sorted[i]->image_name);
+	  if (r < 0)
+	    {
+	      store_unpin(sorted[last]->image_name);
+	      return r;
+	    }
+	  suspended = state_suspend();
+	  r = dedup_file(dir_fd, sorted[last]->image_name, sorted[i]->image_name, &bytes);
+	  state_resume(suspended);
+	  store_unpin(sorted[i]->image_name);
+	  store_unpin(sorted[last]->image_name);
+	  if (r < 0)
+	    {
+	      if (r == -EOPNOTSUPP || r == -ENOTTY || r == -EINVAL || r == -EXDEV)
+		{
+		  log_msg(LOG_NOTICE, "Filesystem of '%s' does not support deduplication", store);
+		  return -EOPNOTSUPP;
+		}
+	      log_msg(LOG_ERR, "Deduplicating '%s' against '%s' failed: %s",
+		      sorted[i]->image_name, sorted[last]->image_name, strerror(-r));
+	      return r;
+	    }
+
+	  if (bytes == 0)
+	    continue;
+
+	  log_msg(LOG_INFO, "Deduplicated %llu bytes of '%s' against '%s'",
+		  (unsigned long long)bytes, sorted[i]->image_name, sorted[last]->image_name);
+
+	  deduped[n_deduped] = strdup(sorted[i]->image_name);
+	  if (deduped[n_deduped] == NULL)
+	    return -ENOMEM;
+	  n_deduped++;
+	  total += bytes;
+	}
+    }
+
+  if (n_deduped > 0)
+    *ret_images = TAKE_PTR(deduped);
+  *ret_bytes = total;
+
+  return 0;
+}
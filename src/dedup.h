@@ -0,0 +1,7 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+
+#pragma once
+
+#include <stdint.h>
+
+extern int dedup_store(const char *store, char ***ret_images, uint64_t *ret_bytes);
@@ -2,21 +2,28 @@
 
 #include "basics.h"
 
-#include <spawn.h>
 #include <sys/wait.h>
 #include <errno.h>
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 
 #include "download.h"
 #include "log_msg.h"
+#include "process.h"
+#include "flight.h"
+#include "metrics.h"
 
 #define SYSTEMD_PULL_PATH "/usr/lib/systemd/systemd-pull"
 
+/* how often the progress callback of download_with_progress() is called */
+#define DOWNLOAD_PROGRESS_INTERVAL (USEC_PER_SEC / 2)
+
 const char *
 wstatus2str(int wstatus)
 {
@@ -59,16 +66,14 @@ join_path(const char *url, const char *suffix, char **ret)
   return 0;
 }
 
-/* return value:
-   < 0 : -errno (error)
-   = 0 : success
-   > 0 : status of waitpid (error)
-*/
+/* Start the download of fn from url to destfn in batch. Once
+   process_batch_wait() returned, download_finished(destfn, *ret_status)
+   is the same as the return value of download(). */
 int
-download(const char *url, const char *fn, const char *destfn, bool verify_signature)
+download_start(struct process_batch *batch, const char *url, const char *fn,
+	       const char *destfn, bool verify_signature, int *ret_status)
 {
   _cleanup_(freep) char *fullurl = NULL;
-  pid_t pid;
   int r;
 
   r = join_path(url, fn, &fullurl);
@@ -85,26 +90,324 @@ download(const char *url, const char *fn, const char *destfn, bool verify_signat
 	  NULL
   };
 
-  r = posix_spawn(&pid, SYSTEMD_PULL_PATH, NULL, NULL, (char *const *)cmdline, environ);
+  r = process_batch_spawn(batch, SYSTEMD_PULL_PATH, cmdline, -EBADF, ret_status);
+  if (r < 0)
+    return r;
+
+  if (streq(fn, "SHA256SUMS"))
+    metrics_inc(METRIC_DOWNLOADS_SHA256SUMS);
+  else if (endswith(fn, ".manifest.gz") || endswith(fn, ".json"))
+    metrics_inc(METRIC_DOWNLOADS_MANIFEST);
+  else
+    metrics_inc(METRIC_DOWNLOADS_IMAGE);
+
+  return 0;
+}
+
+/* The wait status of systemd-pull if it got killed or exited with an
+   error (404, bad signature), else 0 */
+int
+download_result(int status)
+{
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    return status;
+
+  return 0;
+}
+
+/* download_result() of a download started with download_start(),
+   which also counts the downloaded bytes or the failure */
+int
+download_finished(const char *destfn, int status)
+{
+  struct stat st;
+  int r;
 
+  r = download_result(status);
   if (r != 0)
+    metrics_inc(METRIC_DOWNLOADS_FAILED);
+  else if (stat(destfn, &st) == 0)
+    metrics_add(METRIC_DOWNLOAD_BYTES, st.st_size);
+
+  return r;
+}
+
+struct download_progress {
+  const char *fn;
+  const char *destfn;
+  download_progress_t progress;
+  void *userdata;
+  uint64_t bytes;
+  uint64_t time;
+};
+
+static uint64_t
+now_usec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * USEC_PER_SEC + (uint64_t)ts.tv_nsec / NSEC_PER_USEC;
+}
+
+/* systemd-pull --direct writes into destfn, so its size is the
+   number of bytes downloaded so far */
+static int
+download_tick(void *userdata)
+{
+  struct download_progress *d = userdata;
+  uint64_t now = now_usec();
+  uint64_t rate = 0;
+  struct stat st;
+
+  if (stat(d->destfn, &st) < 0)
+    return -errno;
+
+  if (now > d->time && (uint64_t)st.st_size >= d->bytes)
+    rate = ((uint64_t)st.st_size - d->bytes) * USEC_PER_SEC / (now - d->time);
+
+  d->bytes = st.st_size;
+  d->time = now;
+
+  return d->progress(d->fn, d->bytes, rate, d->userdata);
+}
+
+/* Like download(), but progress gets called regularly with the
+   number of bytes downloaded and the current throughput. */
+int
+download_with_progress(const char *url, const char *fn, const char *destfn,
+		       bool verify_signature, download_progress_t progress,
+		       void *userdata)
+{
+  _cleanup_(process_batch_freep) struct process_batch *batch = NULL;
+  struct download_progress d = {
+    .fn = fn,
+    .destfn = destfn,
+    .progress = progress,
+    .userdata = userdata,
+    .bytes = 0,
+    .time = now_usec(),
+  };
+  int status = 0;
+  int r;
+
+  r = process_batch_new(1, &batch);
+  if (r < 0)
+    return r;
+
+  if (progress)
+    {
+      r = process_batch_set_tick(batch, DOWNLOAD_PROGRESS_INTERVAL, download_tick, &d);
+      if (r < 0)
+	return r;
+    }
+
+  r = download_start(batch, url, fn, destfn, verify_signature, &status);
+  if (r < 0)
     {
-      log_msg(LOG_ERR, "Cannot start download: %s\n", strerror(r));
+      log_msg(LOG_ERR, "Cannot start download: %s", strerror(-r));
       return r;
     }
-  else
+
+  /* other requests can run meanwhile */
+  r = process_batch_wait(batch);
+  if (r < 0)
+    return r;
+
+  return download_finished(destfn, status);
+}
+
+struct download_many_progress {
+  struct download_progress *d;
+  struct download_item *items;
+  size_t n;
+};
+
+static int
+download_many_tick(void *userdata)
+{
+  struct download_many_progress *m = userdata;
+
+  for (size_t i = 0; i < m->n; i++)
     {
-      /* waiting for child process */
-      int status;
+      /* not started, failed to start or finished */
+      if (m->items[i].status != -1)
+	continue;
 
-      r =waitpid(pid, &status, 0);
-      if (r == -1)
-        return -errno;
+      (void) download_tick(&m->d[i]);
+    }
 
-      // Use WIFEXITED to check the result
-      if (!WIFEXITED(status))
-        return status;
+  return 0;
+}
+
+/* Download the n files of items from url in parallel, at most
+   PROCESS_MAX_RUNNING at the same time. The result of every file is
+   stored in its item, see download() for the values. progress gets
+   called regularly for every running download. */
+int
+download_many(const char *url, struct download_item *items, size_t n,
+	      bool verify_signature, download_progress_t progress,
+	      void *userdata)
+{
+  _cleanup_(process_batch_freep) struct process_batch *batch = NULL;
+  _cleanup_free_ struct download_progress *d = NULL;
+  struct download_many_progress m = {
+    .items = items,
+    .n = n,
+  };
+  uint64_t start = metrics_now();
+  int r;
+
+  assert(url);
+  assert(items || n == 0);
+
+  if (n == 0)
+    return 0;
+
+  r = process_batch_new(PROCESS_MAX_RUNNING, &batch);
+  if (r < 0)
+    return r;
+
+  if (progress)
+    {
+      d = calloc(n, sizeof(struct download_progress));
+      if (d == NULL)
+	return -ENOMEM;
+
+      for (size_t i = 0; i < n; i++)
+	d[i] = (struct download_progress) {
+	  .fn = items[i].fn,
+	  .destfn = items[i].destfn,
+	  .progress = progress,
+	  .userdata = userdata,
+	  .time = now_usec(),
+	};
+      m.d = d;
+
+      r = process_batch_set_tick(batch, DOWNLOAD_PROGRESS_INTERVAL, download_many_tick, &m);
+      if (r < 0)
+	return r;
+    }
+
+  /* status -1 means running, the tick skips the others */
+  for (size_t i = 0; i < n; i++)
+    {
+      items[i].started = false;
+      items[i].status = 0;
+    }
+
+  for (size_t i = 0; i < n; i++)
+    {
+      items[i].status = -1;
+      r = download_start(batch, url, items[i].fn, items[i].destfn,
+			 verify_signature, &items[i].status);
+      if (r < 0)
+	{
+	  items[i].status = 0;
+	  if (r == -ECANCELED)
+	    return r;
+	  log_msg(LOG_ERR, "Cannot start download of '%s': %s", items[i].fn, strerror(-r));
+	  items[i].result = r;
+	}
+      else
+	items[i].started = true;
     }
 
+  /* other requests can run meanwhile */
+  r = process_batch_wait(batch);
+  if (r < 0)
+    return r;
+
+  for (size_t i = 0; i < n; i++)
+    if (items[i].started)
+      items[i].result = download_finished(items[i].destfn, items[i].status);
+
+  metrics_phase_done(PHASE_IMAGE, start);
+
   return 0;
 }
+
+/* Move a complete download into place */
+static int
+download_rename(int r, const char *destfn, const char *fn)
+{
+  if (r == 0 && rename(destfn, fn) < 0)
+    return -errno;
+
+  return r;
+}
+
+/* Download the image image_name with download_with_progress() to
+   destfn and rename it to fn. If another request downloads the same
+   image at the same time, this waits for it and copies its file
+   instead. Images are the same if name and digest match, without
+   digest the URL must match, too. If the other request put the image
+   to fn already, *ret_shared gets set and nothing is copied: the
+   other request records its digest and enables fs-verity. */
+int
+download_image(const char *url, const char *image_name, const char *digest,
+	       const char *destfn, const char *fn, bool verify_signature,
+	       download_progress_t progress, void *userdata, bool *ret_shared)
+{
+  _cleanup_free_ char *key = NULL;
+  uint64_t start = metrics_now();
+  struct flight *f;
+  int r;
+
+  assert(url);
+  assert(image_name);
+  assert(destfn);
+  assert(fn);
+  assert(ret_shared);
+
+  *ret_shared = false;
+
+  if (digest)
+    r = asprintf(&key, "image %s %s", image_name, digest);
+  else
+    r = asprintf(&key, "image %s/%s", url, image_name);
+  if (r < 0)
+    return -ENOMEM;
+
+  r = flight_join(key, &f);
+  if (r < 0)
+    return r;
+  if (r > 0)
+    {
+      r = download_with_progress(url, image_name, destfn, verify_signature,
+				 progress, userdata);
+      r = download_rename(r, destfn, fn);
+      /* waiters copy it before fs-verity gets enabled */
+      flight_finish(f, r, r == 0 ? fn : NULL);
+    }
+  else
+    {
+      r = flight_result(f);
+      if (r == 0 && streq(flight_path(f), fn))
+	*ret_shared = true;
+      else if (r == 0)
+	r = download_rename(flight_copy(f, destfn), destfn, fn);
+      flight_leave(f);
+
+      /* the other request got cancelled, do it ourself */
+      if (r == -ECANCELED)
+	r = download_rename(download_with_progress(url, image_name, destfn, verify_signature,
+						   progress, userdata),
+			    destfn, fn);
+    }
+
+  metrics_phase_done(PHASE_IMAGE, start);
+
+  return r;
+}
+
+/* return value:
+   < 0 : -errno (error)
+   = 0 : success
+   > 0 : status of waitpid (error)
+*/
+int
+download(const char *url, const char *fn, const char *destfn, bool verify_signature)
+{
+  return download_with_progress(url, fn, destfn, verify_signature, NULL, NULL);
+}
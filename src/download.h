@@ -3,8 +3,36 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "process.h"
 
 extern const char *wstatus2str(int wstatus);
 extern int join_path(const char *url, const char *suffix, char **ret);
+/* bytes downloaded so far and bytes per second since the last call */
+typedef int (*download_progress_t)(const char *fn, uint64_t bytes, uint64_t rate, void *userdata);
+
+struct download_item {
+  const char *fn;
+  const char *destfn;
+  bool started;
+  int status;
+  int result;               /* see download() */
+};
+
 extern int download(const char *url, const char *fn, const char *dest, bool verify_signature);
+extern int download_with_progress(const char *url, const char *fn, const char *dest,
+				  bool verify_signature, download_progress_t progress,
+				  void *userdata);
+extern int download_many(const char *url, struct download_item *items, size_t n,
+			 bool verify_signature, download_progress_t progress,
+			 void *userdata);
+extern int download_image(const char *url, const char *image_name, const char *digest,
+			  const char *dest, const char *fn, bool verify_signature,
+			  download_progress_t progress, void *userdata, bool *ret_shared);
+extern int download_start(struct process_batch *batch, const char *url, const char *fn,
+			  const char *dest, bool verify_signature, int *ret_status);
+extern int download_result(int status);
+extern int download_finished(const char *destfn, int status);
 
@@ -2,7 +2,6 @@
 
 #include "basics.h"
 
-#include <spawn.h>
 #include <sys/wait.h>
 #include <errno.h>
 #include <assert.h>
@@ -15,33 +14,37 @@
 #include "download.h"
 #include "log_msg.h"
 #include "extract.h"
+#include "image-name.h"
+#include "process.h"
+#include "metrics.h"
 
 #define SYSTEMD_DISSECT_PATH "/usr/bin/systemd-dissect"
 
-// External environment array
-extern char **environ;
-
+/* Start copying the extension-release file of image name in path
+   to outfd in batch. Once process_batch_wait() returned,
+   extract_result(*ret_status) is the same as the return value of
+   extract(). */
 int
-extract(const char *path, const char *name, int outfd)
+extract_start(struct process_batch *batch, const char *path, const char *name,
+	      int outfd, int *ret_status)
 {
   _cleanup_free_ char *fn = NULL, *erf = NULL;
-  pid_t pid;
-  posix_spawn_file_actions_t actions;
+  const char *suffix;
   int r;
 
-  if (!endswith(name, ".raw") && !endswith(name, ".img"))
+  suffix = image_name_suffix(name);
+  if (suffix == NULL)
     return -EINVAL;
 
   r = join_path(path, name, &fn);
   if (r < 0)
     return r;
 
-  if (asprintf(&erf, "/usr/lib/extension-release.d/extension-release.%s", name) < 0)
+  /* without .raw/.img */
+  if (asprintf(&erf, "/usr/lib/extension-release.d/extension-release.%.*s",
+	       (int)(suffix - name), name) < 0)
     return -ENOMEM;
 
-  /* remove .raw/.img */
-  erf[strlen(erf) - 4] = '\0';
-
   const char *const cmdline[] = {
 	  SYSTEMD_DISSECT_PATH,
 	  "--copy-from",
@@ -51,48 +54,51 @@ extract(const char *path, const char *name, int outfd)
 	  NULL
   };
 
-  posix_spawn_file_actions_init(&actions);
-
   /* Copy 'outfd' to FD 1 (stdout) of the new process. */
   /* The parent process does not touch the original 'outfd'. */
-  r = posix_spawn_file_actions_adddup2(&actions, outfd, STDOUT_FILENO);
-  if (r == 0)
-    {
-      r = posix_spawn(&pid, SYSTEMD_DISSECT_PATH, &actions, NULL, (char *const *)cmdline, environ);
-
-      if (r != 0)
-        {
-          log_msg(LOG_ERR, "Cannot start extract: %s\n", strerror(r));
-          posix_spawn_file_actions_destroy(&actions);
-          return r;
-        }
-      else
-        {
-          /* waiting for child process */
-          int status;
-
-          r =waitpid(pid, &status, 0);
-          if (r == -1)
-            {
-              posix_spawn_file_actions_destroy(&actions);
-	      return -errno;
-            }
-
-	  // Use WIFEXITED to check the result
-          if (!WIFEXITED(status))
-            {
-              posix_spawn_file_actions_destroy(&actions);
-              return status;
-            }
-        }
-    }
-  else
+  r = process_batch_spawn(batch, SYSTEMD_DISSECT_PATH, cmdline, outfd, ret_status);
+  if (r < 0)
+    return r;
+
+  metrics_inc(METRIC_DISSECT);
+
+  return 0;
+}
+
+int
+extract_result(int status)
+{
+  // Use WIFEXITED to check the result
+  if (!WIFEXITED(status))
+    return status;
+
+  return 0;
+}
+
+int
+extract(const char *path, const char *name, int outfd)
+{
+  _cleanup_(process_batch_freep) struct process_batch *batch = NULL;
+  uint64_t start = metrics_now();
+  int status = 0;
+  int r;
+
+  r = process_batch_new(1, &batch);
+  if (r < 0)
+    return r;
+
+  r = extract_start(batch, path, name, outfd, &status);
+  if (r < 0)
     {
-      log_msg(LOG_ERR, "Cannot set stdout: %s\n", strerror(r));
-      posix_spawn_file_actions_destroy(&actions);
+      log_msg(LOG_ERR, "Cannot start extract: %s", strerror(-r));
       return r;
     }
 
-  posix_spawn_file_actions_destroy(&actions);
-  return 0;
+  /* other requests can run meanwhile */
+  r = process_batch_wait(batch);
+  metrics_phase_done(PHASE_DISSECT, start);
+  if (r < 0)
+    return r;
+
+  return extract_result(status);
 }
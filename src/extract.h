@@ -2,5 +2,9 @@
 
 #pragma once
 
-extern int extract(const char *path, const char *fn, int outfd);
+#include "process.h"
 
+extern int extract(const char *path, const char *fn, int outfd);
+extern int extract_start(struct process_batch *batch, const char *path, const char *fn,
+			 int outfd, int *ret_status);
+extern int extract_result(int status);
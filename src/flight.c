@@ -0,0 +1,236 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/* Single-flight for work which several requests may do at the same
+   time, like resolving the images of one URL or downloading the same
+   image. The first request joining a key is the leader and does the
+   work, requests joining the key meanwhile wait until the leader
+   finished and use its result instead. The leader keeps the file
+   it published until all waiters copied it. Waiting suspends the
+   state lock, so that the leader can continue. */
+
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "basics.h"
+#include "log_msg.h"
+#include "process.h"
+#include "state-lock.h"
+#include "metrics.h"
+#include "flight.h"
+
+/* how often waiters check if their job got cancelled */
+#define FLIGHT_CANCEL_CHECK_NSEC (100 * 1000 * 1000)
+
+struct flight {
+  char *key;
+  bool done;
+  int result;
+  char *path;
+  size_t n_waiters;
+  struct flight *next;
+};
+
+static pthread_mutex_t flights_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flights_cond = PTHREAD_COND_INITIALIZER;
+static struct flight *flights = NULL;
+
+static void
+flight_free(struct flight *f)
+{
+  if (f == NULL)
+    return;
+
+  free(f->key);
+  free(f->path);
+  free(f);
+}
+
+/* Wait for the next change of a flight, returns false if the job of
+   this thread got cancelled */
+static bool
+flight_wait(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_nsec += FLIGHT_CANCEL_CHECK_NSEC;
+  if (ts.tv_nsec >= 1000 * 1000 * 1000)
+    {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000 * 1000 * 1000;
+    }
+  (void) pthread_cond_timedwait(&flights_cond, &flights_mutex, &ts);
+
+  return !process_cancelled();
+}
+
+/* Returns 1 if the caller is the leader for key and has to call
+   flight_finish(), 0 if another request did the same work meanwhile.
+   Waiters have to call flight_leave() once they used the result. */
+int
+flight_join(const char *key, struct flight **ret)
+{
+  struct flight *f;
+  bool suspended;
+  int r = 0;
+
+  assert(key);
+  assert(ret);
+
+  pthread_mutex_lock(&flights_mutex);
+
+  for (f = flights; f; f = f->next)
+    if (streq(f->key, key))
+      break;
+
+  if (f == NULL)
+    {
+      f = calloc(1, sizeof(struct flight));
+      if (f == NULL || (f->key = strdup(key)) == NULL)
+	{
+	  pthread_mutex_unlock(&flights_mutex);
+	  flight_free(f);
+	  return -ENOMEM;
+	}
+      f->next = flights;
+      flights = f;
+      pthread_mutex_unlock(&flights_mutex);
+
+      *ret = f;
+      return 1;
+    }
+
+  log_msg(LOG_DEBUG, "Waiting for running request \"%s\"", key);
+
+  f->n_waiters++;
+  suspended = state_suspend();
+  while (!f->done)
+    if (!flight_wait())
+      {
+	r = -ECANCELED;
+	break;
+      }
+  if (r < 0)
+    {
+      f->n_waiters--;
+      pthread_cond_broadcast(&flights_cond);
+    }
+  pthread_mutex_unlock(&flights_mutex);
+  state_resume(suspended);
+
+  if (r < 0)
+    return r;
+
+  metrics_inc(METRIC_COALESCED);
+
+  *ret = f;
+  return 0;
+}
+
+/* Publish the result of the leader. path, if not NULL, must exist
+   until this returns. */
+void
+flight_finish(struct flight *f, int result, const char *path)
+{
+  bool suspended;
+
+  assert(f);
+
+  pthread_mutex_lock(&flights_mutex);
+
+  /* requests joining from now on start a new flight */
+  for (struct flight **p = &flights; *p; p = &(*p)->next)
+    if (*p == f)
+      {
+	*p = f->next;
+	break;
+      }
+
+  f->result = result;
+  if (path)
+    {
+      f->path = strdup(path);
+      if (f->path == NULL && f->result >= 0)
+	f->result = -ENOMEM;
+    }
+  f->done = true;
+  pthread_cond_broadcast(&flights_cond);
+
+  suspended = state_suspend();
+  while (f->n_waiters > 0)
+    pthread_cond_wait(&flights_cond, &flights_mutex);
+  pthread_mutex_unlock(&flights_mutex);
+  state_resume(suspended);
+
+  flight_free(f);
+}
+
+int
+flight_result(const struct flight *f)
+{
+  return f->result;
+}
+
+const char *
+flight_path(const struct flight *f)
+{
+  return f->path;
+}
+
+void
+flight_leave(struct flight *f)
+{
+  pthread_mutex_lock(&flights_mutex);
+  f->n_waiters--;
+  pthread_cond_broadcast(&flights_cond);
+  pthread_mutex_unlock(&flights_mutex);
+}
+
+/* Copy the file published by the leader to destfn, as reflink if
+   the filesystem supports it. Without reflinks this copies a whole
+   image, so other requests can run meanwhile. The leader keeps the
+   file until the waiter left the flight. */
+int
+flight_copy(const struct flight *f, const char *destfn)
+{
+  _cleanup_close_ int in = -EBADF;
+  _cleanup_close_ int out = -EBADF;
+  bool suspended;
+  ssize_t n;
+  int r = 0;
+
+  assert(f);
+  assert(destfn);
+
+  if (f->path == NULL)
+    return -ENOENT;
+
+  in = open(f->path, O_RDONLY|O_CLOEXEC);
+  if (in < 0)
+    return -errno;
+  out = open(destfn, O_WRONLY|O_TRUNC|O_CLOEXEC);
+  if (out < 0)
+    return -errno;
+
+  suspended = state_suspend();
+  if (ioctl(out, FICLONE, in) < 0)
+    {
+      do
+	n = copy_file_range(in, NULL, out, NULL, SSIZE_MAX, 0);
+      while (n > 0);
+      if (n < 0)
+	r = -errno;
+    }
+  state_resume(suspended);
+
+  return r;
+}
@@ -0,0 +1,12 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+
+#pragma once
+
+struct flight;
+
+extern int flight_join(const char *key, struct flight **ret);
+extern void flight_finish(struct flight *f, int result, const char *path);
+extern int flight_result(const struct flight *f);
+extern const char *flight_path(const struct flight *f);
+extern void flight_leave(struct flight *f);
+extern int flight_copy(const struct flight *f, const char *destfn);
@@ -0,0 +1,306 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#include <assert.h>
+#include <errno.h>
+#include <stddef.h>
+
+#include "basics.h"
+#include "architecture.h"
+#include "extension-util.h"
+#include "image-index.h"
+#include "host-match.h"
+#include "log_msg.h"
+
+/* Verdicts of extension_release_validate(). They only depend on the
+   host and on these fields of the image, which are the same for
+   nearly all images, so there are only a few different entries. */
+struct verdict {
+  uint64_t host;             /* fingerprint of the host */
+  uint64_t hash;             /* of the image fields */
+  char *sysext_scope;
+  char *architecture;
+  char *id;
+  char *sysext_level;
+  char *version_id;
+  bool compatible;
+};
+
+/* power of 2, the table gets cleared if it is half full */
+#define VERDICT_SLOTS 256
+
+static struct verdict verdicts[VERDICT_SLOTS];
+static size_t n_verdicts = 0;
+
+static uint64_t
+hash_add(uint64_t h, const char *s)
+{
+  /* NULL and "" are different for SYSEXT_SCOPE */
+  return (h ^ (s ? string_hash(s) : UINT64_C(0x9e3779b97f4a7c15))) * UINT64_C(0x100000001b3);
+}
+
+static bool
+streq_null(const char *a, const char *b)
+{
+  if (a == NULL || b == NULL)
+    return a == b;
+
+  return streq(a, b);
+}
+
+void
+host_match_init(struct host_match *m, const struct osrelease *osrelease,
+		const char *scope)
+{
+  uint64_t h = 0;
+
+  assert(m);
+  assert(osrelease);
+
+  m->osrelease = osrelease;
+  m->scope = scope;
+  m->architecture = architecture_to_string(uname_architecture());
+
+  h = hash_add(h, osrelease->id);
+  h = hash_add(h, osrelease->id_like);
+  h = hash_add(h, osrelease->version_id);
+  h = hash_add(h, osrelease->sysext_level);
+  h = hash_add(h, scope);
+  h = hash_add(h, m->architecture);
+  /* 0 marks an empty slot in the verdict table */
+  m->fingerprint = h ? h : 1;
+}
+
+/* Same as extention_architecture_compatible() without looking up
+   the host architecture again */
+bool
+host_match_architecture(const struct host_match *m, const char *architecture)
+{
+  return isempty(architecture) || streq(architecture, "_any") ||
+    streq_null(m->architecture, architecture);
+}
+
+static uint64_t
+deps_hash(const struct image_deps *deps)
+{
+  uint64_t hash = 0;
+
+  hash = hash_add(hash, deps->sysext_scope);
+  hash = hash_add(hash, deps->architecture);
+  hash = hash_add(hash, deps->id);
+  hash = hash_add(hash, deps->sysext_level);
+  hash = hash_add(hash, deps->version_id);
+
+  return hash;
+}
+
+static bool
+verdict_matches(const struct verdict *v, uint64_t host, uint64_t hash,
+		const struct image_deps *deps)
+{
+  return v->host == host && v->hash == hash &&
+    streq_null(v->sysext_scope, deps->sysext_scope) &&
+    streq_null(v->architecture, deps->architecture) &&
+    streq_null(v->id, deps->id) &&
+    streq_null(v->sysext_level, deps->sysext_level) &&
+    streq_null(v->version_id, deps->version_id);
+}
+
+/* slot containing the verdict or the empty one where it belongs */
+static size_t
+verdict_slot(uint64_t host, uint64_t hash, const struct image_deps *deps)
+{
+  size_t i;
+
+  for (i = (hash ^ host) & (VERDICT_SLOTS - 1);
+       verdicts[i].host != 0 && !verdict_matches(&verdicts[i], host, hash, deps);
+       i = (i + 1) & (VERDICT_SLOTS - 1))
+    ;
+
+  return i;
+}
+
+static void
+free_verdict(struct verdict *v)
+{
+  v->sysext_scope = mfree(v->sysext_scope);
+  v->architecture = mfree(v->architecture);
+  v->id = mfree(v->id);
+  v->sysext_level = mfree(v->sysext_level);
+  v->version_id = mfree(v->version_id);
+  v->host = v->hash = 0;
+}
+
+void
+host_match_flush(void)
+{
+  for (size_t i = 0; i < VERDICT_SLOTS; i++)
+    free_verdict(&verdicts[i]);
+  n_verdicts = 0;
+}
+
+static int
+strdup_null(const char *s, char **ret)
+{
+  if (s == NULL)
+    {
+      *ret = NULL;
+      return 0;
+    }
+
+  *ret = strdup(s);
+  if (*ret == NULL)
+    return -ENOMEM;
+
+  return 0;
+}
+
+static void
+remember_verdict(struct verdict *v, uint64_t host, uint64_t hash,
+		 const struct image_deps *deps, bool compatible)
+{
+  if (strdup_null(deps->sysext_scope, &v->sysext_scope) < 0 ||
+      strdup_null(deps->architecture, &v->architecture) < 0 ||
+      strdup_null(deps->id, &v->id) < 0 ||
+      strdup_null(deps->sysext_level, &v->sysext_level) < 0 ||
+      strdup_null(deps->version_id, &v->version_id) < 0)
+    {
+      /* not remembering it is no error */
+      free_verdict(v);
+      return;
+    }
+
+  v->host = host;
+  v->hash = hash;
+  v->compatible = compatible;
+  n_verdicts++;
+}
+
+/* extension_release_validate() for the system scope, every verdict
+   is only computed once per host and combination of image values. */
+bool
+host_match_image(const struct host_match *m, const char *name,
+		 const struct image_deps *deps)
+{
+  uint64_t hash;
+  size_t i;
+  bool compatible;
+
+  assert(m);
+  assert(deps);
+
+  hash = deps_hash(deps);
+
+  i = verdict_slot(m->fingerprint, hash, deps);
+  if (verdicts[i].host != 0)
+    {
+      log_msg(LOG_DEBUG, "Extension '%s' is %scompatible (cached)",
+	      name, verdicts[i].compatible ? "" : "not ");
+      return verdicts[i].compatible;
+    }
+
+  compatible = extension_release_validate(name, m->osrelease, m->scope, deps) > 0;
+
+  if (n_verdicts + 1 > VERDICT_SLOTS / 2)
+    {
+      host_match_flush();
+      i = verdict_slot(m->fingerprint, hash, deps);
+    }
+
+  remember_verdict(&verdicts[i], m->fingerprint, hash, deps, compatible);
+
+  return compatible;
+}
+
+/* The verdicts for the state file of the warm cache. The fingerprint
+   of the host is stored with every verdict, so verdicts of an updated
+   host are never used again. */
+int
+host_match_to_json(sd_json_variant **ret)
+{
+  _cleanup_(sd_json_variant_unrefp) sd_json_variant *array = NULL;
+  int r;
+
+  assert(ret);
+
+  r = sd_json_variant_new_array(&array, NULL, 0);
+  if (r < 0)
+    return r;
+
+  for (size_t i = 0; i < VERDICT_SLOTS; i++)
+    {
+      const struct verdict *v = &verdicts[i];
+
+      if (v->host == 0)
+	continue;
+
+      r = sd_json_variant_append_arraybo(&array,
+					 SD_JSON_BUILD_PAIR_UNSIGNED("Host", v->host),
+					 SD_JSON_BUILD_PAIR_CONDITION(!!v->sysext_scope, "SYSEXT_SCOPE", SD_JSON_BUILD_STRING(v->sysext_scope)),
+					 SD_JSON_BUILD_PAIR_CONDITION(!!v->architecture, "ARCHITECTURE", SD_JSON_BUILD_STRING(v->architecture)),
+					 SD_JSON_BUILD_PAIR_CONDITION(!!v->id, "ID", SD_JSON_BUILD_STRING(v->id)),
+					 SD_JSON_BUILD_PAIR_CONDITION(!!v->sysext_level, "SYSEXT_LEVEL", SD_JSON_BUILD_STRING(v->sysext_level)),
+					 SD_JSON_BUILD_PAIR_CONDITION(!!v->version_id, "VERSION_ID", SD_JSON_BUILD_STRING(v->version_id)),
+					 SD_JSON_BUILD_PAIR_BOOLEAN("Compatible", v->compatible));
+      if (r < 0)
+	return r;
+    }
+
+  *ret = TAKE_PTR(array);
+
+  return 0;
+}
+
+/* Load the verdicts written by host_match_to_json() */
+int
+host_match_from_json(sd_json_variant *array)
+{
+  static const sd_json_dispatch_field dispatch_table[] = {
+    { "Host",         SD_JSON_VARIANT_UNSIGNED, sd_json_dispatch_uint64,  offsetof(struct verdict, host),         SD_JSON_MANDATORY },
+    { "SYSEXT_SCOPE", SD_JSON_VARIANT_STRING,   sd_json_dispatch_string,  offsetof(struct verdict, sysext_scope), 0 },
+    { "ARCHITECTURE", SD_JSON_VARIANT_STRING,   sd_json_dispatch_string,  offsetof(struct verdict, architecture), 0 },
+    { "ID",           SD_JSON_VARIANT_STRING,   sd_json_dispatch_string,  offsetof(struct verdict, id),           0 },
+    { "SYSEXT_LEVEL", SD_JSON_VARIANT_STRING,   sd_json_dispatch_string,  offsetof(struct verdict, sysext_level), 0 },
+    { "VERSION_ID",   SD_JSON_VARIANT_STRING,   sd_json_dispatch_string,  offsetof(struct verdict, version_id),   0 },
+    { "Compatible",   SD_JSON_VARIANT_BOOLEAN,  sd_json_dispatch_stdbool, offsetof(struct verdict, compatible),   SD_JSON_MANDATORY },
+    {}
+  };
+  int r;
+
+  for (size_t i = 0; i < sd_json_variant_elements(array); i++)
+    {
+      _cleanup_(free_verdict) struct verdict v = {};
+      struct image_deps deps;
+      size_t slot;
+
+      r = sd_json_dispatch(sd_json_variant_by_index(array, i), dispatch_table,
+			   SD_JSON_ALLOW_EXTENSIONS, &v);
+      if (r < 0)
+	return r;
+
+      /* the table is full, the rest gets computed again */
+      if (n_verdicts + 1 > VERDICT_SLOTS / 2)
+	break;
+
+      if (v.host == 0)
+	continue;
+
+      deps = (struct image_deps) {
+	.sysext_scope = v.sysext_scope,
+	.architecture = v.architecture,
+	.id = v.id,
+	.sysext_level = v.sysext_level,
+	.version_id = v.version_id,
+      };
+      v.hash = deps_hash(&deps);
+
+      slot = verdict_slot(v.host, v.hash, &deps);
+      if (verdicts[slot].host != 0)
+	continue;
+
+      verdicts[slot] = v;
+      v = (struct verdict) {};
+      n_verdicts++;
+    }
+
+  return 0;
+}
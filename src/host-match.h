@@ -0,0 +1,29 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <systemd/sd-json.h>
+
+#include "basics.h"
+#include "osrelease.h"
+#include "image-deps.h"
+
+/* The host values extension_release_validate() compares an image
+   with, collected once per request. The strings are borrowed from
+   the osrelease struct, which has to outlive the matcher. */
+struct host_match {
+  const struct osrelease *osrelease;
+  const char *scope;
+  const char *architecture;  /* of the host */
+  uint64_t fingerprint;      /* hash of all values above */
+};
+
+extern void host_match_init(struct host_match *m, const struct osrelease *osrelease, const char *scope);
+extern bool host_match_architecture(const struct host_match *m, const char *architecture) _pure_;
+extern bool host_match_image(const struct host_match *m, const char *name, const struct image_deps *deps);
+extern void host_match_flush(void);
+extern int host_match_to_json(sd_json_variant **ret);
+extern int host_match_from_json(sd_json_variant *array);
@@ -1,5 +1,7 @@
 /* SPDX-License-Identifier: GPL-2.0-or-later */
 
+#include <assert.h>
+#include <errno.h>
 #include <systemd/sd-json.h>
 
 #include "basics.h"
@@ -44,6 +46,51 @@ free_image_deps_list(struct image_deps ***images)
   free(*images);
 }
 
+static int
+strdup_null(const char *s, char **ret)
+{
+  if (s == NULL)
+    {
+      *ret = NULL;
+      return 0;
+    }
+
+  *ret = strdup(s);
+  if (*ret == NULL)
+    return -ENOMEM;
+
+  return 0;
+}
+
+int
+dup_image_deps(const struct image_deps *src, struct image_deps **ret)
+{
+  _cleanup_(free_image_depsp) struct image_deps *e = NULL;
+
+  assert(src);
+  assert(ret);
+
+  e = calloc(1, sizeof(struct image_deps));
+  if (e == NULL)
+    return -ENOMEM;
+
+  if (strdup_null(src->image_name_json, &e->image_name_json) < 0 ||
+      strdup_null(src->sysext_version_id, &e->sysext_version_id) < 0 ||
+      strdup_null(src->sysext_scope, &e->sysext_scope) < 0 ||
+      strdup_null(src->id, &e->id) < 0 ||
+      strdup_null(src->sysext_level, &e->sysext_level) < 0 ||
+      strdup_null(src->version_id, &e->version_id) < 0 ||
+      strdup_null(src->architecture, &e->architecture) < 0)
+    return -ENOMEM;
+
+  if (src->sysext)
+    e->sysext = sd_json_variant_ref(src->sysext);
+
+  *ret = TAKE_PTR(e);
+
+  return 0;
+}
+
 void
 dump_image_deps(struct image_deps *e)
 {
@@ -61,6 +108,7 @@ free_image_entry(struct image_entry *e)
 {
   e->name = mfree(e->name);
   e->image_name = mfree(e->image_name);
+  e->digest = mfree(e->digest);
   free_image_depsp(&(e->deps));
 }
 
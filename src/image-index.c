@@ -0,0 +1,227 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#include <assert.h>
+#include <errno.h>
+
+#include "basics.h"
+#include "image-index.h"
+
+/* FNV-1a, good enough for file names */
+uint64_t
+string_hash(const char *s)
+{
+  uint64_t h = UINT64_C(0xcbf29ce484222325);
+
+  for (; *s; s++)
+    {
+      h ^= (unsigned char)*s;
+      h *= UINT64_C(0x100000001b3);
+    }
+
+  return h;
+}
+
+int
+image_index_new(size_t hint, struct image_index **ret)
+{
+  _cleanup_(free_image_indexp) struct image_index *idx = NULL;
+  size_t n_slots = 16;
+
+  assert(ret);
+
+  /* keep the load factor below 1/2 */
+  while (n_slots < hint * 2)
+    n_slots *= 2;
+
+  idx = calloc(1, sizeof(struct image_index));
+  if (idx == NULL)
+    return -ENOMEM;
+
+  idx->by_image_name = calloc(n_slots, sizeof(size_t));
+  idx->by_name = calloc(n_slots, sizeof(size_t));
+  if (idx->by_image_name == NULL || idx->by_name == NULL)
+    return -ENOMEM;
+  idx->n_slots = n_slots;
+
+  *ret = TAKE_PTR(idx);
+
+  return 0;
+}
+
+void
+free_image_index(struct image_index *idx)
+{
+  if (!idx)
+    return;
+
+  idx->entries = mfree(idx->entries);
+  idx->next_name = mfree(idx->next_name);
+  idx->by_image_name = mfree(idx->by_image_name);
+  idx->by_name = mfree(idx->by_name);
+  idx->n = idx->max = idx->n_slots = 0;
+}
+
+void
+free_image_indexp(struct image_index **idx)
+{
+  if (!idx || !*idx)
+    return;
+
+  free_image_index(*idx);
+  *idx = mfree(*idx);
+}
+
+/* slot of key in table, either the one containing it or the
+   empty one where it would be inserted */
+static size_t
+find_slot(const struct image_index *idx, const size_t *table,
+	  const char *key, bool by_name)
+{
+  size_t mask = idx->n_slots - 1;
+  size_t slot = string_hash(key) & mask;
+
+  while (table[slot] != 0)
+    {
+      const struct image_entry *e = idx->entries[table[slot] - 1];
+
+      if (streq(by_name ? e->name : e->image_name, key))
+	break;
+      slot = (slot + 1) & mask;
+    }
+
+  return slot;
+}
+
+static void
+insert_entry(struct image_index *idx, size_t i)
+{
+  struct image_entry *e = idx->entries[i];
+  size_t slot;
+
+  slot = find_slot(idx, idx->by_image_name, e->image_name, false);
+  idx->by_image_name[slot] = i + 1;
+
+  /* prepend to the group of this name */
+  slot = find_slot(idx, idx->by_name, e->name, true);
+  idx->next_name[i] = idx->by_name[slot];
+  idx->by_name[slot] = i + 1;
+}
+
+static int
+rehash(struct image_index *idx, size_t n_slots)
+{
+  size_t *by_image_name, *by_name;
+
+  by_image_name = calloc(n_slots, sizeof(size_t));
+  by_name = calloc(n_slots, sizeof(size_t));
+  if (by_image_name == NULL || by_name == NULL)
+    {
+      free(by_image_name);
+      free(by_name);
+      return -ENOMEM;
+    }
+
+  free(idx->by_image_name);
+  free(idx->by_name);
+  idx->by_image_name = by_image_name;
+  idx->by_name = by_name;
+  idx->n_slots = n_slots;
+
+  for (size_t i = 0; i < idx->n; i++)
+    insert_entry(idx, i);
+
+  return 0;
+}
+
+/* Returns -EEXIST if an image with the same image_name is already
+   in the index. */
+int
+image_index_add(struct image_index *idx, struct image_entry *e)
+{
+  int r;
+
+  assert(idx);
+  assert(e);
+  assert(e->name);
+  assert(e->image_name);
+
+  if (image_index_get(idx, e->image_name))
+    return -EEXIST;
+
+  if (idx->n == idx->max)
+    {
+      size_t max = idx->max ? idx->max * 2 : 16;
+      struct image_entry **entries;
+      size_t *next_name;
+
+      entries = realloc(idx->entries, max * sizeof(struct image_entry *));
+      if (entries == NULL)
+	return -ENOMEM;
+      idx->entries = entries;
+
+      next_name = realloc(idx->next_name, max * sizeof(size_t));
+      if (next_name == NULL)
+	return -ENOMEM;
+      idx->next_name = next_name;
+
+      idx->max = max;
+    }
+
+  if ((idx->n + 1) * 2 > idx->n_slots)
+    {
+      r = rehash(idx, idx->n_slots * 2);
+      if (r < 0)
+	return r;
+    }
+
+  idx->entries[idx->n] = e;
+  insert_entry(idx, idx->n);
+  idx->n++;
+
+  return 0;
+}
+
+int
+image_index_add_list(struct image_index *idx, struct image_entry **list, size_t n)
+{
+  int r;
+
+  for (size_t i = 0; i < n; i++)
+    {
+      if (list[i] == NULL)
+	continue;
+
+      r = image_index_add(idx, list[i]);
+      if (r < 0 && r != -EEXIST)
+	return r;
+    }
+
+  return 0;
+}
+
+struct image_entry *
+image_index_get(const struct image_index *idx, const char *image_name)
+{
+  size_t slot;
+
+  assert(image_name);
+
+  if (idx == NULL)
+    return NULL;
+
+  slot = find_slot(idx, idx->by_image_name, image_name, false);
+  if (idx->by_image_name[slot] == 0)
+    return NULL;
+
+  return idx->entries[idx->by_image_name[slot] - 1];
+}
+
+/* index + 1 of the first entry of the name group, 0 if there is none */
+size_t
+image_index_first_name(const struct image_index *idx, const char *name)
+{
+  assert(idx);
+  assert(name);
+
+  return idx->by_name[find_slot(idx, idx->by_name, name, true)];
+}
@@ -0,0 +1,37 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+
+#pragma once
+
+#include <stdint.h>
+
+#include "image-deps.h"
+
+/* Hash index over a list of images, keyed by the full image name
+   ("gcc-30.3.x86-64.raw") and by the name of the image ("gcc"). All
+   versions of an image with the same name form a group, which can
+   be walked with IMAGE_INDEX_FOREACH_NAME().
+   The index does not own the entries. */
+struct image_index {
+  struct image_entry **entries;
+  size_t n;
+  size_t max;
+  size_t *next_name;        /* next entry in the name group, index + 1 */
+  size_t *by_image_name;    /* slot -> index + 1, 0 means empty */
+  size_t *by_name;          /* slot -> first entry of the group, index + 1 */
+  size_t n_slots;
+};
+
+extern uint64_t string_hash(const char *s) _pure_;
+
+extern int image_index_new(size_t hint, struct image_index **ret);
+extern void free_image_index(struct image_index *idx);
+extern void free_image_indexp(struct image_index **idx);
+extern int image_index_add(struct image_index *idx, struct image_entry *e);
+extern int image_index_add_list(struct image_index *idx, struct image_entry **list, size_t n);
+extern struct image_entry *image_index_get(const struct image_index *idx, const char *image_name);
+extern size_t image_index_first_name(const struct image_index *idx, const char *name);
+
+#define IMAGE_INDEX_FOREACH_NAME(e, idx, name)				\
+  for (size_t _i_ = (idx) ? image_index_first_name((idx), (name)) : 0;	\
+       _i_ > 0 && ((e) = (idx)->entries[_i_ - 1]);			\
+       _i_ = (idx)->next_name[_i_ - 1])
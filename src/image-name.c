@@ -0,0 +1,168 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#include <assert.h>
+#include <errno.h>
+
+#include "basics.h"
+#include "image-name.h"
+
+/* Returns the suffix (".raw" or ".img") of an image name or NULL if
+   it is no image */
+const char *
+image_name_suffix(const char *image_name)
+{
+  const char *p;
+
+  p = strrchr(image_name, '.');
+  if (p == NULL)
+    return NULL;
+
+  if (!streq(p, ".raw") && !streq(p, ".img"))
+    return NULL;
+
+  return p;
+}
+
+/* Splits "debug-tools-23.7.x86-64.raw" into its parts without any
+   allocation. The architecture is everything after the last '.'
+   before the suffix, the version everything after the last '-'
+   before the architecture. */
+int
+image_name_parse(const char *image_name, struct image_name *ret)
+{
+  const char *suffix, *p;
+  size_t len;
+
+  assert(image_name);
+  assert(ret);
+
+  suffix = image_name_suffix(image_name);
+  if (suffix == NULL)
+    return -EINVAL;
+
+  *ret = (struct image_name) {
+    .name = image_name,
+    .suffix = suffix,
+    .suffix_len = strlen(suffix),
+  };
+
+  len = suffix - image_name;
+
+  p = memrchr(image_name, '.', len);
+  if (p)
+    {
+      ret->arch = p + 1;
+      ret->arch_len = len - (ret->arch - image_name);
+      len = p - image_name;
+    }
+
+  p = memrchr(image_name, '-', len);
+  if (p)
+    {
+      ret->version = p + 1;
+      ret->version_len = len - (ret->version - image_name);
+      len = p - image_name;
+    }
+
+  ret->name_len = len;
+  version_key(ret->version, ret->version_len, &ret->version_key);
+
+  return 0;
+}
+
+bool
+image_name_is(const struct image_name *n, const char *name)
+{
+  return strlen(name) == n->name_len && strneq(n->name, name, n->name_len);
+}
+
+static bool
+is_digit(char c)
+{
+  return c >= '0' && c <= '9';
+}
+
+/* Encodes version so that memcmp() of two keys orders like
+   strverscmp(). Every other character is copied, a run of digits is
+   stored as its number of digits ('1' to '9') followed by the digits:
+   longer numbers sort after shorter ones and the length byte sorts
+   against other characters like the first digit would.
+   strverscmp() treats numbers with leading zeros as fractional parts,
+   versions with such numbers, numbers with more than 9 digits or
+   which are too long get no key and have to be compared with
+   strverscmp(). */
+bool
+version_key(const char *version, size_t len, struct version_key *ret)
+{
+  size_t n = 0, i = 0;
+
+  assert(ret);
+
+  ret->len = 0;
+
+  if (version == NULL)
+    return false;
+
+  while (i < len)
+    {
+      if (is_digit(version[i]))
+	{
+	  size_t start = i, digits;
+
+	  while (i < len && is_digit(version[i]))
+	    i++;
+	  digits = i - start;
+
+	  if ((version[start] == '0' && digits > 1) || digits > 9 ||
+	      n + 1 + digits > sizeof(ret->data))
+	    return false;
+
+	  ret->data[n++] = '0' + digits;
+	  memcpy(ret->data + n, version + start, digits);
+	  n += digits;
+	}
+      else
+	{
+	  if (n + 1 > sizeof(ret->data))
+	    return false;
+	  ret->data[n++] = version[i++];
+	}
+    }
+
+  ret->len = n;
+
+  return n > 0;
+}
+
+int
+version_key_cmp(const struct version_key *a, const struct version_key *b)
+{
+  int r;
+
+  r = memcmp(a->data, b->data, a->len < b->len ? a->len : b->len);
+  if (r != 0)
+    return r;
+
+  return a->len < b->len ? -1 : a->len > b->len;
+}
+
+/* Compare the versions in the file names of two images with the same
+   name, using the keys computed when the list got created. */
+int
+image_version_cmp(const struct image_entry *a, const struct image_entry *b)
+{
+  if (a->version.len > 0 && b->version.len > 0)
+    return version_key_cmp(&a->version, &b->version);
+
+  return strverscmp(a->image_name, b->image_name);
+}
+
+/* Compare the SYSEXT_VERSION_ID of two images, both need meta data */
+int
+image_sysext_version_cmp(const struct image_entry *a, const struct image_entry *b)
+{
+  if (a->sysext_version.len > 0 && b->sysext_version.len > 0)
+    return version_key_cmp(&a->sysext_version, &b->sysext_version);
+
+  return strverscmp(a->deps->sysext_version_id, b->deps->sysext_version_id);
+}
@@ -0,0 +1,35 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "basics.h"
+#include "image-deps.h"
+
+/* Parts of an image file name like "debug-tools-23.7.x86-64.raw":
+   name "debug-tools", version "23.7", architecture "x86-64" and
+   suffix ".raw". All parts point into the parsed string and are not
+   NUL terminated. Missing parts have length 0. */
+struct image_name {
+  const char *name;
+  size_t name_len;
+  const char *version;
+  size_t version_len;
+  const char *arch;
+  size_t arch_len;
+  const char *suffix;
+  size_t suffix_len;
+  struct version_key version_key;
+};
+
+extern const char *image_name_suffix(const char *image_name) _pure_;
+extern int image_name_parse(const char *image_name, struct image_name *ret);
+extern bool image_name_is(const struct image_name *n, const char *name) _pure_;
+
+extern bool version_key(const char *version, size_t len, struct version_key *ret);
+extern int version_key_cmp(const struct version_key *a, const struct version_key *b) _pure_;
+extern int image_version_cmp(const struct image_entry *a, const struct image_entry *b) _pure_;
+extern int image_sysext_version_cmp(const struct image_entry *a, const struct image_entry *b) _pure_;
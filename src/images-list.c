@@ -5,8 +5,11 @@
 #include <assert.h>
 #include <getopt.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <dirent.h>
+#include <pthread.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 
 #include <systemd/sd-json.h>
 
@@ -17,185 +20,394 @@
 #include "extrelease.h"
 #include "download.h"
 #include "extract.h"
+#include "process.h"
+#include "flight.h"
 #include "tmpfile-util.h"
 #include "strv.h"
 #include "images-list.h"
 #include "log_msg.h"
 #include "mkdir_p.h"
-
+#include "cache.h"
+#include "arena.h"
+#include "image-name.h"
+#include "host-match.h"
+#include "metrics.h"
+
+/* Callback for dir_foreach(), return < 0 to abort with an error,
+   > 0 to stop the iteration. */
+typedef int (*dirent_cb_t)(int dir_fd, const struct dirent64 *de, void *userdata);
+
+/* Iterate over all entries of dir_fd except "." and "..". The entries
+   are read with getdents64() into a buffer on the stack, so nothing
+   gets allocated and they are returned in directory order. */
 static int
-readlink_malloc(const char *path, const char *name, char **ret)
+dir_foreach(int dir_fd, dirent_cb_t cb, void *userdata)
 {
-  _cleanup_free_ char *fn = NULL;
-  _cleanup_free_ char *buf = NULL;
-  ssize_t nbytes, bufsiz;
-  struct stat sb;
+  union {
+    struct dirent64 de;
+    uint8_t data[16 * 1024];
+  } buffer;
   int r;
 
-  r = join_path(path, name, &fn);
-  if (r < 0)
-    return r;
+  assert(dir_fd >= 0);
+  assert(cb);
 
-  if (lstat(fn, &sb) == -1)
+  if (lseek(dir_fd, 0, SEEK_SET) < 0)
+    return -errno;
+
+  for (;;)
     {
-      perror("lstat");
-      return -errno;
+      ssize_t n = getdents64(dir_fd, buffer.data, sizeof(buffer.data));
+      if (n < 0)
+	return -errno;
+      if (n == 0)
+	break;
+
+      for (ssize_t pos = 0; pos < n;)
+	{
+	  const struct dirent64 *de = (const struct dirent64 *)(buffer.data + pos);
+
+	  pos += de->d_reclen;
+
+	  if (streq(de->d_name, ".") || streq(de->d_name, ".."))
+	    continue;
+
+	  r = cb(dir_fd, de, userdata);
+	  if (r != 0)
+	    return r < 0 ? r : 0;
+	}
     }
 
-  /* Add one to the link size, so that we can determine whether
-     the buffer returnd by readlink() was truncated. */
-  bufsiz = sb.st_size + 1;
+  return 0;
+}
 
-  /* Some magic symlinks under (for example) /proc and /sys
-     report 'st_size' as zero. In that case, take PATH_MAX as
-     a "good enough" estimate. */
-  if (sb.st_size == 0)
-    bufsiz = PATH_MAX;
+static unsigned char
+dirent_type(int dir_fd, const struct dirent64 *de)
+{
+  struct stat st;
 
-  buf = malloc(bufsiz);
-  if (buf == NULL)
-    return -ENOMEM;
+  if (de->d_type != DT_UNKNOWN)
+    return de->d_type;
 
-  nbytes = readlink(fn, buf, bufsiz);
-  if (nbytes == -1)
-    return -errno;
+  /* not all filesystems fill in d_type */
+  if (fstatat(dir_fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+    return DT_UNKNOWN;
+
+  return IFTODT(st.st_mode);
+}
+
+static bool
+is_image_name(const char *name)
+{
+  return image_name_suffix(name) != NULL;
+}
+
+/* Name of the image an entry refers to: the basename of the symlink
+   target or the name of the entry itself. buf is used to read the
+   link and must be PATH_MAX bytes large. */
+static int
+image_target_at(int dir_fd, const struct dirent64 *de, char *buf,
+		size_t size, const char **ret)
+{
+  ssize_t nbytes;
+  char *p;
 
-  if (nbytes == bufsiz)
+  if (dirent_type(dir_fd, de) != DT_LNK)
     {
-      log_msg(LOG_CRIT, "Returned buffer may have been truncated!");
-      exit(EXIT_FAILURE);
+      *ret = de->d_name;
+      return 0;
     }
 
-  /* It doesn't contain a terminating null byte ('\0'). */
+  nbytes = readlinkat(dir_fd, de->d_name, buf, size);
+  if (nbytes < 0)
+    return -errno;
+  if ((size_t)nbytes >= size)
+    return -ENAMETOOLONG;
   buf[nbytes] = '\0';
 
-  *ret = TAKE_PTR(buf);
+  p = strrchr(buf, '/');
+  *ret = p ? p + 1 : buf;
 
   return 0;
 }
 
+struct image_collect {
+  char **list;
+  size_t n;
+  size_t max;
+  struct arena *arena;      /* if set, the names are allocated from it */
+};
+
 static int
-image_filter(const struct dirent *de)
+collect_image(int dir_fd, const struct dirent64 *de, void *userdata)
 {
-  if (endswith(de->d_name, ".raw") || endswith(de->d_name, ".img"))
-    return 1;
+  struct image_collect *c = userdata;
+  char buf[PATH_MAX];
+  const char *name;
+  int r;
+
+  if (!is_image_name(de->d_name))
+    return 0;
+
+  r = image_target_at(dir_fd, de, buf, sizeof(buf), &name);
+  if (r < 0)
+    return r;
+
+  if (c->n + 1 >= c->max)
+    {
+      size_t max = c->max ? c->max * 2 : 64;
+      char **tmp = realloc(c->list, max * sizeof(char *));
+      if (tmp == NULL)
+	return -ENOMEM;
+      c->list = tmp;
+      c->max = max;
+    }
+
+  if (c->arena)
+    c->list[c->n] = arena_strdup(c->arena, name);
+  else
+    c->list[c->n] = strdup(name);
+  if (c->list[c->n] == NULL)
+    return -ENOMEM;
+  c->list[++c->n] = NULL;
+
   return 0;
 }
 
-int
-discover_images(const char *path, char ***result)
+static int
+discover_images_in(const char *path, struct arena *arena, char ***result, bool sorted)
 {
-  struct dirent **de = NULL;
+  _cleanup_close_ int dir_fd = -EBADF;
+  struct image_collect c = {
+    .arena = arena,
+  };
   int r;
 
+  assert(path);
   assert(result);
 
-  int num_dirs = scandir(path, &de, image_filter, alphasort);
-  if (num_dirs < 0)
+  dir_fd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+  if (dir_fd < 0)
     return -errno;
 
-  if (num_dirs > 0)
+  r = dir_foreach(dir_fd, collect_image, &c);
+  if (r < 0)
     {
-      *result = malloc((num_dirs+1) * sizeof(char *));
-      if (*result == NULL)
-	return -ENOMEM;
-      (*result)[num_dirs] = NULL;
-
-      for (int i = 0; i < num_dirs; i++)
-      {
-	if (de[i]->d_type == DT_LNK)
-	  {
-	    _cleanup_free_ char *fn = NULL;
-	    char *p;
-
-	    r = readlink_malloc(path, de[i]->d_name, &fn);
-	    if (r < 0)
-	      return r;
-
-	    p = strrchr(fn, '/');
-	    if (p)
-	      (*result)[i] = strdup(++p);
-	    else
-	      (*result)[i] = strdup(fn);
-	  }
-	else
-	  (*result)[i] = strdup(de[i]->d_name);
-
-	if ((*result)[i] == NULL)
-          return -ENOMEM;
-	free(de[i]);
-      }
-      free(de);
+      if (arena)
+	free(c.list);
+      else
+	strv_free(c.list);
+      return r;
     }
 
+  if (c.n == 0)
+    return 0;
+
+  if (sorted)
+    qsort(c.list, c.n, sizeof(char *), strptr_cmp);
+
+  *result = c.list;
+
   return 0;
 }
 
+/* List all images in path. Symlinks are resolved to the name of the
+   image they point to. Only sort the result if the caller needs it. */
+int
+discover_images(const char *path, char ***result, bool sorted)
+{
+  return discover_images_in(path, NULL, result, sorted);
+}
+
+/* path of the extensions directory of a snapshot, relative to
+   the snapshots directory */
 static int
-directory_filter(const struct dirent *de)
+snapshot_extensions_path(const char *snapshot, char *buf, size_t size)
 {
-  /* only directories, but not "." or ".." */
-  if (de->d_type == DT_DIR && !streq(de->d_name, ".") && !streq(de->d_name, ".."))
-    return 1;
+  int n = snprintf(buf, size, "%s/%s", snapshot, config.snapshot_extensions_dir);
+
+  if (n < 0 || (size_t)n >= size)
+    return -ENAMETOOLONG;
+
   return 0;
 }
 
 static int
-snapshot_list(const char *snapshot, struct image_entry **list, size_t n)
+count_image(int dir_fd, const struct dirent64 *de, void *userdata)
 {
-  struct dirent **de = NULL;
+  struct refcount_table *table = userdata;
+  char buf[PATH_MAX];
+  const char *name;
   int r;
 
-  assert(list);
+  if (!is_image_name(de->d_name))
+    return 0;
+
+  r = image_target_at(dir_fd, de, buf, sizeof(buf), &name);
+  if (r < 0)
+    return r;
+
+  return refcount_table_add(table, name);
+}
+
+/* Add all images referenced in the extensions directory of this
+   snapshot to the refcount table */
+static int
+snapshot_list(int snapshots_fd, const char *snapshot, struct refcount_table *table)
+{
+  _cleanup_close_ int dir_fd = -EBADF;
+  char path[PATH_MAX];
+  int r;
+
+  assert(table);
+
+  r = snapshot_extensions_path(snapshot, path, sizeof(path));
+  if (r < 0)
+    return r;
+
+  dir_fd = openat(snapshots_fd, path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+  if (dir_fd < 0)
+    return errno == ENOENT ? 0 : -errno;
+
+  return dir_foreach(dir_fd, count_image, table);
+}
+
+static int
+collect_directory(int dir_fd, const struct dirent64 *de, void *userdata)
+{
+  struct image_collect *c = userdata;
+
+  if (dirent_type(dir_fd, de) != DT_DIR)
+    return 0;
+
+  if (c->n + 1 >= c->max)
+    {
+      size_t max = c->max ? c->max * 2 : 64;
+      char **tmp = realloc(c->list, max * sizeof(char *));
+      if (tmp == NULL)
+	return -ENOMEM;
+      c->list = tmp;
+      c->max = max;
+    }
 
-  _cleanup_free_ char *path = NULL;
-  if (asprintf(&path, "/.snapshots/%s/snapshot/etc/extensions", snapshot) < 0)
+  c->list[c->n] = strdup(de->d_name);
+  if (c->list[c->n] == NULL)
     return -ENOMEM;
+  c->list[++c->n] = NULL;
 
-  int num_dirs = scandir(path, &de, image_filter, NULL /* alphasort */);
+  return 0;
+}
 
-  if (num_dirs < 0 && errno != ENOENT)
-    return -errno;
+/* Snapshots are read-only, the references of a snapshot can only
+   change if the mtime of its extensions directory changes. Returns 0
+   as mtime if the snapshot has no extensions directory. */
+static int
+snapshot_mtime(int snapshots_fd, const char *snapshot, uint64_t *ret)
+{
+  char path[PATH_MAX];
+  struct stat st;
+  int r;
+
+  r = snapshot_extensions_path(snapshot, path, sizeof(path));
+  if (r < 0)
+    return r;
 
-  for (int i = 0; i < num_dirs; i++)
+  if (fstatat(snapshots_fd, path, &st, 0) < 0)
     {
-      _cleanup_free_ char *p = NULL;
-      char *fn = NULL;
+      if (errno != ENOENT)
+	return -errno;
+      *ret = 0;
+      return 0;
+    }
 
-      if (de[i]->d_type == DT_LNK)
-	{
+  *ret = (uint64_t)st.st_mtim.tv_sec * USEC_PER_SEC +
+    (uint64_t)st.st_mtim.tv_nsec / NSEC_PER_USEC;
 
-	  r = readlink_malloc(path, de[i]->d_name, &p);
-	  if (r < 0)
-	    return r;
+  return 0;
+}
 
-	  fn = strrchr(p, '/');
-	  if (fn)
-	    ++fn;
-	  else
-	    fn = p;
-	}
-      else
-	fn = de[i]->d_name;
+#define SNAPSHOT_SCAN_MAX_THREADS 8
+
+/* snapshots which need to be scanned, shared by all scan threads */
+struct snapshot_scan {
+  int snapshots_fd;
+  size_t n;
+  const char **ids;
+  uint64_t *mtimes;
+  struct refcount_table **refs;
+  int *results;
+  size_t next;              /* next snapshot to scan, atomic */
+};
+
+static void
+free_snapshot_scan(struct snapshot_scan *s)
+{
+  for (size_t i = 0; s->refs && i < s->n; i++)
+    free_refcount_tablep(&s->refs[i]);
+  s->ids = mfree(s->ids);
+  s->mtimes = mfree(s->mtimes);
+  s->refs = mfree(s->refs);
+  s->results = mfree(s->results);
+}
+
+static void *
+snapshot_scan_thread(void *userdata)
+{
+  struct snapshot_scan *s = userdata;
+  size_t i;
 
-      for (size_t j = 0; j < n; j++)
+  while ((i = __atomic_fetch_add(&s->next, 1, __ATOMIC_RELAXED)) < s->n)
+    {
+      s->refs[i] = calloc(1, sizeof(struct refcount_table));
+      if (s->refs[i] == NULL)
 	{
-	  if (streq(fn, list[j]->image_name))
-	    list[j]->refcount++;
+	  s->results[i] = -ENOMEM;
+	  continue;
 	}
-
-      free(de[i]);
+      s->results[i] = snapshot_list(s->snapshots_fd, s->ids[i], s->refs[i]);
     }
 
-  free(de);
+  return NULL;
+}
 
-  return 0;
+/* Scan the snapshots with one thread per CPU, the calling thread
+   takes part, too. */
+static void
+scan_snapshots(struct snapshot_scan *s)
+{
+  pthread_t threads[SNAPSHOT_SCAN_MAX_THREADS];
+  size_t n_threads = 0, max_threads;
+  long cpus;
+
+  cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  max_threads = cpus > 0 ? (size_t)cpus : 1;
+  if (max_threads > SNAPSHOT_SCAN_MAX_THREADS)
+    max_threads = SNAPSHOT_SCAN_MAX_THREADS;
+  if (max_threads > s->n)
+    max_threads = s->n;
+
+  /* if a thread cannot be created, the others do the work */
+  while (n_threads + 1 < max_threads &&
+	 pthread_create(&threads[n_threads], NULL, snapshot_scan_thread, s) == 0)
+    n_threads++;
+
+  snapshot_scan_thread(s);
+
+  for (size_t i = 0; i < n_threads; i++)
+    pthread_join(threads[i], NULL);
 }
 
+/* The references of every snapshot are cached with the mtime of its
+   extensions directory, only new or modified snapshots get scanned. */
 int
 calc_refcount(struct image_entry **list, size_t n)
 {
-  struct dirent **de = NULL;
+  _cleanup_(free_snapshot_scan) struct snapshot_scan scan = {};
+  _cleanup_strv_free_ char **snapshots = NULL;
+  _cleanup_close_ int snapshots_fd = -EBADF;
+  const struct refcount_table *table;
+  struct image_collect c = {};
+  uint64_t start = metrics_now();
   int r = 0;
 
   if (n == 0)
@@ -203,34 +415,466 @@ calc_refcount(struct image_entry **list, size_t n)
 
   assert(list);
 
-  int num_dirs = scandir("/.snapshots", &de, directory_filter, NULL /* alphasort */);
-  if (num_dirs < 0)
+  snapshots_fd = open(config.snapshots_dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+  if (snapshots_fd < 0)
     return -errno;
 
-  for (int i = 0; i < num_dirs; i++)
+  r = dir_foreach(snapshots_fd, collect_directory, &c);
+  snapshots = c.list;
+  if (r < 0)
+    return r;
+
+  if (c.n > 0)
+    {
+      qsort(snapshots, c.n, sizeof(char *), strptr_cmp);
+
+      scan.snapshots_fd = snapshots_fd;
+      scan.ids = calloc(c.n, sizeof(char *));
+      scan.mtimes = calloc(c.n, sizeof(uint64_t));
+      scan.refs = calloc(c.n, sizeof(struct refcount_table *));
+      scan.results = calloc(c.n, sizeof(int));
+      if (scan.ids == NULL || scan.mtimes == NULL ||
+	  scan.refs == NULL || scan.results == NULL)
+	return -ENOMEM;
+    }
+
+  /* forget about deleted snapshots */
+  cache_snapshot_prune(snapshots, c.n);
+
+  STRV_FOREACH(snapshot, snapshots)
     {
-      r = snapshot_list(de[i]->d_name, list, n);
-      free(de[i]);
+      uint64_t mtime;
+
+      r = snapshot_mtime(snapshots_fd, *snapshot, &mtime);
       if (r < 0)
+	return r;
+
+      if (cache_snapshot_get(*snapshot, mtime) == NULL)
+	{
+	  scan.ids[scan.n] = *snapshot;
+	  scan.mtimes[scan.n] = mtime;
+	  scan.n++;
+	}
+    }
+
+  if (scan.n > 0)
+    {
+      log_msg(LOG_DEBUG, "Scanning %zu of %zu snapshots", scan.n, c.n);
+
+      scan_snapshots(&scan);
+      metrics_add(METRIC_SNAPSHOTS_SCANNED, scan.n);
+
+      for (size_t i = 0; i < scan.n; i++)
+	{
+	  if (scan.results[i] < 0)
+	    return scan.results[i];
+
+	  r = cache_snapshot_put(scan.ids[i], scan.mtimes[i], TAKE_PTR(scan.refs[i]));
+	  if (r < 0)
+	    return r;
+	}
+    }
+
+  r = cache_refcount_get(&table);
+  if (r < 0)
+    return r;
+
+  for (size_t j = 0; j < n; j++)
+    list[j]->refcount = refcount_table_lookup(table, list[j]->image_name);
+
+  metrics_inc(METRIC_REFCOUNT_SCANS);
+  metrics_phase_done(PHASE_REFCOUNT, start);
+
+  return 0;
+}
+
+/* Images in the store which a running Install or Update is going to
+   link. They release the state lock while downloading and while
+   enabling fs-verity, so an image could be unreferenced in the store
+   at that time. Pinned images never get removed or deduplicated.
+   Protected by the state lock, a name is listed once per pin. */
+static char **store_pins = NULL;
+static size_t n_store_pins = 0;
+
+int
+store_pin(const char *image_name)
+{
+  char **tmp;
+
+  assert(image_name);
+
+  tmp = realloc(store_pins, (n_store_pins + 1) * sizeof(char *));
+  if (tmp == NULL)
+    return -ENOMEM;
+  store_pins = tmp;
+
+  store_pins[n_store_pins] = strdup(image_name);
+  if (store_pins[n_store_pins] == NULL)
+    return -ENOMEM;
+  n_store_pins++;
+
+  return 0;
+}
+
+void
+store_unpin(const char *image_name)
+{
+  assert(image_name);
+
+  for (size_t i = 0; i < n_store_pins; i++)
+    if (streq(store_pins[i], image_name))
+      {
+	free(store_pins[i]);
+	store_pins[i] = store_pins[--n_store_pins];
 	break;
+      }
+
+  if (n_store_pins == 0)
+    store_pins = mfree(store_pins);
+}
+
+bool
+store_pinned(const char *image_name)
+{
+  for (size_t i = 0; i < n_store_pins; i++)
+    if (streq(store_pins[i], image_name))
+      return true;
+
+  return false;
+}
+
+/* Per image state of the retention policy */
+struct store_image {
+  struct image_entry *e;
+  uint64_t size;            /* allocated blocks in bytes */
+  uint64_t last_used;       /* usec, newer of atime and mtime */
+  bool pinned;              /* used by a running Install or Update */
+  bool remove;
+};
+
+/* Sort by name, newest version first */
+static int
+store_image_cmp(const void *a, const void *b)
+{
+  const struct store_image *s1 = a;
+  const struct store_image *s2 = b;
+  int r;
+
+  r = strcmp(s1->e->name, s2->e->name);
+  if (r != 0)
+    return r;
+
+  return -image_version_cmp(s1->e, s2->e);
+}
+
+static uint64_t
+timespec_usec(const struct timespec *ts)
+{
+  return (uint64_t)ts->tv_sec * USEC_PER_SEC +
+    (uint64_t)ts->tv_nsec / NSEC_PER_USEC;
+}
+
+/* Returns true if the store is larger than store_max_size or the
+   filesystem has less than store_min_free bytes free. */
+static bool
+store_over_budget(uint64_t store_size, uint64_t fs_free)
+{
+  if (config.store_max_size > 0 && store_size > config.store_max_size)
+    return true;
+  if (config.store_min_free > 0 && fs_free < config.store_min_free)
+    return true;
+  return false;
+}
+
+/* Select the images to delete: unreferenced images except the newest
+   keep_unused_versions of every name, which are kept as rollback
+   cache. If the store is over budget afterwards, the least recently
+   used of the kept images are deleted, too. Images referenced by a
+   snapshot or pinned by a running request are never deleted. */
+static int
+retention_select(int store_fd, struct store_image *list, size_t n)
+{
+  uint64_t store_size = 0, fs_free = UINT64_MAX;
+  struct statvfs sv;
+  unsigned kept = 0;
+
+  for (size_t i = 0; i < n; i++)
+    {
+      struct stat st;
+
+      if (fstatat(store_fd, list[i].e->image_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+	return -errno;
+
+      list[i].size = (uint64_t)st.st_blocks * 512;
+      list[i].last_used = timespec_usec(&st.st_atim);
+      if (timespec_usec(&st.st_mtim) > list[i].last_used)
+	list[i].last_used = timespec_usec(&st.st_mtim);
+      store_size += list[i].size;
+      list[i].pinned = store_pinned(list[i].e->image_name);
+    }
+
+  if (config.store_min_free > 0)
+    {
+      if (fstatvfs(store_fd, &sv) < 0)
+	return -errno;
+      fs_free = (uint64_t)sv.f_bavail * sv.f_frsize;
+    }
+
+  qsort(list, n, sizeof(struct store_image), store_image_cmp);
+
+  for (size_t i = 0; i < n; i++)
+    {
+      if (i == 0 || !streq(list[i].e->name, list[i-1].e->name))
+	kept = 0;
+
+      if (list[i].e->refcount > 0 || list[i].pinned)
+	continue;
+
+      if (kept < config.keep_unused_versions)
+	kept++;
+      else
+	{
+	  list[i].remove = true;
+	  store_size -= list[i].size;
+	  if (fs_free != UINT64_MAX)
+	    fs_free += list[i].size;
+	}
+    }
+
+  while (store_over_budget(store_size, fs_free))
+    {
+      struct store_image *lru = NULL;
+
+      for (size_t i = 0; i < n; i++)
+	if (list[i].e->refcount == 0 && !list[i].pinned && !list[i].remove &&
+	    (lru == NULL || list[i].last_used < lru->last_used))
+	  lru = &list[i];
+
+      if (lru == NULL)
+	{
+	  log_msg(LOG_WARNING, "Store '%s' is over budget, but all images are in use",
+		  config.sysext_store_dir);
+	  break;
+	}
+
+      log_msg(LOG_DEBUG, "Store over budget, evicting '%s'", lru->e->image_name);
+      lru->remove = true;
+      store_size -= lru->size;
+      if (fs_free != UINT64_MAX)
+	fs_free += lru->size;
+    }
+
+  return 0;
+}
+
+/* Delete the images in store which are not referenced by any snapshot,
+   following the retention policy of the configuration. The names of
+   the deleted images are returned in ret, the number of bytes freed
+   in ret_freed. */
+int
+remove_unused_images(const char *store, char ***ret, uint64_t *ret_freed)
+{
+  _cleanup_(free_image_list) struct image_list images = {};
+  _cleanup_free_ struct store_image *list = NULL;
+  _cleanup_strv_free_ char **removed = NULL;
+  _cleanup_close_ int store_fd = -EBADF;
+  size_t n_removed = 0;
+  uint64_t freed = 0;
+  int r;
+
+  assert(store);
+  assert(ret);
+
+  r = image_local_metadata(store, &images, NULL, NULL, false);
+  if (r < 0)
+    return r;
+
+  if (images.n == 0)
+    {
+      *ret = NULL;
+      if (ret_freed)
+	*ret_freed = 0;
+      return 0;
+    }
+
+  r = calc_refcount(images.images, images.n);
+  if (r < 0)
+    return r;
+
+  store_fd = open(store, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+  if (store_fd < 0)
+    return -errno;
+
+  list = calloc(images.n, sizeof(struct store_image));
+  removed = calloc(images.n + 1, sizeof(char *));
+  if (list == NULL || removed == NULL)
+    return -ENOMEM;
+
+  for (size_t i = 0; i < images.n; i++)
+    list[i].e = images.images[i];
+
+  r = retention_select(store_fd, list, images.n);
+  if (r < 0)
+    return r;
+
+  for (size_t i = 0; i < images.n; i++)
+    {
+      struct image_entry *e = list[i].e;
+      _cleanup_free_ char *fn_cache = NULL;
+
+      if (!list[i].remove)
+	continue;
+
+      log_msg(LOG_INFO, "Unused image '%s', removing", e->image_name);
+
+      if (unlinkat(store_fd, e->image_name, 0) < 0)
+	{
+	  r = -errno;
+	  log_msg(LOG_ERR, "Error to delete '%s/%s': %s", store, e->image_name, strerror(-r));
+	  return r;
+	}
+      freed += list[i].size;
+
+      /* remove cached meta values */
+      cache_metadata_drop(e->image_name);
+      r = join_path(SYSEXT_CACHE_META_DIR, e->image_name, &fn_cache);
+      if (r < 0)
+	return r;
+      unlink(fn_cache);
+
+      removed[n_removed] = strdup(e->image_name);
+      if (removed[n_removed] == NULL)
+	return -ENOMEM;
+      n_removed++;
+    }
+
+  *ret = TAKE_PTR(removed);
+  if (ret_freed)
+    *ret_freed = freed;
+
+  return 0;
+}
+
+void
+free_image_list(struct image_list *l)
+{
+  if (!l)
+    return;
+
+  arena_free(&l->arena);
+  l->images = NULL;
+  l->n = 0;
+}
+
+static int
+arena_copy_string(struct arena *a, const char *s, bool intern, char **ret)
+{
+  if (s == NULL)
+    {
+      *ret = NULL;
+      return 0;
     }
-  free(de);
 
-  return r;
+  /* interned strings are never modified, only shared */
+  *ret = intern ? (char *)arena_intern(a, s) : arena_strdup(a, s);
+  if (*ret == NULL)
+    return -ENOMEM;
+
+  return 0;
+}
+
+/* Copy of src allocated from the arena. ID, VERSION_ID, SYSEXT_LEVEL,
+   SYSEXT_SCOPE and ARCHITECTURE are the same for nearly all images,
+   they are only stored once. */
+static int
+arena_copy_image_deps(struct arena *a, const struct image_deps *src,
+		      struct image_deps **ret)
+{
+  struct image_deps *e;
+
+  assert(src);
+  assert(ret);
+
+  e = arena_alloc(a, sizeof(struct image_deps));
+  if (e == NULL)
+    return -ENOMEM;
+
+  if (arena_copy_string(a, src->image_name_json, false, &e->image_name_json) < 0 ||
+      arena_copy_string(a, src->sysext_version_id, false, &e->sysext_version_id) < 0 ||
+      arena_copy_string(a, src->sysext_scope, true, &e->sysext_scope) < 0 ||
+      arena_copy_string(a, src->id, true, &e->id) < 0 ||
+      arena_copy_string(a, src->sysext_level, true, &e->sysext_level) < 0 ||
+      arena_copy_string(a, src->version_id, true, &e->version_id) < 0 ||
+      arena_copy_string(a, src->architecture, true, &e->architecture) < 0)
+    return -ENOMEM;
+
+  /* the json object is only needed while parsing */
+  e->sysext = NULL;
+
+  *ret = e;
+
+  return 0;
+}
+
+/* The extension-release file of image_name gets extracted into a
+   temporary file in SYSEXT_CACHE_META_DIR and only renamed to its
+   cache file once it is complete. The state lock is released while
+   systemd-dissect runs, other requests must never see a partial file. */
+static int
+metadata_tmpfile(const char *image_name, char **ret)
+{
+  _cleanup_free_ char *tmpfn = NULL;
+  int fd;
+
+  if (asprintf(&tmpfn, "%s/.%s.XXXXXX", SYSEXT_CACHE_META_DIR, image_name) < 0)
+    return -ENOMEM;
+
+  fd = mkostemp_safe(tmpfn);
+  if (fd < 0)
+    return fd;
+
+  *ret = TAKE_PTR(tmpfn);
+
+  return fd;
+}
+
+static int
+metadata_tmpfile_commit(const char *tmpfn, const char *image_name)
+{
+  _cleanup_free_ char *cache_filename = NULL;
+  int r;
+
+  r = join_path(SYSEXT_CACHE_META_DIR, image_name, &cache_filename);
+  if (r < 0)
+    return r;
+
+  if (rename(tmpfn, cache_filename) < 0)
+    return -errno;
+
+  return 0;
 }
 
 static int
-image_read_metadata(const char *image_name, struct image_deps **res)
+image_read_metadata(struct arena *arena, const char *image_name, struct image_deps **res)
 {
   _cleanup_(free_image_depsp) struct image_deps *image = NULL;
   _cleanup_free_ char *cache_filename = NULL;
   _cleanup_close_ int fd = -EBADF;
+  const struct image_deps *cached;
   struct stat st;
   int r;
 
   assert(image_name);
   assert(res);
 
+  cached = cache_metadata_get(image_name);
+  if (cached)
+    {
+      metrics_inc(METRIC_METADATA_CACHE_HITS);
+      return arena_copy_image_deps(arena, cached, res);
+    }
+  metrics_inc(METRIC_METADATA_CACHE_MISSES);
+
   r = mkdir_p(SYSEXT_CACHE_META_DIR, 0755);
   if (r < 0)
     {
@@ -246,38 +890,155 @@ image_read_metadata(const char *image_name, struct image_deps **res)
       return r;
     }
 
-  if (stat(cache_filename, &st) != 0)
+  if (stat(cache_filename, &st) != 0)
+    {
+      _cleanup_free_ char *tmpfn = NULL;
+
+      /* The meta data is not cached. So extract it from image. */
+      fd = metadata_tmpfile(image_name, &tmpfn);
+      if (fd < 0)
+        {
+          log_msg(LOG_ERR, "Cannot create temporary file for %s: %s", cache_filename, strerror(-fd));
+	  return fd;
+        }
+
+      r = extract(config.sysext_store_dir, image_name, fd);
+      if (r == 0)
+	r = metadata_tmpfile_commit(tmpfn, image_name);
+      if (r != 0)
+	unlink(tmpfn);
+      if (r < 0)
+        {
+          log_msg(LOG_ERR, "Failed to extract extension-release from '%s': %s",
+		  image_name, strerror(-r));
+	  return r;
+        }
+      else if (r > 0)
+        {
+          log_msg(LOG_ERR, "Failed to extract extension-release from '%s': systemd-dissect failed (%i)",
+		  image_name, r);
+	  return -EINVAL;
+        }
+    }
+
+  r = load_ext_release(cache_filename, &image);
+  if (r < 0)
+    return r;
+
+  if (image)
+    {
+      r = cache_metadata_put(image_name, image);
+      if (r < 0)
+	return r;
+      return arena_copy_image_deps(arena, image, res);
+    }
+
+  return 0;
+}
+
+struct metadata_tmpfiles {
+  char **fn;                /* NULL if nothing got started */
+  size_t n;
+};
+
+/* removes all temporary files which did not get committed */
+static void
+free_metadata_tmpfiles(struct metadata_tmpfiles *t)
+{
+  for (size_t i = 0; t->fn && i < t->n; i++)
+    if (t->fn[i])
+      {
+	unlink(t->fn[i]);
+	free(t->fn[i]);
+      }
+  t->fn = mfree(t->fn);
+  t->n = 0;
+}
+
+/* Extract the extension-release files of all images, which are not
+   cached yet, at once. image_read_metadata() loads them afterwards.
+   Only complete files get renamed to their cache file, if the
+   extraction failed, image_read_metadata() tries again and reports
+   the error. */
+static int
+image_prefetch_metadata(struct image_entry **images, size_t n)
+{
+  _cleanup_(process_batch_freep) struct process_batch *batch = NULL;
+  _cleanup_(free_metadata_tmpfiles) struct metadata_tmpfiles tmpfiles = {};
+  _cleanup_free_ int *status = NULL;
+  size_t n_started = 0;
+  uint64_t start;
+  int r;
+
+  status = calloc(n, sizeof(int));
+  tmpfiles.fn = calloc(n, sizeof(char *));
+  if (status == NULL || tmpfiles.fn == NULL)
+    return -ENOMEM;
+  tmpfiles.n = n;
+
+  for (size_t i = 0; i < n; i++)
     {
-      /* The meta data is not cached. So extract it from image. */
-      fd = open(cache_filename, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+      _cleanup_free_ char *cache_filename = NULL;
+      _cleanup_close_ int fd = -EBADF;
+      struct stat st;
+
+      if (cache_metadata_get(images[i]->image_name))
+	continue;
+
+      r = join_path(SYSEXT_CACHE_META_DIR, images[i]->image_name, &cache_filename);
+      if (r < 0)
+	return r;
+
+      if (stat(cache_filename, &st) == 0)
+	continue;
+
+      if (batch == NULL)
+	{
+	  r = mkdir_p(SYSEXT_CACHE_META_DIR, 0755);
+	  if (r < 0)
+	    return 0; /* image_read_metadata() reports it */
+
+	  r = process_batch_new(PROCESS_MAX_RUNNING, &batch);
+	  if (r < 0)
+	    return r;
+	}
 
+      fd = metadata_tmpfile(images[i]->image_name, &tmpfiles.fn[i]);
       if (fd < 0)
-        {
-          log_msg(LOG_ERR, "Cannot open filename %s: %s", cache_filename, strerror (errno));
-	  return -1;
-        }
+	continue;
 
-      r = extract(SYSEXT_STORE_DIR, image_name, fd);
+      r = extract_start(batch, config.sysext_store_dir, images[i]->image_name, fd, &status[i]);
       if (r < 0)
-        {
-          log_msg(LOG_ERR, "Failed to extract extension-release from '%s': %s",
-		  image_name, strerror(-r));
-	  return r;
-        }
-      else if (r > 0)
-        {
-          log_msg(LOG_ERR, "Failed to extract extension-release from '%s': systemd-dissect failed (%i)",
-		  image_name, r);
-	  return -EINVAL;
-        }
+	{
+	  unlink(tmpfiles.fn[i]);
+	  tmpfiles.fn[i] = mfree(tmpfiles.fn[i]);
+	  continue;
+	}
+      n_started++;
     }
 
-  r = load_ext_release(cache_filename, &image);
+  if (n_started == 0)
+    return 0;
+
+  log_msg(LOG_DEBUG, "Extracting meta data of %zu images", n_started);
+
+  start = metrics_now();
+  r = process_batch_wait(batch);
+  metrics_phase_done(PHASE_DISSECT, start);
+
+  /* after an error the files of all children are incomplete, the
+     cleanup removes them */
   if (r < 0)
     return r;
 
-  if (image)
-    *res = TAKE_PTR(image);
+  for (size_t i = 0; i < n; i++)
+    {
+      if (tmpfiles.fn[i] == NULL || extract_result(status[i]) != 0)
+	continue;
+
+      if (metadata_tmpfile_commit(tmpfiles.fn[i], images[i]->image_name) == 0)
+	tmpfiles.fn[i] = mfree(tmpfiles.fn[i]);
+    }
 
   return 0;
 }
@@ -295,8 +1056,12 @@ image_json_from_url(const char *url, const char *image_name,
   assert(res);
 
   fd = mkostemp_safe(tmpfn);
+  if (fd < 0)
+    return fd;
 
   jsonfn = malloc(strlen(image_name) + strlen(".json") + 1);
+  if (jsonfn == NULL)
+    return -ENOMEM;
   char *p = stpcpy(jsonfn, image_name);
   strcpy(p, ".json");
 
@@ -339,88 +1104,158 @@ image_json_from_url(const char *url, const char *image_name,
     {
       /* XXX go through the list and search the corret image */
       /* XXX we cannot use TAKE_PTR else the rest of the list will not be free'd */
-      log_msg(LOG_ERR, "More than one entry found, not implemented yet!");
-      exit(EXIT_FAILURE);
+      /* This runs on a worker thread, only this image is unusable */
+      log_msg(LOG_ERR, "More than one entry found in '%s', not implemented yet!", jsonfn);
+      return -EOPNOTSUPP;
     }
 
   return 0;
 }
 
+/* The manifest of a remote image, downloaded in parallel with
+   the manifests of the other images */
+struct manifest_fetch {
+  struct image_entry *e;
+  char *fn;
+  char tmpfn[sizeof("/tmp/sysext-image-manifest.XXXXXX")];
+  int fd;
+  bool started;
+  int status;
+  int result;
+  struct image_deps *deps;
+};
+
+struct manifest_fetches {
+  struct manifest_fetch *f;
+  size_t n;
+};
+
+static void
+free_manifest_fetches(struct manifest_fetches *fetches)
+{
+  for (size_t i = 0; i < fetches->n; i++)
+    {
+      struct manifest_fetch *f = &fetches->f[i];
+
+      free(f->fn);
+      if (f->fd >= 0)
+	{
+	  close(f->fd);
+	  unlink(f->tmpfn);
+	}
+      free_image_depsp(&f->deps);
+    }
+  free(fetches->f);
+}
+
 static int
-image_manifest_from_url(const char *url, const char *image_name,
-			struct image_deps **res, bool verify_signature)
+image_manifest_load(struct manifest_fetch *f)
 {
-  _cleanup_(unlink_tempfilep) char tmpfn[] = "/tmp/sysext-image-manifest.XXXXXX";
-  _cleanup_close_ int fd = -EBADF;
-  _cleanup_free_ char *jsonfn = NULL;
+  _cleanup_(free_image_deps_list) struct image_deps **images = NULL;
   int r;
 
-  assert(url);
-  assert(res);
-
-  fd = mkostemp_safe(tmpfn);
+  r = load_manifest(f->fd, f->tmpfn, &images);
+  if (r < 0)
+    return r;
 
-  jsonfn = malloc(strlen(image_name) + strlen(".manifest.gz") + 1);
-  char *p = stpcpy(jsonfn, image_name);
-  p = endswith(jsonfn, ".raw");
-  if (!p)
+  if (images == NULL || images[0] == NULL)
     {
-      log_msg(LOG_ERR, "The image '%s' has no supported suffix", jsonfn);
-      return -EINVAL;
+      log_msg(LOG_NOTICE, "No entry with dependencies found (%s)!", f->fn);
+      return -ENOENT;
     }
-  strcpy(p, ".manifest.gz");
 
-  r = download(url, jsonfn, tmpfn, verify_signature);
-  if (r != 0)
+  /* There is currently only one entry. see load_manifest in mkosi-manifest.c */
+  if (images[1] == NULL)
+      f->deps = TAKE_PTR(images[0]);
+
+  return 0;
+}
+
+/* Download the manifests of all images at once and load them. The
+   result of every image is in f[i].result, -ENOENT if the image has
+   no manifest. */
+static int
+image_manifests_from_url(const char *url, struct manifest_fetch *f, size_t n,
+			 bool verify_signature)
+{
+  _cleanup_(process_batch_freep) struct process_batch *batch = NULL;
+  uint64_t start = metrics_now();
+  int r;
+
+  assert(url);
+  assert(f);
+
+  r = process_batch_new(PROCESS_MAX_RUNNING, &batch);
+  if (r < 0)
+    return r;
+
+  for (size_t i = 0; i < n; i++)
     {
+      struct image_name parsed;
+
+      r = image_name_parse(f[i].e->image_name, &parsed);
       if (r < 0)
 	{
-	  log_msg(LOG_ERR, "Failed to download '%s' from '%s': %s",
-		  jsonfn, url, strerror(-r));
-	  return r;
+	  log_msg(LOG_ERR, "The image '%s' has no supported suffix", f[i].e->image_name);
+	  f[i].result = r;
+	  continue;
 	}
-      else
+
+      /* "gcc-30.3.x86-64.raw" -> "gcc-30.3.x86-64.manifest.gz" */
+      if (asprintf(&f[i].fn, "%.*s.manifest.gz",
+		   (int)(parsed.suffix - f[i].e->image_name), f[i].e->image_name) < 0)
+	return -ENOMEM;
+
+      strcpy(f[i].tmpfn, "/tmp/sysext-image-manifest.XXXXXX");
+      f[i].fd = mkostemp_safe(f[i].tmpfn);
+      if (f[i].fd < 0)
 	{
-	  log_msg(LOG_ERR, "Failed to download '%s' from '%s': %s", jsonfn, url, wstatus2str(r));
-	  if (WIFEXITED(r))
-	    return -ENOENT;
+	  f[i].result = f[i].fd;
+	  continue;
+	}
 
-	  return -EIO;
+      r = download_start(batch, url, f[i].fn, f[i].tmpfn, verify_signature, &f[i].status);
+      if (r < 0)
+	{
+	  log_msg(LOG_ERR, "Cannot start download: %s", strerror(-r));
+	  f[i].result = r;
+	  continue;
 	}
+      f[i].started = true;
     }
 
-  _cleanup_(free_image_deps_list) struct image_deps **images = NULL;
-  r = load_manifest(fd, tmpfn, &images);
+  r = process_batch_wait(batch);
+  metrics_phase_done(PHASE_MANIFESTS, start);
   if (r < 0)
     return r;
 
-  if (images == NULL || images[0] == NULL)
+  for (size_t i = 0; i < n; i++)
     {
-      log_msg(LOG_NOTICE, "No entry with dependencies found (%s)!", jsonfn);
-      return -ENOENT;
-    }
+      if (!f[i].started)
+	continue;
 
-  /* There is currently only one entry. see load_manifest in mkosi-manifest.c */
-  if (images[1] == NULL)
-      *res = TAKE_PTR(images[0]);
+      r = download_finished(f[i].tmpfn, f[i].status);
+      if (r != 0)
+	{
+	  log_msg(LOG_ERR, "Failed to download '%s' from '%s': %s", f[i].fn, url, wstatus2str(r));
+	  f[i].result = WIFEXITED(r) ? -ENOENT : -EIO;
+	  continue;
+	}
+
+      f[i].result = image_manifest_load(&f[i]);
+    }
 
   return 0;
 }
 
 static int
-image_list_from_url(const char *url, char ***result, bool verify_signature)
+image_list_download(const char *url, const char *tmpfn, bool verify_signature)
 {
-  _cleanup_(unlink_tempfilep) char tmpfn[] = "/tmp/sysext-SHA256SUMS.XXXXXX";
-  _cleanup_close_ int fd = -EBADF;
-  _cleanup_fclose_ FILE *fp = NULL;
+  uint64_t start = metrics_now();
   int r;
 
-  assert(url);
-  assert(result);
-
-  fd = mkostemp_safe(tmpfn);
-
   r = download(url, "SHA256SUMS", tmpfn, verify_signature);
+  metrics_phase_done(PHASE_SHA256SUMS, start);
   if (r != 0)
     {
       if (r < 0)
@@ -439,7 +1274,23 @@ image_list_from_url(const char *url, char ***result, bool verify_signature)
 	}
     }
 
-  fp = fdopen(fd, "r");
+  return 0;
+}
+
+/* result contains the image names of the SHA256SUMS file fn, digests
+   the SHA256 sum of the image with the same index. The strings are
+   allocated from the arena, only the arrays need to be freed. */
+static int
+image_list_parse(const char *fn, struct arena *arena, char ***result,
+		 char ***digests)
+{
+  _cleanup_fclose_ FILE *fp = NULL;
+
+  assert(fn);
+  assert(result);
+  assert(digests);
+
+  fp = fopen(fn, "re");
   if (!fp)
     return -errno;
 
@@ -448,6 +1299,10 @@ image_list_from_url(const char *url, char ***result, bool verify_signature)
   if (*result == NULL)
     return -ENOMEM;
   (*result)[0] = NULL;
+  *digests = malloc((max_entry + 1) * sizeof(char *));
+  if (*digests == NULL)
+    return -ENOMEM;
+  (*digests)[0] = NULL;
 
   _cleanup_(freep) char *line = NULL;
   size_t size = 0;
@@ -459,10 +1314,16 @@ image_list_from_url(const char *url, char ***result, bool verify_signature)
       if (nread && line[nread-1] == '\n')
 	line[nread-1] = '\0';
 
-      if (endswith(line, ".raw") || endswith(line, ".img"))
+      if (is_image_name(line))
 	{
 	  /* get image name, skip SHA256SUM hash and spaces */
 	  char *p = strchr(line, ' ');
+	  if (p == NULL)
+	    continue;
+	  char *digest = arena_alloc(arena, p - line + 1);
+	  if (digest == NULL)
+	    return -ENOMEM;
+	  memcpy(digest, line, p - line);
 	  while (*p == ' ')
 	    ++p;
 
@@ -472,8 +1333,13 @@ image_list_from_url(const char *url, char ***result, bool verify_signature)
 	      *result = realloc(*result, (max_entry + 1) * sizeof(char *));
 	      if (*result == NULL)
 		return -ENOMEM;
+	      *digests = realloc(*digests, (max_entry + 1) * sizeof(char *));
+	      if (*digests == NULL)
+		return -ENOMEM;
 	    }
-	  (*result)[cur_entry] = strdup(p);
+	  (*digests)[cur_entry] = digest;
+	  (*digests)[cur_entry + 1] = NULL;
+	  (*result)[cur_entry] = arena_strdup(arena, p);
 	  if ((*result)[cur_entry] == NULL)
 	    return -ENOMEM;
 	  cur_entry++;
@@ -484,99 +1350,252 @@ image_list_from_url(const char *url, char ***result, bool verify_signature)
   return 0;
 }
 
-int
-image_remote_metadata(const char *url, struct image_entry ***res, size_t *nr,
-		      const char *filter, bool verify_signature,
-		      const struct osrelease *osrelease)
+static bool
+image_name_in(const struct image_name *n, char **names)
 {
-  _cleanup_strv_free_ char **list = NULL;
-  _cleanup_(free_image_entry_list) struct image_entry **images = NULL;
+  STRV_FOREACH(s, names)
+    if (image_name_is(n, *s))
+      return true;
+
+  return false;
+}
+
+/* Creates the entry for image_name in the arena, returns 0 if the
+   name of the image is not one of the names in filter. */
+static int
+image_entry_new(struct arena *arena, char *image_name, char **filter,
+		struct image_entry **ret)
+{
+  struct image_name parsed;
+  struct image_entry *e;
+  int r;
+
+  r = image_name_parse(image_name, &parsed);
+  if (r < 0)
+    return r;
+
+  if (filter && !image_name_in(&parsed, filter))
+    return 0;
+
+  e = arena_alloc(arena, sizeof(struct image_entry));
+  if (e == NULL)
+    return -ENOMEM;
+
+  e->name = arena_strndup(arena, parsed.name, parsed.name_len);
+  if (e->name == NULL)
+    return -ENOMEM;
+  e->image_name = image_name;
+  e->version = parsed.version_key;
+
+  *ret = e;
+
+  return 1;
+}
+
+/* Set the values which depend on the meta data of the image */
+static void
+image_entry_finish(struct image_entry *e, const struct host_match *host)
+{
+  if (e->deps == NULL)
+    return;
+
+  if (e->deps->sysext_version_id)
+    version_key(e->deps->sysext_version_id, strlen(e->deps->sysext_version_id),
+		&e->sysext_version);
+
+  if (host)
+    e->compatible = host_match_image(host, e->image_name, e->deps);
+}
+
+/* Resolve the images listed in the SHA256SUMS file sums of url */
+static int
+image_remote_resolve(const char *url, const char *sums, struct image_list *res,
+		     char **filter, bool verify_signature,
+		     const struct host_match *host,
+		     image_ready_t ready, void *userdata)
+{
+  _cleanup_free_ char **list = NULL;
+  _cleanup_free_ char **digests = NULL;
+  _cleanup_(free_manifest_fetches) struct manifest_fetches fetches = {};
+  struct arena *arena;
   size_t n = 0, pos = 0;
   int r;
 
-  assert(url);
-  assert(res);
+  arena = &res->arena;
 
-  r = image_list_from_url(url, &list, verify_signature);
+  r = image_list_parse(sums, arena, &list, &digests);
   if (r < 0)
     return r;
 
+  /* forget about images which got removed or replaced */
+  cache_remote_prune(url, list, digests);
+
   n = strv_length(list);
-  if (n > 0)
+  if (n == 0)
+    return 0;
+
+  res->images = arena_alloc(arena, (n + 1) * sizeof(struct image_entry *));
+  fetches.f = calloc(n, sizeof(struct manifest_fetch));
+  if (res->images == NULL || fetches.f == NULL)
+    return -ENOMEM;
+
+  for (size_t i = 0; i < n; i++)
     {
-      images = calloc((n+1), sizeof(struct image_entry *));
-      if (images == NULL)
-	return -ENOMEM;
+      const struct image_deps *cached;
+      struct image_entry *e = NULL;
 
-      for (size_t i = 0; i < n; i++)
+      r = image_entry_new(arena, list[i], filter, &e);
+      if (r < 0)
+	return r;
+      if (r == 0)
+	continue;
+      e->remote = true;
+      e->digest = digests[i];
+
+      cached = cache_remote_get(url, list[i], digests[i]);
+      res->images[pos++] = e;
+
+      metrics_inc(cached ? METRIC_REMOTE_CACHE_HITS : METRIC_REMOTE_CACHE_MISSES);
+      if (cached)
 	{
-	  _cleanup_free_ char *name = NULL;
-	  char *p;
+	  r = arena_copy_image_deps(arena, cached, &e->deps);
+	  if (r < 0)
+	    return r;
 
-	  name = strdup(list[i]);
-	  if (name == NULL)
-	    return -ENOMEM;
+	  image_entry_finish(e, host);
+	  if (ready)
+	    {
+	      r = ready(e, userdata);
+	      if (r < 0)
+		return r;
+	    }
+	}
+      else
+	fetches.f[fetches.n++] = (struct manifest_fetch) {
+	  .e = e,
+	  .fd = -EBADF,
+	};
+    }
 
-	  /* create "debug-tools" from "debug-tools-23.7.x86-64.raw" */
-	  p = strrchr(name, '.'); /* raw */
-	  if (p)
-	    *p = '\0';
-	  p = strrchr(name, '.'); /* arch */
-	  if (p)
-	    *p = '\0';
-	  p = strrchr(name, '-'); /* version */
-	  if (p)
-	    *p = '\0';
-
-	  if (filter && !streq(name, filter))
-	    continue;
+  res->n = pos;
 
-	  images[pos] = calloc(1, sizeof(struct image_entry));
-	  if (images[pos] == NULL)
-	    return -ENOMEM;
-	  images[pos]->image_name = strdup(list[i]);
-	  if (images[pos]->image_name == NULL)
-	    return -ENOMEM;
-	  images[pos]->name = strdup(name);
-	  if (images[pos]->name == NULL)
-	    return -ENOMEM;
-	  images[pos]->remote = true;
+  if (fetches.n > 0)
+    {
+      log_msg(LOG_DEBUG, "Fetching meta data of %zu of %zu images", fetches.n, pos);
 
-	  r = image_manifest_from_url(url, list[i], &(images[pos]->deps), verify_signature);
-	  if (r == -ENOENT)
-	    r = image_json_from_url(url, list[i], &(images[pos]->deps), verify_signature);
-	  if (r < 0)
-	    log_msg(LOG_INFO, "Meta data for image '%s' not Ok", list[i]);
+      r = image_manifests_from_url(url, fetches.f, fetches.n, verify_signature);
+      if (r < 0)
+	return r;
+    }
+
+  for (size_t i = 0; i < fetches.n; i++)
+    {
+      _cleanup_(free_image_depsp) struct image_deps *deps = TAKE_PTR(fetches.f[i].deps);
+      struct image_entry *e = fetches.f[i].e;
 
-	  if (images[pos]->deps && osrelease)
-	    images[pos]->compatible =
-	      extension_release_validate(images[pos]->image_name,
-					 osrelease, "system",
-					 images[pos]->deps);
+      r = fetches.f[i].result;
+      if (r == -ENOENT)
+	r = image_json_from_url(url, e->image_name, &deps, verify_signature);
+      if (r < 0)
+	log_msg(LOG_INFO, "Meta data for image '%s' not Ok", e->image_name);
+      else if (deps)
+	{
+	  r = cache_remote_put(url, e->image_name, e->digest, deps);
+	  if (r < 0)
+	    return r;
+	  r = arena_copy_image_deps(arena, deps, &e->deps);
+	  if (r < 0)
+	    return r;
+	}
 
-	  pos++;
+      image_entry_finish(e, host);
+      if (ready)
+	{
+	  r = ready(e, userdata);
+	  if (r < 0)
+	    return r;
 	}
     }
 
-  if (nr)
-    *nr = pos;
-  if (images)
-    *res = TAKE_PTR(images);
-
   return 0;
 }
 
+/* All entries, strings and meta data of res are allocated from
+   res->arena, free_image_list() frees them at once.
+   If ready is not NULL, it gets called for every entry once its meta
+   data is complete: for cached images before any manifest got
+   downloaded, for the others after the downloads.
+   If another request resolves url at the same time, this waits for
+   it and uses its SHA256SUMS file and the manifests it cached.
+   If filter is not NULL, only images with one of these names are
+   resolved. */
+int
+image_remote_metadata(const char *url, struct image_list *res,
+		      char **filter, bool verify_signature,
+		      const struct host_match *host,
+		      image_ready_t ready, void *userdata)
+{
+  _cleanup_(unlink_tempfilep) char tmpfn[] = "/tmp/sysext-SHA256SUMS.XXXXXX";
+  _cleanup_close_ int fd = -EBADF;
+  _cleanup_free_ char *key = NULL;
+  struct flight *f;
+  int r;
+
+  assert(url);
+  assert(res);
+
+  fd = mkostemp_safe(tmpfn);
+  if (fd < 0)
+    return fd;
+
+  if (asprintf(&key, "resolve %s", url) < 0)
+    return -ENOMEM;
+
+  r = flight_join(key, &f);
+  if (r < 0)
+    return r;
+  if (r > 0)
+    {
+      r = image_list_download(url, tmpfn, verify_signature);
+      if (r >= 0)
+	r = image_remote_resolve(url, tmpfn, res, filter, verify_signature,
+				 host, ready, userdata);
+      flight_finish(f, r, tmpfn);
+      return r;
+    }
+
+  r = flight_result(f);
+  if (r >= 0)
+    r = flight_copy(f, tmpfn);
+  flight_leave(f);
+
+  /* the other request got cancelled, do it ourself */
+  if (r == -ECANCELED)
+    r = image_list_download(url, tmpfn, verify_signature);
+  if (r < 0)
+    return r;
+
+  return image_remote_resolve(url, tmpfn, res, filter, verify_signature,
+			      host, ready, userdata);
+}
+
+/* See image_remote_metadata() for the memory handling of res */
 int
-image_local_metadata(const char *store, struct image_entry ***res, size_t *nr,
-		     const char *filter, const struct osrelease *osrelease,
+image_local_metadata(const char *store, struct image_list *res,
+		     char **filter, const struct host_match *host,
 		     bool read_metadata)
 {
-  _cleanup_strv_free_ char **list = NULL;
-  _cleanup_(free_image_entry_list) struct image_entry **images = NULL;
+  _cleanup_free_ char **list = NULL;
+  struct arena *arena;
   size_t n = 0, pos = 0;
   int r;
 
-  r = discover_images(store, &list);
+  assert(store);
+  assert(res);
+
+  arena = &res->arena;
+
+  r = discover_images_in(store, arena, &list, true);
   if (r < 0)
     {
       if (r == -ENOENT)
@@ -587,68 +1606,47 @@ image_local_metadata(const char *store, struct image_entry ***res, size_t *nr,
     }
 
   n = strv_length(list);
-  if (n > 0)
-    {
-      images = calloc((n+1), sizeof(struct image_entry *));
-      if (images == NULL)
-	return -ENOMEM;
-
-      for (size_t i = 0; i < n; i++)
-	{
-	  _cleanup_free_ char *name = NULL;
-	  char *p;
+  if (n == 0)
+    return 0;
 
-	  name = strdup(list[i]);
-	  if (name == NULL)
-	    return -ENOMEM;
+  res->images = arena_alloc(arena, (n + 1) * sizeof(struct image_entry *));
+  if (res->images == NULL)
+    return -ENOMEM;
 
-	  /* create "debug-tools" from "debug-tools-23.7.x86-64.raw" */
-	  p = strrchr(name, '.'); /* raw */
-	  if (p)
-	    *p = '\0';
-	  p = strrchr(name, '.'); /* arch */
-	  if (p)
-	    *p = '\0';
-	  p = strrchr(name, '-'); /* version */
-	  if (p)
-	    *p = '\0';
-
-	  if (filter && !streq(name, filter))
-	    continue;
+  for (size_t i = 0; i < n; i++)
+    {
+      struct image_entry *e = NULL;
 
-	  images[pos] = calloc(1, sizeof(struct image_entry));
-	  if (images[pos] == NULL)
-	    return -ENOMEM;
-	  images[pos]->name = strdup(name);
-	  if (images[pos]->name == NULL)
-	    return -ENOMEM;
-	  images[pos]->image_name = strdup(list[i]);
-	  if (images[pos]->image_name == NULL)
-	    return -ENOMEM;
+      r = image_entry_new(arena, list[i], filter, &e);
+      if (r < 0)
+	return r;
+      if (r == 0)
+	continue;
+      e->local = true;
 
-	  images[pos]->local = true;
+      res->images[pos++] = e;
+    }
 
-	  if (read_metadata)
-	    {
-	      r = image_read_metadata(list[i], &(images[pos]->deps));
-	      if (r < 0)
-		return r;
-	    }
+  res->n = pos;
 
-	  if (images[pos]->deps && osrelease)
-	    images[pos]->compatible =
-	      extension_release_validate(images[pos]->image_name,
-					 osrelease, "system",
-					 images[pos]->deps);
+  if (read_metadata)
+    {
+      r = image_prefetch_metadata(res->images, pos);
+      if (r < 0)
+	return r;
+    }
 
-	  pos++;
+  for (size_t i = 0; i < pos; i++)
+    {
+      if (read_metadata)
+	{
+	  r = image_read_metadata(arena, res->images[i]->image_name, &res->images[i]->deps);
+	  if (r < 0)
+	    return r;
 	}
-    }
 
-  if (nr)
-    *nr = pos;
-  if (images)
-    *res = TAKE_PTR(images);
+      image_entry_finish(res->images[i], host);
+    }
 
   return 0;
 }
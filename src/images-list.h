@@ -2,14 +2,26 @@
 
 #pragma once
 
-#include "osrelease.h"
-
-extern int discover_images(const char *path, char ***result);
-extern int image_remote_metadata(const char *url, struct image_entry ***res,
-		size_t *nr, const char *filter, bool verify_signature,
-		const struct osrelease *osrelease);
-extern int image_local_metadata(const char *store, struct image_entry ***res,
-		size_t *nr, const char *filter, const struct osrelease *osrelease,
+#include "image-deps.h"
+#include "host-match.h"
+
+extern void free_image_list(struct image_list *l);
+
+/* called by image_remote_metadata() for every image, as soon as its
+   meta data is known */
+typedef int (*image_ready_t)(struct image_entry *e, void *userdata);
+
+extern int discover_images(const char *path, char ***result, bool sorted);
+extern int image_remote_metadata(const char *url, struct image_list *res,
+		char **filter, bool verify_signature,
+		const struct host_match *host,
+		image_ready_t ready, void *userdata);
+extern int image_local_metadata(const char *store, struct image_list *res,
+		char **filter, const struct host_match *host,
 		bool read_metadata);
 extern int calc_refcount(struct image_entry **list, size_t n);
+extern int store_pin(const char *image_name);
+extern void store_unpin(const char *image_name);
+extern bool store_pinned(const char *image_name) _pure_;
+extern int remove_unused_images(const char *store, char ***ret, uint64_t *ret_freed);
 
@@ -0,0 +1,377 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/* Jobs run Install or Update on a worker thread without a caller
+   waiting for the reply. The event loop keeps the last progress
+   report and the final reply of every job, clients query them with
+   GetJob or follow them with WatchJob. Every job has an eventfd,
+   which gets written to cancel it, either by CancelJob or once the
+   deadline of the job passed. The children of the method get killed
+   then, see process.c. Jobs are only touched by the event loop. */
+
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+
+#include "basics.h"
+#include "log_msg.h"
+#include "worker.h"
+#include "job.h"
+
+/* finished jobs which are kept for GetJob */
+#define JOBS_KEEP_FINISHED 16
+
+enum job_state {
+  JOB_RUNNING,
+  JOB_SUCCEEDED,
+  JOB_FAILED,
+  JOB_CANCELLED,
+  JOB_TIMEOUT,
+};
+
+static const char *const job_state_table[] = {
+  [JOB_RUNNING]   = "running",
+  [JOB_SUCCEEDED] = "succeeded",
+  [JOB_FAILED]    = "failed",
+  [JOB_CANCELLED] = "cancelled",
+  [JOB_TIMEOUT]   = "timeout",
+};
+
+struct job {
+  uint64_t id;
+  char *method;
+  enum job_state state;
+  enum job_state stop_reason;  /* JOB_CANCELLED or JOB_TIMEOUT once stopped */
+  sd_json_variant *progress;   /* last progress report */
+  sd_json_variant *result;     /* final reply */
+  char *error_id;
+  int cancel_fd;
+  sd_event_source *deadline;
+  sd_varlink **watchers;       /* clients of WatchJob */
+  size_t n_watchers;
+};
+
+static struct job **jobs = NULL;
+static size_t n_jobs = 0;
+static uint64_t last_id = 0;
+
+static void
+job_free(struct job *j)
+{
+  if (j == NULL)
+    return;
+
+  for (size_t i = 0; i < j->n_watchers; i++)
+    sd_varlink_unref(j->watchers[i]);
+  free(j->watchers);
+  sd_event_source_disable_unref(j->deadline);
+  if (j->cancel_fd >= 0)
+    close(j->cancel_fd);
+  sd_json_variant_unref(j->progress);
+  sd_json_variant_unref(j->result);
+  free(j->error_id);
+  free(j->method);
+  free(j);
+}
+
+static void
+job_freep(struct job **j)
+{
+  job_free(*j);
+}
+
+struct job *
+job_get(uint64_t id)
+{
+  for (size_t i = 0; i < n_jobs; i++)
+    if (jobs[i]->id == id)
+      return jobs[i];
+
+  return NULL;
+}
+
+/* Drop the oldest finished jobs */
+static void
+jobs_prune(void)
+{
+  size_t n_finished = 0;
+
+  for (size_t i = 0; i < n_jobs; i++)
+    if (jobs[i]->state != JOB_RUNNING)
+      n_finished++;
+
+  for (size_t i = 0; i < n_jobs && n_finished > JOBS_KEEP_FINISHED;)
+    {
+      if (jobs[i]->state == JOB_RUNNING)
+	{
+	  i++;
+	  continue;
+	}
+
+      job_free(jobs[i]);
+      memmove(&jobs[i], &jobs[i + 1], (n_jobs - i - 1) * sizeof(struct job *));
+      n_jobs--;
+      n_finished--;
+    }
+}
+
+int
+job_build_json(const struct job *j, sd_json_variant **ret)
+{
+  const char *method;
+
+  assert(j);
+  assert(ret);
+
+  /* "org.openSUSE.sysextmgr.Install" -> "Install" */
+  method = strrchr(j->method, '.');
+  method = method ? method + 1 : j->method;
+
+  return sd_json_buildo(ret,
+			SD_JSON_BUILD_PAIR_UNSIGNED("Id", j->id),
+			SD_JSON_BUILD_PAIR_STRING("Method", method),
+			SD_JSON_BUILD_PAIR_STRING("State", job_state_table[j->state]),
+			SD_JSON_BUILD_PAIR_CONDITION(!!j->progress, "Progress", SD_JSON_BUILD_VARIANT(j->progress)),
+			SD_JSON_BUILD_PAIR_CONDITION(!!j->result, "Result", SD_JSON_BUILD_VARIANT(j->result)),
+			SD_JSON_BUILD_PAIR_CONDITION(!!j->error_id, "ErrorId", SD_JSON_BUILD_STRING(j->error_id)));
+}
+
+/* Tell all watchers about the new state of the job, the final state
+   ends the WatchJob calls */
+static void
+job_notify_watchers(struct job *j)
+{
+  _cleanup_(sd_json_variant_unrefp) sd_json_variant *v = NULL;
+  size_t n = 0;
+  int r;
+
+  if (j->n_watchers == 0)
+    return;
+
+  r = job_build_json(j, &v);
+  if (r < 0)
+    {
+      log_msg(LOG_ERR, "Failed to build state of job %llu: %s",
+	      (unsigned long long)j->id, strerror(-r));
+      return;
+    }
+
+  for (size_t i = 0; i < j->n_watchers; i++)
+    {
+      if (j->state == JOB_RUNNING)
+	{
+	  r = sd_varlink_notify(j->watchers[i], v);
+	  /* keep the watcher as long as it is connected */
+	  if (r >= 0)
+	    {
+	      j->watchers[n++] = j->watchers[i];
+	      continue;
+	    }
+	}
+      else
+	r = sd_varlink_reply(j->watchers[i], v);
+
+      if (r < 0)
+	log_msg(LOG_DEBUG, "Failed to send state of job %llu: %s",
+		(unsigned long long)j->id, strerror(-r));
+      sd_varlink_unref(j->watchers[i]);
+    }
+  j->n_watchers = n;
+}
+
+static int
+job_reply(sd_varlink *v, sd_json_variant *parameters, const char *error_id,
+	  sd_varlink_reply_flags_t flags, void *userdata)
+{
+  struct job *j = userdata;
+
+  if (!error_id && (flags & SD_VARLINK_REPLY_CONTINUES))
+    {
+      sd_json_variant *progress = sd_json_variant_by_key(parameters, "Progress");
+
+      if (progress)
+	{
+	  sd_json_variant_unref(j->progress);
+	  j->progress = sd_json_variant_ref(progress);
+	  job_notify_watchers(j);
+	}
+      return 0;
+    }
+
+  j->result = sd_json_variant_ref(parameters);
+  if (error_id)
+    {
+      j->error_id = strdup(error_id);
+      /* the method failed because it got stopped */
+      j->state = j->stop_reason != JOB_RUNNING ? j->stop_reason : JOB_FAILED;
+    }
+  else
+    j->state = JOB_SUCCEEDED;
+
+  log_msg(LOG_INFO, "Job %llu (%s) %s", (unsigned long long)j->id,
+	  j->method, job_state_table[j->state]);
+
+  j->deadline = sd_event_source_disable_unref(j->deadline);
+  sd_varlink_set_userdata(v, NULL);
+  sd_varlink_close_unref(v);
+
+  job_notify_watchers(j);
+  jobs_prune();
+
+  return 0;
+}
+
+static int
+job_stop(struct job *j, enum job_state reason)
+{
+  uint64_t one = 1;
+
+  if (j->state != JOB_RUNNING)
+    return -EALREADY;
+
+  if (j->stop_reason == JOB_RUNNING)
+    j->stop_reason = reason;
+
+  if (write(j->cancel_fd, &one, sizeof(one)) < 0)
+    return -errno;
+
+  return 0;
+}
+
+static int
+on_deadline(sd_event_source _unused_(*s), uint64_t _unused_(usec), void *userdata)
+{
+  struct job *j = userdata;
+  int r;
+
+  log_msg(LOG_WARNING, "Job %llu (%s) exceeded its deadline, cancelling it",
+	  (unsigned long long)j->id, j->method);
+
+  r = job_stop(j, JOB_TIMEOUT);
+  if (r < 0 && r != -EALREADY)
+    log_msg(LOG_ERR, "Failed to cancel job %llu: %s",
+	    (unsigned long long)j->id, strerror(-r));
+
+  return 0;
+}
+
+/* Run method with callback as a new job. A timeout_usec of 0 means
+   the job has no deadline. */
+int
+job_start(sd_event *event, uid_t peer_uid, const char *method,
+	  sd_varlink_method_t callback, sd_json_variant *parameters,
+	  uint64_t timeout_usec, uint64_t *ret_id)
+{
+  _cleanup_(job_freep) struct job *j = NULL;
+  struct job **tmp;
+  int r;
+
+  assert(event);
+  assert(method);
+  assert(callback);
+  assert(ret_id);
+
+  j = calloc(1, sizeof(struct job));
+  if (j == NULL)
+    return -ENOMEM;
+  j->state = JOB_RUNNING;
+  j->stop_reason = JOB_RUNNING;
+  j->method = strdup(method);
+  if (j->method == NULL)
+    return -ENOMEM;
+
+  j->cancel_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+  if (j->cancel_fd < 0)
+    return -errno;
+
+  tmp = realloc(jobs, (n_jobs + 1) * sizeof(struct job *));
+  if (tmp == NULL)
+    return -ENOMEM;
+  jobs = tmp;
+
+  if (timeout_usec > 0)
+    {
+      r = sd_event_add_time_relative(event, &j->deadline, CLOCK_MONOTONIC,
+				     timeout_usec, 0, on_deadline, j);
+      if (r < 0)
+	return r;
+    }
+
+  /* with "more" the progress reports of the method are sent */
+  r = worker_start(event, peer_uid, parameters, SD_VARLINK_METHOD_MORE, method,
+		   callback, j->cancel_fd, job_reply, j);
+  if (r < 0)
+    return r;
+
+  j->id = ++last_id;
+  *ret_id = j->id;
+  jobs[n_jobs++] = TAKE_PTR(j);
+
+  log_msg(LOG_INFO, "Job %llu (%s) started", (unsigned long long)*ret_id, method);
+
+  return 0;
+}
+
+int
+job_cancel(struct job *j)
+{
+  assert(j);
+
+  log_msg(LOG_INFO, "Cancelling job %llu (%s)", (unsigned long long)j->id, j->method);
+
+  return job_stop(j, JOB_CANCELLED);
+}
+
+/* Send the current state of the job to link, further states follow
+   until the job finished */
+int
+job_watch(struct job *j, sd_varlink *link)
+{
+  _cleanup_(sd_json_variant_unrefp) sd_json_variant *v = NULL;
+  sd_varlink **tmp;
+  int r;
+
+  assert(j);
+  assert(link);
+
+  r = job_build_json(j, &v);
+  if (r < 0)
+    return r;
+
+  if (j->state != JOB_RUNNING)
+    return sd_varlink_reply(link, v);
+
+  tmp = realloc(j->watchers, (j->n_watchers + 1) * sizeof(sd_varlink *));
+  if (tmp == NULL)
+    return -ENOMEM;
+  j->watchers = tmp;
+
+  r = sd_varlink_notify(link, v);
+  if (r < 0)
+    return r;
+
+  j->watchers[j->n_watchers++] = sd_varlink_ref(link);
+
+  return 0;
+}
+
+/* Called before the daemon exits, so that the workers finish soon */
+void
+job_cancel_all(void)
+{
+  for (size_t i = 0; i < n_jobs; i++)
+    if (jobs[i]->state == JOB_RUNNING)
+      (void) job_stop(jobs[i], JOB_CANCELLED);
+}
+
+void
+job_free_all(void)
+{
+  for (size_t i = 0; i < n_jobs; i++)
+    job_free(jobs[i]);
+  jobs = mfree(jobs);
+  n_jobs = 0;
+}
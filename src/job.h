@@ -0,0 +1,21 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <systemd/sd-event.h>
+#include <systemd/sd-varlink.h>
+
+struct job;
+
+extern int job_start(sd_event *event, uid_t peer_uid, const char *method,
+		     sd_varlink_method_t callback, sd_json_variant *parameters,
+		     uint64_t timeout_usec, uint64_t *ret_id);
+extern struct job *job_get(uint64_t id);
+extern int job_cancel(struct job *j);
+extern int job_watch(struct job *j, sd_varlink *link);
+extern int job_build_json(const struct job *j, sd_json_variant **ret);
+extern void job_cancel_all(void);
+extern void job_free_all(void);
@@ -1,11 +1,13 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <syslog.h>
 #include <systemd/sd-journal.h>
 
 #include "log_msg.h"
+#include "trace.h"
 
 static int log_level = LOG_WARNING;
 static int saved_log_level = LOG_WARNING;
@@ -51,6 +53,19 @@ log_msg(int priority, const char *fmt, ...)
           putchar('\n');
         }
     }
+  else if (trace_request_id() > 0)
+    {
+      char *msg = NULL;
+
+      /* "journalctl REQUEST_ID=" shows the messages of the request */
+      if (vasprintf(&msg, fmt, ap) < 0)
+        msg = NULL;
+      sd_journal_send("MESSAGE=%s", msg ? msg : fmt,
+                      "PRIORITY=%i", priority,
+                      "REQUEST_ID=%llu", (unsigned long long)trace_request_id(),
+                      NULL);
+      free(msg);
+    }
   else
     sd_journal_printv(priority, fmt, ap);
 
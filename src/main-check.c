@@ -4,7 +4,6 @@
 
 #include <getopt.h>
 #include <stdbool.h>
-#include <libsmartcols/libsmartcols.h>
 
 #include "basics.h"
 #include "sysextmgr.h"
@@ -41,9 +40,19 @@ image_data_free(struct image_data *var)
   var->new_name = mfree(var->new_name);
 }
 
-int
-varlink_check(const char *url, const char *prefix)
+/* updates are printed while the replies arrive, incompatible images
+   without update at the end */
+struct check_output {
+  FILE *out;
+  bool any;
+  bool update_available;
+  sd_json_variant *broken;
+};
+
+static int
+check_reply(sd_json_variant *result, const char *error_id, void *userdata)
 {
+  struct check_output *o = userdata;
   _cleanup_(update_free) struct update p = {
     .success = false,
     .error = NULL,
@@ -57,56 +66,8 @@ varlink_check(const char *url, const char *prefix)
     { "BrokenImages", SD_JSON_VARIANT_ARRAY,   sd_json_dispatch_variant, offsetof(struct update, contents_broken), SD_JSON_NULLABLE },
     {}
   };
-  _cleanup_(sd_varlink_unrefp) sd_varlink *link = NULL;
-  _cleanup_(sd_json_variant_unrefp) sd_json_variant *params = NULL;
-  sd_json_variant *result;
-  const char *error_id = NULL;
-  bool update_available = false;
-  bool broken_images = false;
   int r;
-  struct libscols_table *table = NULL;
-  struct libscols_line *line;
-
-  r = connect_to_sysextmgrd(&link, _VARLINK_SYSEXTMGR_SOCKET);
-  if (r < 0)
-    return r;
-
-  if (url)
-    {
-      r = sd_json_variant_merge_objectbo(&params,
-					 SD_JSON_BUILD_PAIR("URL", SD_JSON_BUILD_STRING(url)));
-      if (r < 0)
-        {
-          fprintf(stderr, "Failed to build param list: %s\n", strerror(-r));
-        }
-    }
-  if (prefix)
-    {
-      r = sd_json_variant_merge_objectbo(&params,
-					 SD_JSON_BUILD_PAIR("Prefix", SD_JSON_BUILD_STRING(prefix)));
-      if (r < 0)
-        {
-          fprintf(stderr, "Failed to build param list: %s\n", strerror(-r));
-        }
-    }
 
-  if (arg_verbose)
-    {
-      r = sd_json_variant_merge_objectbo(&params,
-                                         SD_JSON_BUILD_PAIR("Verbose", SD_JSON_BUILD_BOOLEAN(arg_verbose)));
-      if (r < 0)
-        {
-          fprintf(stderr, "Failed to add verbose to parameter list: %s\n", strerror(-r));
-          return r;
-        }
-    }
-
-  r = sd_varlink_call(link, "org.openSUSE.sysextmgr.Check", params, &result, &error_id);
-  if (r < 0)
-    {
-      fprintf(stderr, "Failed to call Check method: %s\n", strerror(-r));
-      return r;
-    }
   /* dispatch before checking error_id, we may need the result for the error
      message */
   r = sd_json_dispatch(result, dispatch_table, SD_JSON_ALLOW_EXTENSIONS, &p);
@@ -129,13 +90,6 @@ varlink_check(const char *url, const char *prefix)
       return -EIO;
     }
 
-  if ((p.contents_update == NULL || sd_json_variant_is_null(p.contents_update)) &&
-       (p.contents_broken == NULL || sd_json_variant_is_null(p.contents_broken)))
-    {
-      printf("No updates found\n");
-      return 0;
-    }
-
   if (p.contents_update != NULL && !sd_json_variant_is_null(p.contents_update) && !sd_json_variant_is_array(p.contents_update))
     {
       fprintf(stderr, "JSON image update data is no array!\n");
@@ -148,7 +102,6 @@ varlink_check(const char *url, const char *prefix)
       return -EINVAL;
     }
 
-  bool header_printed = false;
   for (size_t i = 0; i < sd_json_variant_elements(p.contents_update); i++)
     {
       _cleanup_(image_data_free) struct image_data e =
@@ -176,67 +129,109 @@ varlink_check(const char *url, const char *prefix)
           return r;
         }
 
+      o->any = true;
       if (e.new_name)
-	update_available = true;
+	o->update_available = true;
 
-      if (!arg_quiet)
+      if (!arg_quiet && (e.new_name || arg_verbose))
 	{
-	  if ((e.new_name || arg_verbose) && !header_printed)
+	  if (o->out == NULL)
 	    {
-              /* Initialize the table */
-	      table = scols_new_table();
-	      if (!table)
-                {
-                  fprintf(stderr, "Failed to allocate table\n");
-                  return -EIO;
-                }
-
-              // Define Column Headers
-	      scols_table_new_column(table, "Old image", 0, 0);
-	      scols_table_new_column(table, "New image", 0, 0);
-	      scols_table_set_column_separator(table, " -> ");
-
-	      header_printed = true;
+	      o->out = pager_open();
+	      fprintf(o->out, "Old image -> New image\n");
 	    }
 
-          line = scols_table_new_line(table, NULL);
-	  if (e.new_name)
-            {
-	      scols_line_sprintf(line, 0, "%s", e.old_name);
-	      scols_line_sprintf(line, 1, "%s", e.new_name);
-            }
-	  else if (arg_verbose)
-            {
-	      scols_line_sprintf(line, 0, "%s", e.old_name);
-	      scols_line_sprintf(line, 1, "No compatible newer version found");
-            }
+	  fprintf(o->out, "%s -> %s\n", e.old_name,
+		  e.new_name ? e.new_name : "No compatible newer version found");
+	  fflush(o->out);
 	}
     }
 
-  if (header_printed)
+  for (size_t i = 0; i < sd_json_variant_elements(p.contents_broken); i++)
     {
-      /* Setup Pager and Print */
-      pager(table,"");
+      sd_json_variant *entry = sd_json_variant_by_index(p.contents_broken, i);
+      if (!sd_json_variant_is_object(entry))
+        {
+          fprintf(stderr, "entry is no object!\n");
+          return -EINVAL;
+        }
 
-      scols_unref_table(table);
-      table = NULL;
+      o->any = true;
+      r = sd_json_variant_append_array(&o->broken, entry);
+      if (r < 0)
+	return r;
     }
 
-  if (!arg_quiet && sd_json_variant_elements(p.contents_broken) > 0)
-  {
-    /* Initialize the table */
-    table = scols_new_table();
-    if (!table)
+  return 0;
+}
+
+int
+varlink_check(const char *url, const char *prefix)
+{
+  _cleanup_(sd_varlink_unrefp) sd_varlink *link = NULL;
+  _cleanup_(sd_json_variant_unrefp) sd_json_variant *params = NULL;
+  _cleanup_(sd_json_variant_unrefp) sd_json_variant *broken = NULL;
+  struct check_output o = {
+    .out = NULL,
+    .any = false,
+    .update_available = false,
+    .broken = NULL,
+  };
+  bool broken_images = false;
+  int r;
+
+  r = connect_to_sysextmgrd(&link, _VARLINK_SYSEXTMGR_SOCKET);
+  if (r < 0)
+    return r;
+
+  if (url)
     {
-      fprintf(stderr, "Failed to allocate table\n");
-      return -EIO;
+      r = sd_json_variant_merge_objectbo(&params,
+					 SD_JSON_BUILD_PAIR("URL", SD_JSON_BUILD_STRING(url)));
+      if (r < 0)
+        {
+          fprintf(stderr, "Failed to build param list: %s\n", strerror(-r));
+        }
+    }
+  if (prefix)
+    {
+      r = sd_json_variant_merge_objectbo(&params,
+					 SD_JSON_BUILD_PAIR("Prefix", SD_JSON_BUILD_STRING(prefix)));
+      if (r < 0)
+        {
+          fprintf(stderr, "Failed to build param list: %s\n", strerror(-r));
+        }
+    }
+
+  if (arg_verbose)
+    {
+      r = sd_json_variant_merge_objectbo(&params,
+                                         SD_JSON_BUILD_PAIR("Verbose", SD_JSON_BUILD_BOOLEAN(arg_verbose)));
+      if (r < 0)
+        {
+          fprintf(stderr, "Failed to add verbose to parameter list: %s\n", strerror(-r));
+          return r;
+        }
     }
 
-    // Define Column Headers
-    scols_table_new_column(table, "Incompatible installed images without update:", 0, 0);
-  }
+  /* every installed image comes in its own reply */
+  r = varlink_call_more(link, "org.openSUSE.sysextmgr.Check", params,
+			check_reply, &o);
+  broken = o.broken;
+  if (r < 0)
+    {
+      if (o.out)
+	pager_close(o.out, "");
+      return r;
+    }
 
-  for (size_t i = 0; i < sd_json_variant_elements(p.contents_broken); i++)
+  if (!o.any)
+    {
+      printf("No updates found\n");
+      return 0;
+    }
+
+  for (size_t i = 0; i < sd_json_variant_elements(broken); i++)
     {
       static const sd_json_dispatch_field dispatch_entry_table[] = {
         { "IMAGE_NAME", SD_JSON_VARIANT_STRING, sd_json_dispatch_string, 0, SD_JSON_MANDATORY },
@@ -244,50 +239,43 @@ varlink_check(const char *url, const char *prefix)
       };
       _cleanup_free_ char *image_name = NULL;
 
-      sd_json_variant *entry = sd_json_variant_by_index(p.contents_broken, i);
-      if (!sd_json_variant_is_object(entry))
-        {
-          fprintf(stderr, "entry is no object!\n");
-          return -EINVAL;
-        }
-
-      r = sd_json_dispatch(entry, dispatch_entry_table, SD_JSON_ALLOW_EXTENSIONS, &image_name);
+      r = sd_json_dispatch(sd_json_variant_by_index(broken, i), dispatch_entry_table,
+			   SD_JSON_ALLOW_EXTENSIONS, &image_name);
       if (r < 0)
         {
           fprintf(stderr, "Failed to parse JSON sysext image entry: %s\n", strerror(-r));
+	  if (o.out)
+	    pager_close(o.out, "");
           return r;
         }
 
-      if (image_name)
-	broken_images = true;
+      if (!image_name)
+	continue;
 
-      if (!arg_quiet && image_name)
+      if (!arg_quiet)
         {
-          line = scols_table_new_line(table, NULL);
-          scols_line_sprintf(line, 0, "%s", image_name);
+	  if (o.out == NULL)
+	    o.out = pager_open();
+	  if (!broken_images)
+	    fprintf(o.out, "Incompatible installed images without update:\n");
+	  fprintf(o.out, "%s\n", image_name);
         }
+      broken_images = true;
     }
 
-  if (table)
-    {
-      /* Setup Pager and Print */
-      pager(table,"");
-
-      scols_unref_table(table);
-    }
+  if (o.out)
+    pager_close(o.out, "");
 
   /* no images for the installed version available */
   if (broken_images)
     return -ENOMEDIUM;
 
-  if (!update_available)
+  if (!o.update_available)
     return -ENODATA;
   else
     return 0;
 }
 
-
-
 int
 main_check(int argc, char **argv)
 {
@@ -18,6 +18,7 @@ struct update {
   bool success;
   char *error;
   sd_json_variant *contents_json;
+  uint64_t bytes;
 };
 
 static void
@@ -34,11 +35,13 @@ varlink_cleanup(void)
     .success = false,
     .error = NULL,
     .contents_json = NULL,
+    .bytes = 0,
   };
   static const sd_json_dispatch_field dispatch_table[] = {
     { "Success",    SD_JSON_VARIANT_BOOLEAN, sd_json_dispatch_stdbool, offsetof(struct update, success), 0 },
     { "ErrorMsg",   SD_JSON_VARIANT_STRING,  sd_json_dispatch_string,  offsetof(struct update, error), SD_JSON_NULLABLE },
     { "Images",     SD_JSON_VARIANT_ARRAY,   sd_json_dispatch_variant, offsetof(struct update, contents_json), SD_JSON_NULLABLE },
+    { "Bytes",      _SD_JSON_VARIANT_TYPE_INVALID, sd_json_dispatch_uint64, offsetof(struct update, bytes), 0 },
     {}
   };
   _cleanup_(sd_varlink_unrefp) sd_varlink *link = NULL;
@@ -151,6 +154,8 @@ varlink_cleanup(void)
       pager(table,"");
 
       scols_unref_table(table);
+
+      printf("%llu bytes freed.\n", (unsigned long long)p.bytes);
     }
 
   return 0;
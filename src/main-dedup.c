@@ -0,0 +1,179 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#include "config.h"
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <libsmartcols/libsmartcols.h>
+
+#include "basics.h"
+#include "sysextmgr.h"
+#include "varlink-client.h"
+#include "pager.h"
+#include "strv.h"
+
+static bool arg_verbose = false;
+static bool arg_quiet = false;
+
+struct dedup {
+  bool success;
+  char *error;
+  char **images;
+  uint64_t bytes;
+};
+
+static void
+dedup_free(struct dedup *var)
+{
+  var->error = mfree(var->error);
+  var->images = strv_free(var->images);
+}
+
+static int
+varlink_dedup(void)
+{
+  _cleanup_(dedup_free) struct dedup p = {
+    .success = false,
+    .error = NULL,
+    .images = NULL,
+    .bytes = 0,
+  };
+  static const sd_json_dispatch_field dispatch_table[] = {
+    { "Success",    SD_JSON_VARIANT_BOOLEAN,  sd_json_dispatch_stdbool, offsetof(struct dedup, success), 0 },
+    { "ErrorMsg",   SD_JSON_VARIANT_STRING,   sd_json_dispatch_string,  offsetof(struct dedup, error), SD_JSON_NULLABLE },
+    { "Images",     SD_JSON_VARIANT_ARRAY,    sd_json_dispatch_strv,    offsetof(struct dedup, images), SD_JSON_NULLABLE },
+    { "Bytes",      _SD_JSON_VARIANT_TYPE_INVALID, sd_json_dispatch_uint64, offsetof(struct dedup, bytes), 0 },
+    {}
+  };
+  _cleanup_(sd_varlink_unrefp) sd_varlink *link = NULL;
+  _cleanup_(sd_json_variant_unrefp) sd_json_variant *params = NULL;
+  sd_json_variant *result;
+  const char *error_id = NULL;
+  int r;
+  struct libscols_table *table = NULL;
+  struct libscols_line *line = NULL;
+
+  r = connect_to_sysextmgrd(&link, _VARLINK_SYSEXTMGR_SOCKET);
+  if (r < 0)
+    return r;
+
+  if (arg_verbose)
+    {
+      r = sd_json_variant_merge_objectbo(&params,
+                                         SD_JSON_BUILD_PAIR("Verbose", SD_JSON_BUILD_BOOLEAN(arg_verbose)));
+      if (r < 0)
+        {
+          fprintf(stderr, "Failed to add verbose to parameter list: %s\n", strerror(-r));
+          return r;
+        }
+    }
+
+  r = sd_varlink_call(link, "org.openSUSE.sysextmgr.Dedup", params, &result, &error_id);
+  if (r < 0)
+    {
+      fprintf(stderr, "Failed to call Dedup method: %s\n", strerror(-r));
+      return r;
+    }
+  /* dispatch before checking error_id, we may need the result for the error
+     message */
+  r = sd_json_dispatch(result, dispatch_table, SD_JSON_ALLOW_EXTENSIONS, &p);
+  if (r < 0)
+    {
+      fprintf(stderr, "Failed to parse JSON answer: %s\n", strerror(-r));
+      return r;
+    }
+
+  if (error_id && strlen(error_id) > 0)
+    {
+      const char *error = NULL;
+
+      if (p.error)
+        error = p.error;
+      else
+        error = error_id;
+
+      fprintf(stderr, "Failed to call Dedup method: %s\n", error);
+      return -EIO;
+    }
+
+  if (strv_isempty(p.images))
+    return -ENODATA;
+
+  if (!arg_quiet)
+    {
+      /* Initialize the table */
+      table = scols_new_table();
+      if (!table)
+	{
+	  fprintf(stderr, "Failed to allocate table\n");
+	  return -EIO;
+	}
+
+      scols_table_new_column(table, "Deduplicated sysext images:", 0, 0);
+
+      STRV_FOREACH(image_name, p.images)
+	{
+	  line = scols_table_new_line(table, NULL);
+	  scols_line_sprintf(line, 0, "%s", *image_name);
+	}
+
+      pager(table, "");
+      scols_unref_table(table);
+
+      printf("%llu bytes shared with newer versions.\n", (unsigned long long)p.bytes);
+    }
+
+  return 0;
+}
+
+int
+main_dedup(int argc, char **argv)
+{
+  struct option const longopts[] = {
+    {"verbose", no_argument, NULL, 'v'},
+    {"quiet", no_argument, NULL, 'q'},
+    {NULL, 0, NULL, '\0'}
+  };
+  int c, r;
+
+  while ((c = getopt_long(argc, argv, "qv", longopts, NULL)) != -1)
+    {
+      switch (c)
+        {
+	case 'v':
+	  arg_verbose = true;
+	  break;
+	case 'q':
+	  arg_quiet = true;
+	  break;
+        default:
+          usage(EXIT_FAILURE);
+          break;
+        }
+    }
+
+  if (argc > optind)
+    {
+      fprintf(stderr, "Unexpected argument: %s\n", argv[optind]);
+      usage(EXIT_FAILURE);
+    }
+
+  r = varlink_dedup();
+  if (r < 0 && r != -ENODATA)
+    {
+      if (VARLINK_IS_NOT_RUNNING(r))
+        fprintf(stderr, "sysextmgrd not running!\n");
+      return -r;
+    }
+
+  /* Return ENODATA if nothing got deduplicated and we should not print anything */
+  if (r == -ENODATA)
+    {
+      if (arg_quiet)
+	return ENODATA;
+      else
+	printf("No data shared between sysext images.\n");
+    }
+
+  return EXIT_SUCCESS;
+}
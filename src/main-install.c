@@ -15,34 +15,91 @@ static bool arg_verbose = false;
 struct install {
   bool success;
   char *error;
-  char *installed;
+  sd_json_variant *results;
 };
 
 static void
 install_free (struct install *var)
 {
   var->error = mfree(var->error);
+  var->results = sd_json_variant_unref(var->results);
+}
+
+struct install_result {
+  char *name;
+  char *installed;
+  char *error;
+};
+
+static void
+install_result_free (struct install_result *var)
+{
+  var->name = mfree(var->name);
   var->installed = mfree(var->installed);
+  var->error = mfree(var->error);
 }
 
+/* Print the result of every image, returns -EIO if one of them
+   could not be installed */
+static int
+print_results(sd_json_variant *results)
+{
+  static const sd_json_dispatch_field dispatch_table[] = {
+    { "Name",      SD_JSON_VARIANT_STRING, sd_json_dispatch_string, offsetof(struct install_result, name), SD_JSON_MANDATORY },
+    { "Installed", SD_JSON_VARIANT_STRING, sd_json_dispatch_string, offsetof(struct install_result, installed), SD_JSON_NULLABLE },
+    { "ErrorMsg",  SD_JSON_VARIANT_STRING, sd_json_dispatch_string, offsetof(struct install_result, error), SD_JSON_NULLABLE },
+    {}
+  };
+  int ret = 0;
+  int r;
+
+  for (size_t i = 0; i < sd_json_variant_elements(results); i++)
+    {
+      _cleanup_(install_result_free) struct install_result e = {};
+
+      r = sd_json_dispatch(sd_json_variant_by_index(results, i), dispatch_table,
+			   SD_JSON_ALLOW_EXTENSIONS, &e);
+      if (r < 0)
+	{
+	  fprintf(stderr, "Failed to parse JSON answer: %s\n", strerror(-r));
+	  return r;
+	}
+
+      if (e.installed)
+	{
+	  if (!arg_quiet)
+	    printf("%s\n", e.installed);
+	}
+      else
+	{
+	  fprintf(stderr, "%s: %s\n", e.name, strna(e.error));
+	  ret = -EIO;
+	}
+    }
+
+  return ret;
+}
+
+/* Install all images with one call, the daemon resolves them against
+   the same repository data and downloads them in parallel */
 int
-varlink_install (const char *name, const char *url)
+varlink_install (char **names, const char *url)
 {
   _cleanup_(install_free) struct install p = {
     .success = false,
     .error = NULL,
-    .installed = NULL,
+    .results = NULL,
   };
   static const sd_json_dispatch_field dispatch_table[] = {
     { "Success",   SD_JSON_VARIANT_BOOLEAN, sd_json_dispatch_stdbool, offsetof(struct install, success), 0 },
     { "ErrorMsg",  SD_JSON_VARIANT_STRING,  sd_json_dispatch_string,  offsetof(struct install, error), SD_JSON_NULLABLE },
-    { "Installed", SD_JSON_VARIANT_STRING,  sd_json_dispatch_string,  offsetof(struct install, installed), SD_JSON_NULLABLE },
+    { "Results",   SD_JSON_VARIANT_ARRAY,   sd_json_dispatch_variant, offsetof(struct install, results), SD_JSON_NULLABLE },
     {}
   };
   _cleanup_(sd_varlink_unrefp) sd_varlink *link = NULL;
   _cleanup_(sd_json_variant_unrefp) sd_json_variant *params = NULL;
-  sd_json_variant *result;
-  const char *error_id = NULL;
+  _cleanup_(sd_json_variant_unrefp) sd_json_variant *result = NULL;
+  _cleanup_free_ char *error_id = NULL;
   int r;
 
   r = connect_to_sysextmgrd(&link, _VARLINK_SYSEXTMGR_SOCKET);
@@ -50,7 +107,7 @@ varlink_install (const char *name, const char *url)
     return r;
 
   r = sd_json_buildo(&params,
-		     SD_JSON_BUILD_PAIR("Install", SD_JSON_BUILD_STRING(name)));
+		     SD_JSON_BUILD_PAIR("Names", SD_JSON_BUILD_STRV(names)));
   if (r < 0)
     {
       fprintf(stderr, "Failed to build parameter list: %s\n", strerror(-r));
@@ -78,12 +135,11 @@ varlink_install (const char *name, const char *url)
         }
     }
 
-  r = sd_varlink_call(link, "org.openSUSE.sysextmgr.Install", params, &result, &error_id);
+  /* the progress of the downloads is shown while waiting */
+  r = varlink_call_with_progress(link, "org.openSUSE.sysextmgr.Install", params, arg_quiet,
+				 &result, &error_id);
   if (r < 0)
-    {
-      fprintf(stderr, "Failed to call install method: %s\n", strerror(-r));
-      return r;
-    }
+    return r;
   /* dispatch before checking error_id, we may need the result for the error
      message */
   r = sd_json_dispatch(result, dispatch_table, SD_JSON_ALLOW_EXTENSIONS, &p);
@@ -106,10 +162,7 @@ varlink_install (const char *name, const char *url)
       return -EIO;
     }
 
-  if (!arg_quiet)
-    printf("%s\n", strna(p.installed));
-
-  return 0;
+  return print_results(p.results);
 }
 
 int
@@ -150,15 +203,12 @@ main_install(int argc, char **argv)
     }
 
   printf("Installed:\n");
-  for (int i = optind; i < argc; i++)
+  r = varlink_install(argv + optind, url);
+  if (r < 0)
     {
-      r = varlink_install(argv[i], url);
-      if (r < 0)
-	{
-	  if (VARLINK_IS_NOT_RUNNING(r))
-	    fprintf(stderr, "sysextmgrd not running!\n");
-	  return -r;
-	}
+      if (VARLINK_IS_NOT_RUNNING(r))
+	fprintf(stderr, "sysextmgrd not running!\n");
+      return -r;
     }
 
   printf("Installed imgages are not activated automatically.\n");
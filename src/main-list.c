@@ -4,7 +4,6 @@
 
 #include <getopt.h>
 #include <stdbool.h>
-#include <libsmartcols/libsmartcols.h>
 
 #include "basics.h"
 #include "sysextmgr.h"
@@ -56,71 +55,102 @@ image_data_free (struct image_data *var)
   var->architecture = mfree(var->architecture);
 }
 
-int
-varlink_list_images (const char *url)
+/* rows are printed while the replies arrive */
+struct list_output {
+  FILE *out;
+  size_t n;
+};
+
+static int
+print_image_data(struct list_output *o, sd_json_variant *entry)
 {
-  _cleanup_(list_images_free) struct list_images p = {
-    .success = false,
-    .error = NULL,
-    .contents_json = NULL,
-  };
-  static const sd_json_dispatch_field dispatch_table[] = {
-    { "Success",    SD_JSON_VARIANT_BOOLEAN, sd_json_dispatch_stdbool, offsetof(struct list_images, success), 0 },
-    { "ErrorMsg",   SD_JSON_VARIANT_STRING,  sd_json_dispatch_string,  offsetof(struct list_images, error), SD_JSON_NULLABLE },
-    { "Images",     SD_JSON_VARIANT_ARRAY,   sd_json_dispatch_variant, offsetof(struct list_images, contents_json), SD_JSON_NULLABLE },
+  _cleanup_(image_data_free) struct image_data e =
+    {
+      .name = NULL,
+      .image_name = NULL,
+      .sysext_version_id = NULL,
+      .sysext_scope = NULL,
+      .id = NULL,
+      .sysext_level = NULL,
+      .version_id = NULL,
+      .architecture = NULL,
+      .remote = false,
+      .local = false,
+      .installed = false,
+      .compatible = false,
+      .refcount = 0,
+    };
+  static const sd_json_dispatch_field dispatch_entry_table[] = {
+    { "NAME",              SD_JSON_VARIANT_STRING, sd_json_dispatch_string,   offsetof(struct image_data, name), SD_JSON_MANDATORY },
+    { "IMAGE_NAME",        SD_JSON_VARIANT_STRING, sd_json_dispatch_string,   offsetof(struct image_data, image_name), SD_JSON_MANDATORY },
+    { "SYSEXT_VERSION_ID", SD_JSON_VARIANT_STRING, sd_json_dispatch_string,   offsetof(struct image_data, sysext_version_id), SD_JSON_MANDATORY },
+    { "SYSEXT_SCOPE",      SD_JSON_VARIANT_STRING, sd_json_dispatch_string,   offsetof(struct image_data, sysext_scope), SD_JSON_NULLABLE},
+    { "ID",                SD_JSON_VARIANT_STRING, sd_json_dispatch_string,   offsetof(struct image_data, id), SD_JSON_NULLABLE},
+    { "SYSEXT_LEVEL",      SD_JSON_VARIANT_STRING, sd_json_dispatch_string,   offsetof(struct image_data, sysext_level), SD_JSON_NULLABLE},
+    { "VERSION_ID",        SD_JSON_VARIANT_STRING, sd_json_dispatch_string,   offsetof(struct image_data, version_id), SD_JSON_NULLABLE},
+    { "ARCHITECTURE",      SD_JSON_VARIANT_STRING, sd_json_dispatch_string,   offsetof(struct image_data, architecture), SD_JSON_NULLABLE},
+    { "LOCAL",             SD_JSON_VARIANT_BOOLEAN, sd_json_dispatch_stdbool, offsetof(struct image_data, local), 0},
+    { "REMOTE",            SD_JSON_VARIANT_BOOLEAN, sd_json_dispatch_stdbool, offsetof(struct image_data, remote), 0},
+    { "INSTALLED",         SD_JSON_VARIANT_BOOLEAN, sd_json_dispatch_stdbool, offsetof(struct image_data, installed), 0},
+    { "COMPATIBLE",        SD_JSON_VARIANT_BOOLEAN, sd_json_dispatch_stdbool, offsetof(struct image_data, compatible), 0},
+    { "REFCOUNT",          SD_JSON_VARIANT_INTEGER, sd_json_dispatch_int,     offsetof(struct image_data, refcount), 0},
     {}
   };
-  _cleanup_(sd_varlink_unrefp) sd_varlink *link = NULL;
-  _cleanup_(sd_json_variant_unrefp) sd_json_variant *params = NULL;
-  sd_json_variant *result;
-  const char *error_id = NULL;
+  char refcount[16];
   int r;
-  struct libscols_table *table = NULL;
-  struct libscols_line *line = NULL;
-
-  r = connect_to_sysextmgrd(&link, _VARLINK_SYSEXTMGR_SOCKET);
-  if (r < 0)
-    return r;
 
-  if (url)
+  if (!sd_json_variant_is_object(entry))
     {
-      r = sd_json_buildo(&params,
-			 SD_JSON_BUILD_PAIR("URL", SD_JSON_BUILD_STRING(url)));
-      if (r < 0)
-	{
-	  fprintf(stderr, "Failed to build param list: %s\n", strerror(-r));
-	  return r;
-	}
+      fprintf(stderr, "entry is no object!\n");
+      return -EINVAL;
     }
 
-  if (arg_verbose)
+  r = sd_json_dispatch(entry, dispatch_entry_table, SD_JSON_ALLOW_EXTENSIONS, &e);
+  if (r < 0)
     {
-      r = sd_json_variant_merge_objectbo(&params,
-                                         SD_JSON_BUILD_PAIR("Verbose", SD_JSON_BUILD_BOOLEAN(arg_verbose)));
-      if (r < 0)
-        {
-          fprintf(stderr, "Failed to add verbose to parameter list: %s\n", strerror(-r));
-          return r;
-        }
+      fprintf(stderr, "Failed to parse JSON sysext image entry: %s\n", strerror(-r));
+      return r;
     }
 
-  if (arg_all)
+  /* same columns as the tables of the other commands */
+  if (o->n == 0)
     {
-      r = sd_json_variant_merge_objectbo(&params,
-                                         SD_JSON_BUILD_PAIR("All", SD_JSON_BUILD_BOOLEAN(arg_all)));
-      if (r < 0)
-        {
-          fprintf(stderr, "Failed to add \"all\" to parameter list: %s\n", strerror(-r));
-          return r;
-        }
+      o->out = pager_open();
+      fprintf(o->out, "R | L | I | C |  # | Name\n");
     }
 
-  r = sd_varlink_call(link, "org.openSUSE.sysextmgr.ListImages", params, &result, &error_id);
-  if (r < 0)
-    {
-      fprintf(stderr, "Failed to call ListImages method: %s\n", strerror(-r));
-      return r;
-    }
+  if (e.refcount > 0)
+    snprintf(refcount, sizeof(refcount), "%2d", e.refcount);
+  else
+    strcpy(refcount, " -");
+
+  fprintf(o->out, "%s | %s | %s | %s | %s | %s\n",
+	  e.remote ? "X" : " ", e.local ? "X" : " ",
+	  e.installed ? "X" : " ", e.compatible ? "X" : " ",
+	  refcount, e.image_name);
+  fflush(o->out);
+  o->n++;
+
+  return 0;
+}
+
+static int
+list_images_reply(sd_json_variant *result, const char *error_id, void *userdata)
+{
+  struct list_output *o = userdata;
+  _cleanup_(list_images_free) struct list_images p = {
+    .success = false,
+    .error = NULL,
+    .contents_json = NULL,
+  };
+  static const sd_json_dispatch_field dispatch_table[] = {
+    { "Success",    SD_JSON_VARIANT_BOOLEAN, sd_json_dispatch_stdbool, offsetof(struct list_images, success), 0 },
+    { "ErrorMsg",   SD_JSON_VARIANT_STRING,  sd_json_dispatch_string,  offsetof(struct list_images, error), SD_JSON_NULLABLE },
+    { "Images",     SD_JSON_VARIANT_ARRAY,   sd_json_dispatch_variant, offsetof(struct list_images, contents_json), SD_JSON_NULLABLE },
+    {}
+  };
+  int r;
+
   /* dispatch before checking error_id, we may need the result for the error
      message */
   r = sd_json_dispatch(result, dispatch_table, SD_JSON_ALLOW_EXTENSIONS, &p);
@@ -145,98 +175,84 @@ varlink_list_images (const char *url)
 
   if (p.contents_json == NULL ||
       sd_json_variant_is_null(p.contents_json))
-    {
-      printf("No images found\n");
-      return 0;
-    }
+    return 0;
+
   if (!sd_json_variant_is_array(p.contents_json))
     {
       fprintf(stderr, "JSON 'Data' is no array!\n");
       return -EINVAL;
     }
 
-  /* Initialize the table */
-  table = scols_new_table();
-  if (!table)
+  for (size_t i = 0; i < sd_json_variant_elements(p.contents_json); i++)
     {
-      fprintf(stderr, "Failed to allocate table\n");
-      return -EIO;
+      r = print_image_data(o, sd_json_variant_by_index(p.contents_json, i));
+      if (r < 0)
+	return r;
     }
 
-  // Define Column Headers
-  scols_table_new_column(table, "R", 1.1, 0);
-  scols_table_new_column(table, "L", 1.1, 0);
-  scols_table_new_column(table, "I", 1.1, 0);
-  scols_table_new_column(table, "C", 1.1, 0);
-  scols_table_new_column(table, " #", 2, 0);
-  scols_table_new_column(table, "Name", 0, SCOLS_FL_TRUNC);
-  scols_table_set_column_separator(table, " | ");
+  return 0;
+}
 
-  for (size_t i = 0; i < sd_json_variant_elements(p.contents_json); i++)
+int
+varlink_list_images (const char *url)
+{
+  _cleanup_(sd_varlink_unrefp) sd_varlink *link = NULL;
+  _cleanup_(sd_json_variant_unrefp) sd_json_variant *params = NULL;
+  struct list_output o = {
+    .out = NULL,
+    .n = 0,
+  };
+  int r;
+
+  r = connect_to_sysextmgrd(&link, _VARLINK_SYSEXTMGR_SOCKET);
+  if (r < 0)
+    return r;
+
+  if (url)
     {
-      _cleanup_(image_data_free) struct image_data e =
+      r = sd_json_buildo(&params,
+			 SD_JSON_BUILD_PAIR("URL", SD_JSON_BUILD_STRING(url)));
+      if (r < 0)
 	{
-	  .name = NULL,
-	  .image_name = NULL,
-	  .sysext_version_id = NULL,
-	  .sysext_scope = NULL,
-	  .id = NULL,
-	  .sysext_level = NULL,
-	  .version_id = NULL,
-	  .architecture = NULL,
-	  .remote = false,
-	  .local = false,
-	  .installed = false,
-	  .compatible = false,
-	  .refcount = 0,
-	};
-      static const sd_json_dispatch_field dispatch_entry_table[] = {
-        { "NAME",              SD_JSON_VARIANT_STRING, sd_json_dispatch_string,   offsetof(struct image_data, name), SD_JSON_MANDATORY },
-        { "IMAGE_NAME",        SD_JSON_VARIANT_STRING, sd_json_dispatch_string,   offsetof(struct image_data, image_name), SD_JSON_MANDATORY },
-        { "SYSEXT_VERSION_ID", SD_JSON_VARIANT_STRING, sd_json_dispatch_string,   offsetof(struct image_data, sysext_version_id), SD_JSON_MANDATORY },
-	{ "SYSEXT_SCOPE",      SD_JSON_VARIANT_STRING, sd_json_dispatch_string,   offsetof(struct image_data, sysext_scope), SD_JSON_NULLABLE},
-	{ "ID",                SD_JSON_VARIANT_STRING, sd_json_dispatch_string,   offsetof(struct image_data, id), SD_JSON_NULLABLE},
-	{ "SYSEXT_LEVEL",      SD_JSON_VARIANT_STRING, sd_json_dispatch_string,   offsetof(struct image_data, sysext_level), SD_JSON_NULLABLE},
-	{ "VERSION_ID",        SD_JSON_VARIANT_STRING, sd_json_dispatch_string,   offsetof(struct image_data, version_id), SD_JSON_NULLABLE},
-	{ "ARCHITECTURE",      SD_JSON_VARIANT_STRING, sd_json_dispatch_string,   offsetof(struct image_data, architecture), SD_JSON_NULLABLE},
-	{ "LOCAL",             SD_JSON_VARIANT_BOOLEAN, sd_json_dispatch_stdbool, offsetof(struct image_data, local), 0},
-	{ "REMOTE",            SD_JSON_VARIANT_BOOLEAN, sd_json_dispatch_stdbool, offsetof(struct image_data, remote), 0},
-	{ "INSTALLED",         SD_JSON_VARIANT_BOOLEAN, sd_json_dispatch_stdbool, offsetof(struct image_data, installed), 0},
-	{ "COMPATIBLE",        SD_JSON_VARIANT_BOOLEAN, sd_json_dispatch_stdbool, offsetof(struct image_data, compatible), 0},
-	{ "REFCOUNT",          SD_JSON_VARIANT_INTEGER, sd_json_dispatch_int,     offsetof(struct image_data, refcount), 0},
-        {}
-      };
-
-      sd_json_variant *entry = sd_json_variant_by_index(p.contents_json, i);
-      if (!sd_json_variant_is_object(entry))
+	  fprintf(stderr, "Failed to build param list: %s\n", strerror(-r));
+	  return r;
+	}
+    }
+
+  if (arg_verbose)
+    {
+      r = sd_json_variant_merge_objectbo(&params,
+                                         SD_JSON_BUILD_PAIR("Verbose", SD_JSON_BUILD_BOOLEAN(arg_verbose)));
+      if (r < 0)
         {
-          fprintf(stderr, "entry is no object!\n");
-          return -EINVAL;
+          fprintf(stderr, "Failed to add verbose to parameter list: %s\n", strerror(-r));
+          return r;
         }
+    }
 
-      r = sd_json_dispatch(entry, dispatch_entry_table, SD_JSON_ALLOW_EXTENSIONS, &e);
+  if (arg_all)
+    {
+      r = sd_json_variant_merge_objectbo(&params,
+                                         SD_JSON_BUILD_PAIR("All", SD_JSON_BUILD_BOOLEAN(arg_all)));
       if (r < 0)
         {
-	  fprintf(stderr, "Failed to parse JSON sysext image entry: %s\n", strerror(-r));
+          fprintf(stderr, "Failed to add \"all\" to parameter list: %s\n", strerror(-r));
           return r;
         }
-
-      line = scols_table_new_line(table, NULL);
-      scols_line_sprintf(line, 0, "%s", e.remote ? "X" : " ");
-      scols_line_sprintf(line, 1, "%s", e.local ? "X" : " ");
-      scols_line_sprintf(line, 2, "%s", e.installed ? "X" : " ");
-      scols_line_sprintf(line, 3, "%s", e.compatible ? "X" : " ");
-      if (e.refcount > 0)
-        scols_line_sprintf(line, 4, "%2d", e.refcount);
-      else
-        scols_line_sprintf(line, 4, " -");
-      scols_line_sprintf(line, 5, "%s", e.image_name);
     }
 
-  /* Setup Pager and Print */
-  pager(table, "R = remote, L = local, I = installed, C = commpatible, # = used in snapshots");
+  /* every image comes in its own reply, print it right away */
+  r = varlink_call_more(link, "org.openSUSE.sysextmgr.ListImages", params,
+			list_images_reply, &o);
+
+  if (o.out)
+    pager_close(o.out, "R = remote, L = local, I = installed, C = commpatible, # = used in snapshots");
+
+  if (r < 0)
+    return r;
 
-  scols_unref_table(table);
+  if (o.n == 0)
+    printf("No images found\n");
 
   return 0;
 }
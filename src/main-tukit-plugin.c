@@ -33,7 +33,9 @@ main_tukit_plugin(int argc, char **argv)
 
   printf("Checking for sysext image updates...\n");
 
-  r = varlink_check(NULL, path);
+  /* check and update with one call, so that the available images
+     are only fetched once */
+  r = varlink_update(NULL, path, true);
   if (r < 0)
     {
       /* sysextmgrd not running, do nothing */
@@ -51,15 +53,6 @@ main_tukit_plugin(int argc, char **argv)
       return ENOMEDIUM;
     }
 
-  /* No update available */
-  if (r == -ENODATA)
-    {
-      printf("No updates found\n");
-      return 0;
-    }
-
-  printf("Updating the sysext images, be patient...\n");
-  r = varlink_update(NULL, path);
   if (r < 0)
     return -r;
 
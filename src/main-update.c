@@ -18,6 +18,7 @@ struct update {
   bool success;
   char *error;
   sd_json_variant *contents_json;
+  sd_json_variant *contents_broken;
 };
 
 static void
@@ -25,6 +26,7 @@ update_free (struct update *var)
 {
   var->error = mfree(var->error);
   var->contents_json = sd_json_variant_unref(var->contents_json);
+  var->contents_broken = sd_json_variant_unref(var->contents_broken);
 }
 
 struct image_data {
@@ -39,24 +41,66 @@ image_data_free (struct image_data *var)
   var->new_name = mfree(var->new_name);
 }
 
+/* Print the incompatible images without update, which are reported
+   by Update with "Check" */
+static int
+print_broken_images(sd_json_variant *broken)
+{
+  static const sd_json_dispatch_field dispatch_entry_table[] = {
+    { "IMAGE_NAME", SD_JSON_VARIANT_STRING, sd_json_dispatch_string, 0, SD_JSON_MANDATORY },
+    {}
+  };
+  int r;
+
+  if (!sd_json_variant_is_array(broken))
+    {
+      fprintf(stderr, "JSON broken image data is no array!\n");
+      return -EINVAL;
+    }
+
+  for (size_t i = 0; i < sd_json_variant_elements(broken); i++)
+    {
+      _cleanup_free_ char *image_name = NULL;
+
+      r = sd_json_dispatch(sd_json_variant_by_index(broken, i), dispatch_entry_table,
+			   SD_JSON_ALLOW_EXTENSIONS, &image_name);
+      if (r < 0)
+        {
+          fprintf(stderr, "Failed to parse JSON sysext image entry: %s\n", strerror(-r));
+          return r;
+        }
+
+      if (i == 0)
+	fprintf(stderr, "Incompatible installed images without update:\n");
+      fprintf(stderr, "%s\n", image_name);
+    }
+
+  return 0;
+}
+
+/* With check the plan gets reported like by varlink_check() and
+   nothing gets updated if an installed image is incompatible without
+   update, -ENOMEDIUM is returned then */
 int
-varlink_update (const char *url, const char *prefix)
+varlink_update (const char *url, const char *prefix, bool check)
 {
   _cleanup_(update_free) struct update p = {
     .success = false,
     .error = NULL,
     .contents_json = NULL,
+    .contents_broken = NULL,
   };
   static const sd_json_dispatch_field dispatch_table[] = {
     { "Success",    SD_JSON_VARIANT_BOOLEAN, sd_json_dispatch_stdbool, offsetof(struct update, success), 0 },
     { "ErrorMsg",   SD_JSON_VARIANT_STRING,  sd_json_dispatch_string,  offsetof(struct update, error), SD_JSON_NULLABLE },
     { "Updated",    SD_JSON_VARIANT_ARRAY,   sd_json_dispatch_variant, offsetof(struct update, contents_json), SD_JSON_NULLABLE },
+    { "BrokenImages", SD_JSON_VARIANT_ARRAY, sd_json_dispatch_variant, offsetof(struct update, contents_broken), SD_JSON_NULLABLE },
     {}
   };
   _cleanup_(sd_varlink_unrefp) sd_varlink *link = NULL;
   _cleanup_(sd_json_variant_unrefp) sd_json_variant *params = NULL;
-  sd_json_variant *result;
-  const char *error_id = NULL;
+  _cleanup_(sd_json_variant_unrefp) sd_json_variant *result = NULL;
+  _cleanup_free_ char *error_id = NULL;
   int r;
   struct libscols_table *table = NULL;
   struct libscols_line *line = NULL;
@@ -97,12 +141,22 @@ varlink_update (const char *url, const char *prefix)
         }
     }
 
-  r = sd_varlink_call(link, "org.openSUSE.sysextmgr.Update", params, &result, &error_id);
-  if (r < 0)
+  if (check)
     {
-      fprintf(stderr, "Failed to call Update method: %s\n", strerror(-r));
-      return r;
+      r = sd_json_variant_merge_objectbo(&params,
+                                         SD_JSON_BUILD_PAIR("Check", SD_JSON_BUILD_BOOLEAN(true)));
+      if (r < 0)
+        {
+          fprintf(stderr, "Failed to add check to parameter list: %s\n", strerror(-r));
+          return r;
+        }
     }
+
+  /* the progress of the download is shown while waiting */
+  r = varlink_call_with_progress(link, "org.openSUSE.sysextmgr.Update", params, arg_quiet,
+				 &result, &error_id);
+  if (r < 0)
+    return r;
   /* dispatch before checking error_id, we may need the result for the error
      message */
   r = sd_json_dispatch(result, dispatch_table, SD_JSON_ALLOW_EXTENSIONS, &p);
@@ -125,6 +179,18 @@ varlink_update (const char *url, const char *prefix)
       return -EIO;
     }
 
+  if (p.contents_broken != NULL && !sd_json_variant_is_null(p.contents_broken) &&
+      sd_json_variant_elements(p.contents_broken) > 0)
+    {
+      if (!arg_quiet)
+	{
+	  r = print_broken_images(p.contents_broken);
+	  if (r < 0)
+	    return r;
+	}
+      return -ENOMEDIUM;
+    }
+
   if (p.contents_json == NULL || sd_json_variant_is_null(p.contents_json))
     {
       printf("No updates found\n");
@@ -240,7 +306,7 @@ main_update(int argc, char **argv)
       usage(EXIT_FAILURE);
     }
 
-  r = varlink_update(url, prefix);
+  r = varlink_update(url, prefix, false);
   if (r < 0)
     {
       if (VARLINK_IS_NOT_RUNNING(r))
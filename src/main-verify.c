@@ -0,0 +1,237 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#include "config.h"
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <libsmartcols/libsmartcols.h>
+
+#include "basics.h"
+#include "sysextmgr.h"
+#include "varlink-client.h"
+#include "pager.h"
+
+static bool arg_verbose = false;
+static bool arg_quiet = false;
+
+struct verify {
+  bool success;
+  char *error;
+  sd_json_variant *contents_json;
+  uint64_t bytes;
+};
+
+static void
+verify_free(struct verify *var)
+{
+  var->error = mfree(var->error);
+  var->contents_json = sd_json_variant_unref(var->contents_json);
+}
+
+struct verified_image {
+  char *image_name;
+  char *status;
+};
+
+static void
+verified_image_free(struct verified_image *var)
+{
+  var->image_name = mfree(var->image_name);
+  var->status = mfree(var->status);
+}
+
+/* Returns -EBADMSG if an image is corrupted */
+static int
+varlink_verify(void)
+{
+  _cleanup_(verify_free) struct verify p = {
+    .success = false,
+    .error = NULL,
+    .contents_json = NULL,
+    .bytes = 0,
+  };
+  static const sd_json_dispatch_field dispatch_table[] = {
+    { "Success",    SD_JSON_VARIANT_BOOLEAN, sd_json_dispatch_stdbool, offsetof(struct verify, success), 0 },
+    { "ErrorMsg",   SD_JSON_VARIANT_STRING,  sd_json_dispatch_string,  offsetof(struct verify, error), SD_JSON_NULLABLE },
+    { "Images",     SD_JSON_VARIANT_ARRAY,   sd_json_dispatch_variant, offsetof(struct verify, contents_json), SD_JSON_NULLABLE },
+    { "Bytes",      _SD_JSON_VARIANT_TYPE_INVALID, sd_json_dispatch_uint64, offsetof(struct verify, bytes), 0 },
+    {}
+  };
+  _cleanup_(sd_varlink_unrefp) sd_varlink *link = NULL;
+  _cleanup_(sd_json_variant_unrefp) sd_json_variant *params = NULL;
+  sd_json_variant *result;
+  const char *error_id = NULL;
+  size_t n_corrupted = 0;
+  int r;
+  struct libscols_table *table = NULL;
+  struct libscols_line *line = NULL;
+
+  r = connect_to_sysextmgrd(&link, _VARLINK_SYSEXTMGR_SOCKET);
+  if (r < 0)
+    return r;
+
+  if (arg_verbose)
+    {
+      r = sd_json_variant_merge_objectbo(&params,
+                                         SD_JSON_BUILD_PAIR("Verbose", SD_JSON_BUILD_BOOLEAN(arg_verbose)));
+      if (r < 0)
+        {
+          fprintf(stderr, "Failed to add verbose to parameter list: %s\n", strerror(-r));
+          return r;
+        }
+    }
+
+  r = sd_varlink_call(link, "org.openSUSE.sysextmgr.Verify", params, &result, &error_id);
+  if (r < 0)
+    {
+      fprintf(stderr, "Failed to call Verify method: %s\n", strerror(-r));
+      return r;
+    }
+  /* dispatch before checking error_id, we may need the result for the error
+     message */
+  r = sd_json_dispatch(result, dispatch_table, SD_JSON_ALLOW_EXTENSIONS, &p);
+  if (r < 0)
+    {
+      fprintf(stderr, "Failed to parse JSON answer: %s\n", strerror(-r));
+      return r;
+    }
+
+  if (error_id && strlen(error_id) > 0)
+    {
+      const char *error = NULL;
+
+      if (p.error)
+        error = p.error;
+      else
+        error = error_id;
+
+      fprintf(stderr, "Failed to call Verify method: %s\n", error);
+      return -EIO;
+    }
+
+  if (p.contents_json == NULL || sd_json_variant_is_null(p.contents_json))
+    return -ENODATA;
+
+  if (!sd_json_variant_is_array(p.contents_json))
+    {
+      fprintf(stderr, "JSON data 'Images' is no array!\n");
+      return -EINVAL;
+    }
+
+  if (!arg_quiet)
+    {
+      table = scols_new_table();
+      if (!table)
+	{
+	  fprintf(stderr, "Failed to allocate table\n");
+	  return -EIO;
+	}
+
+      scols_table_new_column(table, "IMAGE", 0, 0);
+      scols_table_new_column(table, "STATUS", 0, 0);
+    }
+
+  for (size_t i = 0; i < sd_json_variant_elements(p.contents_json); i++)
+    {
+      static const sd_json_dispatch_field dispatch_entry_table[] = {
+        { "IMAGE_NAME", SD_JSON_VARIANT_STRING, sd_json_dispatch_string, offsetof(struct verified_image, image_name), SD_JSON_MANDATORY },
+        { "STATUS",     SD_JSON_VARIANT_STRING, sd_json_dispatch_string, offsetof(struct verified_image, status), SD_JSON_MANDATORY },
+        {}
+      };
+      _cleanup_(verified_image_free) struct verified_image e = {};
+
+      sd_json_variant *entry = sd_json_variant_by_index(p.contents_json, i);
+      if (!sd_json_variant_is_object(entry))
+        {
+          fprintf(stderr, "entry is no object!\n");
+	  if (table)
+	    scols_unref_table(table);
+          return -EINVAL;
+        }
+
+      r = sd_json_dispatch(entry, dispatch_entry_table, SD_JSON_ALLOW_EXTENSIONS, &e);
+      if (r < 0)
+        {
+          fprintf(stderr, "Failed to parse JSON (image): %s\n", strerror(-r));
+	  if (table)
+	    scols_unref_table(table);
+          return r;
+        }
+
+      if (streq(e.status, "corrupted"))
+	n_corrupted++;
+
+      if (table)
+	{
+          line = scols_table_new_line(table, NULL);
+          scols_line_sprintf(line, 0, "%s", e.image_name);
+          scols_line_sprintf(line, 1, "%s", e.status);
+	}
+    }
+
+  if (table)
+    {
+      pager(table, "");
+      scols_unref_table(table);
+
+      if (arg_verbose)
+	printf("%llu bytes read.\n", (unsigned long long)p.bytes);
+    }
+
+  if (n_corrupted > 0)
+    return -EBADMSG;
+
+  return 0;
+}
+
+int
+main_verify(int argc, char **argv)
+{
+  struct option const longopts[] = {
+    {"verbose", no_argument, NULL, 'v'},
+    {"quiet", no_argument, NULL, 'q'},
+    {NULL, 0, NULL, '\0'}
+  };
+  int c, r;
+
+  while ((c = getopt_long(argc, argv, "qv", longopts, NULL)) != -1)
+    {
+      switch (c)
+        {
+	case 'v':
+	  arg_verbose = true;
+	  break;
+	case 'q':
+	  arg_quiet = true;
+	  break;
+        default:
+          usage(EXIT_FAILURE);
+          break;
+        }
+    }
+
+  if (argc > optind)
+    {
+      fprintf(stderr, "Unexpected argument: %s\n", argv[optind]);
+      usage(EXIT_FAILURE);
+    }
+
+  r = varlink_verify();
+  if (r == -EBADMSG)
+    {
+      if (!arg_quiet)
+	fprintf(stderr, "Corrupted sysext images found!\n");
+      return EBADMSG;
+    }
+  if (r < 0 && r != -ENODATA)
+    {
+      if (VARLINK_IS_NOT_RUNNING(r))
+        fprintf(stderr, "sysextmgrd not running!\n");
+      return -r;
+    }
+
+  if (r == -ENODATA && !arg_quiet)
+    printf("No sysext images found.\n");
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,360 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/* Counters and latency histograms of the daemon, returned by
+   GetMetrics and written as textfile for the textfile collector of
+   the Prometheus node_exporter. Counters are updated atomically from
+   every thread, the histograms are protected by a mutex. Everything
+   is cumulative since the daemon started. */
+
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "basics.h"
+#include "tmpfile-util.h"
+#include "metrics.h"
+#include "trace.h"
+
+/* upper bounds of the histogram buckets in usec, the last bucket
+   is +Inf */
+static const uint64_t bucket_bounds[] = {
+  10 * USEC_PER_MSEC, 50 * USEC_PER_MSEC, 100 * USEC_PER_MSEC,
+  250 * USEC_PER_MSEC, 500 * USEC_PER_MSEC, 1 * USEC_PER_SEC,
+  2500 * USEC_PER_MSEC, 5 * USEC_PER_SEC, 10 * USEC_PER_SEC,
+  30 * USEC_PER_SEC, 60 * USEC_PER_SEC, 120 * USEC_PER_SEC,
+  300 * USEC_PER_SEC,
+};
+
+#define N_BOUNDS (sizeof(bucket_bounds) / sizeof(bucket_bounds[0]))
+#define N_BUCKETS (N_BOUNDS + 1)
+
+struct histogram {
+  uint64_t buckets[N_BUCKETS];  /* not cumulative */
+  uint64_t count;
+  uint64_t sum;                 /* usec */
+};
+
+struct method_histogram {
+  char *name;
+  struct histogram h;
+};
+
+/* name in GetMetrics, family and label in the textfile */
+static const struct {
+  const char *name;
+  const char *family;
+  const char *label;
+  const char *help;
+} counter_table[_METRIC_MAX] = {
+  [METRIC_DOWNLOADS_SHA256SUMS]  = { "downloads_sha256sums", "downloads_total", "type=\"sha256sums\"",
+				     "Files downloaded by type" },
+  [METRIC_DOWNLOADS_MANIFEST]    = { "downloads_manifest", "downloads_total", "type=\"manifest\"", NULL },
+  [METRIC_DOWNLOADS_IMAGE]       = { "downloads_image", "downloads_total", "type=\"image\"", NULL },
+  [METRIC_DOWNLOADS_FAILED]      = { "downloads_failed", "downloads_failed_total", NULL,
+				     "Downloads which failed" },
+  [METRIC_DOWNLOAD_BYTES]        = { "download_bytes", "download_bytes_total", NULL,
+				     "Bytes downloaded" },
+  [METRIC_COALESCED]             = { "coalesced", "coalesced_total", NULL,
+				     "Requests which used the result of a running request" },
+  [METRIC_METADATA_CACHE_HITS]   = { "metadata_cache_hits", "metadata_cache_total", "result=\"hit\"",
+				     "Lookups of the meta data of images in the store" },
+  [METRIC_METADATA_CACHE_MISSES] = { "metadata_cache_misses", "metadata_cache_total", "result=\"miss\"", NULL },
+  [METRIC_REMOTE_CACHE_HITS]     = { "remote_cache_hits", "remote_cache_total", "result=\"hit\"",
+				     "Lookups of the meta data of remote images" },
+  [METRIC_REMOTE_CACHE_MISSES]   = { "remote_cache_misses", "remote_cache_total", "result=\"miss\"", NULL },
+  [METRIC_DISSECT]               = { "dissect", "dissect_total", NULL,
+				     "Invocations of systemd-dissect" },
+  [METRIC_REFCOUNT_SCANS]        = { "refcount_scans", "refcount_scans_total", NULL,
+				     "Calculations of the refcounts of images" },
+  [METRIC_SNAPSHOTS_SCANNED]     = { "snapshots_scanned", "snapshots_scanned_total", NULL,
+				     "Snapshots scanned for references to images" },
+};
+
+static const char *const phase_table[_PHASE_MAX] = {
+  [PHASE_SHA256SUMS] = "sha256sums",
+  [PHASE_MANIFESTS]  = "manifests",
+  [PHASE_IMAGE]      = "image",
+  [PHASE_DISSECT]    = "dissect",
+  [PHASE_REFCOUNT]   = "refcount",
+  [PHASE_JSON]       = "json",
+};
+
+static uint64_t counters[_METRIC_MAX];
+
+static pthread_mutex_t metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct histogram phases[_PHASE_MAX];
+static struct method_histogram *methods = NULL;
+static size_t n_methods = 0;
+
+uint64_t
+metrics_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * USEC_PER_SEC + (uint64_t)ts.tv_nsec / NSEC_PER_USEC;
+}
+
+void
+metrics_add(enum metric m, uint64_t n)
+{
+  assert(m < _METRIC_MAX);
+
+  __atomic_fetch_add(&counters[m], n, __ATOMIC_RELAXED);
+}
+
+void
+metrics_inc(enum metric m)
+{
+  metrics_add(m, 1);
+}
+
+/* metrics_mutex must be held */
+static void
+histogram_observe(struct histogram *h, uint64_t start, uint64_t stop)
+{
+  uint64_t usec = stop > start ? stop - start : 0;
+  size_t i;
+
+  for (i = 0; i < N_BOUNDS; i++)
+    if (usec <= bucket_bounds[i])
+      break;
+
+  h->buckets[i]++;
+  h->count++;
+  h->sum += usec;
+}
+
+/* Record a phase from start to stop and add it to the trace of the
+   request */
+void
+metrics_phase_observe(enum metric_phase p, uint64_t start, uint64_t stop)
+{
+  assert(p < _PHASE_MAX);
+
+  pthread_mutex_lock(&metrics_mutex);
+  histogram_observe(&phases[p], start, stop);
+  pthread_mutex_unlock(&metrics_mutex);
+
+  trace_phase(phase_table[p], start, stop);
+}
+
+/* Record the duration of a phase, which began at start */
+void
+metrics_phase_done(enum metric_phase p, uint64_t start)
+{
+  metrics_phase_observe(p, start, metrics_now());
+}
+
+/* Record the duration of a varlink method, which got called at start */
+int
+metrics_method_done(const char *method, uint64_t start)
+{
+  struct method_histogram *tmp;
+  const char *name;
+  size_t i;
+  int r = 0;
+
+  assert(method);
+
+  /* "org.openSUSE.sysextmgr.Update" -> "Update" */
+  name = strrchr(method, '.');
+  name = name ? name + 1 : method;
+
+  pthread_mutex_lock(&metrics_mutex);
+
+  for (i = 0; i < n_methods; i++)
+    if (streq(methods[i].name, name))
+      break;
+
+  if (i == n_methods)
+    {
+      tmp = realloc(methods, (n_methods + 1) * sizeof(struct method_histogram));
+      if (tmp == NULL)
+	{
+	  r = -ENOMEM;
+	  goto out;
+	}
+      methods = tmp;
+      methods[i] = (struct method_histogram) {
+	.name = strdup(name),
+      };
+      if (methods[i].name == NULL)
+	{
+	  r = -ENOMEM;
+	  goto out;
+	}
+      n_methods++;
+    }
+
+  histogram_observe(&methods[i].h, start, metrics_now());
+
+ out:
+  pthread_mutex_unlock(&metrics_mutex);
+  return r;
+}
+
+/* metrics_mutex must be held */
+static int
+histogram_append_json(sd_json_variant **array, const char *kind, const char *name,
+		      const struct histogram *h)
+{
+  _cleanup_(sd_json_variant_unrefp) sd_json_variant *buckets = NULL;
+  uint64_t cumulative = 0;
+  int r;
+
+  /* +Inf is the same as Count */
+  for (size_t i = 0; i < N_BOUNDS; i++)
+    {
+      cumulative += h->buckets[i];
+      r = sd_json_variant_append_arraybo(&buckets,
+					 SD_JSON_BUILD_PAIR_UNSIGNED("LeUsec", bucket_bounds[i]),
+					 SD_JSON_BUILD_PAIR_UNSIGNED("Count", cumulative));
+      if (r < 0)
+	return r;
+    }
+
+  return sd_json_variant_append_arraybo(array,
+					SD_JSON_BUILD_PAIR_STRING("Kind", kind),
+					SD_JSON_BUILD_PAIR_STRING("Name", name),
+					SD_JSON_BUILD_PAIR_UNSIGNED("Count", h->count),
+					SD_JSON_BUILD_PAIR_UNSIGNED("SumUsec", h->sum),
+					SD_JSON_BUILD_PAIR_VARIANT("Buckets", buckets));
+}
+
+/* The reply of GetMetrics without "Success" */
+int
+metrics_build_json(sd_json_variant **ret)
+{
+  _cleanup_(sd_json_variant_unrefp) sd_json_variant *counter_array = NULL;
+  _cleanup_(sd_json_variant_unrefp) sd_json_variant *histograms = NULL;
+  int r = 0;
+
+  assert(ret);
+
+  for (size_t i = 0; i < _METRIC_MAX; i++)
+    {
+      r = sd_json_variant_append_arraybo(&counter_array,
+					 SD_JSON_BUILD_PAIR_STRING("Name", counter_table[i].name),
+					 SD_JSON_BUILD_PAIR_UNSIGNED("Value",
+								     __atomic_load_n(&counters[i], __ATOMIC_RELAXED)));
+      if (r < 0)
+	return r;
+    }
+
+  pthread_mutex_lock(&metrics_mutex);
+  for (size_t i = 0; i < n_methods && r >= 0; i++)
+    r = histogram_append_json(&histograms, "method", methods[i].name, &methods[i].h);
+  for (size_t i = 0; i < _PHASE_MAX && r >= 0; i++)
+    r = histogram_append_json(&histograms, "phase", phase_table[i], &phases[i]);
+  pthread_mutex_unlock(&metrics_mutex);
+  if (r < 0)
+    return r;
+
+  return sd_json_buildo(ret,
+			SD_JSON_BUILD_PAIR_VARIANT("Counters", counter_array),
+			SD_JSON_BUILD_PAIR_VARIANT("Histograms", histograms));
+}
+
+/* metrics_mutex must be held */
+static void
+histogram_write(FILE *fp, const char *family, const char *label, const char *value,
+		const struct histogram *h)
+{
+  uint64_t cumulative = 0;
+
+  for (size_t i = 0; i < N_BOUNDS; i++)
+    {
+      cumulative += h->buckets[i];
+      fprintf(fp, "sysextmgrd_%s_bucket{%s=\"%s\",le=\"%g\"} %llu\n", family, label, value,
+	      (double)bucket_bounds[i] / USEC_PER_SEC, (unsigned long long)cumulative);
+    }
+  fprintf(fp, "sysextmgrd_%s_bucket{%s=\"%s\",le=\"+Inf\"} %llu\n", family, label, value,
+	  (unsigned long long)h->count);
+  fprintf(fp, "sysextmgrd_%s_sum{%s=\"%s\"} %.6f\n", family, label, value,
+	  (double)h->sum / USEC_PER_SEC);
+  fprintf(fp, "sysextmgrd_%s_count{%s=\"%s\"} %llu\n", family, label, value,
+	  (unsigned long long)h->count);
+}
+
+static void
+metrics_write(FILE *fp)
+{
+  for (size_t i = 0; i < _METRIC_MAX; i++)
+    {
+      /* metrics of one family follow each other, the first has the help */
+      if (counter_table[i].help)
+	{
+	  fprintf(fp, "# HELP sysextmgrd_%s %s\n", counter_table[i].family, counter_table[i].help);
+	  fprintf(fp, "# TYPE sysextmgrd_%s counter\n", counter_table[i].family);
+	}
+      fprintf(fp, "sysextmgrd_%s%s%s%s %llu\n", counter_table[i].family,
+	      counter_table[i].label ? "{" : "", strempty(counter_table[i].label),
+	      counter_table[i].label ? "}" : "",
+	      (unsigned long long)__atomic_load_n(&counters[i], __ATOMIC_RELAXED));
+    }
+
+  pthread_mutex_lock(&metrics_mutex);
+
+  fprintf(fp, "# HELP sysextmgrd_method_duration_seconds Duration of varlink methods\n");
+  fprintf(fp, "# TYPE sysextmgrd_method_duration_seconds histogram\n");
+  for (size_t i = 0; i < n_methods; i++)
+    histogram_write(fp, "method_duration_seconds", "method", methods[i].name, &methods[i].h);
+
+  fprintf(fp, "# HELP sysextmgrd_phase_duration_seconds Duration of downloads and extractions\n");
+  fprintf(fp, "# TYPE sysextmgrd_phase_duration_seconds histogram\n");
+  for (size_t i = 0; i < _PHASE_MAX; i++)
+    histogram_write(fp, "phase_duration_seconds", "phase", phase_table[i], &phases[i]);
+
+  pthread_mutex_unlock(&metrics_mutex);
+}
+
+/* Write the metrics atomically to path in the text format of
+   Prometheus, which the textfile collector of node_exporter reads */
+int
+metrics_write_textfile(const char *path)
+{
+  _cleanup_free_ char *tmpfn = NULL;
+  _cleanup_fclose_ FILE *fp = NULL;
+  int fd, r = 0;
+
+  assert(path);
+
+  if (asprintf(&tmpfn, "%s.XXXXXX", path) < 0)
+    return -ENOMEM;
+
+  fd = mkostemp_safe(tmpfn);
+  if (fd < 0)
+    return fd;
+
+  fp = fdopen(fd, "w");
+  if (fp == NULL)
+    {
+      r = -errno;
+      close(fd);
+      unlink(tmpfn);
+      return r;
+    }
+
+  /* mkostemp() creates the file with 0600 */
+  (void) fchmod(fd, 0644);
+
+  metrics_write(fp);
+
+  if (fflush(fp) != 0)
+    r = -errno;
+  if (r >= 0 && rename(tmpfn, path) < 0)
+    r = -errno;
+  if (r < 0)
+    unlink(tmpfn);
+
+  return r;
+}
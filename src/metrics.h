@@ -0,0 +1,43 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+
+#pragma once
+
+#include <stdint.h>
+
+#include <systemd/sd-json.h>
+
+enum metric {
+  METRIC_DOWNLOADS_SHA256SUMS,
+  METRIC_DOWNLOADS_MANIFEST,
+  METRIC_DOWNLOADS_IMAGE,
+  METRIC_DOWNLOADS_FAILED,
+  METRIC_DOWNLOAD_BYTES,
+  METRIC_COALESCED,             /* requests which used the result of another one */
+  METRIC_METADATA_CACHE_HITS,
+  METRIC_METADATA_CACHE_MISSES,
+  METRIC_REMOTE_CACHE_HITS,
+  METRIC_REMOTE_CACHE_MISSES,
+  METRIC_DISSECT,               /* systemd-dissect started */
+  METRIC_REFCOUNT_SCANS,
+  METRIC_SNAPSHOTS_SCANNED,
+  _METRIC_MAX,
+};
+
+enum metric_phase {
+  PHASE_SHA256SUMS,             /* download of SHA256SUMS */
+  PHASE_MANIFESTS,              /* download of the manifests of an URL */
+  PHASE_IMAGE,                  /* download of images */
+  PHASE_DISSECT,                /* extraction of extension-release files */
+  PHASE_REFCOUNT,               /* calculation of the refcounts */
+  PHASE_JSON,                   /* building the reply of ListImages */
+  _PHASE_MAX,
+};
+
+extern uint64_t metrics_now(void);
+extern void metrics_add(enum metric m, uint64_t n);
+extern void metrics_inc(enum metric m);
+extern void metrics_phase_observe(enum metric_phase p, uint64_t start, uint64_t stop);
+extern void metrics_phase_done(enum metric_phase p, uint64_t start);
+extern int metrics_method_done(const char *method, uint64_t start);
+extern int metrics_build_json(sd_json_variant **ret);
+extern int metrics_write_textfile(const char *path);
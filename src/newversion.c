@@ -7,12 +7,16 @@
 #include "basics.h"
 #include "image-deps.h"
 #include "images-list.h"
+#include "image-index.h"
+#include "image-name.h"
 #include "sysextmgr.h"
 
 static int
 check_if_newer(struct image_entry *old, struct image_entry *new,
 	       struct image_entry **update)
 {
+  int r;
+
   assert(update);
 
   /* new image is not compatible */
@@ -40,17 +44,21 @@ check_if_newer(struct image_entry *old, struct image_entry *new,
 	(*update)->installed = new->installed;
       if (new->compatible)
 	(*update)->compatible = new->compatible;
+      if (new->digest && (*update)->digest == NULL)
+	{
+	  (*update)->digest = strdup(new->digest);
+	  if ((*update)->digest == NULL)
+	    return -ENOMEM;
+	}
     }
   /* old->deps->sysext_version_id is not set if this is image is not installed */
   else if (old->deps->sysext_version_id == NULL ||
-	   strverscmp(old->deps->sysext_version_id,
-		      new->deps->sysext_version_id) < 0)
+	   image_sysext_version_cmp(old, new) < 0)
     {
       /* don't update with older version */
       if (*update)
 	{
-	  if (strverscmp((*update)->deps->sysext_version_id,
-			 new->deps->sysext_version_id) >= 0)
+	  if (image_sysext_version_cmp(*update, new) >= 0)
 	    return 0;
 	  free_image_entryp(update);
 	}
@@ -60,32 +68,72 @@ check_if_newer(struct image_entry *old, struct image_entry *new,
 	return -ENOMEM;
       (*update)->name = strdup(new->name);
       (*update)->image_name = strdup(new->image_name);
-      (*update)->deps = TAKE_PTR(new->deps);
+      if ((*update)->name == NULL || (*update)->image_name == NULL)
+	return -ENOMEM;
+      if (new->digest)
+	{
+	  (*update)->digest = strdup(new->digest);
+	  if ((*update)->digest == NULL)
+	    return -ENOMEM;
+	}
+      /* new stays in the index and can be checked again */
+      r = dup_image_deps(new->deps, &(*update)->deps);
+      if (r < 0)
+	return r;
       (*update)->local = new->local;
       (*update)->remote = new->remote;
       (*update)->installed = new->installed;
       (*update)->compatible = new->compatible;
       (*update)->refcount = new->refcount;
+      (*update)->version = new->version;
+      (*update)->sysext_version = new->sysext_version;
     }
 
   return 0;
 }
 
+void
+free_available_images(struct available_images *a)
+{
+  if (!a)
+    return;
+
+  free_image_indexp(&a->remote_index);
+  free_image_indexp(&a->local_index);
+  free_image_list(&a->remote);
+  free_image_list(&a->local);
+}
+
+void
+free_available_imagesp(struct available_images **a)
+{
+  if (!a || !*a)
+    return;
+
+  free_available_images(*a);
+  *a = mfree(*a);
+}
+
+/* Collect all remote images and all images in the store, optionally
+   only the ones with a name in filter, and index them by name. */
 int
-get_latest_version(struct image_entry *curr, struct image_entry **new,
-		   const char *url, bool verify_signature,
-		   const struct osrelease *osrelease)
+load_available_images(const char *url, char **filter,
+		      bool verify_signature, const struct host_match *host,
+		      struct available_images **ret)
 {
-  _cleanup_(free_image_entryp) struct image_entry *update = NULL;
-  _cleanup_(free_image_entry_list) struct image_entry **images_remote = NULL;
-  _cleanup_(free_image_entry_list) struct image_entry **images_local = NULL;
-  size_t n_remote = 0, n_local = 0;
+  _cleanup_(free_available_imagesp) struct available_images *a = NULL;
   int r;
 
+  assert(ret);
+
+  a = calloc(1, sizeof(struct available_images));
+  if (a == NULL)
+    return -ENOMEM;
+
   if (url)
     {
-      r = image_remote_metadata(url, &images_remote, &n_remote, curr->name,
-				verify_signature, osrelease);
+      r = image_remote_metadata(url, &a->remote, filter,
+				verify_signature, host, NULL, NULL);
       if (r < 0)
 	{
 	  fprintf(stderr, "Fetching image data from '%s' failed: %s\n",
@@ -94,9 +142,50 @@ get_latest_version(struct image_entry *curr, struct image_entry **new,
 	}
     }
 
-  for (size_t i = 0; i < n_remote; i++)
+  r = image_local_metadata(config.sysext_store_dir, &a->local, filter, host, true);
+  if (r < 0)
     {
-      r = check_if_newer(curr, images_remote[i], &update);
+      fprintf(stderr, "Searching for images in '%s' failed: %s\n",
+	      config.sysext_store_dir, strerror(-r));
+      return r;
+    }
+
+  r = image_index_new(a->remote.n, &a->remote_index);
+  if (r < 0)
+    return r;
+  r = image_index_add_list(a->remote_index, a->remote.images, a->remote.n);
+  if (r < 0)
+    return r;
+
+  r = image_index_new(a->local.n, &a->local_index);
+  if (r < 0)
+    return r;
+  r = image_index_add_list(a->local_index, a->local.images, a->local.n);
+  if (r < 0)
+    return r;
+
+  *ret = TAKE_PTR(a);
+
+  return 0;
+}
+
+/* Search the newest compatible version of curr, only the images
+   with the same name are looked at. */
+int
+find_latest_version(struct image_entry *curr, const struct available_images *a,
+		    struct image_entry **new)
+{
+  _cleanup_(free_image_entryp) struct image_entry *update = NULL;
+  struct image_entry *e;
+  int r;
+
+  assert(curr);
+  assert(a);
+  assert(new);
+
+  IMAGE_INDEX_FOREACH_NAME(e, a->remote_index, curr->name)
+    {
+      r = check_if_newer(curr, e, &update);
       if (r < 0)
 	{
 	  fprintf(stderr, "Image check failed: %s\n", strerror(-r));
@@ -105,17 +194,9 @@ get_latest_version(struct image_entry *curr, struct image_entry **new,
     }
 
   /* now do the same with local images */
-  r = image_local_metadata(SYSEXT_STORE_DIR, &images_local, &n_local, curr->name, osrelease, true);
-  if (r < 0)
+  IMAGE_INDEX_FOREACH_NAME(e, a->local_index, curr->name)
     {
-      fprintf(stderr, "Searching for images in '%s' failed: %s\n",
-	      SYSEXT_STORE_DIR, strerror(-r));
-      return r;
-    }
-
-  for (size_t i = 0; i < n_local; i++)
-    {
-      r = check_if_newer(curr, images_local[i], &update);
+      r = check_if_newer(curr, e, &update);
       if (r < 0)
 	{
 	  fprintf(stderr, "Image check failed: %s\n", strerror(-r));
@@ -128,3 +209,19 @@ get_latest_version(struct image_entry *curr, struct image_entry **new,
 
   return 0;
 }
+
+int
+get_latest_version(struct image_entry *curr, struct image_entry **new,
+		   const char *url, bool verify_signature,
+		   const struct host_match *host)
+{
+  _cleanup_(free_available_imagesp) struct available_images *a = NULL;
+  char *filter[] = { curr->name, NULL };
+  int r;
+
+  r = load_available_images(url, filter, verify_signature, host, &a);
+  if (r < 0)
+    return r;
+
+  return find_latest_version(curr, a, new);
+}
@@ -0,0 +1,310 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/* Runs child processes like systemd-pull and systemd-dissect in
+   parallel. Every child gets a pidfd, which is watched by a child
+   event source of a private event loop. process_batch_wait() runs
+   the loop until all children exited, the state lock is suspended
+   meanwhile, so that other requests can run. A cancelled job makes
+   the cancel fd of its thread readable, the batch stops waiting then
+   and kills its children once it gets freed. */
+
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include <systemd/sd-event.h>
+
+#include "basics.h"
+#include "log_msg.h"
+#include "state-lock.h"
+#include "process.h"
+
+extern char **environ;
+
+/* readable once the method running on this thread got cancelled */
+static __thread int cancel_fd = -EBADF;
+
+struct process_batch {
+  sd_event *event;
+  size_t n_running;
+  size_t max_running;
+  sd_event_source *tick_source;
+  sd_event_source *cancel_source;
+  bool cancelled;
+  uint64_t tick_interval;
+  process_tick_t tick;
+  void *tick_userdata;
+};
+
+struct process {
+  struct process_batch *batch;
+  int *ret_status;
+};
+
+void
+process_set_cancel_fd(int fd)
+{
+  cancel_fd = fd;
+}
+
+bool
+process_cancelled(void)
+{
+  struct pollfd pfd = {
+    .fd = cancel_fd,
+    .events = POLLIN,
+  };
+
+  if (cancel_fd < 0)
+    return false;
+
+  return poll(&pfd, 1, 0) > 0;
+}
+
+static int
+on_cancel(sd_event_source *s, int _unused_(fd), uint32_t _unused_(revents), void *userdata)
+{
+  struct process_batch *b = userdata;
+
+  b->cancelled = true;
+
+  return sd_event_source_set_enabled(s, SD_EVENT_OFF);
+}
+
+int
+process_batch_new(size_t max_running, struct process_batch **ret)
+{
+  _cleanup_(process_batch_freep) struct process_batch *b = NULL;
+  sigset_t mask;
+  int r;
+
+  assert(ret);
+
+  /* sd-event only watches children if SIGCHLD is blocked, the
+     children get an empty signal mask again */
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  r = pthread_sigmask(SIG_BLOCK, &mask, NULL);
+  if (r != 0)
+    return -r;
+
+  b = calloc(1, sizeof(struct process_batch));
+  if (b == NULL)
+    return -ENOMEM;
+  b->max_running = max_running > 0 ? max_running : 1;
+
+  r = sd_event_new(&b->event);
+  if (r < 0)
+    return r;
+
+  if (cancel_fd >= 0)
+    {
+      r = sd_event_add_io(b->event, &b->cancel_source, cancel_fd, EPOLLIN, on_cancel, b);
+      if (r < 0)
+	return r;
+    }
+
+  *ret = TAKE_PTR(b);
+
+  return 0;
+}
+
+/* Kills and reaps all children which are still running */
+struct process_batch *
+process_batch_free(struct process_batch *b)
+{
+  if (b == NULL)
+    return NULL;
+
+  sd_event_source_disable_unref(b->tick_source);
+  sd_event_source_disable_unref(b->cancel_source);
+  sd_event_unref(b->event);
+  free(b);
+
+  return NULL;
+}
+
+void
+process_batch_freep(struct process_batch **b)
+{
+  *b = process_batch_free(*b);
+}
+
+static int
+on_child_exit(sd_event_source *s, const siginfo_t *si, void *userdata)
+{
+  struct process *p = userdata;
+
+  /* the same value waitpid() would have returned */
+  if (si->si_code == CLD_EXITED)
+    *p->ret_status = W_EXITCODE(si->si_status, 0);
+  else
+    *p->ret_status = (si->si_status & 0x7f) | (si->si_code == CLD_DUMPED ? WCOREFLAG : 0);
+
+  p->batch->n_running--;
+
+  return sd_event_source_set_enabled(s, SD_EVENT_OFF);
+}
+
+static int
+on_tick(sd_event_source *s, uint64_t _unused_(usec), void *userdata)
+{
+  struct process_batch *b = userdata;
+  int r;
+
+  r = b->tick(b->tick_userdata);
+  if (r < 0)
+    log_msg(LOG_DEBUG, "Progress callback failed: %s", strerror(-r));
+
+  r = sd_event_source_set_time_relative(s, b->tick_interval);
+  if (r < 0)
+    return r;
+
+  return sd_event_source_set_enabled(s, SD_EVENT_ONESHOT);
+}
+
+/* Call tick every interval_usec while waiting for the children */
+int
+process_batch_set_tick(struct process_batch *b, uint64_t interval_usec,
+		       process_tick_t tick, void *userdata)
+{
+  assert(b);
+  assert(tick);
+
+  b->tick_source = sd_event_source_disable_unref(b->tick_source);
+  b->tick_interval = interval_usec;
+  b->tick = tick;
+  b->tick_userdata = userdata;
+
+  return sd_event_add_time_relative(b->event, &b->tick_source, CLOCK_MONOTONIC,
+				    interval_usec, interval_usec / 10, on_tick, b);
+}
+
+static int
+run_until(struct process_batch *b, size_t max_running)
+{
+  bool suspended;
+  int r = 0;
+
+  if (b->n_running <= max_running)
+    return 0;
+
+  suspended = state_suspend();
+  while (b->n_running > max_running && r >= 0 && !b->cancelled)
+    r = sd_event_run(b->event, UINT64_MAX);
+  state_resume(suspended);
+
+  if (r < 0)
+    return r;
+
+  return b->cancelled ? -ECANCELED : 0;
+}
+
+/* Start path with argv. If stdout_fd is not negative, it becomes
+   stdout of the child. The wait status gets stored in ret_status
+   once the child exited. If max_running children are already
+   running, this waits until one of them exited. */
+int
+process_batch_spawn(struct process_batch *b, const char *path,
+		    const char *const argv[], int stdout_fd, int *ret_status)
+{
+  _cleanup_free_ struct process *p = NULL;
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  sd_event_source *s = NULL;
+  sigset_t mask;
+  int pidfd;
+  pid_t pid;
+  int r;
+
+  assert(b);
+  assert(path);
+  assert(argv);
+  assert(ret_status);
+
+  if (b->cancelled || process_cancelled())
+    return -ECANCELED;
+
+  r = run_until(b, b->max_running - 1);
+  if (r < 0)
+    return r;
+
+  p = calloc(1, sizeof(struct process));
+  if (p == NULL)
+    return -ENOMEM;
+  p->batch = b;
+  p->ret_status = ret_status;
+
+  posix_spawn_file_actions_init(&actions);
+  posix_spawnattr_init(&attr);
+
+  sigemptyset(&mask);
+  r = posix_spawnattr_setsigmask(&attr, &mask);
+  if (r == 0)
+    r = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+  if (r == 0 && stdout_fd >= 0)
+    r = posix_spawn_file_actions_adddup2(&actions, stdout_fd, STDOUT_FILENO);
+  if (r == 0)
+    r = posix_spawn(&pid, path, &actions, &attr, (char *const *)argv, environ);
+
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+
+  if (r != 0)
+    {
+      log_msg(LOG_ERR, "Cannot start %s: %s", path, strerror(r));
+      return -r;
+    }
+
+  /* the child is not reaped before we watch it, so the pid cannot
+     be reused in between */
+  pidfd = syscall(SYS_pidfd_open, pid, 0);
+  if (pidfd < 0)
+    {
+      r = -errno;
+      kill(pid, SIGKILL);
+      (void) waitpid(pid, NULL, 0);
+      return r;
+    }
+
+  r = sd_event_add_child_pidfd(b->event, &s, pidfd, WEXITED, on_child_exit, p);
+  if (r < 0)
+    {
+      close(pidfd);
+      kill(pid, SIGKILL);
+      (void) waitpid(pid, NULL, 0);
+      return r;
+    }
+
+  /* the source owns pidfd and p, kills the child if the batch gets
+     freed before it exited and is freed together with the batch */
+  (void) sd_event_source_set_child_pidfd_own(s, true);
+  (void) sd_event_source_set_child_process_own(s, true);
+  (void) sd_event_source_set_destroy_callback(s, free);
+  TAKE_PTR(p);
+  r = sd_event_source_set_floating(s, true);
+  sd_event_source_unref(s);
+  if (r < 0)
+    return r;
+
+  b->n_running++;
+
+  return 0;
+}
+
+/* Wait until all children of the batch exited. Returns -ECANCELED
+   if the job got cancelled meanwhile. */
+int
+process_batch_wait(struct process_batch *b)
+{
+  assert(b);
+
+  return run_until(b, 0);
+}
@@ -0,0 +1,26 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* children started at once by the meta data functions */
+#define PROCESS_MAX_RUNNING 8
+
+struct process_batch;
+
+/* called periodically while process_batch_wait() waits */
+typedef int (*process_tick_t)(void *userdata);
+
+extern void process_set_cancel_fd(int fd);
+extern bool process_cancelled(void);
+extern int process_batch_new(size_t max_running, struct process_batch **ret);
+extern struct process_batch *process_batch_free(struct process_batch *b);
+extern void process_batch_freep(struct process_batch **b);
+extern int process_batch_spawn(struct process_batch *b, const char *path,
+			       const char *const argv[], int stdout_fd, int *ret_status);
+extern int process_batch_set_tick(struct process_batch *b, uint64_t interval_usec,
+				  process_tick_t tick, void *userdata);
+extern int process_batch_wait(struct process_batch *b);
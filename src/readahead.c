@@ -0,0 +1,443 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/* Page cache warming for the images systemd-sysext merges at boot.
+   Merging reads the partition table, the superblocks and the inode
+   and directory tables of every image, which is slow on rotating
+   disks if done cold and in random order. Where these parts are
+   located gets recorded when an image is downloaded. Early at boot
+   "sysextmgrd --readahead" asks the kernel to read them for all
+   images linked in the extensions directory, which is the one of the
+   default snapshot at that time. */
+
+#include "config.h"
+
+#include <assert.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "basics.h"
+#include "sysextmgr.h"
+#include "readahead.h"
+#include "images-list.h"
+#include "image-name.h"
+#include "download.h"
+#include "tmpfile-util.h"
+#include "log_msg.h"
+#include "strv.h"
+
+#define READAHEAD_FILE ".readahead"
+
+/* Read for partitions with unknown content: the superblock of
+   most filesystems and the top levels of a verity hash tree */
+#define READAHEAD_HEAD_SIZE (1024 * 1024)
+
+#define SQUASHFS_MAGIC 0x73717368
+#define SQUASHFS_SUPERBLOCK_SIZE 96
+
+#define GPT_SIGNATURE "EFI PART"
+#define GPT_HEADER_SIZE 92
+#define GPT_MAX_ENTRIES 1024
+
+struct readahead_range {
+  char *image_name;
+  uint64_t offset;
+  uint64_t length;
+};
+
+struct range_list {
+  struct readahead_range *ranges;
+  size_t n;
+};
+
+static void
+free_range_list(struct range_list *l)
+{
+  for (size_t i = 0; i < l->n; i++)
+    free(l->ranges[i].image_name);
+  l->ranges = mfree(l->ranges);
+  l->n = 0;
+}
+
+static int
+range_list_add(struct range_list *l, const char *image_name,
+	       uint64_t offset, uint64_t length)
+{
+  struct readahead_range *tmp;
+  char *name;
+
+  if (length == 0)
+    return 0;
+
+  name = strdup(image_name);
+  if (name == NULL)
+    return -ENOMEM;
+
+  tmp = realloc(l->ranges, (l->n + 1) * sizeof(struct readahead_range));
+  if (tmp == NULL)
+    {
+      free(name);
+      return -ENOMEM;
+    }
+  l->ranges = tmp;
+  l->ranges[l->n++] = (struct readahead_range) {
+    .image_name = name,
+    .offset = offset,
+    .length = length,
+  };
+
+  return 0;
+}
+
+static int
+pread_full(int fd, void *buf, size_t size, uint64_t offset)
+{
+  ssize_t n;
+
+  n = pread(fd, buf, size, offset);
+  if (n < 0)
+    return -errno;
+  if ((size_t)n != size)
+    return -EIO;
+
+  return 0;
+}
+
+static uint32_t
+get_le32(const uint8_t *p)
+{
+  uint32_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return le32toh(v);
+}
+
+static uint64_t
+get_le64(const uint8_t *p)
+{
+  uint64_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return le64toh(v);
+}
+
+/* squashfs keeps all metadata (inode, directory, fragment, id and
+   xattr tables) between inode_table_start and bytes_used. */
+static int
+filesystem_ranges(int fd, const char *image_name, uint64_t offset,
+		  uint64_t size, struct range_list *l)
+{
+  uint8_t sb[SQUASHFS_SUPERBLOCK_SIZE];
+  int r;
+
+  if (size >= sizeof(sb))
+    {
+      r = pread_full(fd, sb, sizeof(sb), offset);
+      if (r < 0)
+	return r;
+
+      if (get_le32(sb) == SQUASHFS_MAGIC)
+	{
+	  uint64_t bytes_used = get_le64(sb + 40);
+	  uint64_t inode_table_start = get_le64(sb + 64);
+
+	  if (inode_table_start < bytes_used && bytes_used <= size)
+	    {
+	      /* superblock and compressor options */
+	      r = range_list_add(l, image_name, offset, size < 4096 ? size : 4096);
+	      if (r < 0)
+		return r;
+	      return range_list_add(l, image_name, offset + inode_table_start,
+				    bytes_used - inode_table_start);
+	    }
+	}
+    }
+
+  return range_list_add(l, image_name, offset,
+			size < READAHEAD_HEAD_SIZE ? size : READAHEAD_HEAD_SIZE);
+}
+
+static int
+gpt_ranges(int fd, const char *image_name, uint64_t size, uint64_t sector,
+	   const uint8_t *header, struct range_list *l)
+{
+  _cleanup_free_ uint8_t *entries = NULL;
+  uint64_t entries_offset = get_le64(header + 72) * sector;
+  uint32_t n_entries = get_le32(header + 80);
+  uint32_t entry_size = get_le32(header + 84);
+  size_t entries_size;
+  int r;
+
+  if (entry_size < 128 || entry_size > 4096 || n_entries > GPT_MAX_ENTRIES)
+    return -EBADMSG;
+  entries_size = (size_t)n_entries * entry_size;
+  if (entries_offset + entries_size > size)
+    return -EBADMSG;
+
+  /* protective MBR, header and partition table */
+  r = range_list_add(l, image_name, 0, entries_offset + entries_size);
+  if (r < 0)
+    return r;
+
+  entries = malloc(entries_size);
+  if (entries == NULL)
+    return -ENOMEM;
+
+  r = pread_full(fd, entries, entries_size, entries_offset);
+  if (r < 0)
+    return r;
+
+  for (uint32_t i = 0; i < n_entries; i++)
+    {
+      static const uint8_t unused[16] = {};
+      const uint8_t *e = entries + (size_t)i * entry_size;
+      uint64_t first_lba = get_le64(e + 32);
+      uint64_t last_lba = get_le64(e + 40);
+
+      if (memcmp(e, unused, sizeof(unused)) == 0)
+	continue;
+      if (last_lba < first_lba || (last_lba + 1) * sector > size)
+	continue;
+
+      r = filesystem_ranges(fd, image_name, first_lba * sector,
+			    (last_lba - first_lba + 1) * sector, l);
+      if (r < 0)
+	return r;
+    }
+
+  return 0;
+}
+
+/* Images are either a GPT disk image with the filesystem, verity
+   and signature partitions, or a plain filesystem. */
+static int
+image_ranges(int fd, const char *image_name, struct range_list *l)
+{
+  static const uint64_t sector_sizes[] = { 512, 4096 };
+  struct stat st;
+  int r;
+
+  if (fstat(fd, &st) < 0)
+    return -errno;
+  if (!S_ISREG(st.st_mode))
+    return -EBADFD;
+
+  for (size_t i = 0; i < sizeof(sector_sizes) / sizeof(sector_sizes[0]); i++)
+    {
+      uint8_t header[GPT_HEADER_SIZE];
+
+      if ((uint64_t)st.st_size < sector_sizes[i] + sizeof(header))
+	break;
+
+      r = pread_full(fd, header, sizeof(header), sector_sizes[i]);
+      if (r < 0)
+	return r;
+
+      if (memcmp(header, GPT_SIGNATURE, strlen(GPT_SIGNATURE)) == 0)
+	return gpt_ranges(fd, image_name, st.st_size, sector_sizes[i], header, l);
+    }
+
+  return filesystem_ranges(fd, image_name, 0, st.st_size, l);
+}
+
+/* Read the recorded ranges, lines in the format
+   "<image> <offset> <length>". A missing file is no error. */
+static int
+read_ranges(int store_fd, struct range_list *l)
+{
+  _cleanup_fclose_ FILE *fp = NULL;
+  _cleanup_free_ char *line = NULL;
+  size_t size = 0;
+  int fd, r;
+
+  fd = openat(store_fd, READAHEAD_FILE, O_RDONLY|O_CLOEXEC);
+  if (fd < 0)
+    return errno == ENOENT ? 0 : -errno;
+
+  fp = fdopen(fd, "r");
+  if (fp == NULL)
+    {
+      r = -errno;
+      close(fd);
+      return r;
+    }
+
+  while (getline(&line, &size, fp) > 0)
+    {
+      _cleanup_free_ char *name = NULL;
+      uint64_t offset, length;
+
+      if (sscanf(line, "%ms %" SCNu64 " %" SCNu64, &name, &offset, &length) != 3 ||
+	  image_name_suffix(name) == NULL)
+	continue;
+
+      r = range_list_add(l, name, offset, length);
+      if (r < 0)
+	return r;
+    }
+
+  return 0;
+}
+
+/* Record the parts of an image which get read while merging it. Entries
+   of images which don't exist anymore are removed. */
+int
+readahead_record(const char *store, const char *image_name)
+{
+  _cleanup_(free_range_list) struct range_list l = {};
+  _cleanup_(unlink_tempfilep) char tmpfn[PATH_MAX] = "";
+  _cleanup_free_ char *fn = NULL;
+  _cleanup_close_ int store_fd = -EBADF;
+  _cleanup_close_ int image_fd = -EBADF;
+  _cleanup_fclose_ FILE *fp = NULL;
+  int fd, r;
+
+  assert(store);
+  assert(image_name);
+
+  store_fd = open(store, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+  if (store_fd < 0)
+    return -errno;
+
+  r = read_ranges(store_fd, &l);
+  if (r < 0)
+    return r;
+
+  r = join_path(store, READAHEAD_FILE, &fn);
+  if (r < 0)
+    return r;
+  r = snprintf(tmpfn, sizeof(tmpfn), "%s/" READAHEAD_FILE ".XXXXXX", store);
+  if (r < 0 || (size_t)r >= sizeof(tmpfn))
+    return -ENAMETOOLONG;
+
+  fd = mkostemp_safe(tmpfn);
+  if (fd < 0)
+    return fd;
+  fp = fdopen(fd, "w");
+  if (fp == NULL)
+    {
+      r = -errno;
+      close(fd);
+      return r;
+    }
+  (void) fchmod(fd, 0644);
+
+  for (size_t i = 0; i < l.n; i++)
+    {
+      if (streq(l.ranges[i].image_name, image_name) ||
+	  faccessat(store_fd, l.ranges[i].image_name, F_OK, AT_SYMLINK_NOFOLLOW) < 0)
+	continue;
+      fprintf(fp, "%s %" PRIu64 " %" PRIu64 "\n", l.ranges[i].image_name,
+	      l.ranges[i].offset, l.ranges[i].length);
+    }
+
+  free_range_list(&l);
+
+  image_fd = openat(store_fd, image_name, O_RDONLY|O_CLOEXEC);
+  if (image_fd < 0)
+    return -errno;
+
+  r = image_ranges(image_fd, image_name, &l);
+  if (r < 0)
+    return r;
+
+  for (size_t i = 0; i < l.n; i++)
+    fprintf(fp, "%s %" PRIu64 " %" PRIu64 "\n", image_name,
+	    l.ranges[i].offset, l.ranges[i].length);
+
+  if (fflush(fp) != 0 || fsync(fileno(fp)) < 0)
+    return -errno;
+
+  if (rename(tmpfn, fn) < 0)
+    return -errno;
+
+  return 0;
+}
+
+/* Start reading the recorded parts of all images linked in
+   extensions_dir into the page cache. Images without recorded
+   ranges get analyzed now. The number of bytes requested is
+   returned in ret_bytes. */
+int
+readahead_images(const char *store, const char *extensions_dir, uint64_t *ret_bytes)
+{
+  _cleanup_(free_range_list) struct range_list recorded = {};
+  _cleanup_strv_free_ char **images = NULL;
+  _cleanup_close_ int store_fd = -EBADF;
+  uint64_t bytes = 0;
+  int r;
+
+  assert(store);
+  assert(extensions_dir);
+
+  r = discover_images(extensions_dir, &images, false);
+  if (r < 0)
+    return r;
+
+  if (strv_isempty(images))
+    {
+      if (ret_bytes)
+	*ret_bytes = 0;
+      return 0;
+    }
+
+  store_fd = open(store, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+  if (store_fd < 0)
+    return -errno;
+
+  r = read_ranges(store_fd, &recorded);
+  if (r < 0)
+    return r;
+
+  STRV_FOREACH(image, images)
+    {
+      _cleanup_(free_range_list) struct range_list computed = {};
+      _cleanup_close_ int fd = -EBADF;
+      const struct range_list *l = &recorded;
+      bool found = false;
+      struct stat st;
+
+      fd = openat(store_fd, *image, O_RDONLY|O_CLOEXEC);
+      if (fd < 0 || fstat(fd, &st) < 0)
+	{
+	  log_msg(LOG_DEBUG, "Cannot open '%s': %m", *image);
+	  continue;
+	}
+
+      for (size_t i = 0; i < recorded.n && !found; i++)
+	found = streq(recorded.ranges[i].image_name, *image);
+
+      if (!found)
+	{
+	  r = image_ranges(fd, *image, &computed);
+	  if (r < 0)
+	    {
+	      log_msg(LOG_DEBUG, "Cannot analyze '%s': %s", *image, strerror(-r));
+	      continue;
+	    }
+	  l = &computed;
+	}
+
+      for (size_t i = 0; i < l->n; i++)
+	{
+	  const struct readahead_range *ra = &l->ranges[i];
+
+	  if (!streq(ra->image_name, *image) ||
+	      ra->offset + ra->length > (uint64_t)st.st_size)
+	    continue;
+
+	  r = posix_fadvise(fd, ra->offset, ra->length, POSIX_FADV_WILLNEED);
+	  if (r != 0)
+	    return -r;
+	  bytes += ra->length;
+	}
+    }
+
+  if (ret_bytes)
+    *ret_bytes = bytes;
+
+  return 0;
+}
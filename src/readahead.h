@@ -0,0 +1,8 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+
+#pragma once
+
+#include <stdint.h>
+
+extern int readahead_record(const char *store, const char *image_name);
+extern int readahead_images(const char *store, const char *extensions_dir, uint64_t *ret_bytes);
@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/* The caches, the store and the extension directories are shared by
+   all requests. Requests running on worker threads hold the state
+   lock, so only one of them touches the shared state at a time. While
+   waiting for something which does not need the shared state, like a
+   download, the lock gets suspended and other requests can run. */
+
+#include "config.h"
+
+#include <pthread.h>
+
+#include "state-lock.h"
+
+static pthread_mutex_t state_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* does this thread hold the lock */
+static __thread bool state_locked = false;
+
+void
+state_lock(void)
+{
+  pthread_mutex_lock(&state_mutex);
+  state_locked = true;
+}
+
+void
+state_unlock(void)
+{
+  state_locked = false;
+  pthread_mutex_unlock(&state_mutex);
+}
+
+/* Release the lock if this thread holds it. Returns if the lock
+   has to be taken again with state_resume(). */
+bool
+state_suspend(void)
+{
+  if (!state_locked)
+    return false;
+
+  state_unlock();
+  return true;
+}
+
+void
+state_resume(bool suspended)
+{
+  if (suspended)
+    state_lock();
+}
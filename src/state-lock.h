@@ -0,0 +1,10 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+
+#pragma once
+
+#include <stdbool.h>
+
+extern void state_lock(void);
+extern void state_unlock(void);
+extern bool state_suspend(void);
+extern void state_resume(bool suspended);
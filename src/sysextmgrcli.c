@@ -16,7 +16,7 @@ usage(int retval)
   FILE *output = (retval != EXIT_SUCCESS) ? stderr : stdout;
 
   fputs("Usage: sysextmgrcli [command] [options]\n", output);
-  fputs("Commands: create-json, check, cleanup, dump-json, dump-manifest, install, list, merge-json, update\n\n", output);
+  fputs("Commands: create-json, check, cleanup, dedup, dump-json, dump-manifest, install, list, merge-json, update, verify\n\n", output);
 
   fputs("create-json - create json file from release file\n", output);
   fputs("Options for create-json:\n", output);
@@ -38,6 +38,12 @@ usage(int retval)
   fputs("  -v, --verbose         Verbose output\n", output);
   fputs("\n", output);
 
+  fputs("dedup - Share identical data between versions of an image\n", output);
+  fputs("Options for dedup:\n", output);
+  fputs("  -q, --quiet           Return 0 if data got shared, else ENODATA\n", output);
+  fputs("  -v, --verbose         Verbose output\n", output);
+  fputs("\n", output);
+
   fputs("dump-json - dump content of json file\n", output);
   fputs("Options for dump-json:\n", output);
   fputs("  <file 1> <file 2>...  Input files in json format\n", output);
@@ -76,6 +82,12 @@ usage(int retval)
   fputs("  -v, --verbose         Verbose output\n", output);
   fputs("\n", output);
 
+  fputs("verify - Compare images in the store with their recorded digests\n", output);
+  fputs("Options for verify:\n", output);
+  fputs("  -q, --quiet           Return 0 if no image is corrupted, else EBADMSG\n", output);
+  fputs("  -v, --verbose         Verbose output\n", output);
+  fputs("\n", output);
+
   fputs("Generic options:\n", output);
   fputs("  -h, --help          Display this help message and exit\n", output);
   fputs("  -v, --version       Print version number and exit\n", output);
@@ -407,6 +419,8 @@ main(int argc, char **argv)
     return main_check(--argc, ++argv);
   else if (strcmp(argv[1], "cleanup") == 0)
     return main_cleanup(--argc, ++argv);
+  else if (strcmp(argv[1], "dedup") == 0)
+    return main_dedup(--argc, ++argv);
   else if (strcmp(argv[1], "dump-json") == 0)
     return main_dump_json(--argc, ++argv);
   else if (strcmp(argv[1], "dump-manifest") == 0)
@@ -419,6 +433,8 @@ main(int argc, char **argv)
     return main_merge_json(--argc, ++argv);
   else if (strcmp(argv[1], "update") == 0)
     return main_update(--argc, ++argv);
+  else if (strcmp(argv[1], "verify") == 0)
+    return main_verify(--argc, ++argv);
 
   while ((c = getopt_long(argc, argv, "hv", longopts, NULL)) != -1)
     {
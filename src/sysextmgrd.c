@@ -44,6 +44,16 @@
 #include "architecture.h"
 #include "strv.h"
 #include "log_msg.h"
+#include "cache.h"
+#include "image-index.h"
+#include "image-name.h"
+#include "host-match.h"
+#include "dedup.h"
+#include "verify.h"
+#include "readahead.h"
+#include "worker.h"
+#include "job.h"
+#include "metrics.h"
 
 #include "varlink-org.openSUSE.sysextmgr.h"
 
@@ -98,7 +108,7 @@ check_root_permission(sd_varlink *link, sd_json_variant *parameters, const char
   uid_t peer_uid;
   int r;
 
-  r = sd_varlink_get_peer_uid(link, &peer_uid);
+  r = worker_get_peer_uid(link, &peer_uid);
   if (r < 0)
     {
       log_msg(LOG_ERR, "Failed to get peer UID: %s", strerror(-r));
@@ -215,6 +225,29 @@ vl_method_ping(sd_varlink *link, sd_json_variant *parameters,
   return sd_varlink_replybo(link, SD_JSON_BUILD_PAIR_BOOLEAN("Alive", true));
 }
 
+static int
+vl_method_get_metrics(sd_varlink *link, sd_json_variant *parameters,
+		      sd_varlink_method_flags_t _unused_(flags),
+		      void _unused_(*userdata))
+{
+  _cleanup_(sd_json_variant_unrefp) sd_json_variant *v = NULL;
+  int r;
+
+  log_msg(LOG_INFO, "Varlink method \"GetMetrics\" called...");
+
+  r = sd_varlink_dispatch(link, parameters, NULL, NULL);
+  if (r != 0)
+    return r;
+
+  r = metrics_build_json(&v);
+  if (r >= 0)
+    r = sd_json_variant_merge_objectbo(&v, SD_JSON_BUILD_PAIR_BOOLEAN("Success", true));
+  if (r < 0)
+    return api_error(link, "Failed to build metrics: %s", strerror(-r));
+
+  return sd_varlink_reply(link, v);
+}
+
 static int
 vl_method_set_log_level(sd_varlink *link, sd_json_variant *parameters,
 			sd_varlink_method_flags_t _unused_(flags),
@@ -313,13 +346,14 @@ vl_method_quit(sd_varlink *link, sd_json_variant *parameters,
   return sd_varlink_replybo(link, SD_JSON_BUILD_PAIR_BOOLEAN("Success", true));
 }
 
-/* compare the image names, but move NULL to the end
+/* sort by name and version, but move NULL to the end
    of the list */
 static int
 image_cmp(const void *a, const void *b)
 {
   const struct image_entry *const *i_a = a;
   const struct image_entry *const *i_b = b;
+  int r;
 
   if (a == NULL && b == NULL)
     return 0;
@@ -330,7 +364,17 @@ image_cmp(const void *a, const void *b)
   if (b == NULL)
     return -1;
 
-  return strverscmp((*i_a)->image_name, (*i_b)->image_name);
+  /* all versions of an image are next to each other,
+     the newest one last */
+  r = strcmp((*i_a)->name, (*i_b)->name);
+  if (r != 0)
+    return r;
+
+  r = image_version_cmp(*i_a, *i_b);
+  if (r != 0)
+    return r;
+
+  return strcmp((*i_a)->image_name, (*i_b)->image_name);
 }
 
 struct parameters {
@@ -339,6 +383,8 @@ struct parameters {
   bool all_architecture;
   char *install;
   char *prefix;
+  char **names;
+  bool check;
 };
 
 static void
@@ -347,11 +393,194 @@ parameters_free(struct parameters *var)
   var->url = mfree(var->url);
   var->install = mfree(var->install);
   var->prefix = mfree(var->prefix);
+  var->names = strv_free(var->names);
+}
+
+static int
+build_image_data(const struct image_entry *e, sd_json_variant **ret)
+{
+  log_msg(LOG_INFO, "--------");
+  log_msg(LOG_INFO, "name: %s", e->name);
+  log_msg(LOG_INFO, "version: %s", e->deps->sysext_version_id);
+  log_msg(LOG_INFO, "arch: %s", e->deps->architecture);
+  log_msg(LOG_INFO, "compatible: %d", e->compatible);
+
+  return sd_json_buildo(ret,
+			SD_JSON_BUILD_PAIR_STRING("NAME", e->name),
+			SD_JSON_BUILD_PAIR_STRING("IMAGE_NAME", e->image_name),
+			SD_JSON_BUILD_PAIR_STRING("SYSEXT_VERSION_ID", e->deps->sysext_version_id),
+			SD_JSON_BUILD_PAIR_STRING("SYSEXT_SCOPE", e->deps->sysext_scope),
+			SD_JSON_BUILD_PAIR_STRING("ID", e->deps->id),
+			SD_JSON_BUILD_PAIR_STRING("SYSEXT_LEVEL", e->deps->sysext_level),
+			SD_JSON_BUILD_PAIR_STRING("VERSION_ID", e->deps->version_id),
+			SD_JSON_BUILD_PAIR_STRING("ARCHITECTURE", e->deps->architecture),
+			SD_JSON_BUILD_PAIR_BOOLEAN("LOCAL", e->local),
+			SD_JSON_BUILD_PAIR_BOOLEAN("REMOTE", e->remote),
+			SD_JSON_BUILD_PAIR_BOOLEAN("INSTALLED", e->installed),
+			SD_JSON_BUILD_PAIR_BOOLEAN("COMPATIBLE", e->compatible),
+			SD_JSON_BUILD_PAIR_INTEGER("REFCOUNT", e->refcount));
+}
+
+/* "more" replies of ListImages: every image is sent on its own as
+   soon as its meta data is known, without collecting all of them */
+struct list_stream {
+  sd_varlink *link;
+  struct image_index *local;   /* local images by image name */
+  const struct host_match *host;
+  bool all_architecture;
+  uint64_t json_start;         /* first build_image_data(), 0 if none */
+  uint64_t json_usec;          /* sum of all build_image_data() */
+};
+
+static int
+list_stream_send(struct list_stream *ls, const struct image_entry *e)
+{
+  _cleanup_(sd_json_variant_unrefp) sd_json_variant *v = NULL;
+  uint64_t start;
+  int r;
+
+  if (e->deps == NULL ||
+      !(ls->all_architecture || host_match_architecture(ls->host, e->deps->architecture)))
+    return 0;
+
+  start = metrics_now();
+  if (ls->json_start == 0)
+    ls->json_start = start;
+  r = build_image_data(e, &v);
+  ls->json_usec += metrics_now() - start;
+  if (r < 0)
+    return r;
+
+  r = sd_varlink_notifybo(ls->link, SD_JSON_BUILD_PAIR_BOOLEAN("Success", true),
+			  SD_JSON_BUILD_PAIR("Images", SD_JSON_BUILD_ARRAY(SD_JSON_BUILD_VARIANT(v))));
+  if (r < 0)
+    return r;
+
+  /* the method still runs, so the event loop would not send it yet */
+  return sd_varlink_flush(ls->link);
+}
+
+/* image_ready_t for remote images */
+static int
+list_stream_remote(struct image_entry *e, void *userdata)
+{
+  struct list_stream *ls = userdata;
+  struct image_entry *known;
+
+  /* same as the merge of remote and local images below */
+  known = image_index_get(ls->local, e->image_name);
+  if (known)
+    {
+      e->local = true;
+      e->installed = known->installed;
+    }
+
+  return list_stream_send(ls, e);
+}
+
+/* ListImages with "more": local images are read first, remote images
+   are sent while they get resolved, local only images at the end */
+static int
+list_images_stream(sd_varlink *link, const char *url, const struct host_match *host,
+		   bool all_architecture)
+{
+  _cleanup_(free_image_list) struct image_list images_remote = {};
+  _cleanup_(free_image_list) struct image_list images_local = {};
+  _cleanup_(free_image_indexp) struct image_index *local = NULL;
+  _cleanup_(free_image_indexp) struct image_index *remote = NULL;
+  _cleanup_strv_free_ char **list_etc = NULL;
+  int r;
+
+  r = image_local_metadata(config.sysext_store_dir, &images_local,
+			   NULL, host, true);
+  if (r < 0)
+    {
+      if (r == -ENOMEM)
+	return out_of_memory_error(link);
+      return api_error(link, "Searching for images in '%s' failed: error - %s",
+		       config.sysext_store_dir, strerror(-r));
+    }
+
+  if (images_local.n > 0)
+    {
+      r = calc_refcount(images_local.images, images_local.n);
+      if (r < 0)
+	{
+	  if (r == -ENOMEM)
+	    return out_of_memory_error(link);
+	  return api_error(link, "Calculating refcount failed: error - %s", strerror(-r));
+	}
+    }
+
+  r = discover_images(config.extensions_dir, &list_etc, false);
+  if (r < 0 && r != -ENOENT)
+    return api_error(link, "Searching for images in '%s' failed: error - %s",
+		     config.extensions_dir, strerror(-r));
+
+  r = image_index_new(images_local.n, &local);
+  if (r >= 0)
+    r = image_index_add_list(local, images_local.images, images_local.n);
+  if (r < 0)
+    return api_error(link, "Indexing images failed: error - %s", strerror(-r));
+
+  for (size_t i = 0; list_etc && list_etc[i]; i++)
+    {
+      struct image_entry *e = image_index_get(local, list_etc[i]);
+
+      if (e)
+	e->installed = true;
+    }
+
+  struct list_stream ls = {
+    .link = link,
+    .local = local,
+    .host = host,
+    .all_architecture = all_architecture,
+  };
+
+  if (url)
+    {
+      r = image_remote_metadata(url, &images_remote, NULL, config.verify_signature, host,
+				list_stream_remote, &ls);
+      if (r < 0)
+	{
+	  if (r == -ENOMEM)
+	    return out_of_memory_error(link);
+	  return api_error(link, "Fetching image data from '%s' failed: error - %s", url, strerror(-r));
+	}
+    }
+
+  r = image_index_new(images_remote.n, &remote);
+  if (r >= 0)
+    r = image_index_add_list(remote, images_remote.images, images_remote.n);
+  if (r < 0)
+    return api_error(link, "Indexing images failed: error - %s", strerror(-r));
+
+  if (images_local.n > 0)
+    qsort(images_local.images, images_local.n, sizeof(struct image_entry *), image_cmp);
+
+  for (size_t i = 0; i < images_local.n; i++)
+    {
+      /* already sent as remote image */
+      if (image_index_get(remote, images_local.images[i]->image_name))
+	continue;
+
+      r = list_stream_send(&ls, images_local.images[i]);
+      if (r < 0)
+	return api_error(link, "Sending image data failed: error - %s", strerror(-r));
+    }
+
+  /* the JSON of the images got built in between the downloads, so
+     the phase is the sum of it, starting with the first image */
+  if (ls.json_start != 0)
+    metrics_phase_observe(PHASE_JSON, ls.json_start, ls.json_start + ls.json_usec);
+
+  return sd_varlink_replybo(link, SD_JSON_BUILD_PAIR_BOOLEAN("Success", true));
 }
 
 static int
 vl_method_list_images(sd_varlink *link, sd_json_variant *parameters,
-		      sd_varlink_method_flags_t _unused_(flags),
+		      sd_varlink_method_flags_t flags,
 		      void _unused_(*userdata))
 {
   _cleanup_(sd_json_variant_unrefp) sd_json_variant *array = NULL;
@@ -369,10 +598,10 @@ vl_method_list_images(sd_varlink *link, sd_json_variant *parameters,
     {}
   };
   _cleanup_(free_os_releasep) struct osrelease *osrelease = NULL;
-  _cleanup_(free_image_entry_list) struct image_entry **images = NULL;
-  _cleanup_(free_image_entry_list) struct image_entry **images_remote = NULL;
-  _cleanup_(free_image_entry_list) struct image_entry **images_local = NULL;
-  size_t n_remote = 0, n_local = 0, n_etc = 0;
+  _cleanup_free_ struct image_entry **images = NULL;
+  _cleanup_(free_image_list) struct image_list images_remote = {};
+  _cleanup_(free_image_list) struct image_list images_local = {};
+  size_t n_remote, n_local, n_etc = 0;
   const char *url = NULL;
   int r;
 
@@ -400,15 +629,26 @@ vl_method_list_images(sd_varlink *link, sd_json_variant *parameters,
   if (r < 0)
     return api_error(link, "Couldn't read os-release file: error - %s", strerror(-r));
 
+  struct host_match host;
+  host_match_init(&host, osrelease, "system");
+
   /* use URL from config if none got provided via parameter */
   if (p.url)
     url = p.url;
   else
     url = config.url;
 
+  if (flags & SD_VARLINK_METHOD_MORE)
+    {
+      r = list_images_stream(link, url, &host, p.all_architecture);
+      reset_verbose_log();
+      return r;
+    }
+
   if (url)
     {
-      r = image_remote_metadata(url, &images_remote, &n_remote, NULL, config.verify_signature, osrelease);
+      r = image_remote_metadata(url, &images_remote, NULL, config.verify_signature, &host,
+				NULL, NULL);
       if (r < 0)
         {
           if (r == -ENOMEM)
@@ -423,8 +663,8 @@ vl_method_list_images(sd_varlink *link, sd_json_variant *parameters,
     }
 
   /* local available images */
-  r = image_local_metadata(config.sysext_store_dir, &images_local, &n_local,
-			   NULL, osrelease, true);
+  r = image_local_metadata(config.sysext_store_dir, &images_local,
+			   NULL, &host, true);
   if (r < 0)
     {
       if (r == -ENOMEM)
@@ -438,6 +678,9 @@ vl_method_list_images(sd_varlink *link, sd_json_variant *parameters,
       return r;
     }
 
+  n_remote = images_remote.n;
+  n_local = images_local.n;
+
   if ((n_local + n_remote) == 0)
     {
       log_msg(LOG_INFO, "No images found");
@@ -448,7 +691,7 @@ vl_method_list_images(sd_varlink *link, sd_json_variant *parameters,
 
   if (n_local > 0)
     {
-      r = calc_refcount(images_local, n_local);
+      r = calc_refcount(images_local.images, n_local);
       if (r != 0)
         {
           if (r == -ENOMEM)
@@ -464,14 +707,15 @@ vl_method_list_images(sd_varlink *link, sd_json_variant *parameters,
 
   /* list of "installed" images visible to systemd-sysext */
   _cleanup_strv_free_ char **list_etc = NULL;
-  r = discover_images(config.extensions_dir, &list_etc);
+  r = discover_images(config.extensions_dir, &list_etc, false);
   if (r < 0 && r != -ENOENT)
     return api_error(link, "Searching for images in '%s' failed: error - %s",
 		     config.extensions_dir, strerror(-r));
 
   n_etc = strv_length(list_etc);
 
-  /* merge remote and local images */
+  /* merge remote and local images, the entries stay owned by
+     images_remote and images_local */
   images = calloc((n_remote + n_local + 1), sizeof(struct image_entry *));
   if (images == NULL)
     {
@@ -480,90 +724,120 @@ vl_method_list_images(sd_varlink *link, sd_json_variant *parameters,
       return r;
     }
 
+  _cleanup_(free_image_indexp) struct image_index *index = NULL;
+  r = image_index_new(n_remote + n_local, &index);
+  if (r < 0)
+    {
+      r = out_of_memory_error(link);
+      reset_verbose_log();
+      return r;
+    }
+
   size_t n = 0;
 
   for (size_t i = 0; i < n_remote; i++)
     {
-      images[n] = TAKE_PTR(images_remote[i]);
-
-      if (images[n]->deps)
-        images[n]->compatible = extension_release_validate(images[n]->image_name,
-                                                           osrelease, "system",
-                                                           images[n]->deps);
+      /* compatible got already set by image_remote_metadata() */
+      images[n] = images_remote.images[i];
+      r = image_index_add(index, images[n]);
+      if (r < 0 && r != -EEXIST)
+	return api_error(link, "Indexing images failed: error - %s", strerror(-r));
       n++;
     }
   for (size_t i = 0; i < n_local; i++)
     {
-      bool found = false;
-
-      for (size_t j = 0; j < n_etc; j++)
-        {
-          if (streq(list_etc[j], images_local[i]->image_name))
-            images_local[i]->installed = true;
-        }
+      struct image_entry *known;
 
       /* check if we know already the image */
-      for (size_t j = 0; j < n_remote; j++)
-        {
-          if (streq(images_local[i]->image_name, images[j]->image_name))
-            {
-              images[j]->local = true;
-              images[j]->installed = images_local[i]->installed;
-              found = true;
-              break;
-            }
-        }
-
-      if (!found)
+      known = image_index_get(index, images_local.images[i]->image_name);
+      if (known)
+	known->local = true;
+      else
         {
-          images[n] = TAKE_PTR(images_local[i]);
+          images[n] = images_local.images[i];
+	  r = image_index_add(index, images[n]);
+	  if (r < 0)
+	    return api_error(link, "Indexing images failed: error - %s", strerror(-r));
           n++;
         }
-      else /* Free unused images_local[i] */
-        free_image_entryp(&images_local[i]);
+    }
+
+  /* mark local images linked in the extensions directory as installed */
+  for (size_t j = 0; j < n_etc; j++)
+    {
+      struct image_entry *e = image_index_get(index, list_etc[j]);
+
+      if (e && e->local)
+	e->installed = true;
     }
 
   /* sort list */
   qsort(images, n, sizeof(struct image_entry *), image_cmp);
 
+  uint64_t json_start = metrics_now();
   for (size_t i = 0; images[i] != NULL; i++)
     {
       if (images[i]->deps &&
-	  (p.all_architecture || extention_architecture_compatible(images[i]->deps->architecture)))
+	  (p.all_architecture || host_match_architecture(&host, images[i]->deps->architecture)))
 	{
-	  log_msg(LOG_INFO, "--------");
-	  log_msg(LOG_INFO, "name: %s", images[i]->name);
-	  log_msg(LOG_INFO, "version: %s", images[i]->deps->sysext_version_id);
-	  log_msg(LOG_INFO, "arch: %s", images[i]->deps->architecture);
-	  log_msg(LOG_INFO, "compatible: %d", images[i]->compatible);
+	  _cleanup_(sd_json_variant_unrefp) sd_json_variant *v = NULL;
 
-	  r = sd_json_variant_append_arraybo(&array,
-					     SD_JSON_BUILD_PAIR_STRING("NAME", images[i]->name),
-					     SD_JSON_BUILD_PAIR_STRING("IMAGE_NAME", images[i]->image_name),
-					     SD_JSON_BUILD_PAIR_STRING("SYSEXT_VERSION_ID", images[i]->deps->sysext_version_id),
-					     SD_JSON_BUILD_PAIR_STRING("SYSEXT_SCOPE", images[i]->deps->sysext_scope),
-					     SD_JSON_BUILD_PAIR_STRING("ID", images[i]->deps->id),
-					     SD_JSON_BUILD_PAIR_STRING("SYSEXT_LEVEL", images[i]->deps->sysext_level),
-					     SD_JSON_BUILD_PAIR_STRING("VERSION_ID", images[i]->deps->version_id),
-					     SD_JSON_BUILD_PAIR_STRING("ARCHITECTURE", images[i]->deps->architecture),
-					     SD_JSON_BUILD_PAIR_BOOLEAN("LOCAL", images[i]->local),
-					     SD_JSON_BUILD_PAIR_BOOLEAN("REMOTE", images[i]->remote),
-					     SD_JSON_BUILD_PAIR_BOOLEAN("INSTALLED", images[i]->installed),
-					     SD_JSON_BUILD_PAIR_BOOLEAN("COMPATIBLE", images[i]->compatible),
-					     SD_JSON_BUILD_PAIR_INTEGER("REFCOUNT", images[i]->refcount));
+	  r = build_image_data(images[i], &v);
+	  if (r >= 0)
+	    r = sd_json_variant_append_array(&array, v);
 	  if(r < 0)
 	    return api_error(link, "Appending array failed: error - %s", strerror(-r));
 	}
     }
+  metrics_phase_done(PHASE_JSON, json_start);
 
   reset_verbose_log();
   return sd_varlink_replybo(link, SD_JSON_BUILD_PAIR_BOOLEAN("Success", true),
 			    SD_JSON_BUILD_PAIR_VARIANT("Images", array));
 }
 
+/* Names of the images in l as filter for load_available_images(),
+   the strings belong to l */
+static int
+image_list_names(const struct image_list *l, char ***ret)
+{
+  char **names;
+
+  names = calloc(l->n + 1, sizeof(char *));
+  if (names == NULL)
+    return -ENOMEM;
+
+  for (size_t i = 0; i < l->n; i++)
+    names[i] = l->images[i]->name;
+
+  *ret = names;
+
+  return 0;
+}
+
+/* Add an entry to the "Images" or "BrokenImages" array of the Check
+   reply, or send it right away with "more" */
+static int
+check_append(sd_varlink *link, sd_varlink_method_flags_t flags,
+	     sd_json_variant **array, const char *field, sd_json_variant *entry)
+{
+  int r;
+
+  if (flags & SD_VARLINK_METHOD_MORE)
+    {
+      r = sd_varlink_notifybo(link, SD_JSON_BUILD_PAIR_BOOLEAN("Success", true),
+			      SD_JSON_BUILD_PAIR(field, SD_JSON_BUILD_ARRAY(SD_JSON_BUILD_VARIANT(entry))));
+      if (r < 0)
+	return r;
+      return sd_varlink_flush(link);
+    }
+
+  return sd_json_variant_append_array(array, entry);
+}
+
 static int
 vl_method_check(sd_varlink *link, sd_json_variant *parameters,
-		sd_varlink_method_flags_t _unused_(flags),
+		sd_varlink_method_flags_t flags,
 		void _unused_(*userdata))
 {
   _cleanup_(sd_json_variant_unrefp) sd_json_variant *updates = NULL;
@@ -581,9 +855,8 @@ vl_method_check(sd_varlink *link, sd_json_variant *parameters,
     {}
   };
   _cleanup_(free_os_releasep) struct osrelease *osrelease = NULL;
-  _cleanup_(free_image_entry_list) struct image_entry **images_etc = NULL;
+  _cleanup_(free_image_list) struct image_list images_etc = {};
   _cleanup_free_ char *prefix_ext_dir = NULL;
-  size_t n_etc = 0;
   const char *url = NULL;
   int r;
 
@@ -638,14 +911,17 @@ vl_method_check(sd_varlink *link, sd_json_variant *parameters,
   if (r < 0)
     return api_error(link, "Couldn't read os-release file: error - %s", strerror(-r));
 
+  struct host_match host;
+  host_match_init(&host, osrelease, "system");
+
   /* list of "installed" images visible to systemd-sysext */
-  r = image_local_metadata(prefix_ext_dir, &images_etc, &n_etc, NULL,
-			   osrelease, true);
+  r = image_local_metadata(prefix_ext_dir, &images_etc, NULL,
+			   &host, true);
   if (r < 0)
     return api_error(link, "Searching for images in '%s' failed: error - %s",
 		     prefix_ext_dir, strerror(-r));
 
-  if (n_etc == 0)
+  if (images_etc.n == 0)
     {
       log_msg(LOG_NOTICE, "No installed images found.");
       reset_verbose_log();
@@ -654,38 +930,59 @@ vl_method_check(sd_varlink *link, sd_json_variant *parameters,
 				SD_JSON_BUILD_PAIR_STRING("ErrorMsg", "No installed images found."));
     }
 
-  for (size_t n = 0; n < n_etc; n++)
+  /* fetch remote and local images only once for all installed
+     images, but only the ones with the name of an installed image */
+  _cleanup_(free_available_imagesp) struct available_images *available = NULL;
+  _cleanup_free_ char **names = NULL;
+  r = image_list_names(&images_etc, &names);
+  if (r < 0)
+    return out_of_memory_error(link);
+  r = load_available_images(url, names, config.verify_signature, &host, &available);
+  if (r < 0)
+    return api_error(link, "Failed to get available images from '%s': error - %s",
+		     strna(url), strerror(-r));
+
+  for (size_t n = 0; n < images_etc.n; n++)
     {
       _cleanup_(free_image_entryp) struct image_entry *update = NULL;
+      _cleanup_(sd_json_variant_unrefp) sd_json_variant *entry = NULL;
 
-      r = get_latest_version(images_etc[n], &update, url, config.verify_signature, osrelease);
+      r = find_latest_version(images_etc.images[n], available, &update);
       if (r < 0)
         return api_error(link, "Failed to get latest version for '%s' from '%s': error - %s",
 			 p.install, url, strerror(-r));
 
       if (update)
         {
-	  log_msg(LOG_NOTICE, "Update available: %s -> %s", images_etc[n]->image_name, update->image_name);
+	  log_msg(LOG_NOTICE, "Update available: %s -> %s", images_etc.images[n]->image_name, update->image_name);
 
-	  r = sd_json_variant_append_arraybo(&updates,
-					     SD_JSON_BUILD_PAIR_STRING("OldName", images_etc[n]->image_name),
-					     SD_JSON_BUILD_PAIR_STRING("NewName", update->image_name));
+	  r = sd_json_buildo(&entry,
+			     SD_JSON_BUILD_PAIR_STRING("OldName", images_etc.images[n]->image_name),
+			     SD_JSON_BUILD_PAIR_STRING("NewName", update->image_name));
+	  if (r >= 0)
+	    r = check_append(link, flags, &updates, "Images", entry);
+	  if(r < 0)
+	    return api_error(link, "Appending updates failed: error - %s", strerror(-r));
         }
       else /* No update found */
 	{
 	  /* No update, check if old image is still compatible */
-	  if (!images_etc[n]->compatible)
+	  if (!images_etc.images[n]->compatible)
 	    {
-	      r = sd_json_variant_append_arraybo(&broken,
-						 SD_JSON_BUILD_PAIR_STRING("IMAGE_NAME", images_etc[n]->image_name));
+	      r = sd_json_buildo(&entry,
+				 SD_JSON_BUILD_PAIR_STRING("IMAGE_NAME", images_etc.images[n]->image_name));
+	      if (r >= 0)
+		r = check_append(link, flags, &broken, "BrokenImages", entry);
 	      if(r < 0)
                 return api_error(link, "Appending broken image failed: error - %s", strerror(-r));
 	    }
 	  else
 	    {
-	      r = sd_json_variant_append_arraybo(&updates,
-						 SD_JSON_BUILD_PAIR_STRING("OldName", images_etc[n]->image_name),
-						 SD_JSON_BUILD_PAIR_STRING("NewName", NULL));
+	      r = sd_json_buildo(&entry,
+				 SD_JSON_BUILD_PAIR_STRING("OldName", images_etc.images[n]->image_name),
+				 SD_JSON_BUILD_PAIR_STRING("NewName", NULL));
+	      if (r >= 0)
+		r = check_append(link, flags, &updates, "Images", entry);
 	      if(r < 0)
                 return api_error(link, "Appending updates failed: error - %s", strerror(-r));
 	    }
@@ -693,6 +990,8 @@ vl_method_check(sd_varlink *link, sd_json_variant *parameters,
     }
 
   reset_verbose_log();
+  if (flags & SD_VARLINK_METHOD_MORE)
+    return sd_varlink_replybo(link, SD_JSON_BUILD_PAIR_BOOLEAN("Success", true));
   return sd_varlink_replybo(link, SD_JSON_BUILD_PAIR_BOOLEAN("Success", true),
 			    SD_JSON_BUILD_PAIR_VARIANT("Images", updates),
 			    SD_JSON_BUILD_PAIR_VARIANT("BrokenImages", broken));
@@ -713,12 +1012,161 @@ unlink_and_free_tempfilep(char **p)
   *p = mfree(*p);
 }
 
+/* Record the digest and the readahead ranges of an image after it got
+   moved into the store and enable fs-verity if configured. Failures
+   are no reason to fail the request, the image is usable. */
+static void
+image_downloaded(const struct image_entry *e)
+{
+  int r;
+
+  r = verify_record_digest(config.sysext_store_dir, e->image_name, e->digest);
+  if (r < 0)
+    log_msg(LOG_WARNING, "Failed to record digest of '%s': %s",
+	    e->image_name, strerror(-r));
+
+  r = readahead_record(config.sysext_store_dir, e->image_name);
+  if (r < 0)
+    log_msg(LOG_WARNING, "Failed to record readahead ranges of '%s': %s",
+	    e->image_name, strerror(-r));
+
+  if (!config.fsverity)
+    return;
+
+  r = verify_enable_verity(config.sysext_store_dir, e->image_name, e->digest);
+  if (r == -EOPNOTSUPP)
+    log_msg(LOG_NOTICE, "fs-verity not supported for '%s'", e->image_name);
+  else if (r == -EBADMSG)
+    log_msg(LOG_ERR, "Image '%s' does not match its digest", e->image_name);
+  else if (r < 0)
+    log_msg(LOG_WARNING, "Failed to enable fs-verity for '%s': %s",
+	    e->image_name, strerror(-r));
+}
+
+/* Install and Update with "more" report the progress of every
+   image: "download" while it gets downloaded, "verify" while it gets
+   read to record digest and readahead ranges, "link" at the end */
+static int
+send_progress(sd_varlink *link, sd_varlink_method_flags_t flags, const char *phase,
+	      const char *image_name, uint64_t bytes, uint64_t total, uint64_t rate)
+{
+  int r;
+
+  if (!(flags & SD_VARLINK_METHOD_MORE))
+    return 0;
+
+  r = sd_varlink_notifybo(link, SD_JSON_BUILD_PAIR_BOOLEAN("Success", true),
+			  SD_JSON_BUILD_PAIR_OBJECT("Progress",
+						    SD_JSON_BUILD_PAIR_STRING("Phase", phase),
+						    SD_JSON_BUILD_PAIR_STRING("Image", image_name),
+						    SD_JSON_BUILD_PAIR_UNSIGNED("Bytes", bytes),
+						    SD_JSON_BUILD_PAIR_CONDITION(total > 0, "Total", SD_JSON_BUILD_UNSIGNED(total)),
+						    SD_JSON_BUILD_PAIR_UNSIGNED("BytesPerSecond", rate)));
+  if (r < 0)
+    return r;
+
+  /* the method still runs, so the event loop would not send it yet */
+  return sd_varlink_flush(link);
+}
+
+/* download_progress_t, userdata is the varlink connection */
+static int
+download_progress_reply(const char *fn, uint64_t bytes, uint64_t rate, void *userdata)
+{
+  return send_progress(userdata, SD_VARLINK_METHOD_MORE, "download", fn, bytes, 0, rate);
+}
+
+/* The newest compatible version of every installed image, computed
+   before Update changes anything */
+struct update_plan {
+  struct image_entry **update;  /* NULL if there is no update */
+  size_t n;
+  size_t n_pinned;              /* update[0..n_pinned) are pinned */
+};
+
+static void
+free_update_plan(struct update_plan *plan)
+{
+  for (size_t i = 0; i < plan->n; i++)
+    {
+      if (i < plan->n_pinned && plan->update[i])
+	store_unpin(plan->update[i]->image_name);
+      free_image_entryp(&plan->update[i]);
+    }
+  free(plan->update);
+}
+
+/* Pin all new images in the store, Cleanup must not remove one while
+   another one gets downloaded */
+static int
+update_plan_pin(struct update_plan *plan)
+{
+  int r;
+
+  for (; plan->n_pinned < plan->n; plan->n_pinned++)
+    if (plan->update[plan->n_pinned])
+      {
+	r = store_pin(plan->update[plan->n_pinned]->image_name);
+	if (r < 0)
+	  return r;
+      }
+
+  return 0;
+}
+
+/* Look up the update of every image in images_etc. images gets the
+   same entries as the reply of Check, broken the incompatible images
+   without update. */
+static int
+update_plan_build(const struct image_list *images_etc, const struct available_images *available,
+		  struct update_plan *plan, sd_json_variant **images, sd_json_variant **broken)
+{
+  int r;
+
+  plan->update = calloc(images_etc->n, sizeof(struct image_entry *));
+  if (plan->update == NULL)
+    return -ENOMEM;
+  plan->n = images_etc->n;
+
+  for (size_t n = 0; n < images_etc->n; n++)
+    {
+      const char *old_name = images_etc->images[n]->image_name;
+
+      r = find_latest_version(images_etc->images[n], available, &plan->update[n]);
+      if (r < 0)
+	{
+	  log_msg(LOG_ERR, "Failed to get latest version for '%s': %s",
+		  old_name, strerror(-r));
+	  return r;
+	}
+
+      if (plan->update[n])
+	r = sd_json_variant_append_arraybo(images,
+					   SD_JSON_BUILD_PAIR_STRING("OldName", old_name),
+					   SD_JSON_BUILD_PAIR_STRING("NewName", plan->update[n]->image_name));
+      else if (!images_etc->images[n]->compatible)
+	r = sd_json_variant_append_arraybo(broken,
+					   SD_JSON_BUILD_PAIR_STRING("IMAGE_NAME", old_name));
+      else
+	r = sd_json_variant_append_arraybo(images,
+					   SD_JSON_BUILD_PAIR_STRING("OldName", old_name),
+					   SD_JSON_BUILD_PAIR_STRING("NewName", NULL));
+      if (r < 0)
+	return r;
+    }
+
+  return 0;
+}
+
 static int
 vl_method_update(sd_varlink *link, sd_json_variant *parameters,
-		 sd_varlink_method_flags_t _unused_(flags),
+		 sd_varlink_method_flags_t flags,
 		 void _unused_(*userdata))
 {
   _cleanup_(sd_json_variant_unrefp) sd_json_variant *array = NULL;
+  _cleanup_(sd_json_variant_unrefp) sd_json_variant *images = NULL;
+  _cleanup_(sd_json_variant_unrefp) sd_json_variant *broken = NULL;
+  _cleanup_(free_update_plan) struct update_plan plan = {};
   _cleanup_(parameters_free) struct parameters p = {
     .url = NULL,
     .verbose = config.verbose,
@@ -730,11 +1178,11 @@ vl_method_update(sd_varlink *link, sd_json_variant *parameters,
     { "Verbose", SD_JSON_VARIANT_BOOLEAN, sd_json_dispatch_stdbool, offsetof(struct parameters, verbose), 0},
     { "Install", SD_JSON_VARIANT_STRING,  sd_json_dispatch_string,  offsetof(struct parameters, install), 0},
     { "Prefix",  SD_JSON_VARIANT_STRING,  sd_json_dispatch_string,  offsetof(struct parameters, prefix), 0},
+    { "Check",   SD_JSON_VARIANT_BOOLEAN, sd_json_dispatch_stdbool, offsetof(struct parameters, check), 0},
     {}
   };
   _cleanup_(free_os_releasep) struct osrelease *osrelease = NULL;
-  _cleanup_(free_image_entry_list) struct image_entry **images_etc = NULL;
-  size_t n_etc = 0;
+  _cleanup_(free_image_list) struct image_list images_etc = {};
   _cleanup_free_ char *prefix_ext_dir = NULL;
   const char *url = NULL;
   int r;
@@ -783,19 +1231,23 @@ vl_method_update(sd_varlink *link, sd_json_variant *parameters,
 	}
     }
 
-  log_msg(LOG_INFO, "Update parameters: url='%s', prefix='%s'", strna(p.url), strna(p.prefix));
+  log_msg(LOG_INFO, "Update parameters: url='%s', prefix='%s', check=%s", strna(p.url), strna(p.prefix),
+	  p.check ? "true" : "false");
 
   r = load_os_release(p.prefix, &osrelease);
   if (r < 0)
     return api_error(link, "Couldn't read os-release file: error - %s", strerror(-r));
 
+  struct host_match host;
+  host_match_init(&host, osrelease, "system");
+
   /* list of "installed" images visible to systemd-sysext */
-  r = image_local_metadata(prefix_ext_dir, &images_etc, &n_etc, NULL, osrelease, true);
+  r = image_local_metadata(prefix_ext_dir, &images_etc, NULL, &host, true);
   if (r < 0)
     return api_error(link, "Searching for images in '%s' failed: error - %s",
 		     prefix_ext_dir, strerror(-r));
 
-  if (n_etc == 0)
+  if (images_etc.n == 0)
     {
       log_msg(LOG_NOTICE, "No installed images found.");
       reset_verbose_log();
@@ -804,21 +1256,54 @@ vl_method_update(sd_varlink *link, sd_json_variant *parameters,
 				SD_JSON_BUILD_PAIR_STRING("ErrorMsg", "No installed images found."));
     }
 
-  for (size_t n = 0; n < n_etc; n++)
+  /* fetch remote and local images only once for all installed
+     images, but only the ones with the name of an installed image */
+  _cleanup_(free_available_imagesp) struct available_images *available = NULL;
+  _cleanup_free_ char **names = NULL;
+  r = image_list_names(&images_etc, &names);
+  if (r < 0)
+    return out_of_memory_error(link);
+  r = load_available_images(url, names, config.verify_signature, &host, &available);
+  if (r < 0)
+    return api_error(link, "Failed to get available images from '%s': error - %s",
+		     strna(url), strerror(-r));
+
+  r = update_plan_build(&images_etc, available, &plan, &images, &broken);
+  if (r < 0)
+    return api_error(link, "Failed to get latest versions from '%s': error - %s",
+		     strna(url), strerror(-r));
+
+  /* With "Check" the caller gets the report of Check in the same
+     call. Nothing gets updated if an installed image is incompatible
+     and has no update, like the tukit plugin did after Check. */
+  if (p.check && broken)
     {
-      _cleanup_(free_image_entryp) struct image_entry *update = NULL;
+      log_msg(LOG_NOTICE, "Incompatible images without update found, not updating.");
+      reset_verbose_log();
+      return sd_varlink_replybo(link, SD_JSON_BUILD_PAIR_BOOLEAN("Success", true),
+				SD_JSON_BUILD_PAIR_VARIANT("Images", images),
+				SD_JSON_BUILD_PAIR_VARIANT("BrokenImages", broken));
+    }
+
+  r = update_plan_pin(&plan);
+  if (r < 0)
+    {
+      r = out_of_memory_error(link);
+      reset_verbose_log();
+      return r;
+    }
+
+  for (size_t n = 0; n < images_etc.n; n++)
+    {
+      struct image_entry *update = plan.update[n];
 
-      r = get_latest_version(images_etc[n], &update, url, config.verify_signature, osrelease);
-      if (r < 0)
-        return api_error(link, "Failed to get latest version for '%s' from '%s': error - %s",
-			 p.install, url, strerror(-r));
       if (update)
         {
           _cleanup_free_ char *fn = NULL;
           _cleanup_free_ char *linkfn = NULL;
 	  _cleanup_free_ char *oldlink = NULL;
 
-	  log_msg(LOG_NOTICE, "Updating %s -> %s", images_etc[n]->image_name, update->image_name);
+	  log_msg(LOG_NOTICE, "Updating %s -> %s", images_etc.images[n]->image_name, update->image_name);
 
 	  /* name of the new image in the store */
           r = join_path(config.sysext_store_dir, update->image_name, &fn);
@@ -830,7 +1315,7 @@ vl_method_update(sd_varlink *link, sd_json_variant *parameters,
 	    }
 
 	  /* name of the old image in /etc/extensions */
-	  r = join_path(prefix_ext_dir, images_etc[n]->image_name, &oldlink);
+	  r = join_path(prefix_ext_dir, images_etc.images[n]->image_name, &oldlink);
           if (r < 0)
             {
               r = out_of_memory_error(link);
@@ -851,6 +1336,8 @@ vl_method_update(sd_varlink *link, sd_json_variant *parameters,
             {
               _cleanup_(unlink_and_free_tempfilep) char *tmpfn = NULL;
               _cleanup_close_ int fd = -EBADF;
+	      bool shared;
+	      struct stat st;
 
               assert(url);
 
@@ -862,13 +1349,18 @@ vl_method_update(sd_varlink *link, sd_json_variant *parameters,
 		}
 
               fd = mkostemp_safe(tmpfn);
-
-              r = download(url, update->image_name, tmpfn, config.verify_signature);
-              if (r < 0)
+              if (fd < 0)
+                return api_error(link, "Failed to create '%s': %s", tmpfn, strerror(-fd));
+
+              r = download_image(url, update->image_name, update->digest, tmpfn, fn,
+				 config.verify_signature,
+				 (flags & SD_VARLINK_METHOD_MORE) ? download_progress_reply : NULL,
+				 link, &shared);
+              if (r != 0)
                 {
 		  _cleanup_free_ char *error = NULL;
 		  if (asprintf(&error, "Failed to download '%s' from '%s': %s",
-			       update->image_name, url, strerror(-r)) < 0)
+			       update->image_name, url, r < 0 ? strerror(-r) : wstatus2str(r)) < 0)
 		    error = NULL;
 
 		  log_msg(LOG_ERR, "%s", error);
@@ -878,10 +1370,22 @@ vl_method_update(sd_varlink *link, sd_json_variant *parameters,
 					    SD_JSON_BUILD_PAIR_STRING("ErrorMsg", error?error:"Out of Memory"));
                 }
 
-              if (rename(tmpfn, fn) < 0)
-                return api_error(link, "Error to rename '%s' to '%s': %m", tmpfn, fn);
+	      /* with shared the other request does the rest */
+	      if (!shared)
+		{
+		  if (fstat(fd, &st) == 0)
+		    (void) send_progress(link, flags, "download", update->image_name,
+					 st.st_size, st.st_size, 0);
+		  (void) send_progress(link, flags, "verify", update->image_name, 0, 0, 0);
+
+		  /* fs-verity can only be enabled without writers */
+		  (void) close(TAKE_FD(fd));
+		  image_downloaded(update);
+		}
             }
 
+	  (void) send_progress(link, flags, "link", update->image_name, 0, 0, 0);
+
           if (unlink(oldlink) < 0)
             return api_error(link, "Error to delete '%s': %m", oldlink);
 
@@ -891,7 +1395,7 @@ vl_method_update(sd_varlink *link, sd_json_variant *parameters,
             return api_error(link, "Error to symlink '%s' to '%s': %m", fn, linkfn);
 
 	  r = sd_json_variant_append_arraybo(&array,
-					     SD_JSON_BUILD_PAIR_STRING("OldName", images_etc[n]->image_name),
+					     SD_JSON_BUILD_PAIR_STRING("OldName", images_etc.images[n]->image_name),
 					     SD_JSON_BUILD_PAIR_STRING("NewName", update->image_name));
 	  if(r < 0)
             return api_error(link, "Appending array failed: %s", strerror(-r));
@@ -900,32 +1404,168 @@ vl_method_update(sd_varlink *link, sd_json_variant *parameters,
 
   reset_verbose_log();
   return sd_varlink_replybo(link, SD_JSON_BUILD_PAIR_BOOLEAN("Success", true),
-			    SD_JSON_BUILD_PAIR_VARIANT("Updated", array));
+			    SD_JSON_BUILD_PAIR_VARIANT("Updated", array),
+			    SD_JSON_BUILD_PAIR_CONDITION(p.check, "Images", SD_JSON_BUILD_VARIANT(images)));
 }
 
-static int
-vl_method_install(sd_varlink *link, sd_json_variant *parameters,
-		  sd_varlink_method_flags_t _unused_(flags),
-		  void _unused_(*userdata))
-{
-  _cleanup_(sd_json_variant_unrefp) sd_json_variant *array = NULL;
+/* One image of an Install request */
+struct install_item {
+  const char *name;
+  struct image_entry *new;
+  bool pinned;              /* new is pinned in the store */
+  char *tmpfn;              /* download in the store, until renamed */
+  int fd;
+  const char *error_id;     /* NULL if the image got installed */
+  char *error;
+};
+
+struct install_items {
+  struct install_item *item;
+  size_t n;
+};
+
+static void
+free_install_items(struct install_items *items)
+{
+  for (size_t i = 0; i < items->n; i++)
+    {
+      struct install_item *item = &items->item[i];
+
+      if (item->pinned)
+	store_unpin(item->new->image_name);
+      free_image_entryp(&item->new);
+      unlink_and_free_tempfilep(&item->tmpfn);
+      if (item->fd >= 0)
+	close(item->fd);
+      free(item->error);
+    }
+  free(items->item);
+}
+
+static void
+install_item_fail(struct install_item *item, const char *error_id, const char *format, ...)
+{
+  va_list args;
+
+  item->error_id = error_id;
+  item->error = mfree(item->error);
+
+  va_start(args, format);
+  if (vasprintf(&item->error, format, args) < 0)
+    item->error = NULL;
+  va_end(args);
+
+  log_msg(LOG_ERR, "%s", item->error ? item->error : "Out of Memory");
+}
+
+/* Move a downloaded image into the store, unless download_image()
+   did it already. With shared another request downloaded it into the
+   store and records its digest. */
+static void
+install_item_downloaded(sd_varlink *link, sd_varlink_method_flags_t flags,
+			const char *url, struct install_item *item, int result,
+			bool shared)
+{
+  _cleanup_free_ char *fn = NULL;
+  struct stat st;
+
+  if (result != 0)
+    {
+      install_item_fail(item, "org.openSUSE.sysextmgr.DownloadError",
+			"Failed to download '%s' from '%s': %s", item->new->image_name, url,
+			result < 0 ? strerror(-result) : wstatus2str(result));
+      return;
+    }
+
+  if (join_path(config.sysext_store_dir, item->new->image_name, &fn) < 0)
+    {
+      install_item_fail(item, "org.openSUSE.sysextmgr.InternalError", "Out of Memory");
+      return;
+    }
+
+  if (item->tmpfn && rename(item->tmpfn, fn) < 0)
+    {
+      install_item_fail(item, "org.openSUSE.sysextmgr.InternalError",
+			"Error to rename '%s' to '%s': %m", item->tmpfn, fn);
+      return;
+    }
+  item->tmpfn = mfree(item->tmpfn);
+
+  if (shared)
+    return;
+
+  if (fstat(item->fd, &st) == 0)
+    (void) send_progress(link, flags, "download", item->new->image_name,
+			 st.st_size, st.st_size, 0);
+  (void) send_progress(link, flags, "verify", item->new->image_name, 0, 0, 0);
+
+  /* fs-verity can only be enabled without writers */
+  (void) close(TAKE_FD(item->fd));
+  image_downloaded(item->new);
+}
+
+/* Link an image of the store into the extensions directory */
+static void
+install_item_link(sd_varlink *link, sd_varlink_method_flags_t flags,
+		  struct install_item *item)
+{
+  _cleanup_free_ char *fn = NULL;
+  _cleanup_free_ char *linkfn = NULL;
+  struct stat st;
+
+  (void) send_progress(link, flags, "link", item->new->image_name, 0, 0, 0);
+
+  if (join_path(config.sysext_store_dir, item->new->image_name, &fn) < 0 ||
+      join_path(config.extensions_dir, item->new->image_name, &linkfn) < 0)
+    {
+      install_item_fail(item, "org.openSUSE.sysextmgr.InternalError", "Out of Memory");
+      return;
+    }
+
+  /* remove old link if exists */
+  if (lstat(linkfn, &st) == 0)
+    unlink(linkfn);
+
+  if (symlink(fn, linkfn) < 0)
+    install_item_fail(item, "org.openSUSE.sysextmgr.InternalError",
+		      "Error to symlink '%s' to '%s': %m", fn, linkfn);
+}
+
+/* Install accepts one image as "Install" or several as "Names". All
+   images are resolved against one view of the repository and
+   downloaded in parallel. "Names" gets one result per image. */
+static int
+vl_method_install(sd_varlink *link, sd_json_variant *parameters,
+		  sd_varlink_method_flags_t flags,
+		  void _unused_(*userdata))
+{
+  _cleanup_(sd_json_variant_unrefp) sd_json_variant *results = NULL;
   _cleanup_(parameters_free) struct parameters p = {
     .url = NULL,
     .verbose = config.verbose,
     .install = NULL,
     .prefix = NULL,
+    .names = NULL,
   };
   static const sd_json_dispatch_field dispatch_table[] = {
     { "URL",     SD_JSON_VARIANT_STRING,  sd_json_dispatch_string,  offsetof(struct parameters, url), 0},
     { "Verbose", SD_JSON_VARIANT_BOOLEAN, sd_json_dispatch_stdbool, offsetof(struct parameters, verbose), 0},
-    { "Install", SD_JSON_VARIANT_STRING,  sd_json_dispatch_string,  offsetof(struct parameters, install), SD_JSON_MANDATORY},
+    { "Install", SD_JSON_VARIANT_STRING,  sd_json_dispatch_string,  offsetof(struct parameters, install), 0},
+    { "Names",   SD_JSON_VARIANT_ARRAY,   sd_json_dispatch_strv,    offsetof(struct parameters, names), 0},
     {}
   };
   _cleanup_(free_os_releasep) struct osrelease *osrelease = NULL;
-  _cleanup_(free_image_entryp) struct image_entry *new = NULL;
+  _cleanup_(free_available_imagesp) struct available_images *available = NULL;
+  _cleanup_(free_install_items) struct install_items items = {};
+  _cleanup_free_ struct download_item *downloads = NULL;
+  _cleanup_free_ size_t *download_index = NULL;
+  char *single[] = { NULL, NULL };
+  char **names;
   const char *url = NULL;
+  size_t n_downloads = 0;
+  bool shared = false;
+  bool success = true;
   int r;
-  struct stat path_stat;
 
   log_msg(LOG_INFO, "Varlink method \"Install\" called...");
 
@@ -936,6 +1576,9 @@ vl_method_install(sd_varlink *link, sd_json_variant *parameters,
       return r;
     }
 
+  if (!p.install == !p.names)
+    return sd_varlink_error_invalid_parameter_name(link, p.install ? "Names" : "Install");
+
   /* only root is allowed to install images */
   r = check_root_permission(link, parameters, "for \"Install\"");
   if (r < 0)
@@ -944,6 +1587,14 @@ vl_method_install(sd_varlink *link, sd_json_variant *parameters,
   if (p.verbose != config.verbose)
     set_verbose_log();
 
+  if (p.install)
+    {
+      single[0] = p.install;
+      names = single;
+    }
+  else
+    names = p.names;
+
   /* use URL from config if none got provided via parameter */
   if (p.url)
     url = p.url;
@@ -954,110 +1605,179 @@ vl_method_install(sd_varlink *link, sd_json_variant *parameters,
   if (r < 0)
     return api_error(link, "Couldn't read os-release file: error - %s", strerror(-r));
 
-  struct image_deps wanted_deps = {
-    .architecture = (char *)architecture_to_string(uname_architecture()),
-  };
-  struct image_entry wanted = {
-    .name = p.install,
-    .deps = &wanted_deps
-  };
+  struct host_match host;
+  host_match_init(&host, osrelease, "system");
 
-  r = get_latest_version(&wanted, &new, url, config.verify_signature, osrelease);
-  if (r < 0)
-    return api_error(link, "Failed to get latest version for '%s' from '%s': error - %s",
-		     p.install, url, strerror(-r));
-
-  if (!new)
-    {
-      _cleanup_free_ char *error = NULL;
-      if (asprintf(&error, "Failed to find compatible version for '%s' from '%s'",
-		   p.install, url) < 0)
-	error = NULL;
-
-      log_msg(LOG_ERR, "%s", error);
-      reset_verbose_log();
-      return sd_varlink_errorbo(link, "org.openSUSE.sysextmgr.NoEntryFound",
-				SD_JSON_BUILD_PAIR_BOOLEAN("Success", false),
-				SD_JSON_BUILD_PAIR_STRING("ErrorMsg", error?error:"Out of Memory"));
-    }
-
-  _cleanup_free_ char *fn = NULL;
-  _cleanup_free_ char *linkfn = NULL;
-
-  log_msg(LOG_NOTICE, "Installing %s", new->image_name);
-
-  r = join_path(config.sysext_store_dir, new->image_name, &fn);
+  /* only the entries with the names of the images are needed */
+  r = load_available_images(url, names, config.verify_signature, &host, &available);
   if (r < 0)
+    return api_error(link, "Failed to get available images from '%s': error - %s",
+		     strna(url), strerror(-r));
+
+  items.n = strv_length(names);
+  items.item = calloc(items.n, sizeof(struct install_item));
+  downloads = calloc(items.n, sizeof(struct download_item));
+  download_index = calloc(items.n, sizeof(size_t));
+  if ((items.item == NULL || downloads == NULL || download_index == NULL) && items.n > 0)
     {
       r = out_of_memory_error(link);
       reset_verbose_log();
       return r;
     }
 
-  r = join_path(config.extensions_dir, new->image_name, &linkfn);
+  /* make sure directory exists and is a directory */
+  r = mkdir_p(config.sysext_store_dir, 0755);
   if (r < 0)
-    {
-      r = out_of_memory_error(link);
-      reset_verbose_log();
-      return r;
-    }
+    return api_error(link, "Failed to create directory '%s': error - %s",
+		     config.sysext_store_dir, strerror(-r));
 
-  if (!new->local && new->remote)
+  for (size_t i = 0; i < items.n; i++)
     {
-      _cleanup_(unlink_and_free_tempfilep) char *tmpfn = NULL;
-      _cleanup_close_ int fd = -EBADF;
+      struct install_item *item = &items.item[i];
+      struct image_deps wanted_deps = {
+	.architecture = (char *)host.architecture,
+      };
+      struct image_entry wanted = {
+	.name = names[i],
+	.deps = &wanted_deps
+      };
+
+      item->name = names[i];
+      item->fd = -EBADF;
+
+      r = find_latest_version(&wanted, available, &item->new);
+      if (r < 0)
+	return api_error(link, "Failed to get latest version for '%s' from '%s': error - %s",
+			 names[i], url, strerror(-r));
 
-      assert(url);
+      if (!item->new)
+	{
+	  install_item_fail(item, "org.openSUSE.sysextmgr.NoEntryFound",
+			    "Failed to find compatible version for '%s' from '%s'",
+			    names[i], url);
+	  continue;
+	}
+
+      log_msg(LOG_NOTICE, "Installing %s", item->new->image_name);
 
-      /* make sure directory exists and is a directory */
-      r = mkdir_p(config.sysext_store_dir, 0755);
+      /* Cleanup must not remove it before it got linked, the state
+	 lock gets released while downloading */
+      r = store_pin(item->new->image_name);
       if (r < 0)
-        return api_error(link, "Failed to create directory '%s': error - %s",
-			 config.sysext_store_dir, strerror(-r));
+	{
+	  r = out_of_memory_error(link);
+	  reset_verbose_log();
+	  return r;
+	}
+      item->pinned = true;
 
-      if (asprintf(&tmpfn, "%s/.%s.XXXXXX", config.sysext_store_dir, new->image_name) < 0)
+      if (item->new->local || !item->new->remote)
+	continue;
+
+      assert(url);
+
+      if (asprintf(&item->tmpfn, "%s/.%s.XXXXXX", config.sysext_store_dir, item->new->image_name) < 0)
         {
           r = out_of_memory_error(link);
 	  reset_verbose_log();
 	  return r;
 	}
 
-      fd = mkostemp_safe(tmpfn);
+      item->fd = mkostemp_safe(item->tmpfn);
+      if (item->fd < 0)
+	{
+	  install_item_fail(item, "org.openSUSE.sysextmgr.InternalError",
+			    "Failed to create '%s': %s", item->tmpfn, strerror(-item->fd));
+	  item->tmpfn = mfree(item->tmpfn);
+	  continue;
+	}
+
+      downloads[n_downloads] = (struct download_item) {
+	.fn = item->new->image_name,
+	.destfn = item->tmpfn,
+      };
+      download_index[n_downloads++] = i;
+    }
 
-      r = download(url, new->image_name, tmpfn, config.verify_signature);
-      if (r < 0)
+  /* a single download can be shared with other requests */
+  if (n_downloads == 1)
+    {
+      struct install_item *item = &items.item[download_index[0]];
+      _cleanup_free_ char *fn = NULL;
+
+      if (join_path(config.sysext_store_dir, item->new->image_name, &fn) < 0)
 	{
-	  _cleanup_free_ char *error = NULL;
-	  if (asprintf(&error, "Failed to download '%s' from '%s': %s",
-		       new->image_name, url, strerror(-r)) < 0)
-	    error = NULL;
-
-	  log_msg(LOG_ERR, "%s", error);
-	  return sd_varlink_errorbo(link, "org.openSUSE.sysextmgr.DownloadError",
-				    SD_JSON_BUILD_PAIR_BOOLEAN("Success", false),
-				    SD_JSON_BUILD_PAIR_STRING("ErrorMsg", error?error:"Out of Memory"));
+	  r = out_of_memory_error(link);
+	  reset_verbose_log();
+	  return r;
 	}
 
-      if (rename(tmpfn, fn) < 0)
-        return api_error(link, "Error to rename '%s' to '%s': %m", tmpfn, fn);
+      downloads[0].result = download_image(url, item->new->image_name, item->new->digest,
+					   item->tmpfn, fn, config.verify_signature,
+					   (flags & SD_VARLINK_METHOD_MORE) ? download_progress_reply : NULL,
+					   link, &shared);
+      /* renamed to fn or not needed anymore */
+      if (downloads[0].result == 0)
+	unlink_and_free_tempfilep(&item->tmpfn);
+    }
+  else if (n_downloads > 1)
+    {
+      r = download_many(url, downloads, n_downloads, config.verify_signature,
+			(flags & SD_VARLINK_METHOD_MORE) ? download_progress_reply : NULL,
+			link);
+      if (r < 0)
+	for (size_t i = 0; i < n_downloads; i++)
+	  downloads[i].result = r;
     }
 
+  for (size_t i = 0; i < n_downloads; i++)
+    install_item_downloaded(link, flags, url, &items.item[download_index[i]],
+			    downloads[i].result, shared);
+
   /* make sure directory exists and is a directory */
   r = mkdir_p(config.extensions_dir, 0755);
   if (r < 0)
     return api_error(link, "Failed to create directory '%s': error - %s",
 		     config.extensions_dir, strerror(-r));
 
-  /* remove old link if exists */
-  if (lstat(linkfn, &path_stat) == 0)
-    unlink(linkfn);
-
-  if (symlink(fn, linkfn) < 0)
-    return api_error(link, "Error to symlink '%s' to '%s': %m", fn, linkfn);
+  for (size_t i = 0; i < items.n; i++)
+    if (items.item[i].error_id == NULL)
+      install_item_link(link, flags, &items.item[i]);
 
   reset_verbose_log();
-  return sd_varlink_replybo(link, SD_JSON_BUILD_PAIR_BOOLEAN("Success", true),
-			    SD_JSON_BUILD_PAIR_STRING("Installed", new->image_name));
+
+  if (p.install)
+    {
+      struct install_item *item = &items.item[0];
+
+      if (item->error_id)
+	return sd_varlink_errorbo(link, item->error_id,
+				  SD_JSON_BUILD_PAIR_BOOLEAN("Success", false),
+				  SD_JSON_BUILD_PAIR_STRING("ErrorMsg", item->error?item->error:"Out of Memory"));
+
+      return sd_varlink_replybo(link, SD_JSON_BUILD_PAIR_BOOLEAN("Success", true),
+				SD_JSON_BUILD_PAIR_STRING("Installed", item->new->image_name));
+    }
+
+  for (size_t i = 0; i < items.n; i++)
+    {
+      struct install_item *item = &items.item[i];
+
+      if (item->error_id)
+	success = false;
+
+      r = sd_json_variant_append_arraybo(&results,
+					 SD_JSON_BUILD_PAIR_STRING("Name", item->name),
+					 SD_JSON_BUILD_PAIR_CONDITION(!item->error_id, "Installed",
+								      SD_JSON_BUILD_STRING(item->new ? item->new->image_name : NULL)),
+					 SD_JSON_BUILD_PAIR_CONDITION(!!item->error_id, "ErrorMsg",
+								      SD_JSON_BUILD_STRING(item->error ? item->error : "Out of Memory")));
+      if (r < 0)
+	return api_error(link, "Appending results failed: error - %s", strerror(-r));
+    }
+
+  return sd_varlink_replybo(link, SD_JSON_BUILD_PAIR_BOOLEAN("Success", success),
+			    SD_JSON_BUILD_PAIR_VARIANT("Results", results));
 }
 
 static int
@@ -1076,9 +1796,8 @@ vl_method_cleanup(sd_varlink *link, sd_json_variant *parameters,
     { "Verbose", SD_JSON_VARIANT_BOOLEAN, sd_json_dispatch_stdbool, offsetof(struct parameters, verbose), 0},
     {}
   };
-  _cleanup_(free_os_releasep) struct osrelease *osrelease = NULL;
-  _cleanup_(free_image_entry_list) struct image_entry **images_store = NULL;
-  size_t n_store = 0;
+  _cleanup_strv_free_ char **removed = NULL;
+  uint64_t freed = 0;
   int r;
 
   log_msg(LOG_INFO, "Varlink method \"Cleanup\" called...");
@@ -1098,8 +1817,7 @@ vl_method_cleanup(sd_varlink *link, sd_json_variant *parameters,
   if (p.verbose != config.verbose)
     set_verbose_log();
 
-  /* list of images in the sysext_store */
-  r = image_local_metadata(config.sysext_store_dir, &images_store, &n_store, NULL, NULL, false);
+  r = remove_unused_images(config.sysext_store_dir, &removed, &freed);
   if (r < 0)
     {
       if (r == -ENOENT)
@@ -1108,72 +1826,200 @@ vl_method_cleanup(sd_varlink *link, sd_json_variant *parameters,
 	  reset_verbose_log();
 	  return sd_varlink_replybo(link, SD_JSON_BUILD_PAIR_BOOLEAN("Success", true));
 	}
-      else
+      else if (r == -ENOMEM)
 	{
-          if (r == -ENOMEM)
-            {
-              r = out_of_memory_error(link);
-	      reset_verbose_log();
-            }
-          else
-            r = api_error(link, "Searching for images in '%s' failed: error - %s",
-			  config.sysext_store_dir, strerror(-r));
-          return r;
+	  r = out_of_memory_error(link);
+	  reset_verbose_log();
+	  return r;
 	}
+      else
+	return api_error(link, "Removing unused images from '%s' failed: error - %s",
+			 config.sysext_store_dir, strerror(-r));
     }
 
-  if (n_store == 0)
+  if (removed == NULL)
     {
       log_msg(LOG_NOTICE, "No installed images found.");
       reset_verbose_log();
       return sd_varlink_replybo(link, SD_JSON_BUILD_PAIR_BOOLEAN("Success", true));
     }
 
-  r = calc_refcount(images_store, n_store);
-  if (r != 0)
-    return api_error(link, "Calculating refcount failed: error - %s", strerror(-r));
+  STRV_FOREACH(image_name, removed)
+    {
+      r = sd_json_variant_append_arraybo(&array,
+                                         SD_JSON_BUILD_PAIR_STRING("IMAGE_NAME", *image_name));
+      if(r < 0)
+        return api_error(link, "Appending array failed: error - %s", strerror(-r));
+    }
+
+  reset_verbose_log();
+  return sd_varlink_replybo(link, SD_JSON_BUILD_PAIR_BOOLEAN("Success", true),
+			    SD_JSON_BUILD_PAIR_VARIANT("Images", array),
+			    SD_JSON_BUILD_PAIR_UNSIGNED("Bytes", freed));
+}
+
+static int
+vl_method_dedup(sd_varlink *link, sd_json_variant *parameters,
+		sd_varlink_method_flags_t _unused_(flags),
+		void _unused_(*userdata))
+{
+  _cleanup_(parameters_free) struct parameters p = {
+    .url = NULL,
+    .verbose = config.verbose,
+    .install = NULL,
+    .prefix = NULL,
+  };
+  static const sd_json_dispatch_field dispatch_table[] = {
+    { "Verbose", SD_JSON_VARIANT_BOOLEAN, sd_json_dispatch_stdbool, offsetof(struct parameters, verbose), 0},
+    {}
+  };
+  _cleanup_strv_free_ char **deduped = NULL;
+  uint64_t bytes = 0;
+  int r;
 
-  for (size_t i = 0; i < n_store; i++)
+  log_msg(LOG_INFO, "Varlink method \"Dedup\" called...");
+
+  r = sd_varlink_dispatch(link, parameters, dispatch_table, &p);
+  if (r < 0)
     {
-      _cleanup_free_ char *fn = NULL;
-      _cleanup_free_ char *fn_cache = NULL;
+      log_msg(LOG_ERR, "Dedup request: varlink dispatch failed: %s", strerror(-r));
+      return r;
+    }
 
-      if (images_store[i]->refcount > 0)
-	continue;
+  /* only root is allowed to modify images */
+  r = check_root_permission(link, parameters, "for \"Dedup\"");
+  if (r < 0)
+    return r;
 
-      log_msg(LOG_INFO, "Unused image '%s', removing", images_store[i]->image_name);
+  if (p.verbose != config.verbose)
+    set_verbose_log();
 
-      /* name of the image in the store */
-      r = join_path(config.sysext_store_dir, images_store[i]->image_name, &fn);
-      if (r < 0)
-        {
-          r = out_of_memory_error(link);
+  r = dedup_store(config.sysext_store_dir, &deduped, &bytes);
+  if (r < 0)
+    {
+      if (r == -ENOENT)
+	{
+	  log_msg(LOG_NOTICE, "No images found.");
+	  reset_verbose_log();
+	  return sd_varlink_replybo(link, SD_JSON_BUILD_PAIR_BOOLEAN("Success", true));
+	}
+      else if (r == -ENOMEM)
+	{
+	  r = out_of_memory_error(link);
 	  reset_verbose_log();
 	  return r;
 	}
+      else if (r == -EOPNOTSUPP)
+	return api_error(link, "The filesystem of '%s' does not support deduplication",
+			 config.sysext_store_dir);
+      else
+	return api_error(link, "Deduplicating images in '%s' failed: error - %s",
+			 config.sysext_store_dir, strerror(-r));
+    }
 
-      if (unlink(fn) < 0)
-        return api_error(link, "Error to delete '%s': %m", fn);
+  log_msg(LOG_INFO, "Deduplicated %zu images, %llu bytes", strv_length(deduped),
+	  (unsigned long long)bytes);
 
-      /* remove cached meta values */
-      r = join_path(SYSEXT_CACHE_META_DIR, images_store[i]->image_name, &fn_cache);
-      if (r < 0)
-        {
-          r = out_of_memory_error(link);
+  reset_verbose_log();
+  return sd_varlink_replybo(link, SD_JSON_BUILD_PAIR_BOOLEAN("Success", true),
+			    SD_JSON_BUILD_PAIR_CONDITION(!strv_isempty(deduped), "Images",
+							 SD_JSON_BUILD_STRV(deduped)),
+			    SD_JSON_BUILD_PAIR_UNSIGNED("Bytes", bytes));
+}
+
+static const char *
+verify_status(int result)
+{
+  switch (result)
+    {
+    case 0:
+      return "ok";
+    case -EBADMSG:
+      return "corrupted";
+    case -ENOKEY:
+      return "unknown";
+    default:
+      return "error";
+    }
+}
+
+static int
+vl_method_verify(sd_varlink *link, sd_json_variant *parameters,
+		 sd_varlink_method_flags_t _unused_(flags),
+		 void _unused_(*userdata))
+{
+  _cleanup_(sd_json_variant_unrefp) sd_json_variant *array = NULL;
+  _cleanup_(parameters_free) struct parameters p = {
+    .url = NULL,
+    .verbose = config.verbose,
+    .install = NULL,
+    .prefix = NULL,
+  };
+  static const sd_json_dispatch_field dispatch_table[] = {
+    { "Verbose", SD_JSON_VARIANT_BOOLEAN, sd_json_dispatch_stdbool, offsetof(struct parameters, verbose), 0},
+    {}
+  };
+  _cleanup_(free_image_verify_list) struct image_verify *results = NULL;
+  size_t n = 0, n_corrupted = 0;
+  uint64_t bytes = 0;
+  int r;
+
+  log_msg(LOG_INFO, "Varlink method \"Verify\" called...");
+
+  r = sd_varlink_dispatch(link, parameters, dispatch_table, &p);
+  if (r < 0)
+    {
+      log_msg(LOG_ERR, "Verify request: varlink dispatch failed: %s", strerror(-r));
+      return r;
+    }
+
+  /* reading all images is expensive, only root is allowed to do that */
+  r = check_root_permission(link, parameters, "for \"Verify\"");
+  if (r < 0)
+    return r;
+
+  if (p.verbose != config.verbose)
+    set_verbose_log();
+
+  r = verify_store(config.sysext_store_dir, &results, &n, &bytes);
+  if (r < 0)
+    {
+      if (r == -ENOENT)
+	{
+	  log_msg(LOG_NOTICE, "No images found.");
+	  reset_verbose_log();
+	  return sd_varlink_replybo(link, SD_JSON_BUILD_PAIR_BOOLEAN("Success", true));
+	}
+      else if (r == -ENOMEM)
+	{
+	  r = out_of_memory_error(link);
 	  reset_verbose_log();
 	  return r;
 	}
-      unlink(fn_cache);
+      else
+	return api_error(link, "Verifying images in '%s' failed: error - %s",
+			 config.sysext_store_dir, strerror(-r));
+    }
+
+  for (size_t i = 0; i < n; i++)
+    {
+      if (results[i].result == -EBADMSG)
+	n_corrupted++;
 
       r = sd_json_variant_append_arraybo(&array,
-                                         SD_JSON_BUILD_PAIR_STRING("IMAGE_NAME", images_store[i]->image_name));
-      if(r < 0)
-        return api_error(link, "Appending array failed: error - %s", strerror(-r));
+					 SD_JSON_BUILD_PAIR_STRING("IMAGE_NAME", results[i].image_name),
+					 SD_JSON_BUILD_PAIR_STRING("STATUS", verify_status(results[i].result)));
+      if (r < 0)
+	return api_error(link, "Appending array failed: error - %s", strerror(-r));
     }
 
+  log_msg(LOG_INFO, "Verified %zu images, %zu corrupted, %llu bytes read", n,
+	  n_corrupted, (unsigned long long)bytes);
+
   reset_verbose_log();
   return sd_varlink_replybo(link, SD_JSON_BUILD_PAIR_BOOLEAN("Success", true),
-			    SD_JSON_BUILD_PAIR_VARIANT("Images", array));
+			    SD_JSON_BUILD_PAIR_VARIANT("Images", array),
+			    SD_JSON_BUILD_PAIR_UNSIGNED("Bytes", bytes));
 }
 
 /* Send a messages to systemd daemon, that inicialization of daemon
@@ -1196,12 +2042,193 @@ announce_stopping(void)
     log_msg(LOG_ERR, "sd_notify(STOPPING) failed: %s", strerror(-r));
 }
 
-/* event loop which quits after 30 seconds idle time */
-#define USEC_PER_SEC  ((uint64_t) 1000000ULL)
-#define DEFAULT_EXIT_USEC (30*USEC_PER_SEC)
+/* Methods which download, extract or read images run on a worker
+   thread, so that they don't block the event loop */
+#define DEFINE_WORKER_METHOD(name, method)				\
+  static int								\
+  vl_worker_##name(sd_varlink *link, sd_json_variant *parameters,	\
+		   sd_varlink_method_flags_t flags,			\
+		   void _unused_(*userdata))				\
+  {									\
+    return worker_call(link, parameters, flags,				\
+		       "org.openSUSE.sysextmgr." method, vl_method_##name); \
+  }
+
+DEFINE_WORKER_METHOD(check, "Check")
+DEFINE_WORKER_METHOD(install, "Install")
+DEFINE_WORKER_METHOD(list_images, "ListImages")
+DEFINE_WORKER_METHOD(update, "Update")
+DEFINE_WORKER_METHOD(cleanup, "Cleanup")
+DEFINE_WORKER_METHOD(dedup, "Dedup")
+DEFINE_WORKER_METHOD(verify, "Verify")
+
+/* Start Install or Update as job. The parameters are the ones of the
+   method plus an optional timeout in seconds. */
+static int
+start_job(sd_varlink *link, sd_json_variant *parameters, sd_event *event,
+	  const char *method, sd_varlink_method_t callback)
+{
+  static const sd_json_dispatch_field dispatch_table[] = {
+    { "Timeout", SD_JSON_VARIANT_INTEGER, sd_json_dispatch_uint64, 0, 0 },
+    {}
+  };
+  _cleanup_(sd_json_variant_unrefp) sd_json_variant *params = NULL;
+  uint64_t timeout = 0;
+  uid_t peer_uid;
+  uint64_t id;
+  int r;
+
+  /* the other parameters are checked by the method itself */
+  r = sd_json_dispatch(parameters, dispatch_table, SD_JSON_ALLOW_EXTENSIONS, &timeout);
+  if (r < 0)
+    return sd_varlink_error_invalid_parameter_name(link, "Timeout");
+
+  r = check_root_permission(link, parameters, "for starting a job");
+  if (r < 0)
+    return r;
+
+  r = sd_varlink_get_peer_uid(link, &peer_uid);
+  if (r < 0)
+    return r;
+
+  if (timeout > UINT64_MAX / USEC_PER_SEC)
+    return sd_varlink_error_invalid_parameter_name(link, "Timeout");
+
+  params = sd_json_variant_ref(parameters);
+  r = sd_json_variant_filter(&params, (char **)(const char *[]) { "Timeout", NULL });
+  if (r < 0)
+    return out_of_memory_error(link);
+
+  r = job_start(event, peer_uid, method, callback, params, timeout * USEC_PER_SEC, &id);
+  if (r < 0)
+    return api_error(link, "Failed to start job: %s", strerror(-r));
+
+  return sd_varlink_replybo(link,
+			    SD_JSON_BUILD_PAIR_BOOLEAN("Success", true),
+			    SD_JSON_BUILD_PAIR_UNSIGNED("Id", id));
+}
 
 static int
-varlink_event_loop_with_idle(sd_event *e, sd_varlink_server *s)
+vl_method_start_install(sd_varlink *link, sd_json_variant *parameters,
+			sd_varlink_method_flags_t _unused_(flags),
+			void *userdata)
+{
+  log_msg(LOG_INFO, "Varlink method \"StartInstall\" called...");
+
+  return start_job(link, parameters, userdata, "org.openSUSE.sysextmgr.Install", vl_method_install);
+}
+
+static int
+vl_method_start_update(sd_varlink *link, sd_json_variant *parameters,
+		       sd_varlink_method_flags_t _unused_(flags),
+		       void *userdata)
+{
+  log_msg(LOG_INFO, "Varlink method \"StartUpdate\" called...");
+
+  return start_job(link, parameters, userdata, "org.openSUSE.sysextmgr.Update", vl_method_update);
+}
+
+static int
+dispatch_job(sd_varlink *link, sd_json_variant *parameters, struct job **ret)
+{
+  static const sd_json_dispatch_field dispatch_table[] = {
+    { "Id", SD_JSON_VARIANT_INTEGER, sd_json_dispatch_uint64, 0, SD_JSON_MANDATORY },
+    {}
+  };
+  uint64_t id = 0;
+  int r;
+
+  r = sd_varlink_dispatch(link, parameters, dispatch_table, &id);
+  if (r != 0)
+    return r;
+
+  *ret = job_get(id);
+  if (*ret == NULL)
+    return sd_varlink_errorbo(link, "org.openSUSE.sysextmgr.NoSuchJob",
+			      SD_JSON_BUILD_PAIR_UNSIGNED("Id", id));
+
+  return 0;
+}
+
+static int
+vl_method_get_job(sd_varlink *link, sd_json_variant *parameters,
+		  sd_varlink_method_flags_t _unused_(flags),
+		  void _unused_(*userdata))
+{
+  _cleanup_(sd_json_variant_unrefp) sd_json_variant *v = NULL;
+  struct job *j = NULL;
+  int r;
+
+  log_msg(LOG_INFO, "Varlink method \"GetJob\" called...");
+
+  r = dispatch_job(link, parameters, &j);
+  if (r != 0 || j == NULL)
+    return r;
+
+  r = job_build_json(j, &v);
+  if (r < 0)
+    return out_of_memory_error(link);
+
+  return sd_varlink_reply(link, v);
+}
+
+static int
+vl_method_watch_job(sd_varlink *link, sd_json_variant *parameters,
+		    sd_varlink_method_flags_t flags,
+		    void _unused_(*userdata))
+{
+  struct job *j = NULL;
+  int r;
+
+  log_msg(LOG_INFO, "Varlink method \"WatchJob\" called...");
+
+  if (!(flags & SD_VARLINK_METHOD_MORE))
+    return sd_varlink_error(link, SD_VARLINK_ERROR_EXPECTED_MORE, NULL);
+
+  r = dispatch_job(link, parameters, &j);
+  if (r != 0 || j == NULL)
+    return r;
+
+  r = job_watch(j, link);
+  if (r < 0)
+    return api_error(link, "Failed to watch job: %s", strerror(-r));
+
+  return 0;
+}
+
+static int
+vl_method_cancel_job(sd_varlink *link, sd_json_variant *parameters,
+		     sd_varlink_method_flags_t _unused_(flags),
+		     void _unused_(*userdata))
+{
+  struct job *j = NULL;
+  int r;
+
+  log_msg(LOG_INFO, "Varlink method \"CancelJob\" called...");
+
+  r = dispatch_job(link, parameters, &j);
+  if (r != 0 || j == NULL)
+    return r;
+
+  r = check_root_permission(link, parameters, "for \"CancelJob\"");
+  if (r < 0)
+    return r;
+
+  r = job_cancel(j);
+  if (r == -EALREADY)
+    return sd_varlink_replybo(link,
+			      SD_JSON_BUILD_PAIR_BOOLEAN("Success", false),
+			      SD_JSON_BUILD_PAIR_STRING("ErrorMsg", "Job already finished"));
+  if (r < 0)
+    return api_error(link, "Failed to cancel job: %s", strerror(-r));
+
+  return sd_varlink_replybo(link, SD_JSON_BUILD_PAIR_BOOLEAN("Success", true));
+}
+
+/* event loop which quits after idle_timeout usec without connection.
+   USEC_INFINITY means the daemon never quits by itself. */
+static int
+varlink_event_loop_with_idle(sd_event *e, sd_varlink_server *s, uint64_t idle_timeout)
 {
   int r, code;
 
@@ -1213,11 +2240,20 @@ varlink_event_loop_with_idle(sd_event *e, sd_varlink_server *s)
       if (r == SD_EVENT_FINISHED)
 	break;
 
-      r = sd_event_run(e, DEFAULT_EXIT_USEC);
+      r = sd_event_run(e, idle_timeout);
       if (r < 0)
 	return r;
 
-      if (r == 0 && (sd_varlink_server_current_connections(s) == 0))
+      /* don't keep any state between two requests */
+      if (!config.warm_cache && worker_busy() == 0)
+	{
+	  cache_flush();
+	  host_match_flush();
+	}
+
+      if (r == 0 && idle_timeout != USEC_INFINITY &&
+	  (sd_varlink_server_current_connections(s) == 0) &&
+	  worker_busy() == 0)
 	sd_event_exit(e, 0);
     }
 
@@ -1228,6 +2264,20 @@ varlink_event_loop_with_idle(sd_event *e, sd_varlink_server *s)
   return code;
 }
 
+static void
+write_metrics(void)
+{
+  int r;
+
+  if (config.metrics_file == NULL)
+    return;
+
+  r = metrics_write_textfile(config.metrics_file);
+  if (r < 0)
+    log_msg(LOG_WARNING, "Failed to write metrics to %s: %s",
+	    config.metrics_file, strerror(-r));
+}
+
 static int
 run_varlink(void)
 {
@@ -1280,12 +2330,20 @@ run_varlink(void)
     }
 
   r = sd_varlink_server_bind_method_many(varlink_server,
-					 "org.openSUSE.sysextmgr.Check",          vl_method_check,
-					 "org.openSUSE.sysextmgr.Install",        vl_method_install,
-					 "org.openSUSE.sysextmgr.ListImages",     vl_method_list_images,
-					 "org.openSUSE.sysextmgr.Update",         vl_method_update,
-					 "org.openSUSE.sysextmgr.Cleanup",        vl_method_cleanup,
+					 "org.openSUSE.sysextmgr.Check",          vl_worker_check,
+					 "org.openSUSE.sysextmgr.Install",        vl_worker_install,
+					 "org.openSUSE.sysextmgr.ListImages",     vl_worker_list_images,
+					 "org.openSUSE.sysextmgr.Update",         vl_worker_update,
+					 "org.openSUSE.sysextmgr.Cleanup",        vl_worker_cleanup,
+					 "org.openSUSE.sysextmgr.Dedup",          vl_worker_dedup,
+					 "org.openSUSE.sysextmgr.Verify",         vl_worker_verify,
+					 "org.openSUSE.sysextmgr.StartInstall",   vl_method_start_install,
+					 "org.openSUSE.sysextmgr.StartUpdate",    vl_method_start_update,
+					 "org.openSUSE.sysextmgr.GetJob",         vl_method_get_job,
+					 "org.openSUSE.sysextmgr.WatchJob",       vl_method_watch_job,
+					 "org.openSUSE.sysextmgr.CancelJob",      vl_method_cancel_job,
 					 "org.openSUSE.sysextmgr.GetEnvironment", vl_method_get_environment,
+					 "org.openSUSE.sysextmgr.GetMetrics",     vl_method_get_metrics,
 					 "org.openSUSE.sysextmgr.Ping",           vl_method_ping,
 					 "org.openSUSE.sysextmgr.Quit",           vl_method_quit,
 					 "org.openSUSE.sysextmgr.SetLogLevel",    vl_method_set_log_level);
@@ -1323,16 +2381,65 @@ run_varlink(void)
 	}
     }
 
+  if (socket_activation && config.idle_timeout != USEC_INFINITY)
+    log_msg(LOG_INFO, "Exit after %llu seconds without connection",
+	    (unsigned long long)(config.idle_timeout / USEC_PER_SEC));
+
+  if (config.warm_cache)
+    {
+      r = cache_load(SYSEXT_CACHE_STATE);
+      if (r < 0)
+	log_msg(LOG_WARNING, "Failed to load state from %s: %s",
+		SYSEXT_CACHE_STATE, strerror(-r));
+    }
+
+  /* the counters of the last run are gone */
+  write_metrics();
+
   announce_ready();
-  if (socket_activation)
-    r = varlink_event_loop_with_idle(event, varlink_server);
-  else
-    r = sd_event_loop(event);
+  r = varlink_event_loop_with_idle(event, varlink_server,
+				   socket_activation ? config.idle_timeout : USEC_INFINITY);
   announce_stopping();
 
+  /* the caches must not change anymore */
+  job_cancel_all();
+  worker_wait_all();
+  job_free_all();
+  write_metrics();
+
+  if (config.warm_cache)
+    {
+      int k = cache_save(SYSEXT_CACHE_STATE);
+      if (k < 0)
+	log_msg(LOG_WARNING, "Failed to save state to %s: %s",
+		SYSEXT_CACHE_STATE, strerror(-k));
+    }
+  cache_flush();
+  host_match_flush();
+
   return r;
 }
 
+/* Runs early at boot before systemd-sysext merges the images */
+static int
+run_readahead(void)
+{
+  uint64_t bytes = 0;
+  int r;
+
+  r = readahead_images(config.sysext_store_dir, config.extensions_dir, &bytes);
+  if (r < 0)
+    {
+      log_msg(LOG_ERR, "Readahead of images in '%s' failed: %s",
+	      config.extensions_dir, strerror(-r));
+      return r;
+    }
+
+  log_msg(LOG_INFO, "Requested readahead of %llu bytes", (unsigned long long)bytes);
+
+  return 0;
+}
+
 static void
 print_help(void)
 {
@@ -1341,6 +2448,7 @@ print_help(void)
   printf("  -s, --socket   Activation through socket\n");
   printf("  -d, --debug    Debug mode\n");
   printf("  -v, --verbose  Verbose logging\n");
+  printf("  -r, --readahead Read images linked in the extensions directory into the page cache and exit\n");
   printf("  -?, --help     Give this help list\n");
   printf("      --version  Print program version\n");
 }
@@ -1348,6 +2456,7 @@ print_help(void)
 int
 main(int argc, char **argv)
 {
+  bool readahead = false;
   int r;
 
   r = load_config("sysextmgrd");
@@ -1369,13 +2478,14 @@ main(int argc, char **argv)
 	  {"socket", no_argument, NULL, 's'},
           {"debug", no_argument, NULL, 'd'},
           {"verbose", no_argument, NULL, 'v'},
+          {"readahead", no_argument, NULL, 'r'},
           {"version", no_argument, NULL, '\255'},
           {"usage", no_argument, NULL, '?'},
           {"help", no_argument, NULL, 'h'},
           {NULL, 0, NULL, '\0'}
         };
 
-      c = getopt_long(argc, argv, "sdvh?", long_options, &option_index);
+      c = getopt_long(argc, argv, "sdvrh?", long_options, &option_index);
       if (c == (-1))
         break;
       switch (c)
@@ -1393,6 +2503,9 @@ main(int argc, char **argv)
         case 'v':
           set_verbose_log();
           break;
+        case 'r':
+          readahead = true;
+          break;
         case '\255':
           fprintf(stdout, "sysextmgrd (%s) %s\n", PACKAGE, VERSION);
           return 0;
@@ -1411,6 +2524,9 @@ main(int argc, char **argv)
       return 1;
     }
 
+  if (readahead)
+    return -run_readahead();
+
   log_msg(LOG_INFO, "Starting sysextmgrd (%s) %s...", PACKAGE, VERSION);
 
   r = run_varlink();
@@ -0,0 +1,118 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/* Traces of the phases of a request. With trace= enabled every
+   request running on a worker thread gets an id, the phases recorded
+   by metrics_phase_done() are collected while it runs and sent to the
+   journal once it finished: one entry per phase and one with the
+   phase "total", with the fields REQUEST_ID, METHOD, PHASE,
+   START_USEC, STOP_USEC (CLOCK_MONOTONIC) and DURATION_USEC. Messages
+   of log_msg() get the REQUEST_ID, too, e.g.
+   "journalctl REQUEST_ID=42" shows everything about one request. */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <systemd/sd-journal.h>
+
+#include "basics.h"
+#include "sysextmgr.h"
+#include "metrics.h"
+#include "trace.h"
+
+static uint64_t last_id = 0;
+
+/* the request running on this thread, NULL if not traced */
+static __thread struct trace *current_trace = NULL;
+
+/* Start tracing method, which got called at start. t must exist
+   until trace_end(). Does nothing if tracing is disabled. */
+void
+trace_begin(struct trace *t, const char *method, uint64_t start)
+{
+  assert(t);
+  assert(method);
+
+  if (!config.trace)
+    return;
+
+  /* "org.openSUSE.sysextmgr.Update" -> "Update" */
+  t->method = strrchr(method, '.');
+  t->method = t->method ? t->method + 1 : method;
+  t->id = __atomic_add_fetch(&last_id, 1, __ATOMIC_RELAXED);
+  t->start = start;
+  t->spans = NULL;
+  t->n_spans = 0;
+
+  current_trace = t;
+}
+
+/* Record a phase of the current request, phase must be a static string */
+void
+trace_phase(const char *phase, uint64_t start, uint64_t stop)
+{
+  struct trace *t = current_trace;
+  struct trace_span *tmp;
+
+  if (t == NULL)
+    return;
+
+  /* a trace without this phase is still useful */
+  tmp = realloc(t->spans, (t->n_spans + 1) * sizeof(struct trace_span));
+  if (tmp == NULL)
+    return;
+  t->spans = tmp;
+
+  t->spans[t->n_spans++] = (struct trace_span) {
+    .phase = phase,
+    .start = start,
+    .stop = stop,
+  };
+}
+
+static void
+trace_send(const struct trace *t, const char *phase, uint64_t start, uint64_t stop)
+{
+  uint64_t duration = stop > start ? stop - start : 0;
+
+  sd_journal_send("MESSAGE=Request %llu (%s): %s took %llu.%03llu ms",
+		  (unsigned long long)t->id, t->method, phase,
+		  (unsigned long long)(duration / USEC_PER_MSEC),
+		  (unsigned long long)(duration % USEC_PER_MSEC),
+		  "PRIORITY=%i", LOG_INFO,
+		  "REQUEST_ID=%llu", (unsigned long long)t->id,
+		  "METHOD=%s", t->method,
+		  "PHASE=%s", phase,
+		  "START_USEC=%llu", (unsigned long long)start,
+		  "STOP_USEC=%llu", (unsigned long long)stop,
+		  "DURATION_USEC=%llu", (unsigned long long)duration,
+		  NULL);
+}
+
+/* Send the trace of the current request to the journal */
+void
+trace_end(void)
+{
+  struct trace *t = current_trace;
+
+  if (t == NULL)
+    return;
+
+  current_trace = NULL;
+
+  for (size_t i = 0; i < t->n_spans; i++)
+    trace_send(t, t->spans[i].phase, t->spans[i].start, t->spans[i].stop);
+  trace_send(t, "total", t->start, metrics_now());
+
+  t->spans = mfree(t->spans);
+  t->n_spans = 0;
+}
+
+/* Id of the request running on this thread, 0 if there is none */
+uint64_t
+trace_request_id(void)
+{
+  return current_trace ? current_trace->id : 0;
+}
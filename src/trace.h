@@ -0,0 +1,26 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct trace_span {
+  const char *phase;
+  uint64_t start;           /* CLOCK_MONOTONIC usec */
+  uint64_t stop;
+};
+
+/* A request running on a worker thread */
+struct trace {
+  uint64_t id;
+  const char *method;
+  uint64_t start;
+  struct trace_span *spans;
+  size_t n_spans;
+};
+
+extern void trace_begin(struct trace *t, const char *method, uint64_t start);
+extern void trace_phase(const char *phase, uint64_t start, uint64_t stop);
+extern void trace_end(void);
+extern uint64_t trace_request_id(void);
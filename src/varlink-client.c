@@ -1,5 +1,8 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 
+#include <inttypes.h>
+#include <unistd.h>
+
 #include "basics.h"
 #include "varlink-client.h"
 
@@ -19,3 +22,222 @@ connect_to_sysextmgrd(sd_varlink **ret, const char *socket)
   *ret = TAKE_PTR(link);
   return 0;
 }
+
+struct more_call {
+  varlink_more_reply_t reply;
+  void *userdata;
+  bool done;
+  int r;
+};
+
+static int
+more_reply(sd_varlink *link, sd_json_variant *parameters, const char *error_id,
+	   sd_varlink_reply_flags_t flags, void *userdata)
+{
+  struct more_call *c = userdata;
+  int r;
+
+  r = c->reply(parameters, error_id, c->userdata);
+  if (r < 0 && c->r == 0)
+    c->r = r;
+
+  if (error_id || !(flags & SD_VARLINK_REPLY_CONTINUES))
+    c->done = true;
+
+  return 0;
+}
+
+/* Call method with "more" and hand every reply to the reply function
+   as soon as it arrives. A daemon sending only one reply works, too.
+   Returns the first error of the reply function. */
+int
+varlink_call_more(sd_varlink *link, const char *method, sd_json_variant *parameters,
+		  varlink_more_reply_t reply, void *userdata)
+{
+  struct more_call c = {
+    .reply = reply,
+    .userdata = userdata,
+    .done = false,
+    .r = 0,
+  };
+  int r;
+
+  sd_varlink_set_userdata(link, &c);
+
+  r = sd_varlink_bind_reply(link, more_reply);
+  if (r >= 0)
+    r = sd_varlink_observe(link, method, parameters);
+
+  while (r >= 0 && !c.done)
+    {
+      r = sd_varlink_process(link);
+      if (r == 0)
+	r = sd_varlink_wait(link, UINT64_MAX);
+    }
+
+  sd_varlink_set_userdata(link, NULL);
+
+  /* errors of the reply function got already reported */
+  if (r < 0)
+    {
+      fprintf(stderr, "Failed to call %s method: %s\n", method, strerror(-r));
+      return r;
+    }
+
+  return c.r;
+}
+
+struct progress {
+  char *phase;
+  char *image;
+  uint64_t bytes;
+  uint64_t total;
+  uint64_t rate;
+};
+
+static void
+progress_free(struct progress *var)
+{
+  var->phase = mfree(var->phase);
+  var->image = mfree(var->image);
+}
+
+static void
+format_bytes(char *buf, size_t size, uint64_t bytes)
+{
+  static const char *const units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+  double value = bytes;
+  size_t i = 0;
+
+  while (value >= 1024 && i < sizeof(units)/sizeof(units[0]) - 1)
+    {
+      value /= 1024;
+      i++;
+    }
+
+  if (i == 0)
+    snprintf(buf, size, "%" PRIu64 " %s", bytes, units[0]);
+  else
+    snprintf(buf, size, "%.1f %s", value, units[i]);
+}
+
+/* Print the progress as one line, which gets overwritten by the next one */
+static int
+print_progress(sd_json_variant *v)
+{
+  _cleanup_(progress_free) struct progress p = {
+    .phase = NULL,
+    .image = NULL,
+    .bytes = 0,
+    .total = 0,
+    .rate = 0,
+  };
+  static const sd_json_dispatch_field dispatch_table[] = {
+    { "Phase",          SD_JSON_VARIANT_STRING,   sd_json_dispatch_string, offsetof(struct progress, phase), SD_JSON_MANDATORY },
+    { "Image",          SD_JSON_VARIANT_STRING,   sd_json_dispatch_string, offsetof(struct progress, image), SD_JSON_MANDATORY },
+    { "Bytes",          _SD_JSON_VARIANT_TYPE_INVALID, sd_json_dispatch_uint64, offsetof(struct progress, bytes), 0 },
+    { "Total",          _SD_JSON_VARIANT_TYPE_INVALID, sd_json_dispatch_uint64, offsetof(struct progress, total), 0 },
+    { "BytesPerSecond", _SD_JSON_VARIANT_TYPE_INVALID, sd_json_dispatch_uint64, offsetof(struct progress, rate), 0 },
+    {}
+  };
+  char bytes[32], total[32], rate[32];
+  int r;
+
+  r = sd_json_dispatch(v, dispatch_table, SD_JSON_ALLOW_EXTENSIONS, &p);
+  if (r < 0)
+    return r;
+
+  fprintf(stderr, "\r%s: %s", p.image, p.phase);
+  if (streq(p.phase, "download"))
+    {
+      format_bytes(bytes, sizeof(bytes), p.bytes);
+      fprintf(stderr, " %s", bytes);
+      if (p.total > 0)
+	{
+	  format_bytes(total, sizeof(total), p.total);
+	  fprintf(stderr, " of %s", total);
+	}
+      if (p.rate > 0)
+	{
+	  format_bytes(rate, sizeof(rate), p.rate);
+	  fprintf(stderr, " at %s/s", rate);
+	}
+    }
+  /* clear the rest of the previous line */
+  fprintf(stderr, "\033[K");
+  fflush(stderr);
+
+  return 0;
+}
+
+struct progress_call {
+  bool quiet;
+  bool shown;
+  sd_json_variant *parameters;
+  char *error_id;
+};
+
+static int
+progress_reply(sd_json_variant *parameters, const char *error_id, void *userdata)
+{
+  struct progress_call *c = userdata;
+  sd_json_variant *v;
+
+  v = sd_json_variant_by_key(parameters, "Progress");
+  if (!error_id && v && !sd_json_variant_is_null(v))
+    {
+      if (c->quiet || !isatty(STDERR_FILENO))
+	return 0;
+
+      c->shown = true;
+      return print_progress(v);
+    }
+
+  if (c->shown)
+    {
+      fprintf(stderr, "\r\033[K");
+      c->shown = false;
+    }
+
+  c->parameters = sd_json_variant_ref(parameters);
+  if (error_id)
+    {
+      c->error_id = strdup(error_id);
+      if (c->error_id == NULL)
+	return -ENOMEM;
+    }
+
+  return 0;
+}
+
+/* Like sd_varlink_call(), but the daemon reports the progress with
+   "more", which gets printed to stderr if it is a terminal. The
+   final reply is returned, the caller has to free it. */
+int
+varlink_call_with_progress(sd_varlink *link, const char *method,
+			   sd_json_variant *parameters, bool quiet,
+			   sd_json_variant **ret_parameters, char **ret_error_id)
+{
+  struct progress_call c = {
+    .quiet = quiet,
+    .shown = false,
+    .parameters = NULL,
+    .error_id = NULL,
+  };
+  int r;
+
+  r = varlink_call_more(link, method, parameters, progress_reply, &c);
+  if (c.shown)
+    fprintf(stderr, "\n");
+  if (r < 0)
+    {
+      sd_json_variant_unref(c.parameters);
+      free(c.error_id);
+      return r;
+    }
+
+  *ret_parameters = c.parameters;
+  *ret_error_id = c.error_id;
+
+  return 0;
+}
@@ -3,14 +3,23 @@
 #pragma once
 
 #include <errno.h>
+#include <stdbool.h>
 #include <systemd/sd-varlink.h>
 
 #define VARLINK_IS_NOT_RUNNING(r) (r == -ECONNREFUSED || r == -ENOENT || r == -ECONNRESET || r == -EACCES)
 
+/* called for every reply of varlink_call_more() */
+typedef int (*varlink_more_reply_t)(sd_json_variant *parameters, const char *error_id, void *userdata);
+
 extern int connect_to_sysextmgrd(sd_varlink **ret, const char *socket);
+extern int varlink_call_more(sd_varlink *link, const char *method, sd_json_variant *parameters,
+			     varlink_more_reply_t reply, void *userdata);
+extern int varlink_call_with_progress(sd_varlink *link, const char *method,
+				      sd_json_variant *parameters, bool quiet,
+				      sd_json_variant **ret_parameters, char **ret_error_id);
 extern int varlink_list_images (const char *url);
 extern int varlink_check (const char *url, const char *prefix);
 extern int varlink_cleanup (void);
-extern int varlink_update (const char *url, const char *prefix);
-extern int varlink_install (const char *name, const char *url);
+extern int varlink_update (const char *url, const char *prefix, bool check);
+extern int varlink_install (char **names, const char *url);
 
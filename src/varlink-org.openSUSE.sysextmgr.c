@@ -34,8 +34,63 @@ static SD_VARLINK_DEFINE_STRUCT_TYPE(UpdatedImage,
 				     SD_VARLINK_FIELD_COMMENT("New Image Name"),
 				     SD_VARLINK_DEFINE_FIELD(NewImage, SD_VARLINK_STRING, SD_VARLINK_NULLABLE));
 
-static SD_VARLINK_DEFINE_METHOD(
+static SD_VARLINK_DEFINE_STRUCT_TYPE(BrokenImage,
+				     SD_VARLINK_FIELD_COMMENT("Incompatible installed image without update"),
+				     SD_VARLINK_DEFINE_FIELD(IMAGE_NAME, SD_VARLINK_STRING, 0));
+
+static SD_VARLINK_DEFINE_STRUCT_TYPE(VerifiedImage,
+				     SD_VARLINK_FIELD_COMMENT("Full image name including version/arch/suffix"),
+				     SD_VARLINK_DEFINE_FIELD(IMAGE_NAME, SD_VARLINK_STRING, 0),
+				     SD_VARLINK_FIELD_COMMENT("ok, corrupted, unknown (no digest recorded) or error"),
+				     SD_VARLINK_DEFINE_FIELD(STATUS,     SD_VARLINK_STRING, 0));
+
+static SD_VARLINK_DEFINE_STRUCT_TYPE(Progress,
+				     SD_VARLINK_FIELD_COMMENT("download, verify or link"),
+				     SD_VARLINK_DEFINE_FIELD(Phase,          SD_VARLINK_STRING, 0),
+				     SD_VARLINK_FIELD_COMMENT("Full image name including version/arch/suffix"),
+				     SD_VARLINK_DEFINE_FIELD(Image,          SD_VARLINK_STRING, 0),
+				     SD_VARLINK_FIELD_COMMENT("Number of bytes downloaded"),
+				     SD_VARLINK_DEFINE_FIELD(Bytes,          SD_VARLINK_INT,    SD_VARLINK_NULLABLE),
+				     SD_VARLINK_FIELD_COMMENT("Size of the image, once known"),
+				     SD_VARLINK_DEFINE_FIELD(Total,          SD_VARLINK_INT,    SD_VARLINK_NULLABLE),
+				     SD_VARLINK_FIELD_COMMENT("Current download speed"),
+				     SD_VARLINK_DEFINE_FIELD(BytesPerSecond, SD_VARLINK_INT,    SD_VARLINK_NULLABLE));
+
+static SD_VARLINK_DEFINE_STRUCT_TYPE(InstallResult,
+				     SD_VARLINK_FIELD_COMMENT("Name of the image as requested"),
+				     SD_VARLINK_DEFINE_FIELD(Name,      SD_VARLINK_STRING, 0),
+				     SD_VARLINK_FIELD_COMMENT("Full image name of the installed image"),
+				     SD_VARLINK_DEFINE_FIELD(Installed, SD_VARLINK_STRING, SD_VARLINK_NULLABLE),
+				     SD_VARLINK_FIELD_COMMENT("Why the image did not get installed"),
+				     SD_VARLINK_DEFINE_FIELD(ErrorMsg,  SD_VARLINK_STRING, SD_VARLINK_NULLABLE));
+
+static SD_VARLINK_DEFINE_STRUCT_TYPE(Counter,
+				     SD_VARLINK_FIELD_COMMENT("Name of the counter"),
+				     SD_VARLINK_DEFINE_FIELD(Name,  SD_VARLINK_STRING, 0),
+				     SD_VARLINK_FIELD_COMMENT("Value since the daemon started"),
+				     SD_VARLINK_DEFINE_FIELD(Value, SD_VARLINK_INT,    0));
+
+static SD_VARLINK_DEFINE_STRUCT_TYPE(HistogramBucket,
+				     SD_VARLINK_FIELD_COMMENT("Upper bound of the bucket in usec"),
+				     SD_VARLINK_DEFINE_FIELD(LeUsec, SD_VARLINK_INT, 0),
+				     SD_VARLINK_FIELD_COMMENT("Number of observations up to the bound"),
+				     SD_VARLINK_DEFINE_FIELD(Count,  SD_VARLINK_INT, 0));
+
+static SD_VARLINK_DEFINE_STRUCT_TYPE(Histogram,
+				     SD_VARLINK_FIELD_COMMENT("method or phase"),
+				     SD_VARLINK_DEFINE_FIELD(Kind,    SD_VARLINK_STRING, 0),
+				     SD_VARLINK_FIELD_COMMENT("Name of the method or phase"),
+				     SD_VARLINK_DEFINE_FIELD(Name,    SD_VARLINK_STRING, 0),
+				     SD_VARLINK_FIELD_COMMENT("Number of observations"),
+				     SD_VARLINK_DEFINE_FIELD(Count,   SD_VARLINK_INT,    0),
+				     SD_VARLINK_FIELD_COMMENT("Sum of all durations in usec"),
+				     SD_VARLINK_DEFINE_FIELD(SumUsec, SD_VARLINK_INT,    0),
+				     SD_VARLINK_FIELD_COMMENT("Cumulative buckets, +Inf is Count"),
+				     SD_VARLINK_DEFINE_FIELD_BY_TYPE(Buckets, HistogramBucket, SD_VARLINK_ARRAY));
+
+static SD_VARLINK_DEFINE_METHOD_FULL(
                 Check,
+                SD_VARLINK_SUPPORTS_MORE,
                 SD_VARLINK_FIELD_COMMENT("URL of remote sysext images, requires root rights"),
                 SD_VARLINK_DEFINE_INPUT(URL, SD_VARLINK_STRING, SD_VARLINK_NULLABLE),
 		SD_VARLINK_FIELD_COMMENT("Verbose logging to journald"),
@@ -44,8 +99,10 @@ static SD_VARLINK_DEFINE_METHOD(
 		SD_VARLINK_DEFINE_INPUT(Prefix, SD_VARLINK_STRING, SD_VARLINK_NULLABLE),
 		SD_VARLINK_FIELD_COMMENT("If call succeeded"),
 		SD_VARLINK_DEFINE_OUTPUT(Success, SD_VARLINK_BOOL, 0),
-                SD_VARLINK_FIELD_COMMENT("List of images with compatible updates"),
+                SD_VARLINK_FIELD_COMMENT("List of images with compatible updates, one image per reply with 'more'"),
 		SD_VARLINK_DEFINE_OUTPUT_BY_TYPE(Images, UpdatedImage, SD_VARLINK_ARRAY | SD_VARLINK_NULLABLE),
+                SD_VARLINK_FIELD_COMMENT("Incompatible installed images without update"),
+		SD_VARLINK_DEFINE_OUTPUT_BY_TYPE(BrokenImages, BrokenImage, SD_VARLINK_ARRAY | SD_VARLINK_NULLABLE),
                 SD_VARLINK_FIELD_COMMENT("Error Message"),
                 SD_VARLINK_DEFINE_OUTPUT(ErrorMsg, SD_VARLINK_STRING, SD_VARLINK_NULLABLE));
 
@@ -57,13 +114,44 @@ static SD_VARLINK_DEFINE_METHOD(
 		SD_VARLINK_DEFINE_OUTPUT(Success, SD_VARLINK_BOOL, 0),
                 SD_VARLINK_FIELD_COMMENT("List of images which got removed"),
 		SD_VARLINK_DEFINE_OUTPUT(Images, SD_VARLINK_STRING, SD_VARLINK_ARRAY | SD_VARLINK_NULLABLE),
+                SD_VARLINK_FIELD_COMMENT("Number of bytes freed in the store"),
+		SD_VARLINK_DEFINE_OUTPUT(Bytes, SD_VARLINK_INT, SD_VARLINK_NULLABLE),
+                SD_VARLINK_FIELD_COMMENT("Error Message"),
+                SD_VARLINK_DEFINE_OUTPUT(ErrorMsg, SD_VARLINK_STRING, SD_VARLINK_NULLABLE));
+
+static SD_VARLINK_DEFINE_METHOD(
+                Dedup,
+		SD_VARLINK_FIELD_COMMENT("Verbose logging to journald"),
+		SD_VARLINK_DEFINE_INPUT(Verbose, SD_VARLINK_BOOL, SD_VARLINK_NULLABLE),
+		SD_VARLINK_FIELD_COMMENT("If call succeeded"),
+		SD_VARLINK_DEFINE_OUTPUT(Success, SD_VARLINK_BOOL, 0),
+                SD_VARLINK_FIELD_COMMENT("List of images which share data with a newer version now"),
+		SD_VARLINK_DEFINE_OUTPUT(Images, SD_VARLINK_STRING, SD_VARLINK_ARRAY | SD_VARLINK_NULLABLE),
+                SD_VARLINK_FIELD_COMMENT("Number of bytes which got deduplicated"),
+		SD_VARLINK_DEFINE_OUTPUT(Bytes, SD_VARLINK_INT, SD_VARLINK_NULLABLE),
                 SD_VARLINK_FIELD_COMMENT("Error Message"),
                 SD_VARLINK_DEFINE_OUTPUT(ErrorMsg, SD_VARLINK_STRING, SD_VARLINK_NULLABLE));
 
 static SD_VARLINK_DEFINE_METHOD(
+                Verify,
+		SD_VARLINK_FIELD_COMMENT("Verbose logging to journald"),
+		SD_VARLINK_DEFINE_INPUT(Verbose, SD_VARLINK_BOOL, SD_VARLINK_NULLABLE),
+		SD_VARLINK_FIELD_COMMENT("If call succeeded"),
+		SD_VARLINK_DEFINE_OUTPUT(Success, SD_VARLINK_BOOL, 0),
+                SD_VARLINK_FIELD_COMMENT("Images with the result of the verification"),
+		SD_VARLINK_DEFINE_OUTPUT_BY_TYPE(Images, VerifiedImage, SD_VARLINK_ARRAY | SD_VARLINK_NULLABLE),
+                SD_VARLINK_FIELD_COMMENT("Number of bytes read"),
+		SD_VARLINK_DEFINE_OUTPUT(Bytes, SD_VARLINK_INT, SD_VARLINK_NULLABLE),
+                SD_VARLINK_FIELD_COMMENT("Error Message"),
+                SD_VARLINK_DEFINE_OUTPUT(ErrorMsg, SD_VARLINK_STRING, SD_VARLINK_NULLABLE));
+
+static SD_VARLINK_DEFINE_METHOD_FULL(
                 Install,
-		SD_VARLINK_FIELD_COMMENT("Name of sysext images"),
-                SD_VARLINK_DEFINE_INPUT(Install, SD_VARLINK_STRING, 0),
+                SD_VARLINK_SUPPORTS_MORE,
+		SD_VARLINK_FIELD_COMMENT("Name of sysext image, either Install or Names is required"),
+                SD_VARLINK_DEFINE_INPUT(Install, SD_VARLINK_STRING, SD_VARLINK_NULLABLE),
+		SD_VARLINK_FIELD_COMMENT("Names of sysext images, all are installed with one call"),
+                SD_VARLINK_DEFINE_INPUT(Names, SD_VARLINK_STRING, SD_VARLINK_ARRAY | SD_VARLINK_NULLABLE),
                 SD_VARLINK_FIELD_COMMENT("URL of remote sysext images"),
                 SD_VARLINK_DEFINE_INPUT(URL, SD_VARLINK_STRING, SD_VARLINK_NULLABLE),
                 SD_VARLINK_FIELD_COMMENT("Verbose logging to journald"),
@@ -72,11 +160,18 @@ static SD_VARLINK_DEFINE_METHOD(
                 SD_VARLINK_DEFINE_OUTPUT(Success, SD_VARLINK_BOOL, 0),
                 SD_VARLINK_FIELD_COMMENT("Data of sysext images"),
                 SD_VARLINK_DEFINE_OUTPUT_BY_TYPE(Images, ImageData, SD_VARLINK_ARRAY | SD_VARLINK_NULLABLE),
+                SD_VARLINK_FIELD_COMMENT("Installed image, if called with Install"),
+                SD_VARLINK_DEFINE_OUTPUT(Installed, SD_VARLINK_STRING, SD_VARLINK_NULLABLE),
+                SD_VARLINK_FIELD_COMMENT("Result for every image, if called with Names"),
+                SD_VARLINK_DEFINE_OUTPUT_BY_TYPE(Results, InstallResult, SD_VARLINK_ARRAY | SD_VARLINK_NULLABLE),
+                SD_VARLINK_FIELD_COMMENT("Progress of the installation, only with 'more'"),
+                SD_VARLINK_DEFINE_OUTPUT_BY_TYPE(Progress, Progress, SD_VARLINK_NULLABLE),
                 SD_VARLINK_FIELD_COMMENT("Error Message"),
                 SD_VARLINK_DEFINE_OUTPUT(ErrorMsg, SD_VARLINK_STRING, SD_VARLINK_NULLABLE));
 
-static SD_VARLINK_DEFINE_METHOD(
+static SD_VARLINK_DEFINE_METHOD_FULL(
                 ListImages,
+                SD_VARLINK_SUPPORTS_MORE,
                 SD_VARLINK_FIELD_COMMENT("URL of remote sysext images, requires root rights"),
                 SD_VARLINK_DEFINE_INPUT(URL, SD_VARLINK_STRING,  SD_VARLINK_NULLABLE),
 		SD_VARLINK_FIELD_COMMENT("Verbose logging to journald"),
@@ -85,23 +180,117 @@ static SD_VARLINK_DEFINE_METHOD(
 		SD_VARLINK_DEFINE_INPUT(All, SD_VARLINK_BOOL, SD_VARLINK_NULLABLE),
 		SD_VARLINK_FIELD_COMMENT("If call succeeded"),
 		SD_VARLINK_DEFINE_OUTPUT(Success, SD_VARLINK_BOOL, 0),
-                SD_VARLINK_FIELD_COMMENT("Data of sysext images"),
+                SD_VARLINK_FIELD_COMMENT("Data of sysext images, one image per reply with 'more'"),
 		SD_VARLINK_DEFINE_OUTPUT_BY_TYPE(Images, ImageData, SD_VARLINK_ARRAY | SD_VARLINK_NULLABLE),
                 SD_VARLINK_FIELD_COMMENT("Error Message"),
                 SD_VARLINK_DEFINE_OUTPUT(ErrorMsg, SD_VARLINK_STRING, SD_VARLINK_NULLABLE));
 
-static SD_VARLINK_DEFINE_METHOD(
+static SD_VARLINK_DEFINE_METHOD_FULL(
                 Update,
+                SD_VARLINK_SUPPORTS_MORE,
                 SD_VARLINK_FIELD_COMMENT("URL of remote sysext images, requires root rights"),
                 SD_VARLINK_DEFINE_INPUT(URL, SD_VARLINK_STRING, SD_VARLINK_NULLABLE),
 		SD_VARLINK_FIELD_COMMENT("Verbose logging to journald"),
 		SD_VARLINK_DEFINE_INPUT(Verbose, SD_VARLINK_BOOL, SD_VARLINK_NULLABLE),
 		SD_VARLINK_FIELD_COMMENT("Prefix to a different root filesystem"),
 		SD_VARLINK_DEFINE_INPUT(Prefix, SD_VARLINK_STRING, SD_VARLINK_NULLABLE),
+		SD_VARLINK_FIELD_COMMENT("Report like Check and do not update if BrokenImages is not empty"),
+		SD_VARLINK_DEFINE_INPUT(Check, SD_VARLINK_BOOL, SD_VARLINK_NULLABLE),
 		SD_VARLINK_FIELD_COMMENT("If call succeeded"),
 		SD_VARLINK_DEFINE_OUTPUT(Success, SD_VARLINK_BOOL, 0),
                 SD_VARLINK_FIELD_COMMENT("List of updated images"),
+		SD_VARLINK_DEFINE_OUTPUT_BY_TYPE(Updated, UpdatedImage, SD_VARLINK_ARRAY | SD_VARLINK_NULLABLE),
+                SD_VARLINK_FIELD_COMMENT("Report of Check, only with Check"),
 		SD_VARLINK_DEFINE_OUTPUT_BY_TYPE(Images, UpdatedImage, SD_VARLINK_ARRAY | SD_VARLINK_NULLABLE),
+                SD_VARLINK_FIELD_COMMENT("Incompatible installed images without update, only with Check"),
+		SD_VARLINK_DEFINE_OUTPUT_BY_TYPE(BrokenImages, BrokenImage, SD_VARLINK_ARRAY | SD_VARLINK_NULLABLE),
+                SD_VARLINK_FIELD_COMMENT("Progress of the update, only with 'more'"),
+                SD_VARLINK_DEFINE_OUTPUT_BY_TYPE(Progress, Progress, SD_VARLINK_NULLABLE),
+                SD_VARLINK_FIELD_COMMENT("Error Message"),
+                SD_VARLINK_DEFINE_OUTPUT(ErrorMsg, SD_VARLINK_STRING, SD_VARLINK_NULLABLE));
+
+static SD_VARLINK_DEFINE_METHOD(
+                GetMetrics,
+		SD_VARLINK_FIELD_COMMENT("If call succeeded"),
+		SD_VARLINK_DEFINE_OUTPUT(Success, SD_VARLINK_BOOL, 0),
+                SD_VARLINK_FIELD_COMMENT("Counters of downloads, caches, systemd-dissect and snapshot scans"),
+		SD_VARLINK_DEFINE_OUTPUT_BY_TYPE(Counters, Counter, SD_VARLINK_ARRAY),
+                SD_VARLINK_FIELD_COMMENT("Latency of methods running on a worker and of fetch phases"),
+		SD_VARLINK_DEFINE_OUTPUT_BY_TYPE(Histograms, Histogram, SD_VARLINK_ARRAY | SD_VARLINK_NULLABLE),
+                SD_VARLINK_FIELD_COMMENT("Error Message"),
+                SD_VARLINK_DEFINE_OUTPUT(ErrorMsg, SD_VARLINK_STRING, SD_VARLINK_NULLABLE));
+
+static SD_VARLINK_DEFINE_METHOD(
+                StartInstall,
+		SD_VARLINK_FIELD_COMMENT("Name of sysext image, either Install or Names is required"),
+                SD_VARLINK_DEFINE_INPUT(Install, SD_VARLINK_STRING, SD_VARLINK_NULLABLE),
+		SD_VARLINK_FIELD_COMMENT("Names of sysext images, all are installed with one call"),
+                SD_VARLINK_DEFINE_INPUT(Names, SD_VARLINK_STRING, SD_VARLINK_ARRAY | SD_VARLINK_NULLABLE),
+                SD_VARLINK_FIELD_COMMENT("URL of remote sysext images"),
+                SD_VARLINK_DEFINE_INPUT(URL, SD_VARLINK_STRING, SD_VARLINK_NULLABLE),
+                SD_VARLINK_FIELD_COMMENT("Verbose logging to journald"),
+                SD_VARLINK_DEFINE_INPUT(Verbose, SD_VARLINK_BOOL, SD_VARLINK_NULLABLE),
+                SD_VARLINK_FIELD_COMMENT("Cancel the job after this many seconds"),
+                SD_VARLINK_DEFINE_INPUT(Timeout, SD_VARLINK_INT, SD_VARLINK_NULLABLE),
+                SD_VARLINK_FIELD_COMMENT("If the job got started"),
+                SD_VARLINK_DEFINE_OUTPUT(Success, SD_VARLINK_BOOL, 0),
+                SD_VARLINK_FIELD_COMMENT("Id of the job"),
+                SD_VARLINK_DEFINE_OUTPUT(Id, SD_VARLINK_INT, SD_VARLINK_NULLABLE),
+                SD_VARLINK_FIELD_COMMENT("Error Message"),
+                SD_VARLINK_DEFINE_OUTPUT(ErrorMsg, SD_VARLINK_STRING, SD_VARLINK_NULLABLE));
+
+static SD_VARLINK_DEFINE_METHOD(
+                StartUpdate,
+                SD_VARLINK_FIELD_COMMENT("URL of remote sysext images"),
+                SD_VARLINK_DEFINE_INPUT(URL, SD_VARLINK_STRING, SD_VARLINK_NULLABLE),
+		SD_VARLINK_FIELD_COMMENT("Verbose logging to journald"),
+		SD_VARLINK_DEFINE_INPUT(Verbose, SD_VARLINK_BOOL, SD_VARLINK_NULLABLE),
+		SD_VARLINK_FIELD_COMMENT("Prefix to a different root filesystem"),
+		SD_VARLINK_DEFINE_INPUT(Prefix, SD_VARLINK_STRING, SD_VARLINK_NULLABLE),
+		SD_VARLINK_FIELD_COMMENT("Report like Check and do not update if an image is incompatible"),
+		SD_VARLINK_DEFINE_INPUT(Check, SD_VARLINK_BOOL, SD_VARLINK_NULLABLE),
+                SD_VARLINK_FIELD_COMMENT("Cancel the job after this many seconds"),
+                SD_VARLINK_DEFINE_INPUT(Timeout, SD_VARLINK_INT, SD_VARLINK_NULLABLE),
+                SD_VARLINK_FIELD_COMMENT("If the job got started"),
+                SD_VARLINK_DEFINE_OUTPUT(Success, SD_VARLINK_BOOL, 0),
+                SD_VARLINK_FIELD_COMMENT("Id of the job"),
+                SD_VARLINK_DEFINE_OUTPUT(Id, SD_VARLINK_INT, SD_VARLINK_NULLABLE),
+                SD_VARLINK_FIELD_COMMENT("Error Message"),
+                SD_VARLINK_DEFINE_OUTPUT(ErrorMsg, SD_VARLINK_STRING, SD_VARLINK_NULLABLE));
+
+#define JOB_OUTPUT							\
+  SD_VARLINK_FIELD_COMMENT("Id of the job"),				\
+  SD_VARLINK_DEFINE_OUTPUT(Id, SD_VARLINK_INT, 0),			\
+  SD_VARLINK_FIELD_COMMENT("Install or Update"),				\
+  SD_VARLINK_DEFINE_OUTPUT(Method, SD_VARLINK_STRING, 0),		\
+  SD_VARLINK_FIELD_COMMENT("running, succeeded, failed, cancelled or timeout"), \
+  SD_VARLINK_DEFINE_OUTPUT(State, SD_VARLINK_STRING, 0),		\
+  SD_VARLINK_FIELD_COMMENT("Last progress report of the job"),		\
+  SD_VARLINK_DEFINE_OUTPUT_BY_TYPE(Progress, Progress, SD_VARLINK_NULLABLE), \
+  SD_VARLINK_FIELD_COMMENT("Reply of the method, once the job finished"), \
+  SD_VARLINK_DEFINE_OUTPUT(Result, SD_VARLINK_OBJECT, SD_VARLINK_NULLABLE), \
+  SD_VARLINK_FIELD_COMMENT("Varlink error of the method, if it failed"), \
+  SD_VARLINK_DEFINE_OUTPUT(ErrorId, SD_VARLINK_STRING, SD_VARLINK_NULLABLE)
+
+static SD_VARLINK_DEFINE_METHOD(
+                GetJob,
+                SD_VARLINK_FIELD_COMMENT("Id of the job"),
+                SD_VARLINK_DEFINE_INPUT(Id, SD_VARLINK_INT, 0),
+                JOB_OUTPUT);
+
+static SD_VARLINK_DEFINE_METHOD_FULL(
+                WatchJob,
+                SD_VARLINK_REQUIRES_MORE,
+                SD_VARLINK_FIELD_COMMENT("Id of the job"),
+                SD_VARLINK_DEFINE_INPUT(Id, SD_VARLINK_INT, 0),
+                JOB_OUTPUT);
+
+static SD_VARLINK_DEFINE_METHOD(
+                CancelJob,
+                SD_VARLINK_FIELD_COMMENT("Id of the job"),
+                SD_VARLINK_DEFINE_INPUT(Id, SD_VARLINK_INT, 0),
+                SD_VARLINK_FIELD_COMMENT("If the job got cancelled"),
+                SD_VARLINK_DEFINE_OUTPUT(Success, SD_VARLINK_BOOL, 0),
                 SD_VARLINK_FIELD_COMMENT("Error Message"),
                 SD_VARLINK_DEFINE_OUTPUT(ErrorMsg, SD_VARLINK_STRING, SD_VARLINK_NULLABLE));
 
@@ -130,6 +319,10 @@ static SD_VARLINK_DEFINE_METHOD(
 static SD_VARLINK_DEFINE_ERROR(NoEntryFound);
 static SD_VARLINK_DEFINE_ERROR(InternalError);
 static SD_VARLINK_DEFINE_ERROR(DownloadError);
+static SD_VARLINK_DEFINE_ERROR(
+                NoSuchJob,
+                SD_VARLINK_FIELD_COMMENT("Id of the unknown job"),
+                SD_VARLINK_DEFINE_FIELD(Id, SD_VARLINK_INT, 0));
 
 SD_VARLINK_DEFINE_INTERFACE(
                 org_openSUSE_sysextmgr,
@@ -139,12 +332,28 @@ SD_VARLINK_DEFINE_INTERFACE(
                 &vl_method_Check,
 		SD_VARLINK_SYMBOL_COMMENT("Remove no longer used images"),
 		&vl_method_Cleanup,
+		SD_VARLINK_SYMBOL_COMMENT("Share identical data between versions of an image in the store"),
+		&vl_method_Dedup,
+		SD_VARLINK_SYMBOL_COMMENT("Compare the images in the store with their recorded digests"),
+		&vl_method_Verify,
 		SD_VARLINK_SYMBOL_COMMENT("Install newest compatible image with this name"),
                 &vl_method_Install,
 		SD_VARLINK_SYMBOL_COMMENT("List all images including dependencies"),
                 &vl_method_ListImages,
 		SD_VARLINK_SYMBOL_COMMENT("Update installed images"),
                 &vl_method_Update,
+		SD_VARLINK_SYMBOL_COMMENT("Counters and latency histograms since the daemon started"),
+                &vl_method_GetMetrics,
+		SD_VARLINK_SYMBOL_COMMENT("Start Install as job and return its id"),
+                &vl_method_StartInstall,
+		SD_VARLINK_SYMBOL_COMMENT("Start Update as job and return its id"),
+                &vl_method_StartUpdate,
+		SD_VARLINK_SYMBOL_COMMENT("Get the state of a job"),
+                &vl_method_GetJob,
+		SD_VARLINK_SYMBOL_COMMENT("Get the state of a job whenever it changes until the job finished"),
+                &vl_method_WatchJob,
+		SD_VARLINK_SYMBOL_COMMENT("Cancel a running job"),
+                &vl_method_CancelJob,
  		SD_VARLINK_SYMBOL_COMMENT("Stop the daemon"),
                 &vl_method_Quit,
 		SD_VARLINK_SYMBOL_COMMENT("Checks if the service is running."),
@@ -158,4 +367,6 @@ SD_VARLINK_DEFINE_INTERFACE(
 		SD_VARLINK_SYMBOL_COMMENT("Internal Error"),
 		&vl_error_InternalError,
 		SD_VARLINK_SYMBOL_COMMENT("Download Error"),
-		&vl_error_DownloadError);
+		&vl_error_DownloadError,
+		SD_VARLINK_SYMBOL_COMMENT("No job with this id"),
+		&vl_error_NoSuchJob);
@@ -0,0 +1,696 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/* Verification of the images in the store against the SHA256 digests
+   from SHA256SUMS recorded when they got downloaded. The digests are
+   stored in a file in the same format in the store, so they can be
+   checked with "sha256sum -c", too.
+   If fs-verity is enabled for an image, the kernel checks the content
+   on every read against the Merkle tree, so as long as the verity
+   digest did not change the image does not need to be read again. */
+
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/fsverity.h>
+#include <linux/ioprio.h>
+#include <openssl/evp.h>
+
+#include "basics.h"
+#include "sysextmgr.h"
+#include "verify.h"
+#include "images-list.h"
+#include "cache.h"
+#include "download.h"
+#include "tmpfile-util.h"
+#include "log_msg.h"
+#include "state-lock.h"
+#include "strv.h"
+
+#define DIGEST_FILE "SHA256SUMS"
+#define DIGEST_LENGTH 64          /* hex digits of a SHA256 digest */
+#define VERITY_MAX_SIZE 64        /* bytes of the largest fs-verity digest */
+#define VERITY_LENGTH (7 + 2 * VERITY_MAX_SIZE + 1) /* "sha512:<hex>" */
+
+#define VERIFY_MAX_THREADS 4
+#define VERIFY_READ_SIZE (1024 * 1024)
+
+void
+free_image_verify_list(struct image_verify **list)
+{
+  if (!list || !*list)
+    return;
+
+  for (size_t i = 0; (*list)[i].image_name != NULL; i++)
+    free((*list)[i].image_name);
+  *list = mfree(*list);
+}
+
+static bool
+is_digest(const char *s, size_t len)
+{
+  if (len != DIGEST_LENGTH)
+    return false;
+
+  for (size_t i = 0; i < len; i++)
+    if (!strchr("0123456789abcdefABCDEF", s[i]))
+      return false;
+
+  return true;
+}
+
+struct recorded_digest {
+  char *image_name;
+  char digest[DIGEST_LENGTH + 1];
+};
+
+static void
+free_recorded_digests(struct recorded_digest **list)
+{
+  if (!list || !*list)
+    return;
+
+  for (size_t i = 0; (*list)[i].image_name != NULL; i++)
+    free((*list)[i].image_name);
+  *list = mfree(*list);
+}
+
+static const char *
+recorded_digest(const struct recorded_digest *list, const char *image_name)
+{
+  for (size_t i = 0; list && list[i].image_name; i++)
+    if (streq(list[i].image_name, image_name))
+      return list[i].digest;
+
+  return NULL;
+}
+
+/* Read the recorded digests, lines in the format of sha256sum:
+   "<digest>  <image>" or "<digest> *<image>". The list is terminated
+   by an entry without image name, a missing file is no error. */
+static int
+read_digests(int store_fd, struct recorded_digest **ret)
+{
+  _cleanup_(free_recorded_digests) struct recorded_digest *list = NULL;
+  _cleanup_fclose_ FILE *fp = NULL;
+  _cleanup_free_ char *line = NULL;
+  size_t size = 0, n = 0;
+  int fd, r;
+
+  fd = openat(store_fd, DIGEST_FILE, O_RDONLY|O_CLOEXEC);
+  if (fd < 0)
+    {
+      if (errno != ENOENT)
+	return -errno;
+      *ret = NULL;
+      return 0;
+    }
+
+  fp = fdopen(fd, "r");
+  if (fp == NULL)
+    {
+      r = -errno;
+      close(fd);
+      return r;
+    }
+
+  list = calloc(1, sizeof(struct recorded_digest));
+  if (list == NULL)
+    return -ENOMEM;
+
+  while (getline(&line, &size, fp) > 0)
+    {
+      struct recorded_digest *tmp;
+      char *name;
+
+      line[strcspn(line, "\n")] = '\0';
+
+      if (strlen(line) < DIGEST_LENGTH + 2 || !is_digest(line, DIGEST_LENGTH) ||
+	  line[DIGEST_LENGTH] != ' ')
+	continue;
+
+      name = line + DIGEST_LENGTH + 1;
+      if (*name == ' ' || *name == '*')
+	name++;
+      if (isempty(name))
+	continue;
+
+      tmp = realloc(list, (n + 2) * sizeof(struct recorded_digest));
+      if (tmp == NULL)
+	return -ENOMEM;
+      list = tmp;
+      list[n + 1].image_name = NULL;
+
+      list[n].image_name = strdup(name);
+      if (list[n].image_name == NULL)
+	return -ENOMEM;
+      memcpy(list[n].digest, line, DIGEST_LENGTH);
+      list[n].digest[DIGEST_LENGTH] = '\0';
+      n++;
+    }
+
+  *ret = TAKE_PTR(list);
+
+  return 0;
+}
+
+/* Record the digest of an image after it got downloaded to the store.
+   Entries of images which don't exist anymore are removed. */
+int
+verify_record_digest(const char *store, const char *image_name, const char *digest)
+{
+  _cleanup_(free_recorded_digests) struct recorded_digest *list = NULL;
+  _cleanup_(unlink_tempfilep) char tmpfn[PATH_MAX] = "";
+  _cleanup_free_ char *fn = NULL;
+  _cleanup_close_ int store_fd = -EBADF;
+  _cleanup_fclose_ FILE *fp = NULL;
+  int fd, r;
+
+  assert(store);
+  assert(image_name);
+
+  if (digest == NULL || !is_digest(digest, strlen(digest)))
+    return -EINVAL;
+
+  store_fd = open(store, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+  if (store_fd < 0)
+    return -errno;
+
+  r = read_digests(store_fd, &list);
+  if (r < 0)
+    return r;
+
+  r = join_path(store, DIGEST_FILE, &fn);
+  if (r < 0)
+    return r;
+  r = snprintf(tmpfn, sizeof(tmpfn), "%s/." DIGEST_FILE ".XXXXXX", store);
+  if (r < 0 || (size_t)r >= sizeof(tmpfn))
+    return -ENAMETOOLONG;
+
+  fd = mkostemp_safe(tmpfn);
+  if (fd < 0)
+    return fd;
+  fp = fdopen(fd, "w");
+  if (fp == NULL)
+    {
+      r = -errno;
+      close(fd);
+      return r;
+    }
+  (void) fchmod(fd, 0644);
+
+  for (size_t i = 0; list && list[i].image_name; i++)
+    {
+      if (streq(list[i].image_name, image_name) ||
+	  faccessat(store_fd, list[i].image_name, F_OK, AT_SYMLINK_NOFOLLOW) < 0)
+	continue;
+      fprintf(fp, "%s  %s\n", list[i].digest, list[i].image_name);
+    }
+  fprintf(fp, "%s  %s\n", digest, image_name);
+
+  if (fflush(fp) != 0 || fsync(fileno(fp)) < 0)
+    return -errno;
+
+  if (rename(tmpfn, fn) < 0)
+    return -errno;
+
+  return 0;
+}
+
+/* don't change the atime, Cleanup uses it to find the least
+   recently used images */
+static int
+open_image(int store_fd, const char *image_name)
+{
+  int fd;
+
+  fd = openat(store_fd, image_name, O_RDONLY|O_CLOEXEC|O_NOATIME);
+  if (fd < 0 && errno == EPERM)
+    fd = openat(store_fd, image_name, O_RDONLY|O_CLOEXEC);
+  if (fd < 0)
+    return -errno;
+
+  return fd;
+}
+
+/* Query the fs-verity digest of the file as "<algorithm>:<hex>" like
+   fsverity(1) prints it. Returns -ENODATA if fs-verity is not enabled
+   for the file or not supported by the filesystem. */
+static int
+measure_verity(int fd, char ret[static VERITY_LENGTH])
+{
+  _cleanup_free_ struct fsverity_digest *d = NULL;
+  const char *alg;
+  char *p;
+
+  d = malloc(sizeof(struct fsverity_digest) + VERITY_MAX_SIZE);
+  if (d == NULL)
+    return -ENOMEM;
+  d->digest_size = VERITY_MAX_SIZE;
+
+  if (ioctl(fd, FS_IOC_MEASURE_VERITY, d) < 0)
+    {
+      if (errno == ENOTTY || errno == EOPNOTSUPP)
+	return -ENODATA;
+      return -errno;
+    }
+
+  switch (d->digest_algorithm)
+    {
+    case FS_VERITY_HASH_ALG_SHA256:
+      alg = "sha256";
+      break;
+    case FS_VERITY_HASH_ALG_SHA512:
+      alg = "sha512";
+      break;
+    default:
+      return -EOPNOTSUPP;
+    }
+
+  p = stpcpy(stpcpy(ret, alg), ":");
+  for (unsigned int i = 0; i < d->digest_size && i < VERITY_MAX_SIZE; i++)
+    p += sprintf(p, "%02x", d->digest[i]);
+
+  return 0;
+}
+
+/* images which need to be hashed, shared by all hash threads */
+struct verify_item {
+  const char *image_name;
+  char digest[DIGEST_LENGTH + 1];
+  char verity[VERITY_LENGTH];  /* empty if fs-verity is not enabled */
+  uint64_t bytes;
+  int result;
+};
+
+struct verify_hash {
+  int store_fd;
+  size_t n;
+  struct verify_item *items;
+  uint64_t max_rate;        /* bytes per second and thread, 0 for no limit */
+  size_t next;              /* next image to hash, atomic */
+};
+
+static uint64_t
+timespec_usec(const struct timespec *ts)
+{
+  return (uint64_t)ts->tv_sec * USEC_PER_SEC + (uint64_t)ts->tv_nsec / NSEC_PER_USEC;
+}
+
+static uint64_t
+now_usec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return timespec_usec(&ts);
+}
+
+/* Sleep until reading bytes since start does not exceed max_rate */
+static void
+throttle(uint64_t start, uint64_t bytes, uint64_t max_rate)
+{
+  uint64_t due, now;
+
+  if (max_rate == 0)
+    return;
+
+  due = start + bytes / max_rate * USEC_PER_SEC +
+    (bytes % max_rate) * USEC_PER_SEC / max_rate;
+  now = now_usec();
+  if (due > now)
+    {
+      struct timespec ts = {
+	.tv_sec = (due - now) / USEC_PER_SEC,
+	.tv_nsec = ((due - now) % USEC_PER_SEC) * NSEC_PER_USEC,
+      };
+      nanosleep(&ts, NULL);
+    }
+}
+
+static void
+EVP_MD_CTX_freep(EVP_MD_CTX **ctx)
+{
+  if (*ctx)
+    EVP_MD_CTX_free(*ctx);
+}
+
+/* OpenSSL uses the SHA extensions of the CPU if available */
+static int
+hash_image(const struct verify_hash *h, struct verify_item *item, uint8_t *buf)
+{
+  _cleanup_(EVP_MD_CTX_freep) EVP_MD_CTX *ctx = NULL;
+  _cleanup_close_ int fd = -EBADF;
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int md_len = 0;
+  uint64_t start;
+  int r;
+
+  fd = open_image(h->store_fd, item->image_name);
+  if (fd < 0)
+    return fd;
+
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_NOREUSE);
+
+  ctx = EVP_MD_CTX_new();
+  if (ctx == NULL)
+    return -ENOMEM;
+  if (EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) != 1)
+    return -EIO;
+
+  start = now_usec();
+  for (;;)
+    {
+      ssize_t n = read(fd, buf, VERIFY_READ_SIZE);
+
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return -errno;
+	}
+      if (n == 0)
+	break;
+
+      if (EVP_DigestUpdate(ctx, buf, n) != 1)
+	return -EIO;
+      item->bytes += n;
+
+      throttle(start, item->bytes, h->max_rate);
+    }
+
+  if (EVP_DigestFinal_ex(ctx, md, &md_len) != 1 || md_len * 2 != DIGEST_LENGTH)
+    return -EIO;
+
+  for (unsigned int i = 0; i < md_len; i++)
+    sprintf(&item->digest[i * 2], "%02x", md[i]);
+
+  r = measure_verity(fd, item->verity);
+  if (r == -ENODATA)
+    item->verity[0] = '\0';
+  else if (r < 0)
+    return r;
+
+  return 0;
+}
+
+static void *
+verify_hash_thread(void *userdata)
+{
+  struct verify_hash *h = userdata;
+  _cleanup_free_ uint8_t *buf = NULL;
+  size_t i;
+
+  /* hashing the store should not slow down anything else */
+  syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+	  IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0));
+
+  buf = malloc(VERIFY_READ_SIZE);
+
+  while ((i = __atomic_fetch_add(&h->next, 1, __ATOMIC_RELAXED)) < h->n)
+    {
+      if (buf == NULL)
+	h->items[i].result = -ENOMEM;
+      else
+	h->items[i].result = hash_image(h, &h->items[i], buf);
+    }
+
+  return NULL;
+}
+
+/* Hash the images with one thread per CPU, at most VERIFY_MAX_THREADS,
+   the calling thread takes part, too. */
+static void
+hash_images(struct verify_hash *h)
+{
+  pthread_t threads[VERIFY_MAX_THREADS];
+  size_t n_threads = 0, max_threads;
+  long cpus;
+
+  cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  max_threads = cpus > 0 ? (size_t)cpus : 1;
+  if (max_threads > VERIFY_MAX_THREADS)
+    max_threads = VERIFY_MAX_THREADS;
+  if (max_threads > h->n)
+    max_threads = h->n;
+
+  /* the rate limit is for all threads together */
+  if (h->max_rate > 0 && max_threads > 1)
+    h->max_rate = h->max_rate / max_threads ?: 1;
+
+  /* if a thread cannot be created, the others do the work */
+  while (n_threads + 1 < max_threads &&
+	 pthread_create(&threads[n_threads], NULL, verify_hash_thread, h) == 0)
+    n_threads++;
+
+  verify_hash_thread(h);
+
+  for (size_t i = 0; i < n_threads; i++)
+    pthread_join(threads[i], NULL);
+}
+
+static int
+digest_result(const char *digest, const char *expected)
+{
+  return strcaseeq(digest, expected) ? 0 : -EBADMSG;
+}
+
+/* Enable fs-verity for an image freshly moved into the store and
+   cache its SHA256 digest together with the verity digest, so that
+   Verify only needs to query the verity digest. The image must not
+   be open for writing anymore. Returns -EOPNOTSUPP if the filesystem
+   does not support fs-verity and -EBADMSG if the image does not match
+   digest. */
+int
+verify_enable_verity(const char *store, const char *image_name, const char *digest)
+{
+  /* older kernels only support the page size as block size */
+  struct fsverity_enable_arg arg = {
+    .version = 1,
+    .hash_algorithm = FS_VERITY_HASH_ALG_SHA256,
+    .block_size = sysconf(_SC_PAGESIZE),
+  };
+  _cleanup_close_ int store_fd = -EBADF;
+  _cleanup_close_ int fd = -EBADF;
+  _cleanup_free_ uint8_t *buf = NULL;
+  struct verify_hash h = {};
+  struct verify_item item = {
+    .image_name = image_name,
+  };
+  bool suspended;
+  struct stat st;
+  int r;
+
+  assert(store);
+  assert(image_name);
+
+  store_fd = open(store, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+  if (store_fd < 0)
+    return -errno;
+
+  fd = open_image(store_fd, image_name);
+  if (fd < 0)
+    return fd;
+
+  buf = malloc(VERIFY_READ_SIZE);
+  if (buf == NULL)
+    return -ENOMEM;
+
+  suspended = state_suspend();
+
+  /* this reads the whole image to build the Merkle tree */
+  if (ioctl(fd, FS_IOC_ENABLE_VERITY, &arg) < 0 && errno != EEXIST)
+    r = (errno == ENOTTY || errno == EOPNOTSUPP) ? -EOPNOTSUPP : -errno;
+  else if (fstat(fd, &st) < 0)
+    r = -errno;
+  else
+    {
+      /* the image is in the page cache now, hashing it is cheap */
+      h.store_fd = store_fd;
+      r = hash_image(&h, &item, buf);
+    }
+
+  state_resume(suspended);
+  if (r < 0)
+    return r;
+
+  if (isempty(item.verity))
+    return -EOPNOTSUPP;
+
+  r = cache_digest_put(image_name, st.st_ino, st.st_size,
+		       timespec_usec(&st.st_mtim), item.digest, item.verity);
+  if (r < 0)
+    return r;
+
+  if (digest && !strcaseeq(item.digest, digest))
+    return -EBADMSG;
+
+  log_msg(LOG_DEBUG, "fs-verity enabled for '%s': %s", image_name, item.verity);
+
+  return 0;
+}
+
+/* The cached digest of an image with fs-verity is still valid if the
+   verity digest is unchanged. */
+static bool
+verity_unchanged(int store_fd, const char *image_name, const char *verity)
+{
+  _cleanup_close_ int fd = -EBADF;
+  char measured[VERITY_LENGTH];
+
+  fd = open_image(store_fd, image_name);
+  if (fd < 0)
+    return false;
+
+  if (measure_verity(fd, measured) < 0)
+    return false;
+
+  return streq(measured, verity);
+}
+
+/* Compare all images in store with their recorded digests. Digests
+   get cached with inode, size and mtime of the image, so only new or
+   modified images are read. For images with fs-verity the verity
+   digest is checked instead. The number of bytes read is returned in
+   ret_bytes. */
+int
+verify_store(const char *store, struct image_verify **ret, size_t *ret_n,
+	     uint64_t *ret_bytes)
+{
+  _cleanup_(free_image_verify_list) struct image_verify *list = NULL;
+  _cleanup_strv_free_ char **images = NULL;
+  _cleanup_(free_recorded_digests) struct recorded_digest *recorded = NULL;
+  _cleanup_free_ struct verify_item *items = NULL;
+  _cleanup_free_ struct stat *stats = NULL;
+  _cleanup_free_ size_t *item_of = NULL;
+  _cleanup_close_ int store_fd = -EBADF;
+  struct verify_hash h = {};
+  uint64_t bytes = 0;
+  size_t n;
+  int r;
+
+  assert(store);
+  assert(ret);
+  assert(ret_n);
+
+  r = discover_images(store, &images, true);
+  if (r < 0)
+    return r;
+
+  n = strv_length(images);
+
+  store_fd = open(store, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+  if (store_fd < 0)
+    return -errno;
+
+  r = read_digests(store_fd, &recorded);
+  if (r < 0)
+    return r;
+
+  /* forget about removed images */
+  cache_digest_prune(images);
+
+  list = calloc(n + 1, sizeof(struct image_verify));
+  items = calloc(n, sizeof(struct verify_item));
+  stats = calloc(n, sizeof(struct stat));
+  item_of = calloc(n, sizeof(size_t));
+  if (list == NULL || items == NULL || stats == NULL || item_of == NULL)
+    return -ENOMEM;
+
+  for (size_t i = 0; i < n; i++)
+    {
+      const char *expected, *cached, *verity = NULL;
+
+      list[i].image_name = strdup(images[i]);
+      if (list[i].image_name == NULL)
+	return -ENOMEM;
+
+      expected = recorded_digest(recorded, images[i]);
+      if (expected == NULL)
+	{
+	  log_msg(LOG_DEBUG, "No digest recorded for '%s'", images[i]);
+	  list[i].result = -ENOKEY;
+	  continue;
+	}
+
+      if (fstatat(store_fd, images[i], &stats[i], 0) < 0)
+	{
+	  list[i].result = -errno;
+	  continue;
+	}
+
+      cached = cache_digest_get(images[i], stats[i].st_ino, stats[i].st_size,
+				timespec_usec(&stats[i].st_mtim), &verity);
+      if (cached && verity && !verity_unchanged(store_fd, images[i], verity))
+	{
+	  log_msg(LOG_WARNING, "fs-verity digest of '%s' changed", images[i]);
+	  cached = NULL;
+	}
+      if (cached)
+	{
+	  list[i].result = digest_result(cached, expected);
+	  continue;
+	}
+
+      item_of[h.n] = i;
+      items[h.n].image_name = images[i];
+      h.n++;
+    }
+
+  if (h.n > 0)
+    {
+      log_msg(LOG_DEBUG, "Hashing %zu of %zu images", h.n, n);
+
+      h.store_fd = store_fd;
+      h.items = items;
+      h.max_rate = config.verify_max_rate;
+
+      bool suspended = state_suspend();
+      hash_images(&h);
+      state_resume(suspended);
+    }
+
+  for (size_t k = 0; k < h.n; k++)
+    {
+      size_t i = item_of[k];
+
+      bytes += items[k].bytes;
+
+      if (items[k].result < 0)
+	{
+	  list[i].result = items[k].result;
+	  continue;
+	}
+
+      r = cache_digest_put(images[i], stats[i].st_ino, stats[i].st_size,
+			   timespec_usec(&stats[i].st_mtim), items[k].digest,
+			   isempty(items[k].verity) ? NULL : items[k].verity);
+      if (r < 0)
+	return r;
+
+      list[i].result = digest_result(items[k].digest,
+				     recorded_digest(recorded, images[i]));
+    }
+
+  for (size_t i = 0; i < n; i++)
+    if (list[i].result == -EBADMSG)
+      log_msg(LOG_ERR, "Image '%s' does not match its digest", list[i].image_name);
+    else if (list[i].result < 0 && list[i].result != -ENOKEY)
+      log_msg(LOG_ERR, "Verifying '%s' failed: %s", list[i].image_name,
+	      strerror(-list[i].result));
+
+  *ret = TAKE_PTR(list);
+  *ret_n = n;
+  if (ret_bytes)
+    *ret_bytes = bytes;
+
+  return 0;
+}
@@ -0,0 +1,19 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Result of the verification of one image in the store. result is
+   0 if the image matches the recorded digest, -EBADMSG if not,
+   -ENOKEY if no digest got recorded and else the error reading it. */
+struct image_verify {
+  char *image_name;
+  int result;
+};
+
+extern void free_image_verify_list(struct image_verify **list);
+extern int verify_record_digest(const char *store, const char *image_name, const char *digest);
+extern int verify_enable_verity(const char *store, const char *image_name, const char *digest);
+extern int verify_store(const char *store, struct image_verify **ret, size_t *ret_n, uint64_t *ret_bytes);
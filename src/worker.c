@@ -0,0 +1,422 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/* Long running varlink methods are executed on a worker thread, so
+   that the event loop keeps answering Ping and other cheap requests
+   while images get downloaded. sd-varlink and sd-event objects must
+   not be used by more than one thread, so every worker runs its own
+   varlink server with the unchanged method handler on one end of a
+   socketpair. The event loop calls the method on the other end and
+   forwards the replies to the caller. Jobs use the same mechanism,
+   but keep the replies themselves, see job.c.
+   At most WORKER_THREADS_MAX threads run at the same time, further
+   methods wait in a queue until one of them is done. */
+
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include <systemd/sd-event.h>
+#include <systemd/sd-varlink.h>
+
+#include "basics.h"
+#include "log_msg.h"
+#include "metrics.h"
+#include "process.h"
+#include "state-lock.h"
+#include "sysextmgr.h"
+#include "trace.h"
+#include "worker.h"
+#include "varlink-org.openSUSE.sysextmgr.h"
+
+/* Upper limit of worker threads */
+#define WORKER_THREADS_MAX 8
+
+struct worker {
+  struct worker *next;      /* next worker in the queue */
+  sd_varlink_method_t callback;
+  char *method;
+  uid_t peer_uid;           /* UID of the caller of the method */
+  int fd;
+  int cancel_fd;            /* readable once the method should stop */
+  uint64_t start;           /* when the method got called */
+  bool busy;
+};
+
+static pthread_mutex_t workers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workers_cond = PTHREAD_COND_INITIALIZER;
+static size_t n_busy = 0;
+
+/* workers waiting for a thread, protected by workers_mutex */
+static struct worker *queue_head = NULL;
+static struct worker *queue_tail = NULL;
+static size_t n_threads = 0;
+
+/* the worker running on this thread, NULL for the event loop */
+static __thread struct worker *current_worker = NULL;
+
+static void
+worker_free(struct worker *w)
+{
+  if (w == NULL)
+    return;
+
+  if (w->fd >= 0)
+    close(w->fd);
+  if (w->cancel_fd >= 0)
+    close(w->cancel_fd);
+  free(w->method);
+  free(w);
+}
+
+static void
+worker_freep(struct worker **w)
+{
+  worker_free(*w);
+}
+
+/* Called once a worker does not touch shared state anymore */
+static void
+worker_idle(struct worker *w)
+{
+  if (!w->busy)
+    return;
+
+  pthread_mutex_lock(&workers_mutex);
+  w->busy = false;
+  n_busy--;
+  pthread_cond_broadcast(&workers_cond);
+  pthread_mutex_unlock(&workers_mutex);
+}
+
+/* Number of workers running a method */
+size_t
+worker_busy(void)
+{
+  size_t n;
+
+  pthread_mutex_lock(&workers_mutex);
+  n = n_busy;
+  pthread_mutex_unlock(&workers_mutex);
+
+  return n;
+}
+
+/* Wait until all workers finished their method. Their replies are
+   not forwarded anymore if the event loop is not running. */
+void
+worker_wait_all(void)
+{
+  pthread_mutex_lock(&workers_mutex);
+  while (n_busy > 0)
+    pthread_cond_wait(&workers_cond, &workers_mutex);
+  pthread_mutex_unlock(&workers_mutex);
+}
+
+/* The peer of a method running on a worker is the daemon itself */
+int
+worker_get_peer_uid(sd_varlink *link, uid_t *ret)
+{
+  if (current_worker)
+    {
+      *ret = current_worker->peer_uid;
+      return 0;
+    }
+
+  return sd_varlink_get_peer_uid(link, ret);
+}
+
+static int
+worker_method(sd_varlink *link, sd_json_variant *parameters,
+	      sd_varlink_method_flags_t flags, void *userdata)
+{
+  struct worker *w = userdata;
+  struct trace t;
+  int r;
+
+  trace_begin(&t, w->method, w->start);
+  state_lock();
+  process_set_cancel_fd(w->cancel_fd);
+  r = w->callback(link, parameters, flags, NULL);
+  process_set_cancel_fd(-EBADF);
+  state_unlock();
+  trace_end();
+
+  (void) metrics_method_done(w->method, w->start);
+
+  worker_idle(w);
+
+  return r;
+}
+
+static void
+worker_run(struct worker *w_arg)
+{
+  _cleanup_(worker_freep) struct worker *w = w_arg;
+  _cleanup_(sd_varlink_server_unrefp) sd_varlink_server *server = NULL;
+  _cleanup_(sd_event_unrefp) sd_event *event = NULL;
+  int r;
+
+  current_worker = w;
+
+  r = sd_event_new(&event);
+  if (r >= 0)
+    r = sd_varlink_server_new(&server, SD_VARLINK_SERVER_INHERIT_USERDATA);
+  if (r >= 0)
+    r = sd_varlink_server_add_interface(server, &vl_interface_org_openSUSE_sysextmgr);
+  if (r >= 0)
+    r = sd_varlink_server_bind_method(server, w->method, worker_method);
+  if (r >= 0)
+    {
+      sd_varlink_server_set_userdata(server, w);
+      r = sd_varlink_server_attach_event(server, event, SD_EVENT_PRIORITY_NORMAL);
+    }
+  /* quit after the event loop closed the connection */
+  if (r >= 0)
+    r = sd_varlink_server_set_exit_on_idle(server, true);
+  if (r >= 0)
+    {
+      r = sd_varlink_server_add_connection(server, w->fd, NULL);
+      if (r >= 0)
+	w->fd = -EBADF;
+    }
+  if (r >= 0)
+    r = sd_event_loop(event);
+
+  if (r < 0)
+    log_msg(LOG_ERR, "Worker for \"%s\" failed: %s", w->method, strerror(-r));
+
+  /* the reply got sent already */
+  if (config.metrics_file)
+    {
+      r = metrics_write_textfile(config.metrics_file);
+      if (r < 0)
+	log_msg(LOG_WARNING, "Failed to write metrics to %s: %s",
+		config.metrics_file, strerror(-r));
+    }
+
+  /* if the method did not run */
+  worker_idle(w);
+  current_worker = NULL;
+}
+
+/* Run queued workers until the queue is empty */
+static void *
+worker_thread(void _unused_(*userdata))
+{
+  for (;;)
+    {
+      struct worker *w;
+
+      pthread_mutex_lock(&workers_mutex);
+      w = queue_head;
+      if (w == NULL)
+	{
+	  n_threads--;
+	  pthread_mutex_unlock(&workers_mutex);
+	  return NULL;
+	}
+      queue_head = w->next;
+      if (queue_head == NULL)
+	queue_tail = NULL;
+      pthread_mutex_unlock(&workers_mutex);
+
+      worker_run(w);
+    }
+}
+
+/* Forward the replies of the worker to the caller */
+static int
+worker_reply(sd_varlink *v, sd_json_variant *parameters, const char *error_id,
+	     sd_varlink_reply_flags_t flags, void *userdata)
+{
+  sd_varlink *link = userdata;
+  int r;
+
+  if (error_id)
+    r = sd_varlink_error(link, error_id, parameters);
+  else if (flags & SD_VARLINK_REPLY_CONTINUES)
+    r = sd_varlink_notify(link, parameters);
+  else
+    r = sd_varlink_reply(link, parameters);
+  if (r < 0)
+    log_msg(LOG_DEBUG, "Failed to forward reply: %s", strerror(-r));
+
+  if (error_id || !(flags & SD_VARLINK_REPLY_CONTINUES))
+    {
+      sd_varlink_set_userdata(v, NULL);
+      sd_varlink_unref(link);
+      sd_varlink_close_unref(v);
+    }
+
+  return 0;
+}
+
+static int
+worker_thread_start(void)
+{
+  pthread_attr_t attr;
+  pthread_t thread;
+  int r;
+
+  r = pthread_attr_init(&attr);
+  if (r != 0)
+    return -r;
+  r = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (r == 0)
+    r = pthread_create(&thread, &attr, worker_thread, NULL);
+  pthread_attr_destroy(&attr);
+
+  return -r;
+}
+
+/* Queue w and start a new thread for it if all threads are running
+   a method and the limit is not reached yet. On success the queue
+   owns w. */
+static int
+worker_queue(struct worker *w)
+{
+  int r = 0;
+
+  pthread_mutex_lock(&workers_mutex);
+
+  w->next = NULL;
+  if (queue_tail)
+    queue_tail->next = w;
+  else
+    queue_head = w;
+  queue_tail = w;
+
+  if (n_threads < WORKER_THREADS_MAX)
+    {
+      r = worker_thread_start();
+      if (r == 0)
+	n_threads++;
+      else if (n_threads > 0)
+	{
+	  /* one of the running threads picks it up */
+	  log_msg(LOG_WARNING, "Failed to start worker thread: %s", strerror(-r));
+	  r = 0;
+	}
+      else
+	/* without threads the queue was empty before */
+	queue_head = queue_tail = NULL;
+    }
+
+  pthread_mutex_unlock(&workers_mutex);
+
+  return r;
+}
+
+/* Run method with callback on a worker thread, reply gets the
+   replies of the method on event. If cancel_fd is not negative,
+   children of the method get killed once it is readable. On success
+   userdata belongs to reply. */
+int
+worker_start(sd_event *event, uid_t peer_uid, sd_json_variant *parameters,
+	     sd_varlink_method_flags_t flags, const char *method,
+	     sd_varlink_method_t callback, int cancel_fd,
+	     sd_varlink_reply_t reply, void *userdata)
+{
+  _cleanup_(sd_varlink_close_unrefp) sd_varlink *v = NULL;
+  _cleanup_(worker_freep) struct worker *w = NULL;
+  int fds[2];
+  int r;
+
+  assert(event);
+  assert(method);
+  assert(callback);
+  assert(reply);
+
+  w = calloc(1, sizeof(struct worker));
+  if (w == NULL)
+    return -ENOMEM;
+  w->fd = -EBADF;
+  w->cancel_fd = -EBADF;
+  w->callback = callback;
+  w->peer_uid = peer_uid;
+  w->start = metrics_now();
+  w->method = strdup(method);
+  if (w->method == NULL)
+    return -ENOMEM;
+
+  if (cancel_fd >= 0)
+    {
+      w->cancel_fd = fcntl(cancel_fd, F_DUPFD_CLOEXEC, 3);
+      if (w->cancel_fd < 0)
+	return -errno;
+    }
+
+  if (socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, fds) < 0)
+    return -errno;
+  w->fd = fds[1];
+
+  r = sd_varlink_connect_fd(&v, fds[0]);
+  if (r < 0)
+    {
+      close(fds[0]);
+      return r;
+    }
+
+  r = sd_varlink_attach_event(v, event, SD_EVENT_PRIORITY_NORMAL);
+  if (r < 0)
+    return r;
+  r = sd_varlink_bind_reply(v, reply);
+  if (r < 0)
+    return r;
+
+  if (flags & SD_VARLINK_METHOD_MORE)
+    r = sd_varlink_observe(v, method, parameters);
+  else
+    r = sd_varlink_invoke(v, method, parameters);
+  if (r < 0)
+    return r;
+
+  pthread_mutex_lock(&workers_mutex);
+  w->busy = true;
+  n_busy++;
+  pthread_mutex_unlock(&workers_mutex);
+
+  r = worker_queue(w);
+  if (r < 0)
+    {
+      worker_idle(w);
+      return r;
+    }
+  TAKE_PTR(w);
+
+  sd_varlink_set_userdata(v, userdata);
+  TAKE_PTR(v);
+
+  return 0;
+}
+
+/* Run method on a worker thread. The caller gets the replies
+   once the worker sends them, the event loop continues meanwhile. */
+int
+worker_call(sd_varlink *link, sd_json_variant *parameters,
+	    sd_varlink_method_flags_t flags, const char *method,
+	    sd_varlink_method_t callback)
+{
+  uid_t peer_uid;
+  int r;
+
+  assert(link);
+
+  r = sd_varlink_get_peer_uid(link, &peer_uid);
+  if (r < 0)
+    return r;
+
+  r = worker_start(sd_varlink_get_event(link), peer_uid, parameters, flags,
+		   method, callback, -EBADF, worker_reply, link);
+  if (r < 0)
+    return r;
+
+  /* released by worker_reply() */
+  sd_varlink_ref(link);
+
+  return 0;
+}
@@ -0,0 +1,20 @@
+//SPDX-License-Identifier: GPL-2.0-or-later
+
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <systemd/sd-event.h>
+#include <systemd/sd-varlink.h>
+
+extern int worker_start(sd_event *event, uid_t peer_uid, sd_json_variant *parameters,
+			sd_varlink_method_flags_t flags, const char *method,
+			sd_varlink_method_t callback, int cancel_fd,
+			sd_varlink_reply_t reply, void *userdata);
+extern int worker_call(sd_varlink *link, sd_json_variant *parameters,
+		       sd_varlink_method_flags_t flags, const char *method,
+		       sd_varlink_method_t callback);
+extern int worker_get_peer_uid(sd_varlink *link, uid_t *ret);
+extern size_t worker_busy(void);
+extern void worker_wait_all(void);
@@ -0,0 +1,226 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/* Creates a store with K images and N snapshots with M symlinks each
+   in a temporary directory and measures calc_refcount() and the
+   removal of unused images.
+
+   Usage: bench-refcount [snapshots [symlinks [images]]] */
+
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "basics.h"
+#include "sysextmgr.h"
+#include "images-list.h"
+#include "image-deps.h"
+#include "strv.h"
+#include "mkdir_p.h"
+#include "cache.h"
+
+static uint64_t
+now_usec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * USEC_PER_SEC + (uint64_t)ts.tv_nsec / NSEC_PER_USEC;
+}
+
+static void
+report(const char *what, uint64_t start)
+{
+  uint64_t t = now_usec() - start;
+
+  printf("%-32s %8llu.%03llu ms\n", what,
+	 (unsigned long long)(t / USEC_PER_MSEC),
+	 (unsigned long long)(t % USEC_PER_MSEC));
+}
+
+static int
+rm_cb(const char *fpath, const struct stat *sb _unused_,
+      int typeflag _unused_, struct FTW *ftwbuf _unused_)
+{
+  return remove(fpath);
+}
+
+static int
+image_name(char *buf, size_t size, size_t i)
+{
+  int n = snprintf(buf, size, "bench%zu-1.0.x86-64.raw", i);
+
+  if (n < 0 || (size_t)n >= size)
+    return -ENAMETOOLONG;
+  return 0;
+}
+
+/* Snapshot i links the images i*31, i*31+1, ... modulo the first 90%
+   of the store, so the last 10% of the images are unused. */
+static int
+create_tree(const char *root, size_t n_snapshots, size_t n_links, size_t n_images)
+{
+  char path[PATH_MAX], target[PATH_MAX], name[64];
+  size_t used = n_images - n_images / 10;
+  int r;
+
+  snprintf(path, sizeof(path), "%s/store", root);
+  r = mkdir_p(path, 0755);
+  if (r < 0)
+    return r;
+
+  for (size_t i = 0; i < n_images; i++)
+    {
+      _cleanup_close_ int fd = -EBADF;
+
+      r = image_name(name, sizeof(name), i);
+      if (r < 0)
+	return r;
+      snprintf(path, sizeof(path), "%s/store/%s", root, name);
+      fd = open(path, O_WRONLY|O_CREAT|O_CLOEXEC, 0644);
+      if (fd < 0)
+	return -errno;
+    }
+
+  for (size_t i = 0; i < n_snapshots; i++)
+    {
+      snprintf(path, sizeof(path), "%s/snapshots/%zu/snapshot/etc/extensions", root, i + 1);
+      r = mkdir_p(path, 0755);
+      if (r < 0)
+	return r;
+
+      for (size_t j = 0; j < n_links && j < used; j++)
+	{
+	  r = image_name(name, sizeof(name), (i * 31 + j) % used);
+	  if (r < 0)
+	    return r;
+	  snprintf(target, sizeof(target), "%s/store/%s", root, name);
+	  snprintf(path, sizeof(path), "%s/snapshots/%zu/snapshot/etc/extensions/%s",
+		   root, i + 1, name);
+	  if (symlink(target, path) < 0)
+	    return -errno;
+	}
+    }
+
+  return 0;
+}
+
+static size_t
+parse_arg(int argc, char **argv, int i, size_t def)
+{
+  if (argc <= i)
+    return def;
+
+  return strtoul(argv[i], NULL, 10);
+}
+
+int
+main(int argc, char **argv)
+{
+  _cleanup_(free_image_list) struct image_list images = {};
+  _cleanup_strv_free_ char **removed = NULL;
+  _cleanup_free_ char *store = NULL;
+  _cleanup_free_ char *snapshots = NULL;
+  char root[] = "/tmp/sysextmgr-bench.XXXXXX";
+  char path[PATH_MAX], name[64];
+  size_t n_snapshots, n_links, n_images;
+  uint64_t start;
+  int r;
+
+  n_snapshots = parse_arg(argc, argv, 1, 300);
+  n_links = parse_arg(argc, argv, 2, 20);
+  n_images = parse_arg(argc, argv, 3, 1000);
+  if (n_images == 0)
+    {
+      fprintf(stderr, "Need at least one image\n");
+      return 1;
+    }
+
+  if (mkdtemp(root) == NULL)
+    {
+      perror("mkdtemp");
+      return 1;
+    }
+
+  printf("%zu snapshots x %zu symlinks, %zu images\n", n_snapshots, n_links, n_images);
+
+  start = now_usec();
+  r = create_tree(root, n_snapshots, n_links, n_images);
+  if (r < 0)
+    {
+      fprintf(stderr, "Creating test data failed: %s\n", strerror(-r));
+      goto out;
+    }
+  report("create tree", start);
+
+  if (asprintf(&store, "%s/store", root) < 0 ||
+      asprintf(&snapshots, "%s/snapshots", root) < 0)
+    {
+      r = -ENOMEM;
+      goto out;
+    }
+  config.sysext_store_dir = store;
+  config.snapshots_dir = snapshots;
+
+  r = image_local_metadata(store, &images, NULL, NULL, false);
+  if (r < 0)
+    {
+      fprintf(stderr, "Reading store failed: %s\n", strerror(-r));
+      goto out;
+    }
+
+  start = now_usec();
+  r = calc_refcount(images.images, images.n);
+  if (r < 0)
+    goto out;
+  report("calc_refcount (cold)", start);
+
+  start = now_usec();
+  r = calc_refcount(images.images, images.n);
+  if (r < 0)
+    goto out;
+  report("calc_refcount (warm)", start);
+
+  /* a new snapshot with one image */
+  snprintf(path, sizeof(path), "%s/%zu/snapshot/etc/extensions", snapshots, n_snapshots + 1);
+  r = mkdir_p(path, 0755);
+  if (r < 0)
+    goto out;
+  r = image_name(name, sizeof(name), 0);
+  if (r < 0)
+    goto out;
+  snprintf(path, sizeof(path), "%s/%zu/snapshot/etc/extensions/%s",
+	   snapshots, n_snapshots + 1, name);
+  if (symlink(name, path) < 0)
+    {
+      r = -errno;
+      goto out;
+    }
+
+  start = now_usec();
+  r = calc_refcount(images.images, images.n);
+  if (r < 0)
+    goto out;
+  report("calc_refcount (new snapshot)", start);
+
+  start = now_usec();
+  r = remove_unused_images(store, &removed, NULL);
+  if (r < 0)
+    goto out;
+  report("cleanup", start);
+  printf("%zu unused images removed\n", strv_length(removed));
+
+ out:
+  if (r < 0)
+    fprintf(stderr, "Benchmark failed: %s\n", strerror(-r));
+
+  cache_flush();
+  nftw(root, rm_cb, 16, FTW_DEPTH|FTW_PHYS);
+
+  return r < 0 ? 1 : 0;
+}
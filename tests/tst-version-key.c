@@ -0,0 +1,155 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/* Versions with a key from version_key() have to sort with
+   version_key_cmp() exactly like with strverscmp(), versions without
+   a key fall back to strverscmp(). */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "basics.h"
+#include "image-name.h"
+
+static const struct {
+  const char *a;
+  const char *b;
+} pairs[] = {
+  { "1", "1" },
+  { "1", "2" },
+  { "9", "10" },
+  { "10", "9" },
+  { "99", "100" },
+  { "1.9", "1.10" },
+  { "1.2", "1.2.1" },
+  { "1.2", "1.2a" },
+  { "1.2a", "1.2b" },
+  { "1.2a", "1.2.0" },
+  { "1a", "1" },
+  { "a1", "a10" },
+  { "a", "1" },
+  { "1", "." },
+  { "29.1", "30.1" },
+  { "1.31.5+k3s1", "1.31.5+k3s2" },
+  { "1.31.5+k3s1", "1.31.10+k3s1" },
+  { "0", "1" },
+  { "0", "00" },
+  { "0.1", "0.01" },
+  { "1.05", "1.5" },
+  { "1.05", "1.005" },
+  { "1.010", "1.01" },
+  { "007", "7" },
+  { "123456789", "1234567890" },
+  { "1234567890", "1234567891" },
+  { "12345678901", "9999999999" },
+  { "1.1234567890", "1.999999999" },
+  { "x", "" },
+  { "", "" },
+  { "1.0-rc1", "1.0" },
+  { "1.0~rc1", "1.0" },
+  { "20250101.1", "20241231.12" },
+  { "1.2.3.4.5.6.7.8.9.10.11.12.13.14", "1.2.3.4.5.6.7.8.9.10.11.12.13.15" },
+};
+
+/* the comparison of image_version_cmp() */
+static int
+version_cmp(const char *a, const char *b)
+{
+  struct version_key ka, kb;
+
+  if (version_key(a, strlen(a), &ka) && version_key(b, strlen(b), &kb))
+    return version_key_cmp(&ka, &kb);
+
+  return strverscmp(a, b);
+}
+
+static int
+sign(int r)
+{
+  return r < 0 ? -1 : r > 0;
+}
+
+static int
+check(const char *a, const char *b)
+{
+  int expected = sign(strverscmp(a, b));
+  int got = sign(version_cmp(a, b));
+
+  if (got != expected)
+    {
+      fprintf(stderr, "'%s' <=> '%s': got %i, strverscmp gives %i\n",
+	      a, b, got, expected);
+      return 1;
+    }
+
+  return 0;
+}
+
+/* all strings of up to 4 characters of this alphabet */
+static const char alphabet[] = "019.a~";
+#define MAX_LEN 4
+#define N_ALL (1 + 6 + 6 * 6 + 6 * 6 * 6 + 6 * 6 * 6 * 6)
+
+static char all[N_ALL][MAX_LEN + 1];
+
+static size_t
+gen_all(void)
+{
+  size_t n = 0, k = strlen(alphabet);
+
+  for (size_t len = 0; len <= MAX_LEN; len++)
+    {
+      size_t total = 1;
+
+      for (size_t i = 0; i < len; i++)
+	total *= k;
+
+      for (size_t v = 0; v < total; v++)
+	{
+	  size_t x = v;
+
+	  for (size_t i = 0; i < len; i++, x /= k)
+	    all[n][i] = alphabet[x % k];
+	  all[n][len] = '\0';
+	  n++;
+	}
+    }
+
+  return n;
+}
+
+int
+main(void)
+{
+  struct version_key key;
+  size_t n;
+  int failed = 0;
+
+  for (size_t i = 0; i < sizeof(pairs) / sizeof(pairs[0]); i++)
+    {
+      failed += check(pairs[i].a, pairs[i].b);
+      failed += check(pairs[i].b, pairs[i].a);
+    }
+
+  /* strverscmp() treats these differently, they must not get a key */
+  if (version_key("1.05", 4, &key) || version_key("00", 2, &key) ||
+      version_key("1234567890", 10, &key))
+    {
+      fprintf(stderr, "Leading zeros or more than 9 digits got a key\n");
+      failed++;
+    }
+
+  n = gen_all();
+  for (size_t i = 0; i < n; i++)
+    for (size_t j = 0; j < n; j++)
+      failed += check(all[i], all[j]);
+
+  if (failed)
+    {
+      fprintf(stderr, "%i comparisons failed\n", failed);
+      return 1;
+    }
+
+  return 0;
+}